@@ -0,0 +1,173 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+#define PRODUCER_ITEMS 2000000
+#define PING_COUNT 100000
+#define CHAN_SIZE 1024
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Throughput: plain threads blast into a channel read by a single fiber */
+
+static struct fbr_chan *sink;
+static unsigned nproducers = 2;
+
+static void *producer_thread(_unused_ void *_arg)
+{
+	size_t i;
+	for (i = 1; i <= PRODUCER_ITEMS; i++) {
+		while (fbr_chan_send(sink, (void *)i))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void consumer_fiber(FBR_P_ _unused_ void *_arg)
+{
+	void *objs[256];
+	size_t total = 0, batches = 0;
+	size_t expected = (size_t)PRODUCER_ITEMS * nproducers;
+	double start = now(), elapsed;
+
+	while (total < expected) {
+		total += fbr_chan_recv_many(sink, objs, 256);
+		batches++;
+	}
+	elapsed = now() - start;
+	printf("throughput: %u producers, %.0f msgs/sec, %.1f msgs per"
+			" batch\n", nproducers, total / elapsed,
+			(double)total / batches);
+	ev_break(fctx->__p->loop, EVBREAK_ALL);
+}
+
+static void bench_throughput(void)
+{
+	struct fbr_context context;
+	pthread_t threads[64];
+	fbr_id_t id;
+	unsigned i;
+
+	fbr_init(&context, EV_DEFAULT);
+	sink = fbr_chan_create(&context, CHAN_SIZE);
+	assert(sink);
+	id = fbr_create(&context, "consumer", consumer_fiber, NULL, 0);
+	fbr_transfer(&context, id);
+	for (i = 0; i < nproducers; i++)
+		pthread_create(threads + i, NULL, producer_thread, NULL);
+	ev_run(EV_DEFAULT, 0);
+	for (i = 0; i < nproducers; i++)
+		pthread_join(threads[i], NULL);
+	fbr_chan_destroy(sink);
+	fbr_destroy(&context);
+}
+
+/* Wakeup latency: two contexts in two threads bounce a message, each side
+ * parks in between, so every hop is a full cross-thread wakeup */
+
+static struct fbr_chan *ping_chan;
+static struct fbr_chan *pong_chan;
+static int pong_ready;
+
+static void pong_fiber(FBR_P_ _unused_ void *_arg)
+{
+	void *obj;
+	pong_chan = fbr_chan_create(FBR_A_ 16);
+	__atomic_store_n(&pong_ready, 1, __ATOMIC_RELEASE);
+	for (;;) {
+		obj = fbr_chan_recv(pong_chan);
+		fbr_chan_send(ping_chan, obj);
+		if (NULL == obj)
+			break;
+	}
+	ev_break(fctx->__p->loop, EVBREAK_ALL);
+}
+
+static void *pong_thread(_unused_ void *_arg)
+{
+	struct fbr_context context;
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	fbr_id_t id;
+
+	fbr_init(&context, loop);
+	id = fbr_create(&context, "pong", pong_fiber, NULL, 0);
+	fbr_transfer(&context, id);
+	ev_run(loop, 0);
+	fbr_chan_destroy(pong_chan);
+	fbr_destroy(&context);
+	ev_loop_destroy(loop);
+	return NULL;
+}
+
+static void ping_fiber(FBR_P_ _unused_ void *_arg)
+{
+	size_t i;
+	double start, elapsed;
+
+	start = now();
+	for (i = 1; i <= PING_COUNT; i++) {
+		fbr_chan_send(pong_chan, (void *)i);
+		fbr_chan_recv(ping_chan);
+	}
+	elapsed = now() - start;
+	fbr_chan_send(pong_chan, NULL);
+	fbr_chan_recv(ping_chan);
+	printf("latency: %.2f usec per round trip\n",
+			elapsed * 1e6 / PING_COUNT);
+	ev_break(fctx->__p->loop, EVBREAK_ALL);
+}
+
+static void bench_latency(void)
+{
+	struct fbr_context context;
+	pthread_t thread;
+	fbr_id_t id;
+
+	fbr_init(&context, EV_DEFAULT);
+	ping_chan = fbr_chan_create(&context, 16);
+	pthread_create(&thread, NULL, pong_thread, NULL);
+	while (!__atomic_load_n(&pong_ready, __ATOMIC_ACQUIRE))
+		sched_yield();
+	id = fbr_create(&context, "ping", ping_fiber, NULL, 0);
+	fbr_transfer(&context, id);
+	ev_run(EV_DEFAULT, 0);
+	pthread_join(thread, NULL);
+	fbr_chan_destroy(ping_chan);
+	fbr_destroy(&context);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		nproducers = atoi(argv[1]);
+	assert(nproducers > 0 && nproducers <= 64);
+	bench_throughput();
+	bench_latency();
+	return 0;
+}
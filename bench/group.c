@@ -0,0 +1,79 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+#define TASK_COUNT 2000
+#define TASK_ROUNDS 200000
+
+static int done;
+static volatile unsigned sink;
+
+static void crunch_fiber(_unused_ FBR_P_ _unused_ void *_arg)
+{
+	unsigned i, x = 1;
+	for (i = 0; i < TASK_ROUNDS; i++)
+		x = x * 1103515245 + 12345;
+	sink = x;
+	__atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_group *group;
+	unsigned max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned nworkers;
+	double start, elapsed, base = 0;
+	int i, retval;
+	(void)retval;
+
+	if (argc > 1)
+		max_workers = atoi(argv[1]);
+
+	for (nworkers = 1; nworkers <= max_workers; nworkers *= 2) {
+		done = 0;
+		group = fbr_group_create(nworkers);
+		assert(group);
+		start = now();
+		for (i = 0; i < TASK_COUNT; i++) {
+			retval = fbr_group_submit(group, "crunch",
+					crunch_fiber, NULL, 0);
+			assert(0 == retval);
+		}
+		while (TASK_COUNT != __atomic_load_n(&done, __ATOMIC_ACQUIRE))
+			usleep(100);
+		elapsed = now() - start;
+		if (1 == nworkers)
+			base = elapsed;
+		printf("%u workers: %.0f tasks/sec, speedup %.2f\n", nworkers,
+				TASK_COUNT / elapsed, base / elapsed);
+		fbr_group_destroy(group);
+	}
+	return 0;
+}
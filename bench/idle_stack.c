@@ -0,0 +1,108 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* Each fiber goes this deep before parking, think of request parsing */
+#define WORK_DEPTH 48
+
+static struct fbr_cond_var park_cond;
+
+static int recurse(int depth)
+{
+	volatile char buf[512];
+	buf[0] = depth;
+	if (0 == depth)
+		return buf[0];
+	return recurse(depth - 1) + buf[0];
+}
+
+static void idle_fiber(FBR_P_ _unused_ void *_arg)
+{
+	recurse(WORK_DEPTH);
+	/* Parked, as if waiting for the next request on a keep-alive
+	 * connection */
+	fbr_cond_wait(FBR_A_ &park_cond, NULL);
+}
+
+static long resident_pages(void)
+{
+	FILE *f;
+	long size, resident = 0;
+	int retval;
+
+	f = fopen("/proc/self/statm", "r");
+	assert(f);
+	retval = fscanf(f, "%ld %ld", &size, &resident);
+	assert(2 == retval);
+	(void)retval;
+	fclose(f);
+	return resident;
+}
+
+static void run(int nfibers, int flags, const char *mode)
+{
+	struct fbr_context context;
+	fbr_id_t id;
+	long before, after;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_cond_init(&context, &park_cond);
+
+	before = resident_pages();
+	for (i = 0; i < nfibers; i++) {
+		id = fbr_create_flags(&context, "idle", idle_fiber, NULL, 0,
+				flags);
+		assert(!fbr_id_isnull(id));
+		fbr_transfer(&context, id);
+	}
+	after = resident_pages();
+	printf("%s: %d idle fibers, %.1f KB resident per fiber\n", mode,
+			nfibers, (after - before) * sysconf(_SC_PAGESIZE)
+			/ 1024.0 / nfibers);
+
+	fbr_cond_broadcast(&context, &park_cond);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fbr_cond_destroy(&context, &park_cond);
+	fbr_destroy(&context);
+}
+
+int main(int argc, char *argv[])
+{
+	int nfibers = 10000;
+	pid_t pid;
+
+	if (argc > 1)
+		nfibers = atoi(argv[1]);
+
+	/* Separate processes, so that one mode does not reuse pages freed
+	 * by the other */
+	pid = fork();
+	if (0 == pid) {
+		run(nfibers, 0, "default");
+		return 0;
+	}
+	waitpid(pid, NULL, 0);
+	run(nfibers, FBR_FIBER_STACK_COMPACT, "compact");
+	return 0;
+}
@@ -0,0 +1,173 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* A client pipelines small requests over a socket pair to a server, which
+ * answers every one of them. Most of the time a request is already there when
+ * the server comes for it, so trying the syscall first saves the readiness
+ * wait. The same run is done with unregistered descriptors, which are waited
+ * for before every syscall, and with registered ones, which take the fast
+ * path.
+ *
+ * The syscalls are counted by overriding the libc wrappers, which the library
+ * and libev get bound to. */
+
+#define MSG_SIZE 16
+#define PIPELINE 32
+#define REQUESTS 200000
+
+static unsigned long long nr_syscalls;
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	nr_syscalls++;
+	return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	nr_syscalls++;
+	return syscall(SYS_write, fd, buf, count);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout)
+{
+	nr_syscalls++;
+	return syscall(SYS_epoll_pwait, epfd, events, maxevents, timeout,
+			NULL, 8);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	nr_syscalls++;
+	return syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+static void server_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char buf[MSG_SIZE];
+	ssize_t retval;
+
+	for (;;) {
+		retval = fbr_read_all(FBR_A_ fd, buf, sizeof(buf));
+		if (retval != sizeof(buf))
+			return;
+		retval = fbr_write_all(FBR_A_ fd, buf, sizeof(buf));
+		if (retval != sizeof(buf))
+			return;
+	}
+}
+
+static void client_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char buf[MSG_SIZE * PIPELINE] = {0};
+	ssize_t retval;
+	int i;
+
+	for (i = 0; i < REQUESTS / PIPELINE; i++) {
+		retval = fbr_write_all(FBR_A_ fd, buf, sizeof(buf));
+		if (retval != sizeof(buf))
+			abort();
+		retval = fbr_read_all(FBR_A_ fd, buf, sizeof(buf));
+		if (retval != sizeof(buf))
+			abort();
+	}
+	shutdown(fd, SHUT_WR);
+}
+
+static void run(int do_register)
+{
+	struct fbr_context context;
+	struct fbr_sched_stats stats;
+	fbr_id_t server, client;
+	unsigned long long syscalls;
+	unsigned iterations;
+	ev_tstamp started;
+	int fds[2];
+	int retval;
+	(void)retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(0 == retval);
+	if (do_register) {
+		retval = fbr_fd_register(&context, fds[0]);
+		assert(0 == retval);
+		retval = fbr_fd_register(&context, fds[1]);
+		assert(0 == retval);
+	} else {
+		fbr_fd_nonblock(&context, fds[0]);
+		fbr_fd_nonblock(&context, fds[1]);
+	}
+
+	server = fbr_create(&context, "server", server_fiber, fds + 0, 0);
+	assert(!fbr_id_isnull(server));
+	client = fbr_create(&context, "client", client_fiber, fds + 1, 0);
+	assert(!fbr_id_isnull(client));
+
+	ev_now_update(EV_DEFAULT);
+	started = ev_time();
+	iterations = ev_iteration(EV_DEFAULT);
+	syscalls = nr_syscalls;
+	retval = fbr_transfer(&context, server);
+	assert(0 == retval);
+	retval = fbr_transfer(&context, client);
+	assert(0 == retval);
+	ev_run(EV_DEFAULT, 0);
+	syscalls = nr_syscalls - syscalls;
+	iterations = ev_iteration(EV_DEFAULT) - iterations;
+	fbr_get_sched_stats(&context, &stats);
+
+	printf("%-12s %8.0f req/s %6.2f syscalls/req %6.2f switches/req "
+			"%6.2f iterations/req\n",
+			do_register ? "syscall-first" : "wait-first",
+			REQUESTS / (ev_time() - started),
+			(double)syscalls / REQUESTS,
+			(double)stats.switches / REQUESTS,
+			(double)iterations / REQUESTS);
+
+	if (do_register) {
+		fbr_fd_unregister(&context, fds[0]);
+		fbr_fd_unregister(&context, fds[1]);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	run(0);
+	run(1);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* Every waiter keeps a long timeout armed while waiting on a conditional
+ * variable, which is broadcast over and over, so each wakeup costs an arm and
+ * a cancel of a timeout with all the other ones outstanding */
+
+struct fiber_arg {
+	struct fbr_cond_var cond;
+	size_t count;
+};
+
+static void waiter_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *events[] = {&ev.ev_base, NULL};
+	for (;;) {
+		fbr_ev_cond_var_init(FBR_A_ &ev, &arg->cond, NULL);
+		fbr_ev_wait_to(FBR_A_ events, 30.);
+		arg->count++;
+	}
+}
+
+static void broadcast_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	for (;;) {
+		fbr_cond_broadcast(FBR_A_ &arg->cond);
+		fbr_sleep(FBR_A_ 0.);
+	}
+}
+
+static void stats_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	size_t last;
+	size_t diff;
+	int count = 0;
+	int max_samples = 10;
+	for (;;) {
+		last = arg->count;
+		fbr_sleep(FBR_A_ 1.0);
+		diff = arg->count - last;
+		printf("%zd\n", diff);
+		if (count++ > max_samples) {
+			ev_break(fctx->__p->loop, EVBREAK_ALL);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	int num_waiters = 20000;
+	int retval;
+	int i;
+	(void)retval;
+	struct fiber_arg arg = {
+		.count = 0
+	};
+
+	if (argc > 1)
+		num_waiters = atoi(argv[1]);
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_cond_init(&context, &arg.cond);
+
+	for (i = 0; i < num_waiters; i++) {
+		fiber = fbr_create(&context, "waiter", waiter_fiber, &arg,
+				16 * 1024);
+		assert(!fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		assert(0 == retval);
+	}
+
+	fiber = fbr_create(&context, "broadcast", broadcast_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	fiber = fbr_create(&context, "fiber_stats", stats_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fbr_cond_destroy(&context, &arg.cond);
+	fbr_destroy(&context);
+	return 0;
+}
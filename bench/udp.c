@@ -0,0 +1,201 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* A fiber floods a UDP socket over the loopback in bursts, while another one
+ * receives from it either one datagram per call with fbr_recvfrom, or a
+ * batch per call with fbr_recvmmsg. Both run in the same thread, which keeps
+ * a single core busy, so the rate is packets per second per core, with the
+ * cost of sending included the same way in both modes. */
+
+#define MSG_SIZE 64
+#define BATCH 64
+#define BURST 128
+#define SAMPLES 5
+
+struct receiver_arg {
+	int fd;
+	int batch;
+	size_t count;
+};
+
+static void flood_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	static char bufs[BATCH][MSG_SIZE];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
+	int retval;
+	int i;
+	(void)retval;
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for (i = 0; i < BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = MSG_SIZE;
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (;;) {
+		for (i = 0; i < BURST / BATCH; i++) {
+			retval = fbr_sendmmsg(FBR_A_ fd, msgs, BATCH, 0);
+			assert(BATCH == retval);
+		}
+		/* Let the receiver drain the burst */
+		fbr_sleep(FBR_A_ 0.);
+	}
+}
+
+static void receiver_fiber(FBR_P_ void *_arg)
+{
+	struct receiver_arg *arg = _arg;
+	static char bufs[BATCH][MSG_SIZE];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH];
+	int retval;
+	int i;
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for (i = 0; i < BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = MSG_SIZE;
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (;;) {
+		if (arg->batch) {
+			retval = fbr_recvmmsg(FBR_A_ arg->fd, msgs, BATCH, 0);
+		} else {
+			retval = fbr_recvfrom(FBR_A_ arg->fd, bufs[0], MSG_SIZE,
+					0, NULL, NULL);
+			retval = (retval >= 0) ? 1 : -1;
+		}
+		assert(retval > 0);
+		arg->count += retval;
+	}
+}
+
+static double cpu_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void stats_fiber(FBR_P_ void *_arg)
+{
+	struct receiver_arg *arg = _arg;
+	size_t diff;
+	size_t last;
+	ev_tstamp started;
+	double cpu;
+	int count = 0;
+	for (;;) {
+		last = arg->count;
+		started = ev_time();
+		cpu = cpu_time();
+		fbr_sleep(FBR_A_ 1.0);
+		diff = arg->count - last;
+		printf("%s: %9.0f pps, %9.0f pps per CPU second\n",
+				arg->batch ? "recvmmsg" : "recvfrom",
+				diff / (ev_time() - started),
+				diff / (cpu_time() - cpu));
+		if (++count >= SAMPLES)
+			ev_break(fctx->__p->loop, EVBREAK_ALL);
+	}
+}
+
+static void run(int batch, int fd, int sfd)
+{
+	struct fbr_context context;
+	struct receiver_arg arg = {fd, batch, 0};
+	fbr_id_t fiber;
+	int retval;
+	(void)retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	/* Otherwise the flood would pause for a slack after every burst */
+	retval = fbr_set_timer_slack(&context, 1e-6);
+	assert(0 == retval);
+	retval = fbr_fd_register(&context, fd);
+	assert(0 == retval);
+
+	fiber = fbr_create(&context, "receiver", receiver_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+	fiber = fbr_create(&context, "stats", stats_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+	fiber = fbr_create(&context, "flood", flood_fiber, &sfd, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fbr_fd_unregister(&context, fd);
+	fbr_destroy(&context);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int rcvbuf = 4 * 1024 * 1024;
+	int rfd, sfd;
+	int retval;
+	(void)argc;
+	(void)argv;
+	(void)retval;
+
+	rfd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(rfd >= 0);
+	setsockopt(rfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(rfd, (struct sockaddr *)&addr, sizeof(addr));
+	assert(0 == retval);
+	retval = getsockname(rfd, (struct sockaddr *)&addr, &addrlen);
+	assert(0 == retval);
+
+	sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(sfd >= 0);
+	retval = connect(sfd, (struct sockaddr *)&addr, addrlen);
+	assert(0 == retval);
+
+	run(0, rfd, sfd);
+	run(1, rfd, sfd);
+
+	close(sfd);
+	close(rfd);
+	return 0;
+}
@@ -0,0 +1,184 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* Compares the readiness based wrappers with the io_uring engine on two
+ * loads over unix socket pairs:
+ *  - throughput: many connections, each pipelining small requests to an echo
+ *    server fiber, so lots of operations are queued per loop iteration;
+ *  - latency: a single connection doing one request at a time.
+ *
+ * The readiness based run uses registered descriptors, i.e. the
+ * syscall-first fast path, which is what io_uring has to beat. */
+
+#define MSG_SIZE 64
+#define PIPELINE 16
+#define CONNECTIONS 64
+#define THROUGHPUT_REQUESTS 400000
+#define LATENCY_REQUESTS 50000
+
+struct conn {
+	int fds[2];
+	int requests;
+	int pipeline;
+	ev_tstamp *latencies;
+};
+
+static void server_fiber(FBR_P_ void *_arg)
+{
+	struct conn *conn = _arg;
+	char buf[MSG_SIZE * PIPELINE];
+	ssize_t retval;
+
+	for (;;) {
+		retval = fbr_read(FBR_A_ conn->fds[0], buf, sizeof(buf));
+		if (retval <= 0)
+			return;
+		retval = fbr_write_all(FBR_A_ conn->fds[0], buf, retval);
+		if (retval <= 0)
+			return;
+	}
+}
+
+static void client_fiber(FBR_P_ void *_arg)
+{
+	struct conn *conn = _arg;
+	char buf[MSG_SIZE * PIPELINE] = {0};
+	size_t size = MSG_SIZE * conn->pipeline;
+	ev_tstamp started;
+	ssize_t retval;
+	int i;
+
+	for (i = 0; i < conn->requests / conn->pipeline; i++) {
+		started = ev_time();
+		retval = fbr_write_all(FBR_A_ conn->fds[1], buf, size);
+		if (retval != (ssize_t)size)
+			abort();
+		retval = fbr_read_all(FBR_A_ conn->fds[1], buf, size);
+		if (retval != (ssize_t)size)
+			abort();
+		if (conn->latencies)
+			conn->latencies[i] = ev_time() - started;
+	}
+	shutdown(conn->fds[1], SHUT_WR);
+}
+
+static int compare_tstamp(const void *a, const void *b)
+{
+	ev_tstamp x = *(const ev_tstamp *)a;
+	ev_tstamp y = *(const ev_tstamp *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void run(int flags, int connections, int requests, int pipeline)
+{
+	struct fbr_context context;
+	struct conn *conns;
+	ev_tstamp *latencies = NULL;
+	ev_tstamp started, elapsed;
+	unsigned iterations;
+	fbr_id_t id;
+	int i;
+	int retval;
+	(void)retval;
+
+	fbr_init_flags(&context, EV_DEFAULT, flags);
+	if ((flags & FBR_INIT_IO_URING) && !fbr_io_uring_enabled(&context)) {
+		printf("io_uring is not available\n");
+		fbr_destroy(&context);
+		return;
+	}
+
+	conns = calloc(connections, sizeof(*conns));
+	assert(conns);
+	if (1 == connections) {
+		latencies = calloc(requests, sizeof(*latencies));
+		assert(latencies);
+	}
+	for (i = 0; i < connections; i++) {
+		retval = socketpair(AF_UNIX, SOCK_STREAM, 0, conns[i].fds);
+		assert(0 == retval);
+		retval = fbr_fd_register(&context, conns[i].fds[0]);
+		assert(0 == retval);
+		retval = fbr_fd_register(&context, conns[i].fds[1]);
+		assert(0 == retval);
+		conns[i].requests = requests / connections;
+		conns[i].pipeline = pipeline;
+		conns[i].latencies = latencies;
+	}
+
+	ev_now_update(EV_DEFAULT);
+	started = ev_time();
+	iterations = ev_iteration(EV_DEFAULT);
+	for (i = 0; i < connections; i++) {
+		id = fbr_create(&context, "server", server_fiber, conns + i, 0);
+		assert(!fbr_id_isnull(id));
+		retval = fbr_transfer(&context, id);
+		assert(0 == retval);
+		id = fbr_create(&context, "client", client_fiber, conns + i, 0);
+		assert(!fbr_id_isnull(id));
+		retval = fbr_transfer(&context, id);
+		assert(0 == retval);
+	}
+	ev_run(EV_DEFAULT, 0);
+	elapsed = ev_time() - started;
+	iterations = ev_iteration(EV_DEFAULT) - iterations;
+
+	printf("%-10s %-10s %9.0f req/s %7.3f iterations/req",
+			(flags & FBR_INIT_IO_URING) ? "io_uring" : "readiness",
+			latencies ? "latency" : "throughput",
+			requests / elapsed, (double)iterations / requests);
+	if (latencies) {
+		qsort(latencies, requests, sizeof(*latencies), compare_tstamp);
+		printf(" p50 %6.1f us p99 %6.1f us",
+				latencies[requests / 2] * 1e6,
+				latencies[requests * 99 / 100] * 1e6);
+	}
+	printf("\n");
+
+	for (i = 0; i < connections; i++) {
+		fbr_fd_unregister(&context, conns[i].fds[0]);
+		fbr_fd_unregister(&context, conns[i].fds[1]);
+		close(conns[i].fds[0]);
+		close(conns[i].fds[1]);
+	}
+	free(latencies);
+	free(conns);
+	fbr_destroy(&context);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	run(0, CONNECTIONS, THROUGHPUT_REQUESTS, PIPELINE);
+	run(FBR_INIT_IO_URING, CONNECTIONS, THROUGHPUT_REQUESTS, PIPELINE);
+	run(0, 1, LATENCY_REQUESTS, 1);
+	run(FBR_INIT_IO_URING, 1, LATENCY_REQUESTS, 1);
+	return 0;
+}
@@ -77,9 +77,11 @@
 #  include <unistd.h>
 # endif
 
-static coro_func coro_init_func;
-static void *coro_init_arg;
-static coro_context *new_coro, *create_coro;
+/* coro_create hands these over to the new coroutine, keep them per thread so
+ * that coroutines can be created in several threads at once */
+static __thread coro_func coro_init_func;
+static __thread void *coro_init_arg;
+static __thread coro_context *new_coro, *create_coro;
 
 static void
 coro_init (void)
@@ -37,6 +37,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 #ifdef FBR_USE_EMBEDDED_EIO
 #include <evfibers/libeio_embedded.h>
 #else
@@ -61,6 +62,14 @@ struct fbr_ev_eio {
 	fbr_eio_custom_func_t custom_func;
 	void *custom_arg;
 	struct fbr_ev_base ev_base;
+	eio_ssize_t result; /*!< copy of req->result */
+	int errorno; /*!< copy of req->errorno */
+	off_t offs; /*!< copy of req->offs */
+	void *buf; //Private
+	size_t buf_size; //Private
+	int buf_string; //Private
+	int state; //Private
+	TAILQ_ENTRY(fbr_ev_eio) entries; //Private
 };
 
 /**
@@ -76,15 +85,17 @@ void fbr_ev_eio_init(FBR_P_ struct fbr_ev_eio *ev, eio_req *req);
 /**
  * Initialization routine for libeio fiber wrapper.
  *
- * This functions initializes libeio and sets up the necessary glue code to
- * interact with libev (and in turn libevfibers).
+ * This functions initializes libeio if needed and sets up the glue code
+ * for the context, which uses its own event loop. Every context that does
+ * file I/O has to call it, including the ones running in other threads,
+ * further calls for the same context do nothing.
  *
- * Must be called only once, uses EV_DEFAULT event loop internally, but any
- * fiber scheduler can interact with libeio independently.
+ * libeio results are delivered to the contexts that own them by whichever
+ * context polls libeio first, and the waiting fibers are resumed in bulk.
  * @see fbr_ev_eio
  * @see fbr_ev_wait
  */
-void fbr_eio_init();
+void fbr_eio_init(FBR_P);
 
 int fbr_eio_open(FBR_P_ const char *path, int flags, mode_t mode, int pri);
 int fbr_eio_truncate(FBR_P_ const char *path, off_t offset, int pri);
@@ -136,4 +147,232 @@ int fbr_eio_fallocate(FBR_P_ int fd, int mode, off_t offset, off_t len,
 eio_ssize_t fbr_eio_custom(FBR_P_ fbr_eio_custom_func_t func, void *data,
 		int pri);
 
+/**
+ * Vectored positional read.
+ * @param [in] fd file descriptor
+ * @param [in] iov buffers to fill in, in order
+ * @param [in] iovcnt number of buffers
+ * @param [in] offset file offset, -1 for the file position
+ * @param [in] flags RWF_* flags of preadv2
+ * @param [in] pri libeio priority
+ * @returns number of bytes read, or -1 in case of error
+ *
+ * Works like preadv2, whichever way the call gets served: inline if the
+ * data is in the page cache, through io_uring if the context has one, or by
+ * the thread pool. A range that is only partly cached is read inline as far
+ * as it goes, and the rest is offloaded. With RWF_NOWAIT in the flags the
+ * read is only ever tried inline, and fails with EAGAIN (or comes back
+ * short) if that would block. On systems without preadv2 non-zero flags
+ * fail with EOPNOTSUPP.
+ * @see fbr_eio_pwritev
+ */
+ssize_t fbr_eio_preadv(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags, int pri);
+
+/**
+ * Vectored positional write.
+ * @param [in] fd file descriptor
+ * @param [in] iov buffers to write out, in order
+ * @param [in] iovcnt number of buffers
+ * @param [in] offset file offset, -1 for the file position
+ * @param [in] flags RWF_* flags of pwritev2, e.g. RWF_DSYNC or RWF_APPEND
+ * @param [in] pri libeio priority
+ * @returns number of bytes written, or -1 in case of error
+ *
+ * Works like pwritev2, so a header, a payload and a trailer go out in one
+ * request without being copied together first. With RWF_NOWAIT in the
+ * flags the write is done on the loop thread, and fails with EAGAIN if it
+ * would block. On systems without pwritev2 non-zero flags fail with
+ * EOPNOTSUPP.
+ * @see fbr_eio_preadv
+ */
+ssize_t fbr_eio_pwritev(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags, int pri);
+
+/**
+ * Operation types of a batch.
+ * @see fbr_eio_op
+ */
+enum fbr_eio_op_type {
+	FBR_EIO_OP_OPEN, /*!< open(path, flags, mode) */
+	FBR_EIO_OP_CLOSE, /*!< close(fd) */
+	FBR_EIO_OP_READ, /*!< read length bytes at offset into buf */
+	FBR_EIO_OP_WRITE, /*!< write length bytes at offset from buf */
+	FBR_EIO_OP_STAT, /*!< stat(path) into buf, an EIO_STRUCT_STAT */
+	FBR_EIO_OP_LSTAT, /*!< lstat(path) into buf, an EIO_STRUCT_STAT */
+	FBR_EIO_OP_FSTAT, /*!< fstat(fd) into buf, an EIO_STRUCT_STAT */
+	FBR_EIO_OP_FSYNC, /*!< fsync(fd) */
+	FBR_EIO_OP_FDATASYNC, /*!< fdatasync(fd) */
+	FBR_EIO_OP_UNLINK, /*!< unlink(path) */
+	FBR_EIO_OP_READAHEAD, /*!< readahead(fd, offset, length) */
+};
+
+/**
+ * Single operation of a batch.
+ *
+ * The caller fills in the type and the arguments the type needs, the rest
+ * is filled in by fbr_eio_batch.
+ * @see fbr_eio_batch
+ */
+struct fbr_eio_op {
+	enum fbr_eio_op_type type; /*!< what to do */
+	int fd; /*!< file descriptor */
+	const char *path; /*!< path name */
+	void *buf; /*!< data buffer or stat structure */
+	size_t length; /*!< number of bytes */
+	off_t offset; /*!< file offset, -1 for the file position */
+	int flags; /*!< open flags */
+	mode_t mode; /*!< open mode */
+	eio_ssize_t result; /*!< result of the operation, valid if done */
+	int errorno; /*!< errno of the operation, valid if result is -1 */
+	int done; /*!< set once the operation has completed */
+};
+
+/**
+ * Runs several file operations at once.
+ * @param [in,out] ops operations to run
+ * @param [in] count number of operations
+ * @param [in] wait_for number of completions to wait for, 0 means all
+ * @param [in] pri libeio priority of the operations
+ * @returns number of completed operations, or -1 in case of error
+ *
+ * All the operations are submitted to libeio as members of a single eio
+ * group, and the calling fiber is resumed once, when wait_for of them have
+ * completed, instead of doing a round trip to the thread pool per
+ * operation. The operations that have not completed by then are cancelled,
+ * their done flag stays unset and errorno is ECANCELED. ECANCELED means that
+ * the outcome is unknown, not that the operation has not been executed: it
+ * may still be running in the thread pool, so a write may land, a read may
+ * still fill its buffer, and the buffers must stay valid until the file is
+ * closed. Descriptors opened by cancelled OPEN operations are closed.
+ * Operations complete in no particular order,
+ * so they must not depend on each other. At most as many members as the
+ * per fiber limit allows are in the thread pool at once, the rest are
+ * submitted as the first ones complete, see fbr_eio_set_limits.
+ *
+ * Failures of individual operations are reported by their result and
+ * errorno, the call itself only fails if the fiber gets reclaimed, hits its
+ * deadline, or fbr_eio_init has not been called, in which case f_errno is
+ * set to FBR_EEIO.
+ * @see fbr_eio_op
+ */
+ssize_t fbr_eio_batch(FBR_P_ struct fbr_eio_op *ops, size_t count,
+		size_t wait_for, int pri);
+
+/**
+ * Streams a file into a buffer.
+ * @param [in] fd file descriptor of a regular file
+ * @param [in] offset where to start reading
+ * @param [in] length number of bytes to stream, 0 means up to the end of the
+ * file
+ * @param [in] buffer buffer to fill in
+ * @param [in] chunk size of a single read
+ * @param [in] depth number of reads to keep in flight
+ * @param [in] pri libeio priority of the reads
+ * @returns number of bytes streamed, or -1 in case of error
+ *
+ * The calling fiber becomes the producer of the buffer. The file is read
+ * straight into the space of the buffer, depth chunks at a time, so a
+ * consumer fiber gets the data without a copy through
+ * fbr_buffer_read_address and fbr_buffer_read_advance. While the consumer
+ * is busy, the next chunks are read, and the kernel is asked to read ahead
+ * the ones after them. Once the buffer is full, the producer waits for the
+ * consumer to free some space.
+ *
+ * At most half of the buffer is read into at once, so that the reads
+ * overlap with the consumer, depth is reduced to fit otherwise. The call
+ * returns once everything has been committed to the buffer, it is up to
+ * the caller to tell the consumer where the stream ends.
+ *
+ * If a read fails, the data before it stays in the buffer, and errno is
+ * set by the read. f_errno is set to FBR_EINVAL if the chunk size, the
+ * depth or the offset is invalid.
+ * @see fbr_buffer_alloc_prepare
+ * @see fbr_eio_batch
+ */
+ssize_t fbr_eio_stream(FBR_P_ int fd, off_t offset, size_t length,
+		struct fbr_buffer *buffer, size_t chunk, unsigned depth, int pri);
+
+/**
+ * Number of I/O classes, one per libeio priority.
+ * @see fbr_eio_class_set
+ */
+#define FBR_EIO_CLASSES (EIO_PRI_MAX - EIO_PRI_MIN + 1)
+
+/**
+ * Configures an I/O class.
+ * @param [in] pri libeio priority the class is made of
+ * @param [in] weight share of the thread pool the class gets under
+ * contention, relative to the other classes
+ * @param [in] workers number of requests of the class that may be in the
+ * thread pool at once, 0 means no limit
+ * @returns -1 in case of error, 0 otherwise
+ *
+ * The requests the wrappers send to the libeio thread pool are grouped in
+ * classes by their priority. libeio only orders its queue by priority, so a
+ * fiber doing bulk transfers may occupy every worker and starve everybody
+ * else. With the limits set the context admits requests to the pool by
+ * class: a request that is over the limits waits in the queue of its class,
+ * and whenever there is room the classes are served in proportion to their
+ * weights, in the order of arrival within a class.
+ *
+ * By default the weight of a class is its priority minus EIO_PRI_MIN plus
+ * one, and there are no limits, so nothing is ever queued. The size of the
+ * thread pool itself is process wide and is set with eio_set_max_parallel.
+ *
+ * Operations served by io_uring or on the loop thread do not go through the
+ * pool and are not accounted for.
+ *
+ * f_errno is set to FBR_EINVAL if the priority is out of range or the
+ * weight is 0, and to FBR_EEIO if fbr_eio_init has not been called.
+ * @see fbr_eio_set_limits
+ * @see fbr_eio_get_class_stats
+ */
+int fbr_eio_class_set(FBR_P_ int pri, unsigned weight, unsigned workers);
+
+/**
+ * Sets the context wide limits of the thread pool usage.
+ * @param [in] max_inflight number of requests of the context that may be
+ * in the thread pool at once, 0 means no limit
+ * @param [in] fiber_max_inflight number of requests a fiber may have in the
+ * thread pool at once, 0 means no limit
+ * @returns -1 in case of error, 0 otherwise
+ *
+ * A fiber only has one request in flight at a time, unless it runs a batch,
+ * so the per fiber limit caps the number of batch members that are run at
+ * once, the rest are submitted as the first ones complete.
+ *
+ * f_errno is set to FBR_EEIO if fbr_eio_init has not been called.
+ * @see fbr_eio_class_set
+ * @see fbr_eio_batch
+ */
+int fbr_eio_set_limits(FBR_P_ unsigned max_inflight,
+		unsigned fiber_max_inflight);
+
+/**
+ * Admission statistics of an I/O class.
+ * @see fbr_eio_get_class_stats
+ */
+struct fbr_eio_class_stats {
+	unsigned queued; /*!< requests waiting for admission */
+	unsigned inflight; /*!< requests in the thread pool */
+	uint64_t admitted; /*!< requests admitted so far */
+	uint64_t delayed; /*!< admitted requests that had to wait */
+	ev_tstamp wait_time; /*!< total time spent in the queue */
+	ev_tstamp max_wait_time; /*!< longest time spent in the queue */
+};
+
+/**
+ * Retrieves the admission statistics of an I/O class.
+ * @param [in] pri libeio priority of the class
+ * @param [out] stats where to store the statistics
+ * @returns -1 in case of error, 0 otherwise
+ *
+ * A batch is counted once, as a request that takes as many slots as it may
+ * have members in flight. f_errno is set to FBR_EINVAL if the priority is
+ * out of range, and to FBR_EEIO if fbr_eio_init has not been called.
+ * @see fbr_eio_class_set
+ */
+int fbr_eio_get_class_stats(FBR_P_ int pri, struct fbr_eio_class_stats *stats);
+
 #endif
@@ -144,6 +144,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/queue.h>
 #include <assert.h>
 #include <ev.h>
@@ -158,6 +159,11 @@
  * Default stack size for a fiber of 64 KB.
  */
 #define FBR_STACK_SIZE (64 * 1024) /* 64 KB */
+/**
+ * No limit on the number of pooled stacks of a size class.
+ * @see fbr_stack_pool_set_cap
+ */
+#define FBR_STACK_POOL_UNLIMITED ((unsigned)-1)
 
 /**
  * @def fbr_assert
@@ -231,6 +237,7 @@ enum fbr_error_code {
 	FBR_EPROTOBUF,
 	FBR_EBUFFERNOSPACE,
 	FBR_EEIO,
+	FBR_ETIMEDOUT,
 };
 
 /**
@@ -384,6 +391,7 @@ enum fbr_ev_type {
 	FBR_EV_MUTEX, /*!< fbr_mutex event */
 	FBR_EV_COND_VAR, /*!< fbr_cond_var event */
 	FBR_EV_EIO, /*!< libeio event */
+	FBR_EV_TIMEOUT, /*!< timer wheel timeout event */
 };
 
 struct fbr_ev_base;
@@ -444,6 +452,22 @@ struct fbr_id_tailq_i {
 
 TAILQ_HEAD(fbr_id_tailq, fbr_id_tailq_i);
 
+struct fbr_wheel_node;
+
+typedef void (*fbr_wheel_cb_t)(FBR_P_ struct fbr_wheel_node *node);
+
+struct fbr_wheel_node {
+	/* Private structure */
+	ev_tstamp deadline;
+	uint64_t expires;
+	fbr_wheel_cb_t cb;
+	void *data;
+	LIST_ENTRY(fbr_wheel_node) entries;
+	unsigned level;
+	unsigned slot;
+	int armed;
+};
+
 /**
  * Base struct for all events.
  *
@@ -512,6 +536,25 @@ struct fbr_ev_cond_var {
 	struct fbr_ev_base ev_base;
 };
 
+/**
+ * Timeout event.
+ *
+ * This event arrives once its deadline has passed. Timeouts are kept in a
+ * per-context hierarchical timer wheel driven by a single libev timer, so
+ * arming and cancelling one is O(1) regardless of how many fibers are
+ * waiting. A timeout may arrive up to the timer slack later than requested,
+ * but never earlier.
+ * @see fbr_ev_timeout_init
+ * @see fbr_set_timer_slack
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_timeout {
+	ev_tstamp deadline; /*!< absolute time (ev_now based) of expiration */
+	struct fbr_wheel_node node; //Private
+	struct fbr_ev_base ev_base;
+};
+
 /**
  * Mutex structure.
  *
@@ -576,8 +619,161 @@ struct fbr_buffer {
 	struct fbr_mutex read_mutex;
 };
 
+/**
+ * Buffered stream over a file descriptor.
+ *
+ * Reads and writes go through a pair of buffers, so that parsing lines or
+ * small requests does not cost a syscall per piece.
+ * @see fbr_stream_init
+ * @see fbr_stream_destroy
+ */
+struct fbr_stream {
+	int fd; /*!< descriptor of the stream */
+	size_t size; /*!< size of each of the buffers */
+	char *rbuf; /*!< read buffer */
+	size_t rstart; /*!< offset of the first unread byte */
+	size_t rend; /*!< offset past the last buffered byte */
+	int eof; /*!< end of file has been reached */
+	char *wbuf; /*!< write buffer */
+	size_t wlen; /*!< number of bytes waiting in wbuf */
+};
+
+struct fbr_zc;
+
+/**
+ * Buffer release callback of a zerocopy send.
+ * @see fbr_zc_init
+ */
+typedef void (*fbr_zc_release_func_t)(FBR_P_ struct fbr_zc *zc, void *arg);
+
+/**
+ * Zerocopy send request.
+ *
+ * Tracks the buffer of fbr_send_zc until the kernel is done with it. All
+ * fields are read-only for the user, apart from func and arg, which are
+ * set up by fbr_zc_init.
+ * @see fbr_zc_init
+ * @see fbr_send_zc
+ */
+struct fbr_zc {
+	fbr_zc_release_func_t func; /*!< called once the buffer is released */
+	void *arg; /*!< argument of func */
+	int released; /*!< the buffer may be reused */
+	int copied; /*!< the kernel has copied the data after all */
+	int aborted; /*!< released by fbr_fd_unregister before the kernel
+		       has reported it, see fbr_send_zc */
+	uint32_t first; /*!< first send call of the request */
+	uint32_t last; /*!< last send call of the request */
+	unsigned pending; /*!< number of send calls still referencing the
+			    buffer */
+	struct fbr_zc_socket *socket; /*!< state of the socket */
+	TAILQ_ENTRY(fbr_zc) entries; /*!< pending list of the socket */
+};
+
 struct fbr_mq;
 
+/**
+ * Lock-free cross-thread channel.
+ *
+ * Opaque structure, see fbr_chan_create for details.
+ * @see fbr_chan_create
+ */
+struct fbr_chan;
+
+/**
+ * Outbound connection pool.
+ *
+ * Opaque structure, see fbr_pool_create for details.
+ * @see fbr_pool_create
+ */
+struct fbr_pool;
+
+/**
+ * Connection pool parameters.
+ * @see fbr_pool_create
+ */
+struct fbr_pool_params {
+	unsigned max_conns; /*!< maximum number of connections per endpoint,
+			      idle, checked out and being established alike,
+			      0 for no limit */
+	unsigned max_connecting; /*!< maximum number of connects in flight
+				   per endpoint, 0 for no limit */
+	ev_tstamp connect_timeout; /*!< timeout of a single connect, 0 to
+				     only limit it by the checkout timeout */
+	ev_tstamp idle_timeout; /*!< idle connections are closed after this
+				  many seconds, 0 to keep them forever */
+};
+
+/**
+ * Connection pool statistics.
+ * @see fbr_pool_get_stats
+ */
+struct fbr_pool_stats {
+	uint64_t hits; /*!< checkouts served with an idle connection */
+	uint64_t misses; /*!< checkouts that established a new connection */
+	uint64_t waits; /*!< checkouts that had to wait for a connection to
+			  be checked in or a connect slot to free up */
+	uint64_t timeouts; /*!< checkouts that gave up waiting */
+	uint64_t connect_failures; /*!< connects that failed or timed out */
+	uint64_t evictions; /*!< idle connections closed by the reaper for
+			      being idle for too long */
+	uint64_t broken; /*!< idle connections found closed by the peer or
+			   otherwise unusable */
+	ev_tstamp wait_time; /*!< total time spent waiting by checkouts */
+	ev_tstamp max_wait_time; /*!< longest wait of a single checkout */
+	unsigned idle; /*!< connections currently idle */
+	unsigned busy; /*!< connections currently checked out */
+	unsigned connecting; /*!< connects currently in flight */
+};
+
+/**
+ * Multi-threaded fiber group.
+ *
+ * Opaque structure, representing a number of worker threads, each running
+ * its own event loop and fiber context.
+ * @see fbr_group_create
+ */
+struct fbr_group;
+
+/**
+ * Scheduler statistics.
+ *
+ * Fibers woken up by mutexes and conditional variables are put into a ready
+ * queue, which is drained in bulk once per event loop iteration. This
+ * structure describes how the drains went so far.
+ * @see fbr_get_sched_stats
+ */
+struct fbr_sched_stats {
+	uint64_t drains; /*!< number of drains that resumed at least one
+			   fiber */
+	uint64_t resumed; /*!< total number of fibers resumed by drains */
+	unsigned last_drain; /*!< number of fibers resumed by the most recent
+			       drain */
+	unsigned max_drain; /*!< maximum number of fibers resumed by a single
+			      drain */
+	uint64_t switches; /*!< number of transfers into fibers, both by the
+			     drains and direct fbr_transfer calls */
+};
+
+/**
+ * File operation statistics.
+ *
+ * fbr_eio_read(), fbr_eio_stat(), fbr_eio_lstat() and fbr_eio_fstat() first
+ * try to complete on the loop thread, and are only handed over to the thread
+ * pool (or io_uring) when that could block. The inline hit ratio of reads is
+ * inline_reads / (inline_reads + offloaded_reads), same for stats.
+ * @see fbr_get_file_stats
+ */
+struct fbr_file_stats {
+	uint64_t inline_reads; /*!< reads served from the page cache on the
+				 loop thread */
+	uint64_t offloaded_reads; /*!< reads that had to be offloaded */
+	uint64_t inline_stats; /*!< stat calls done on the loop thread */
+	uint64_t offloaded_stats; /*!< stat calls that have been offloaded */
+	uint64_t slow_inline_stats; /*!< inline stat calls that took long
+				      enough to switch stats to offloading */
+};
+
 /**
  * Fiber-local data key.
  *
@@ -664,6 +860,20 @@ void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
 void fbr_ev_cond_var_init(FBR_P_ struct fbr_ev_cond_var *ev,
 		struct fbr_cond_var *cond, struct fbr_mutex *mutex);
 
+/**
+ * Initializer for timeout event.
+ * @param [in] timeout number of seconds from now until the event arrives
+ *
+ * This functions properly initializes fbr_ev_timeout struct. You should not do
+ * it manually. The deadline is fixed at initialization time, so the same event
+ * may be passed to several consecutive fbr_ev_wait calls to limit the total
+ * time spent waiting. An event, which deadline has already passed, arrives
+ * immediately.
+ * @see fbr_ev_timeout
+ * @see fbr_ev_wait
+ */
+void fbr_ev_timeout_init(FBR_P_ struct fbr_ev_timeout *ev, ev_tstamp timeout);
+
 /**
  * Event awaiting function (one event only wrapper).
  * @param [in] one the event base pointer of the event to wait for
@@ -695,8 +905,8 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[]);
  * @returns the number of events arrived or -1 upon error
  *
  * This function is a convenient wrapper around fbr_ev_wait, it just creates a
- * timer watcher and makes new events array with the timer watcher included.
- * Timer event is not counted in the number of returned events.
+ * timeout event and makes new events array with the timeout event included.
+ * Timeout event is not counted in the number of returned events.
  * @see fbr_ev_wait
  */
 int fbr_ev_wait_to(FBR_P_ struct fbr_ev_base *events[], ev_tstamp timeout);
@@ -724,6 +934,57 @@ int fbr_transfer(FBR_P_ fbr_id_t to);
  */
 void fbr_init(struct fbr_context *fctx, struct ev_loop *loop);
 
+/**
+ * Context initialization flags.
+ * @see fbr_init_flags
+ */
+enum fbr_init_flags {
+	FBR_INIT_IO_URING = 1 << 0, /*!< use io_uring for the socket I/O
+				      wrappers if available */
+};
+
+/**
+ * Initializes the library context with extra flags.
+ * @param [in] fctx pointer to the user allocated fbr_context.
+ * @param [in] loop pointer to the user supplied libev loop.
+ * @param [in] flags bitwise or of fbr_init_flags
+ *
+ * Same as fbr_init(), except for the flags. With FBR_INIT_IO_URING,
+ * fbr_read(), fbr_write(), fbr_recv(), fbr_send(), fbr_accept(),
+ * fbr_connect() and their *_wto and *_all variants submit the operations
+ * themselves to an io_uring instead of waiting for readiness and then doing
+ * the syscall. Submissions are batched: everything the fibers have queued
+ * during a loop iteration is passed to the kernel with a single
+ * io_uring_enter at the end of it, and fibers are resumed from the
+ * completions.
+ *
+ * If the library has been built without io_uring support, or the kernel
+ * lacks the operations needed (Linux 5.6 is required), the context silently
+ * falls back to the readiness based wrappers.
+ *
+ * On kernels that support the file operations, the same ring serves
+ * fbr_eio_open(), fbr_eio_read(), fbr_eio_write(),
+ * fbr_eio_fsync(), fbr_eio_fdatasync(), fbr_eio_stat(), fbr_eio_lstat(),
+ * fbr_eio_fstat() and fbr_eio_fallocate(), which then bypass the libeio
+ * thread pool and ignore the priority argument. These do not need
+ * fbr_eio_init().
+ *
+ * A fiber that times out or is reclaimed while an operation is in flight
+ * cancels it. For sockets and pipes this is immediate, but an operation
+ * that the kernel is already executing completes regardless, so buffers
+ * passed by a fiber that gets reclaimed should not be reused right away.
+ * @see fbr_io_uring_enabled
+ */
+void fbr_init_flags(struct fbr_context *fctx, struct ev_loop *loop,
+		int flags);
+
+/**
+ * Tells whether the context uses io_uring.
+ * @returns 1 if the I/O wrappers are served by io_uring, 0 otherwise
+ * @see fbr_init_flags
+ */
+int fbr_io_uring_enabled(FBR_P);
+
 /**
  * Destroys the library context.
  * All created fibers are reclaimed and all of the memory is freed.  Stopping
@@ -843,21 +1104,125 @@ void fbr_log_d(FBR_P_ const char *format, ...)
  *
  * Stack is anonymously mmaped so it should not occupy all the required space
  * straight away. Adjust stack size only when you know what you are doing!
+ * The page below the stack is inaccessible, so that an overflow crashes with
+ * SIGSEGV instead of silently corrupting memory.
  *
  * Allocated stacks are registered as stacks via valgrind client request
  * mechanism, so it's generally valgrind friendly and should not cause any
  * noise.
  *
+ * Stack size is rounded up to a power of two size class (4 KB to 2 MB).
+ * Reclaimed fibers are pooled per size class and reused only by requests of
+ * the same class. Larger stacks are not pooled by default.
+ *
  * Fibers are organized in a tree. Child nodes are attached to a parent
  * whenever the parent is creating them. This tree is used primarily for
  * automatic reclaim of child fibers.
  * @see fbr_reclaim
  * @see fbr_disown
  * @see fbr_parent
+ * @see fbr_stack_pool_set_cap
+ * @see fbr_create_flags
  */
 fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 		size_t stack_size);
 
+/**
+ * Fiber creation flags.
+ * @see fbr_create_flags
+ */
+enum fbr_fiber_flags {
+	FBR_FIBER_STACK_POPULATE = 1 << 0, /*!< commit the whole stack
+					     upfront */
+	FBR_FIBER_STACK_COMPACT = 1 << 1, /*!< release unused stack pages
+					    whenever the fiber parks */
+};
+
+/**
+ * Creates a new fiber with extra flags.
+ * @param [in] name fiber name
+ * @param [in] func function used as a fiber's ``main''.
+ * @param [in] arg user supplied argument to a fiber.
+ * @param [in] stack_size stack size (0 for default).
+ * @param [in] flags bitwise or of fbr_fiber_flags
+ * @return Pointer to the created fiber.
+ *
+ * Same as fbr_create(), except for the flags. FBR_FIBER_STACK_POPULATE makes
+ * all stack pages resident before the fiber starts, so latency critical fibers
+ * do not take page faults while running.
+ *
+ * FBR_FIBER_STACK_COMPACT is meant for large numbers of mostly idle fibers,
+ * i.e. keep-alive connections parked in fbr_read(). Each time such a fiber
+ * yields, pages of its stack below the current frame are dropped with
+ * madvise(MADV_DONTNEED), so a parked fiber only keeps its live depth
+ * resident rather than the deepest it has ever been. The price is a system
+ * call per park and page faults when the fiber grows its stack again.
+ *
+ * Keep in mind that every stack takes two memory mappings (the stack itself
+ * and its guard page), so hundreds of thousands of fibers may need
+ * vm.max_map_count to be raised.
+ * @see fbr_create
+ */
+fbr_id_t fbr_create_flags(FBR_P_ const char *name, fbr_fiber_func_t func,
+		void *arg, size_t stack_size, int flags);
+
+/**
+ * Sets a limit on pooled stacks of a size class.
+ * @param [in] stack_size any stack size within the class (0 for default)
+ * @param [in] cap maximum number of pooled stacks or FBR_STACK_POOL_UNLIMITED
+ *
+ * Once more than cap fibers of the class are reclaimed, stacks of the least
+ * recently used ones are freed. Pooled stacks exceeding the new cap are freed
+ * straight away. All classes are unlimited by default, except for the
+ * oversized one (above 2 MB), which has the cap of 0.
+ *
+ * A fiber that has just finished still runs on its stack, so that one may be
+ * kept over the cap until the next reclaim or trim of its class.
+ * @see fbr_stack_pool_trim
+ */
+void fbr_stack_pool_set_cap(FBR_P_ size_t stack_size, unsigned cap);
+
+/**
+ * Preallocates stacks of a size class.
+ * @param [in] stack_size any stack size within the class (0 for default)
+ * @param [in] count desired number of pooled stacks
+ * @returns number of stacks allocated
+ *
+ * Allocates stacks until the pool of the class holds count of them (or
+ * reaches the cap of the class), so that fbr_create() does not have to call
+ * the allocator on a latency sensitive path.
+ */
+unsigned fbr_stack_pool_prewarm(FBR_P_ size_t stack_size, unsigned count);
+
+/**
+ * Returns number of pooled stacks of a size class.
+ * @param [in] stack_size any stack size within the class (0 for default)
+ * @returns number of reclaimed fibers with stacks, ready for reuse
+ */
+unsigned fbr_stack_pool_count(FBR_P_ size_t stack_size);
+
+/**
+ * Releases pooled stacks.
+ * @param [in] keep number of stacks to keep in each size class
+ * @returns number of bytes released
+ *
+ * Useful under memory pressure. The least recently used stacks are released
+ * first.
+ */
+size_t fbr_stack_pool_trim(FBR_P_ unsigned keep);
+
+/**
+ * Sets how much of a pooled stack is kept resident.
+ * @param [in] threshold number of bytes at the top of the stack to keep
+ *
+ * When a fiber is reclaimed, pages of its stack which lie below the threshold
+ * (counting from the top of the stack, where it starts to grow) are handed
+ * back to the kernel with madvise(MADV_FREE), or MADV_DONTNEED where the
+ * former is not supported. The memory stays mapped and is committed again on
+ * demand. Default is 16 KB, (size_t)-1 disables releasing altogether.
+ */
+void fbr_stack_set_release_threshold(FBR_P_ size_t threshold);
+
 /**
  * Retrieve a name of the fiber.
  * @param [in] id identificator of a fiber
@@ -1118,6 +1483,47 @@ void fbr_free_nd(FBR_P_ void *ptr);
  */
 int fbr_fd_nonblock(FBR_P_ int fd);
 
+/**
+ * Registers a file descriptor with the context.
+ * @param [in] fd file descriptor to register
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * By default every I/O wrapper starts an ev_io watcher of its own before the
+ * syscall and stops it afterwards, which with the epoll backend costs a pair
+ * of epoll_ctl calls per wrapper call. A registered descriptor gets a single
+ * watcher that stays alive until fbr_fd_unregister. Its interest mask is
+ * changed lazily: a direction is added when some fiber waits for it, and
+ * dropped only when readiness arrives with nobody waiting. Readiness is passed
+ * to the fibers waiting on the descriptor one at a time. All I/O wrappers
+ * (fbr_read, fbr_write, fbr_recv, fbr_send, fbr_accept, fbr_connect and their
+ * variants) pick the registration up automatically. The watcher keeps the
+ * event loop alive only while some fiber waits on the descriptor.
+ *
+ * The descriptor is switched to non-blocking mode. It must be unregistered
+ * before it's closed, since the same number may be reused by another
+ * descriptor.
+ *
+ * Possible errno values:
+ * @arg FBR_EINVAL fd is negative or already registered
+ * @arg FBR_ESYSTEM out of memory or fcntl failed
+ * @see fbr_fd_unregister
+ */
+int fbr_fd_register(FBR_P_ int fd);
+
+/**
+ * Unregisters a file descriptor.
+ * @param [in] fd file descriptor to unregister
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Stops the watcher of the descriptor. Fibers that are blocked on it at the
+ * moment are woken up and their calls fail with errno set to EBADF.
+ *
+ * Possible errno values:
+ * @arg FBR_EINVAL fd is not registered
+ * @see fbr_fd_register
+ */
+int fbr_fd_unregister(FBR_P_ int fd);
+
 /**
  * Fiber friendly connect wrapper.
  * @param [in] sockfd - socket file descriptor
@@ -1245,10 +1651,14 @@ ssize_t fbr_read_all_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeo
  * starting at buf, but stops if newline is encountered. Calling fiber will be
  * blocked until the required amount of data, EOF or newline arrive at fd.
  *
+ * The line is read byte by byte, as nothing past the newline may be consumed.
+ * Use fbr_stream_readline for anything but occasional lines.
+ *
  * Possible errno values are described in read man page.
  *
  * @see fbr_read
  * @see fbr_read_all
+ * @see fbr_stream_readline
  */
 ssize_t fbr_readline(FBR_P_ int fd, void *buffer, size_t n);
 
@@ -1385,6 +1795,472 @@ ssize_t fbr_sendto(FBR_P_ int sockfd, const void *buf, size_t len, int flags, co
  */
 ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags);
 
+/**
+ * Fiber friendly libc readv wrapper.
+ * @param [in] fd file descriptor to read from
+ * @param [in] iov array of buffers to fill
+ * @param [in] iovcnt number of elements in iov
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Scatter counterpart of fbr_read. Calling fiber will be blocked until
+ * something arrives at fd.
+ *
+ * Possible errno values are described in readv man page.
+ *
+ * @see fbr_readv_all
+ */
+ssize_t fbr_readv(FBR_P_ int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Fiber friendly libc readv wrapper with timeout.
+ * @param [in] fd file descriptor to read from
+ * @param [in] iov array of buffers to fill
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Same as fbr_readv, ETIMEDOUT is returned in case of timeout.
+ */
+ssize_t fbr_readv_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Reads until all the buffers are filled.
+ * @param [in] fd file descriptor to read from
+ * @param [in,out] iov array of buffers to fill
+ * @param [in] iovcnt number of elements in iov
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Scatter counterpart of fbr_read_all. Less than the total length of the
+ * buffers is returned only at the end of file.
+ *
+ * The elements of iov are advanced past the data read, so the array is
+ * modified by the call.
+ */
+ssize_t fbr_readv_all(FBR_P_ int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Reads until all the buffers are filled or the timeout expires.
+ * @param [in] fd file descriptor to read from
+ * @param [in,out] iov array of buffers to fill
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Same as fbr_readv_all, ETIMEDOUT is returned in case of timeout, with iov
+ * advanced past the data read so far.
+ */
+ssize_t fbr_readv_all_wto(FBR_P_ int fd, struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc writev wrapper.
+ * @param [in] fd file descriptor to write to
+ * @param [in] iov array of buffers to write
+ * @param [in] iovcnt number of elements in iov
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Gather counterpart of fbr_write, useful to send a header and a body in one
+ * syscall without copying them together.
+ *
+ * Possible errno values are described in writev man page.
+ *
+ * @see fbr_writev_all
+ */
+ssize_t fbr_writev(FBR_P_ int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Fiber friendly libc writev wrapper with timeout.
+ * @param [in] fd file descriptor to write to
+ * @param [in] iov array of buffers to write
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_writev, ETIMEDOUT is returned in case of timeout.
+ */
+ssize_t fbr_writev_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Writes all the buffers.
+ * @param [in] fd file descriptor to write to
+ * @param [in,out] iov array of buffers to write
+ * @param [in] iovcnt number of elements in iov
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Gather counterpart of fbr_write_all. The elements of iov are advanced past
+ * the data written, so the array is modified by the call.
+ */
+ssize_t fbr_writev_all(FBR_P_ int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Writes all the buffers unless the timeout expires.
+ * @param [in] fd file descriptor to write to
+ * @param [in,out] iov array of buffers to write
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_writev_all, ETIMEDOUT is returned in case of timeout, with iov
+ * advanced past the data written so far.
+ */
+ssize_t fbr_writev_all_wto(FBR_P_ int fd, struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc recvmsg wrapper.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in,out] msg message header, see man recvmsg for details
+ * @param [in] flags just flags, see man recvmsg for details
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Calling fiber will be blocked until a message arrives at sockfd. There is
+ * no *_all flavor, since ancillary data is received along with every chunk.
+ *
+ * Possible errno values are described in recvmsg man page.
+ */
+ssize_t fbr_recvmsg(FBR_P_ int sockfd, struct msghdr *msg, int flags);
+
+/**
+ * Fiber friendly libc recvmsg wrapper with timeout.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in,out] msg message header, see man recvmsg for details
+ * @param [in] flags just flags, see man recvmsg for details
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Same as fbr_recvmsg, ETIMEDOUT is returned in case of timeout.
+ */
+ssize_t fbr_recvmsg_wto(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc sendmsg wrapper.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in] msg message header, see man sendmsg for details
+ * @param [in] flags just flags, see man sendmsg for details
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Possible errno values are described in sendmsg man page.
+ *
+ * @see fbr_sendmsg_all
+ */
+ssize_t fbr_sendmsg(FBR_P_ int sockfd, const struct msghdr *msg, int flags);
+
+/**
+ * Fiber friendly libc sendmsg wrapper with timeout.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in] msg message header, see man sendmsg for details
+ * @param [in] flags just flags, see man sendmsg for details
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_sendmsg, ETIMEDOUT is returned in case of timeout.
+ */
+ssize_t fbr_sendmsg_wto(FBR_P_ int sockfd, const struct msghdr *msg,
+		int flags, ev_tstamp timeout);
+
+/**
+ * Sends the whole message over a stream socket.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in,out] msg message header, see man sendmsg for details
+ * @param [in] flags just flags, see man sendmsg for details
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Keeps sending until all of msg_iov is written. The iovec array is advanced
+ * past the data written, and the ancillary data is sent with the first chunk
+ * only, so both the array and msg are modified by the call.
+ */
+ssize_t fbr_sendmsg_all(FBR_P_ int sockfd, struct msghdr *msg, int flags);
+
+/**
+ * Sends the whole message over a stream socket unless the timeout expires.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in,out] msg message header, see man sendmsg for details
+ * @param [in] flags just flags, see man sendmsg for details
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_sendmsg_all, ETIMEDOUT is returned in case of timeout.
+ */
+ssize_t fbr_sendmsg_all_wto(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp timeout);
+
+#ifdef HAVE_RECVMMSG
+
+struct mmsghdr;
+
+/**
+ * Receives a batch of datagrams.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in,out] msgvec array of message headers, see man recvmmsg
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man recvmmsg for details
+ * @return number of messages received on success, -1 in case of error and
+ * errno set
+ *
+ * Calling fiber will be blocked until at least one datagram arrives at
+ * sockfd, then as many of the queued ones as fit into msgvec are received in
+ * a single syscall. Received lengths are stored in msg_len of each element.
+ *
+ * Only available on systems that have recvmmsg, struct mmsghdr is declared by
+ * sys/socket.h with _GNU_SOURCE defined.
+ *
+ * Possible errno values are described in recvmmsg man page.
+ */
+int fbr_recvmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags);
+
+/**
+ * Receives a batch of datagrams with timeout.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in,out] msgvec array of message headers, see man recvmmsg
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man recvmmsg for details
+ * @param [in] timeout in seconds to wait for the first datagram
+ * @return number of messages received on success, -1 in case of error and
+ * errno set
+ *
+ * Same as fbr_recvmmsg, ETIMEDOUT is returned in case of timeout.
+ */
+int fbr_recvmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout);
+
+/**
+ * Sends a batch of datagrams.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in,out] msgvec array of message headers, see man sendmmsg
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man sendmmsg for details
+ * @return number of messages sent on success, -1 in case of error and errno
+ * set
+ *
+ * Sends all of msgvec, as many datagrams per syscall as the socket buffer
+ * takes, and blocks the calling fiber while it is full. Sent lengths are
+ * stored in msg_len of each element. If an error occurs after some datagrams
+ * have been sent, their number is returned.
+ *
+ * Possible errno values are described in sendmmsg man page.
+ */
+int fbr_sendmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags);
+
+/**
+ * Sends a batch of datagrams with timeout.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in,out] msgvec array of message headers, see man sendmmsg
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man sendmmsg for details
+ * @param [in] timeout in seconds to wait for the whole batch
+ * @return number of messages sent on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_sendmmsg, the datagrams sent before the timeout are counted
+ * as usual, ETIMEDOUT is returned if none has been sent.
+ */
+int fbr_sendmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout);
+
+#endif
+
+#ifdef HAVE_SENDFILE
+
+/**
+ * Fiber friendly sendfile wrapper.
+ * @param [in] out_fd descriptor to write to, usually a socket
+ * @param [in] in_fd file to read from
+ * @param [in,out] offset where to start reading in_fd, or NULL to use and
+ * advance its file position
+ * @param [in] count maximum number of bytes to copy
+ * @return number of bytes copied on success, 0 at the end of in_fd, -1 in
+ * case of error and errno set
+ *
+ * Copies data within the kernel on the loop thread, blocking the calling
+ * fiber until out_fd is writable, just like fbr_write does. Reading in_fd is
+ * not waited for, so it should be in the page cache, otherwise the whole
+ * thread waits for the disk. Use fbr_eio_sendfile for cold files.
+ *
+ * Possible errno values are described in sendfile man page.
+ *
+ * @see fbr_sendfile_all
+ */
+ssize_t fbr_sendfile(FBR_P_ int out_fd, int in_fd, off_t *offset,
+		size_t count);
+
+/**
+ * Sends the whole range of a file.
+ * @param [in] out_fd descriptor to write to, usually a socket
+ * @param [in] in_fd file to read from
+ * @param [in,out] offset where to start reading in_fd, or NULL to use and
+ * advance its file position
+ * @param [in] count number of bytes to copy
+ * @return number of bytes copied on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_sendfile, but keeps going until count bytes are copied or the
+ * end of in_fd is reached.
+ */
+ssize_t fbr_sendfile_all(FBR_P_ int out_fd, int in_fd, off_t *offset,
+		size_t count);
+
+#endif
+
+#ifdef HAVE_SPLICE
+
+/**
+ * Fiber friendly splice wrapper.
+ * @param [in] fd_in descriptor to read from
+ * @param [in,out] off_in offset in fd_in, see man splice for details
+ * @param [in] fd_out descriptor to write to
+ * @param [in,out] off_out offset in fd_out, see man splice for details
+ * @param [in] len maximum number of bytes to move
+ * @param [in] flags SPLICE_F_* flags, SPLICE_F_NONBLOCK is always added
+ * @return number of bytes moved on success, 0 at the end of fd_in, -1 in case
+ * of error and errno set
+ *
+ * Moves data between a pipe and another descriptor without copying it to
+ * user space. The calling fiber is blocked until both ends are ready: the
+ * other end is waited for first, the pipe end once it turns out to be empty
+ * or full.
+ *
+ * Possible errno values are described in splice man page.
+ *
+ * @see fbr_splice_all
+ * @see fbr_proxy
+ */
+ssize_t fbr_splice(FBR_P_ int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags);
+
+/**
+ * Moves exactly len bytes with splice.
+ * @param [in] fd_in descriptor to read from
+ * @param [in,out] off_in offset in fd_in, see man splice for details
+ * @param [in] fd_out descriptor to write to
+ * @param [in,out] off_out offset in fd_out, see man splice for details
+ * @param [in] len number of bytes to move
+ * @param [in] flags SPLICE_F_* flags, SPLICE_F_NONBLOCK is always added
+ * @return number of bytes moved on success, -1 in case of error and errno
+ * set
+ *
+ * Same as fbr_splice, but keeps going until len bytes are moved or the end of
+ * fd_in is reached.
+ */
+ssize_t fbr_splice_all(FBR_P_ int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags);
+
+/**
+ * Fiber friendly tee wrapper.
+ * @param [in] fd_in pipe to duplicate the data of
+ * @param [in] fd_out pipe to duplicate the data to
+ * @param [in] len maximum number of bytes to duplicate
+ * @param [in] flags SPLICE_F_* flags, SPLICE_F_NONBLOCK is always added
+ * @return number of bytes duplicated on success, 0 if fd_in has no writers
+ * left, -1 in case of error and errno set
+ *
+ * The calling fiber is blocked until fd_in has some data and fd_out has room
+ * for it. There is no *_all flavor, since tee does not consume
+ * the input, so another call would duplicate the same data again.
+ *
+ * Possible errno values are described in tee man page.
+ */
+ssize_t fbr_tee(FBR_P_ int fd_in, int fd_out, size_t len, unsigned int flags);
+
+/**
+ * Pumps data from one socket to another.
+ * @param [in] fd_in descriptor to read from
+ * @param [in] fd_out descriptor to write to
+ * @return number of bytes pumped on success, -1 in case of error and errno
+ * set
+ *
+ * Moves everything arriving at fd_in to fd_out through a kernel pipe, with no
+ * copying in user space, until the end of file on fd_in. Data flows in one
+ * direction only, a bidirectional proxy needs a fiber per direction.
+ *
+ * @see fbr_splice
+ */
+ssize_t fbr_proxy(FBR_P_ int fd_in, int fd_out);
+
+#endif
+
+/**
+ * Initializes a zerocopy send request.
+ * @param [in] zc request to initialize
+ * @param [in] func callback to call once the buffer is released, may be NULL
+ * @param [in] arg argument of func
+ *
+ * The request may be reused for another fbr_send_zc once released.
+ * @see fbr_send_zc
+ */
+void fbr_zc_init(FBR_P_ struct fbr_zc *zc, fbr_zc_release_func_t func,
+		void *arg);
+
+/**
+ * Sends a buffer without copying it into the kernel.
+ * @param [in] sockfd socket to write to, must be registered with
+ * fbr_fd_register
+ * @param [in] buf data to send
+ * @param [in] len number of bytes to send
+ * @param [in] flags just flags, see man send for details
+ * @param [in] zc request initialized by fbr_zc_init
+ * @return len on success, -1 in case of error and errno set
+ *
+ * Sends all of buf with MSG_ZEROCOPY, so the kernel transmits straight from
+ * the pages of buf. The call returns once everything is queued, but buf must
+ * stay intact until the request is released: either wait for it with
+ * fbr_zc_wait, or have the callback of the request notified. The completions
+ * are picked up from the error queue of the socket by the event loop.
+ *
+ * Messages shorter than the threshold set with fbr_set_zc_threshold, and
+ * sockets or systems that do not support zerocopy, get the data copied as
+ * usual. The request is released right away then, with the callback called
+ * before fbr_send_zc returns. The kernel may also decide to copy, e.g. over
+ * the loopback, the copied field of the request tells that such sends would
+ * better use the threshold.
+ *
+ * Requests still pending when sockfd is unregistered are released with the
+ * aborted field set. The kernel may still be transmitting from such a buffer:
+ * it is not safe to reuse until the socket is closed, and data queued before
+ * the close may still go out with whatever the buffer holds by then, so
+ * the socket should be closed before the buffers are freed or overwritten.
+ *
+ * Possible errno values are described in send man page, EINVAL is returned
+ * for sockets that are not registered.
+ * @see fbr_zc_wait
+ */
+ssize_t fbr_send_zc(FBR_P_ int sockfd, const void *buf, size_t len,
+		int flags, struct fbr_zc *zc);
+
+/**
+ * Waits for a zerocopy send request to be released.
+ * @param [in] zc request passed to fbr_send_zc
+ * @returns 0 on success, -1 upon error
+ *
+ * Possible errno values:
+ * @arg FBR_ETIMEDOUT the deadline of the fiber has expired
+ * @see fbr_send_zc
+ */
+int fbr_zc_wait(FBR_P_ struct fbr_zc *zc);
+
+/**
+ * Sets the zerocopy size threshold.
+ * @param [in] threshold minimum size of the messages worth sending without
+ * copying (16KiB by default)
+ *
+ * Pinning the pages and processing the completion cost more than copying a
+ * small message.
+ * @see fbr_send_zc
+ */
+void fbr_set_zc_threshold(FBR_P_ size_t threshold);
+
 /**
  * Fiber friendly libc accept wrapper.
  * @param [in] sockfd file descriptor to accept on
@@ -1399,6 +2275,279 @@ ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags);
  */
 int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
+/**
+ * Accepts a batch of connections.
+ * @param [in] sockfd listening socket
+ * @param [out] fds array to store the accepted descriptors in
+ * @param [in] count number of elements in fds
+ * @return number of connections accepted on success, -1 in case of error and
+ * errno set
+ *
+ * Blocks the calling fiber until a connection arrives, then accepts as many
+ * of the pending ones as fit into fds, so a burst of connections is taken in
+ * a single wakeup. The accepted descriptors are non-blocking and
+ * close-on-exec.
+ *
+ * The batch is only drained past the first connection if sockfd is
+ * non-blocking, i.e. registered with fbr_fd_register or switched with
+ * fbr_fd_nonblock.
+ *
+ * Possible errno values are described in accept man page. Errors that
+ * happen after the first connection end the batch and are reported by the
+ * next call.
+ * @see fbr_listen_reuseport
+ */
+int fbr_accept_batch(FBR_P_ int sockfd, int *fds, int count);
+
+/**
+ * Opens a listening socket that shares its port with others.
+ * @param [in] addr address to listen on
+ * @param [in] addrlen size of addr
+ * @param [in] backlog maximum length of the queue of pending connections
+ * @return listening socket on success, -1 in case of error and errno set
+ *
+ * Every group worker may open its own listener with SO_REUSEPORT on the same
+ * address, the kernel spreads the incoming connections across them, and each
+ * worker runs its own acceptor fiber. The socket is registered with
+ * fbr_fd_register in the calling context, so it has to be unregistered
+ * before it is closed.
+ *
+ * In case of failure FBR_ESYSTEM is set as f_errno and errno tells what went
+ * wrong, ENOPROTOOPT on systems without SO_REUSEPORT.
+ * @see fbr_accept_batch
+ */
+int fbr_listen_reuseport(FBR_P_ const struct sockaddr *addr,
+		socklen_t addrlen, int backlog);
+
+/**
+ * Creates an outbound connection pool.
+ * @param [in] params pool parameters
+ * @returns a pointer to a new pool or NULL upon error
+ *
+ * The pool keeps connections to any number of endpoints, keyed by the bytes
+ * of their addresses, so the same address has to be passed the same way
+ * every time (e.g. with sin_zero cleared). Connections are TCP sockets
+ * registered with fbr_fd_register, which the pool owns: they are handed out
+ * with fbr_pool_checkout and have to be given back with fbr_pool_checkin,
+ * never closed by the user.
+ *
+ * If idle_timeout is set, a reaper fiber closes the connections that have
+ * been idle for longer. It only sleeps while there are idle connections, so
+ * it keeps the loop running until the last of them is evicted.
+ *
+ * Possible errors:
+ *  - FBR_EINVAL if the timeouts are negative
+ *  - FBR_ESYSTEM if memory allocation failed
+ * @see fbr_pool_checkout
+ * @see fbr_pool_checkin
+ * @see fbr_pool_destroy
+ */
+struct fbr_pool *fbr_pool_create(FBR_P_ const struct fbr_pool_params *params);
+
+/**
+ * Checks a connection out of a pool.
+ * @param [in] pool connection pool
+ * @param [in] addr address of the endpoint
+ * @param [in] addrlen size of addr
+ * @param [in] timeout how long the checkout may take in seconds
+ * @return connected socket on success, -1 in case of error and errno set
+ *
+ * Takes the most recently used idle connection to the endpoint, after
+ * checking that the peer has not closed it. If there is none, a new one is
+ * established, unless either of the per endpoint limits is reached, in which
+ * case the fiber waits for a connection to be checked in or a connect slot
+ * to free up.
+ *
+ * The whole checkout, connecting included, is limited by timeout, and by the
+ * deadline of the fiber. If it expires, errno is set to ETIMEDOUT and
+ * f_errno to FBR_ETIMEDOUT, which is also the case for a connect that takes
+ * longer than connect_timeout. Other connect failures are reported with errno
+ * of the connect and f_errno set to FBR_ESYSTEM.
+ * @see fbr_pool_checkin
+ */
+int fbr_pool_checkout(FBR_P_ struct fbr_pool *pool,
+		const struct sockaddr *addr, socklen_t addrlen,
+		ev_tstamp timeout);
+
+/**
+ * Returns a connection to a pool.
+ * @param [in] pool connection pool
+ * @param [in] fd descriptor obtained with fbr_pool_checkout
+ * @param [in] reusable whether the connection may be handed out again
+ * @return 0 on success, -1 if fd is not checked out from the pool
+ *
+ * A reusable connection is kept idle for the next checkout, otherwise it is
+ * closed. Connections that are in an unknown protocol state, e.g. after an
+ * I/O error or a timeout in the middle of a request, shall not be reused.
+ */
+int fbr_pool_checkin(FBR_P_ struct fbr_pool *pool, int fd, int reusable);
+
+/**
+ * Retrieves connection pool statistics.
+ * @param [in] pool connection pool
+ * @param [out] stats where to store the statistics
+ */
+void fbr_pool_get_stats(FBR_P_ struct fbr_pool *pool,
+		struct fbr_pool_stats *stats);
+
+/**
+ * Destroys a connection pool.
+ * @param [in] pool connection pool
+ *
+ * Closes the idle connections. No fiber may be waiting in fbr_pool_checkout
+ * at this point. The connections still checked out are left alone, they
+ * have to be unregistered with fbr_fd_unregister and closed by their users.
+ */
+void fbr_pool_destroy(FBR_P_ struct fbr_pool *pool);
+
+/**
+ * Initializes a buffered stream.
+ * @param [in] stream fbr_stream structure to initialize
+ * @param [in] fd descriptor to read from and write to
+ * @param [in] size size of each of the read and write buffers
+ * @returns 0 on success, -1 upon error
+ *
+ * The stream does not own fd, it is neither switched to non-blocking mode nor
+ * closed by fbr_stream_destroy. Registering it with fbr_fd_register lets the
+ * stream pick up the data that is already there without waiting.
+ *
+ * Data written to the stream is collected in the write buffer and only sent
+ * once the buffer fills up, fbr_stream_flush is called, or the stream is
+ * about to wait for more input, so the replies to pipelined requests leave in
+ * a single write.
+ *
+ * Possible errno values:
+ * @arg FBR_EINVAL fd is negative or size is zero
+ * @arg FBR_ESYSTEM out of memory
+ * @see fbr_stream_destroy
+ */
+int fbr_stream_init(FBR_P_ struct fbr_stream *stream, int fd, size_t size);
+
+/**
+ * Destroys a buffered stream.
+ * @param [in] stream fbr_stream structure to destroy
+ *
+ * Any unflushed data is discarded, call fbr_stream_flush first if it
+ * matters.
+ */
+void fbr_stream_destroy(FBR_P_ struct fbr_stream *stream);
+
+/**
+ * Reads from a buffered stream.
+ * @param [in] stream stream to read from
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] count maximum number of bytes to read
+ * @return number of bytes read on success, 0 at the end of file, -1 in case
+ * of error and errno set
+ *
+ * Returns the buffered data if there is any, otherwise waits for the
+ * descriptor like fbr_read.
+ */
+ssize_t fbr_stream_read(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t count);
+
+/**
+ * Reads exact number of bytes from a buffered stream.
+ * @param [in] stream stream to read from
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] count desired number of bytes to read
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Works like fbr_read_all: less than count bytes are returned only at the end
+ * of file.
+ */
+ssize_t fbr_stream_read_exact(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t count);
+
+/**
+ * Reads up to a delimiter from a buffered stream.
+ * @param [in] stream stream to read from
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] n size of buf
+ * @param [in] delim delimiter byte
+ * @return number of bytes read on success, 0 at the end of file, -1 in case of
+ * error and errno set
+ *
+ * Reads up to and including delim, but not more than n - 1 bytes, and
+ * terminates buf with a null byte, just like fgets does. The delimiter is not
+ * the last byte read if the line is too long for buf, its remainder is
+ * left in the stream, or the end of file has been reached.
+ *
+ * An incomplete line stays in the stream when an error occurs, so the read
+ * may be retried. The only exception is a line longer than the stream
+ * buffer: if part of it has been moved to buf already, that part is returned
+ * and the error is left to the next call.
+ *
+ * @see fbr_stream_readline
+ */
+ssize_t fbr_stream_read_until(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t n, int delim);
+
+/**
+ * Reads a line from a buffered stream.
+ * @param [in] stream stream to read from
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] n size of buf
+ * @return number of bytes read on success, 0 at the end of file, -1 in case of
+ * error and errno set
+ *
+ * Same as fbr_stream_read_until with '\\n' as a delimiter.
+ * @see fbr_stream_read_until
+ */
+ssize_t fbr_stream_readline(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t n);
+
+/**
+ * Peeks into a buffered stream.
+ * @param [in] stream stream to read from
+ * @param [out] ptr pointer to the buffered data
+ * @param [in] count number of bytes needed, not more than the buffer size
+ * @return number of bytes available at ptr, -1 in case of error and errno set
+ *
+ * Waits until at least count bytes are buffered and returns them without
+ * consuming. Less than count bytes are returned at the end of file. The data
+ * stays valid until the next read from the stream.
+ * @see fbr_stream_consume
+ */
+ssize_t fbr_stream_peek(FBR_P_ struct fbr_stream *stream, void **ptr,
+		size_t count);
+
+/**
+ * Discards buffered data of a stream.
+ * @param [in] stream stream to consume data of
+ * @param [in] count number of bytes to discard
+ *
+ * Used along with fbr_stream_peek, at most the number of buffered bytes is
+ * discarded.
+ * @see fbr_stream_peek
+ */
+void fbr_stream_consume(FBR_P_ struct fbr_stream *stream, size_t count);
+
+/**
+ * Writes to a buffered stream.
+ * @param [in] stream stream to write to
+ * @param [in] buf pointer to the data
+ * @param [in] count number of bytes to write
+ * @return count on success, -1 in case of error and errno set
+ *
+ * Small writes are collected in the write buffer, the ones that do not fit
+ * into it go to the descriptor right away after the buffered data.
+ * @see fbr_stream_flush
+ */
+ssize_t fbr_stream_write(FBR_P_ struct fbr_stream *stream, const void *buf,
+		size_t count);
+
+/**
+ * Flushes a buffered stream.
+ * @param [in] stream stream to flush
+ * @return 0 on success, -1 in case of error and errno set
+ *
+ * Writes out all the data collected in the write buffer. Upon error the data
+ * that has been written already is dropped from the buffer, and the next
+ * flush picks up from where this one has stopped.
+ */
+int fbr_stream_flush(FBR_P_ struct fbr_stream *stream);
+
 /**
  * Puts current fiber to sleep.
  * @param [in] seconds maximum number of seconds to sleep
@@ -1425,6 +2574,83 @@ void fbr_async_wait(FBR_P_ ev_async *w);
  */
 void fbr_dump_stack(FBR_P_ fbr_logutil_func_t log);
 
+/**
+ * Retrieves scheduler statistics.
+ * @param [out] stats structure to fill in
+ *
+ * Useful to see how many fibers are resumed from the ready queue per loop
+ * iteration.
+ * @see fbr_sched_stats
+ */
+void fbr_get_sched_stats(FBR_P_ struct fbr_sched_stats *stats);
+
+/**
+ * Retrieves file operation statistics.
+ * @param [out] stats structure to fill in
+ *
+ * Tells how often the file wrappers managed to avoid the trip to a worker
+ * thread.
+ * @see fbr_file_stats
+ */
+void fbr_get_file_stats(FBR_P_ struct fbr_file_stats *stats);
+
+/**
+ * Sets the timer slack.
+ * @param [in] slack timer resolution in seconds (1ms by default)
+ * @returns 0 on success, -1 upon error
+ *
+ * All timeouts, including the ones of fbr_sleep and *_wto functions, are
+ * rounded up to the multiple of slack, so the deadlines that are close to each
+ * other expire together in a single event loop iteration. Larger slack means
+ * less wakeups, smaller one means better precision. Timeouts that are already
+ * armed are rescheduled according to the new slack.
+ *
+ * Possible errno values:
+ * @arg FBR_EINVAL slack is not positive
+ * @see fbr_ev_timeout
+ */
+int fbr_set_timer_slack(FBR_P_ ev_tstamp slack);
+
+/**
+ * Sets the deadline of the current fiber.
+ * @param [in] deadline absolute time, comparable to ev_now() of the loop
+ * @returns 0 on success, -1 upon error
+ *
+ * Once the deadline passes, all blocking calls of the fiber (I/O, sleeping,
+ * mutexes, conditional variables, message queues, channels, libeio requests
+ * and generic fbr_ev_wait) fail with FBR_ETIMEDOUT, and errno set to
+ * ETIMEDOUT. A call that is blocked at the moment is woken up. Calls that
+ * complete without blocking still succeed. Explicit timeouts of the *_wto
+ * functions keep working alongside, whichever expires first wins.
+ *
+ * The deadline is meant to cover a request as a whole: it's armed once, and
+ * only moving it somewhere else re-arms the timer, so any number of blocking
+ * calls may be made under it at no extra cost. The deadline is cleared when
+ * the fiber is reclaimed.
+ *
+ * Possible errno values:
+ * @arg FBR_EINVAL called from the root fiber
+ * @see fbr_deadline_clear
+ * @see fbr_deadline_get
+ */
+int fbr_deadline_set(FBR_P_ ev_tstamp deadline);
+
+/**
+ * Clears the deadline of the current fiber.
+ *
+ * Does nothing if no deadline is set. This is the way to do some cleanup
+ * requiring blocking calls after the deadline has expired.
+ * @see fbr_deadline_set
+ */
+void fbr_deadline_clear(FBR_P);
+
+/**
+ * Retrieves the deadline of the current fiber.
+ * @returns the deadline or 0 if none is set
+ * @see fbr_deadline_set
+ */
+ev_tstamp fbr_deadline_get(FBR_P);
+
 /**
  * Initializes a mutex.
  * @param [in] mutex a mutex structure to initialize
@@ -1443,16 +2669,20 @@ void fbr_mutex_init(FBR_P_ struct fbr_mutex *mutex);
 /**
  * Locks a mutex.
  * @param [in] mutex pointer to a mutex
+ * @returns 0 on success, -1 upon error
  *
  * Attempts to lock a mutex. If mutex is already locked then the calling fiber
  * is suspended until the mutex is eventually freed.
  *
+ * Possible errno values:
+ * @arg FBR_ETIMEDOUT the deadline of the fiber has expired
  * @see fbr_mutex_init
  * @see fbr_mutex_trylock
  * @see fbr_mutex_unlock
  * @see fbr_mutex_destroy
+ * @see fbr_deadline_set
  */
-void fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex);
+int fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex);
 
 /**
  * Tries to locks a mutex.
@@ -1530,8 +2760,12 @@ void fbr_cond_destroy(FBR_P_ struct fbr_cond_var *cond);
  *
  * A mutex must be acquired by the calling fiber prior to waiting for a
  * condition. Internally mutex is released and reacquired again before
- * returning. Upon successful return calling fiber will hold the mutex.
+ * returning. Upon successful return calling fiber will hold the mutex, the
+ * same is true when the fiber gives up waiting because of the deadline.
  *
+ * Possible errno values:
+ * @arg FBR_EINVAL the mutex is not locked
+ * @arg FBR_ETIMEDOUT the deadline of the fiber has expired
  * @see fbr_cond_init
  * @see fbr_cond_destroy
  * @see fbr_cond_broadcast
@@ -2007,26 +3241,27 @@ static inline struct fbr_cond_var *fbr_buffer_cond_write(FBR_PU_
  * Helper function, which waits until read is possible.
  * @param [in] buffer a pointer to fbr_buffer
  * @param [in] size required read size
- * @returns 1 to be while friendly
+ * @returns 1 to be while friendly, 0 if the deadline has expired
  *
  * This function is useful when you need to wait for data to arrive on a buffer
  * in a while loop.
+ * @see fbr_deadline_set
  */
 static inline int fbr_buffer_wait_read(FBR_P_ struct fbr_buffer *buffer,
 		size_t size)
 {
 	struct fbr_mutex mutex;
-	int retval;
+	int retval = 0;
 	fbr_mutex_init(FBR_A_ &mutex);
 	fbr_mutex_lock(FBR_A_ &mutex);
 	while (fbr_buffer_bytes(FBR_A_ buffer) < size) {
 		retval = fbr_cond_wait(FBR_A_ &buffer->committed_cond, &mutex);
-		assert(0 == retval);
-		(void)retval;
+		if (-1 == retval)
+			break;
 	}
 	fbr_mutex_unlock(FBR_A_ &mutex);
 	fbr_mutex_destroy(FBR_A_ &mutex);
-	return 1;
+	return 0 == retval;
 }
 
 /**
@@ -2048,27 +3283,28 @@ static inline int fbr_buffer_can_read(FBR_P_ struct fbr_buffer *buffer,
  * Helper function, which waits until write is possible.
  * @param [in] buffer a pointer to fbr_buffer
  * @param [in] size required write size
- * @returns 1 to be while friendly
+ * @returns 1 to be while friendly, 0 if the deadline has expired
  *
  * This function is useful when you need to wait for free space on a buffer
  * in a while loop.
+ * @see fbr_deadline_set
  */
 static inline int fbr_buffer_wait_write(FBR_P_ struct fbr_buffer *buffer,
 		size_t size)
 {
 	struct fbr_mutex mutex;
-	int retval;
+	int retval = 0;
 	fbr_mutex_init(FBR_A_ &mutex);
 	fbr_mutex_lock(FBR_A_ &mutex);
 	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size) {
 		retval = fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
 				&mutex);
-		assert(0 == retval);
-		(void)retval;
+		if (-1 == retval)
+			break;
 	}
 	fbr_mutex_unlock(FBR_A_ &mutex);
 	fbr_mutex_destroy(FBR_A_ &mutex);
-	return 1;
+	return 0 == retval;
 }
 
 /**
@@ -2087,15 +3323,97 @@ static inline int fbr_buffer_can_write(FBR_P_ struct fbr_buffer *buffer,
 }
 
 struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags);
-void fbr_mq_push(struct fbr_mq *mq, void *obj);
+/* Blocking operations below fail with FBR_ETIMEDOUT (-1 or NULL respectively)
+ * once the deadline of the calling fiber expires, see fbr_deadline_set */
+int fbr_mq_push(struct fbr_mq *mq, void *obj);
 int fbr_mq_try_push(struct fbr_mq *mq, void *obj);
-void fbr_mq_wait_push(struct fbr_mq *mq);
+int fbr_mq_wait_push(struct fbr_mq *mq);
 void *fbr_mq_pop(struct fbr_mq *mq);
 int fbr_mq_try_pop(struct fbr_mq *mq, void **obj);
-void fbr_mq_wait_pop(struct fbr_mq *mq);
+int fbr_mq_wait_pop(struct fbr_mq *mq);
 void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers);
 void fbr_mq_destroy(struct fbr_mq *mq);
 
+/**
+ * Creates a cross-thread channel.
+ * @param [in] size channel capacity (rounded up to a power of two)
+ * @returns a pointer to a new channel or NULL upon error
+ *
+ * Unlike fbr_mq, a channel can be written to by any number of threads,
+ * fiber contexts or plain threads alike, without any locking. The channel
+ * belongs to the context it was created with: only fibers of this context
+ * may receive from it.
+ *
+ * A receiving fiber that finds the channel empty parks until something gets
+ * sent. Senders wake the owner loop with a single ev_async_send() per batch:
+ * only the first send after the reader has parked pays for it.
+ *
+ * Possible errors:
+ *  - FBR_EINVAL if the size is zero
+ *  - FBR_ESYSTEM if memory allocation failed
+ * @see fbr_chan_send
+ * @see fbr_chan_recv
+ * @see fbr_chan_destroy
+ */
+struct fbr_chan *fbr_chan_create(FBR_P_ size_t size);
+
+/**
+ * Sends an object into a channel.
+ * @param [in] chan target channel
+ * @param [in] obj object to send
+ * @returns -1 on error (errno is set), 0 on success
+ *
+ * This function never blocks and is safe to call from any thread, with or
+ * without a fiber context. If the channel is full, errno is set to EAGAIN and
+ * it's up to the caller to apply backpressure or retry.
+ */
+int fbr_chan_send(struct fbr_chan *chan, void *obj);
+
+/**
+ * Receives an object from a channel.
+ * @param [in] chan source channel
+ * @returns received object or NULL if the deadline has expired
+ *
+ * Parks the calling fiber until an object is available. Must only be called
+ * by fibers of the context owning the channel. Objects sent by the same
+ * thread are received in the order they were sent.
+ *
+ * Gives up with FBR_ETIMEDOUT set in the context once the deadline of the
+ * fiber expires.
+ * @see fbr_deadline_set
+ */
+void *fbr_chan_recv(struct fbr_chan *chan);
+
+/**
+ * Receives a batch of objects from a channel.
+ * @param [in] chan source channel
+ * @param [out] objs array to store received objects into
+ * @param [in] max size of objs array (must be positive)
+ * @returns number of objects received, 0 if the deadline has expired
+ *
+ * Parks the calling fiber until at least one object is available, then
+ * takes up to max of them without blocking.
+ * @see fbr_deadline_set
+ */
+size_t fbr_chan_recv_many(struct fbr_chan *chan, void **objs, size_t max);
+
+/**
+ * Receives an object from a channel if there is one.
+ * @param [in] chan source channel
+ * @param [out] obj where to store the received object
+ * @returns -1 if the channel is empty, 0 on success
+ */
+int fbr_chan_try_recv(struct fbr_chan *chan, void **obj);
+
+/**
+ * Destroys a channel.
+ * @param [in] chan channel to destroy
+ *
+ * Must be called from the thread owning the channel, once no other thread is
+ * going to send to it anymore. Objects still in the channel are discarded.
+ */
+void fbr_chan_destroy(struct fbr_chan *chan);
+
 /**
  * Gets fiber user data pointer.
  * @param [in] id fiber id
@@ -2200,4 +3518,102 @@ int fbr_waitpid(FBR_P_ pid_t pid);
 int fbr_system(FBR_P_ const char *filename, char *const argv[],
 		char *const envp[], const char *working_dir);
 
+/**
+ * Creates a group of worker threads.
+ * @param [in] size number of worker threads
+ * @returns a pointer to a new group or NULL upon error (errno is set)
+ *
+ * Each worker runs a private event loop with a private fiber context. Fibers
+ * never migrate between contexts once started, as their stacks reference the
+ * context, but tasks submitted with fbr_group_submit() which are yet to be
+ * started are stolen by idle workers from the busy ones.
+ *
+ * This function does not need a fiber context and may be called from any
+ * thread.
+ * @see fbr_group_submit
+ * @see fbr_group_destroy
+ */
+struct fbr_group *fbr_group_create(unsigned size);
+
+/**
+ * Destroys a group of worker threads.
+ * @param [in] group group to destroy
+ *
+ * Stops all event loops, joins worker threads and destroys their fiber
+ * contexts, reclaiming any fibers that were still running. Tasks that did not
+ * get a chance to start are discarded.
+ */
+void fbr_group_destroy(struct fbr_group *group);
+
+/**
+ * Returns number of workers in a group.
+ * @param [in] group group in question
+ * @returns number of worker threads
+ */
+unsigned fbr_group_size(struct fbr_group *group);
+
+/**
+ * Submits a task to a group.
+ * @param [in] group target group
+ * @param [in] name fiber name for the task
+ * @param [in] func fiber function
+ * @param [in] arg user supplied argument to the fiber
+ * @param [in] stack_size stack size (0 for default one)
+ * @returns -1 on error (errno is set), 0 on success
+ *
+ * The task is queued to workers in a round-robin fashion and will be started
+ * as a fiber in the context of whichever worker gets to it first: idle
+ * workers steal not yet started tasks from the busy ones. The fiber function
+ * receives a worker's context, it may use fbr_group_worker() to find out
+ * which worker it runs on.
+ *
+ * This function is thread-safe.
+ * @see fbr_group_submit_to
+ */
+int fbr_group_submit(struct fbr_group *group, const char *name,
+		fbr_fiber_func_t func, void *arg, size_t stack_size);
+
+/**
+ * Submits a task to a particular worker.
+ * @param [in] group target group
+ * @param [in] index worker index (0 to fbr_group_size() - 1)
+ * @param [in] name fiber name for the task
+ * @param [in] func fiber function
+ * @param [in] arg user supplied argument to the fiber
+ * @param [in] stack_size stack size (0 for default one)
+ * @returns -1 on error (errno is set), 0 on success
+ *
+ * Tasks submitted by this function are never stolen by other workers.
+ *
+ * This function is thread-safe.
+ * @see fbr_group_submit
+ */
+int fbr_group_submit_to(struct fbr_group *group, unsigned index,
+		const char *name, fbr_fiber_func_t func, void *arg,
+		size_t stack_size);
+
+/**
+ * Submits a task to each worker of a group.
+ * @param [in] group target group
+ * @param [in] name fiber name for the task
+ * @param [in] func fiber function
+ * @param [in] arg user supplied argument to the fiber
+ * @param [in] stack_size stack size (0 for default one)
+ * @returns -1 on error (errno is set), 0 on success
+ *
+ * Useful for per-thread initialization, i.e. setting up listeners.
+ * @see fbr_group_submit_to
+ */
+int fbr_group_broadcast(struct fbr_group *group, const char *name,
+		fbr_fiber_func_t func, void *arg, size_t stack_size);
+
+/**
+ * Returns index of a group worker owning the context.
+ * @returns worker index or -1 if the context does not belong to a group
+ *
+ * Possible errors:
+ *  - FBR_EINVAL if the context is not owned by a group worker
+ */
+int fbr_group_worker(FBR_P);
+
 #endif
@@ -140,6 +140,7 @@ LIST_HEAD(mem_pool_list, mem_pool);
 
 TAILQ_HEAD(fiber_destructor_tailq, fbr_destructor);
 LIST_HEAD(fiber_list, fbr_fiber);
+TAILQ_HEAD(fiber_tailq, fbr_fiber);
 
 struct fbr_fiber {
 	uint64_t id;
@@ -149,16 +150,28 @@ struct fbr_fiber {
 	coro_context ctx;
 	char *stack;
 	size_t stack_size;
+	unsigned stack_class;
+	unsigned valgrind_stack_id;
 	struct {
 		struct fbr_ev_base **waiting;
 		int arrived;
 	} ev;
+	struct {
+		struct fbr_wheel_node node;
+		struct fbr_destructor dtor;
+		struct fbr_id_tailq_i item;
+		ev_tstamp at;
+		int set;
+		int expired;
+		int waiting;
+		int suppress;
+	} deadline;
 	struct trace_info reclaim_tinfo;
 	struct fiber_list children;
 	struct fbr_fiber *parent;
 	struct mem_pool_list pool;
 	struct {
-		LIST_ENTRY(fbr_fiber) reclaimed;
+		TAILQ_ENTRY(fbr_fiber) reclaimed;
 		LIST_ENTRY(fbr_fiber) children;
 	} entries;
 	struct fiber_destructor_tailq destructors;
@@ -166,6 +179,7 @@ struct fbr_fiber {
 	void *key_data[FBR_MAX_KEY];
 	int no_reclaim;
 	int want_reclaim;
+	int flags;
 	struct fbr_cond_var reclaim_cond;
 };
 
@@ -176,13 +190,158 @@ struct fbr_stack_item {
 	struct trace_info tinfo;
 };
 
+/* Stack size classes are powers of two from 4 KB up to 2 MB, anything larger
+ * goes to the oversized class, which is not pooled by default */
+#define FBR_STACK_CLASS_MIN_SHIFT 12
+#define FBR_STACK_CLASSES 10
+#define FBR_STACK_CLASS_OVERSIZED FBR_STACK_CLASSES
+
+/* Top part of a pooled stack which is kept resident by default */
+#define FBR_STACK_RELEASE_THRESHOLD (16 * 1024)
+/* Distance from the current frame that is left alone when releasing the stack
+ * of a running fiber (covers the red zone) */
+#define FBR_STACK_RELEASE_MARGIN 256
+
+struct fbr_stack_class {
+	struct fiber_tailq fibers;
+	unsigned count;
+	unsigned cap;
+};
+
+struct fbr_group_worker;
+
+/* Timer wheel geometry: 4 levels of 64 slots, i.e. with the default 1ms slack
+ * level 0 covers 64ms, level 1 -- 4s, level 2 -- 4.4m and level 3 -- 4.6h,
+ * anything further away is parked in the last level and cascaded again */
+#define FBR_WHEEL_BITS 6
+#define FBR_WHEEL_SLOTS (1 << FBR_WHEEL_BITS)
+#define FBR_WHEEL_LEVELS 4
+#define FBR_TIMER_SLACK 0.001
+
+LIST_HEAD(fbr_wheel_slot, fbr_wheel_node);
+
+struct fbr_wheel {
+	struct fbr_wheel_slot slots[FBR_WHEEL_LEVELS][FBR_WHEEL_SLOTS];
+	uint64_t occupied[FBR_WHEEL_LEVELS];
+	uint64_t now;
+	uint64_t armed;
+	ev_tstamp base;
+	ev_tstamp slack;
+	size_t count;
+	ev_timer timer;
+};
+
+/* Persistent watcher of a descriptor registered with fbr_fd_register. The
+ * entries are never freed before the context is destroyed, as the waiters
+ * that were woken up by fbr_fd_unregister still have to look at generation */
+struct fbr_fd_entry {
+	struct fbr_context *fctx;
+	ev_io io;
+	int fd;
+	int registered;
+	unsigned generation;
+	unsigned waiters;
+	int unref;
+	struct fbr_cond_var readable;
+	struct fbr_cond_var writable;
+	struct fbr_zc_socket *zc;
+};
+
+/* MSG_ZEROCOPY state of a registered socket, allocated by the first
+ * fbr_send_zc */
+#define FBR_ZC_DEFAULT_THRESHOLD (16 * 1024)
+
+TAILQ_HEAD(fbr_zc_tailq, fbr_zc);
+
+struct fbr_zc_socket {
+	/* The socket the numbering belongs to */
+	dev_t dev;
+	ino_t ino;
+	int probed;
+	int enabled;
+	uint32_t next_seq;
+	struct fbr_zc_tailq pending;
+	struct fbr_cond_var released;
+	ev_timer reaper;
+};
+
+/* Completion of an io_uring operation. Requests are recycled through a free
+ * list, and may outlive the fiber that submitted them: when it is reclaimed
+ * the request is orphaned and freed by its completion */
+struct fbr_uring_req {
+	int32_t res;
+	int done;
+	int orphaned;
+	struct fbr_cond_var done_cond;
+	struct fbr_uring_req *next_free;
+	LIST_ENTRY(fbr_uring_req) orphans;
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct stat;
+struct fbr_eio_engine;
+
+struct fbr_uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	/* Queued in the ring, but not yet passed to io_uring_enter */
+	unsigned unsubmitted;
+	/* Submitted and not yet completed */
+	unsigned inflight;
+	struct fbr_uring_req *free_reqs;
+	LIST_HEAD(, fbr_uring_req) orphans;
+	/* The kernel supports the file operations of the eio wrappers */
+	int files;
+	ev_io io;
+	ev_prepare prepare;
+	struct fbr_context *fctx;
+};
+
+/* State of the inline fast path of the file wrappers, see file.c */
+struct fbr_file_inline {
+	struct fbr_file_stats stats;
+	/* preadv2 or RWF_NOWAIT is not supported by the kernel */
+	int no_nowait;
+	/* The last inline stat was slow, stats are offloaded */
+	int stat_slow;
+	unsigned stat_offloaded;
+};
+
 struct fbr_context_private {
 	struct fbr_stack_item stack[FBR_CALL_STACK_SIZE];
 	struct fbr_stack_item *sp;
 	struct fbr_fiber root;
-	struct fiber_list reclaimed;
-	struct ev_async pending_async;
+	struct fbr_stack_class stack_classes[FBR_STACK_CLASSES + 1];
+	struct fiber_tailq bare_fibers;
+	size_t stack_release_threshold;
+	struct ev_prepare pending_prepare;
+	struct ev_idle pending_idle;
 	struct fbr_id_tailq pending_fibers;
+	struct fbr_sched_stats sched_stats;
+	struct fbr_wheel wheel;
+	struct fbr_fd_entry **fd_entries;
+	int fd_entries_size;
+	uint64_t fd_interest_changes;
+	size_t zc_threshold;
+	struct fbr_group_worker *group_worker;
+	struct fbr_uring *uring;
+	struct fbr_eio_engine *eio;
+	struct fbr_file_inline file_inline;
 	int backtraces_enabled;
 	uint64_t last_id;
 	uint64_t key_free_mask;
@@ -202,4 +361,130 @@ struct fbr_mq {
 	struct fbr_cond_var bytes_freed_cond;
 };
 
+#define FBR_CACHELINE_SIZE 64
+
+struct fbr_chan_cell {
+	size_t seq;
+	void *obj;
+};
+
+struct fbr_chan {
+	/* Read-mostly part, shared by everyone */
+	struct fbr_context *fctx;
+	struct fbr_chan_cell *cells;
+	size_t size;
+	size_t mask;
+	ev_async async;
+	struct fbr_cond_var available;
+	/* Written by producers */
+	size_t enqueue_pos __attribute__((aligned(FBR_CACHELINE_SIZE)));
+	/* Set by the sender that has sent the wakeup, cleared once the owner
+	 * loop has handled it */
+	int signalled __attribute__((aligned(FBR_CACHELINE_SIZE)));
+	/* Written by the consumer: number of parked receivers */
+	int parked __attribute__((aligned(FBR_CACHELINE_SIZE)));
+	size_t dequeue_pos;
+};
+
+struct fbr_pool_conn {
+	int fd;
+	ev_tstamp idle_since;
+	TAILQ_ENTRY(fbr_pool_conn) entries;
+};
+
+TAILQ_HEAD(fbr_pool_conn_tailq, fbr_pool_conn);
+
+/* Idle connections are kept most recently used first, checkouts take them
+ * from the head and the reaper evicts from the tail */
+struct fbr_pool_endpoint {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct fbr_pool_conn_tailq idle;
+	unsigned nidle;
+	unsigned nbusy;
+	unsigned nconnecting;
+	struct fbr_cond_var available;
+	TAILQ_ENTRY(fbr_pool_endpoint) entries;
+};
+
+TAILQ_HEAD(fbr_pool_endpoint_tailq, fbr_pool_endpoint);
+
+struct fbr_pool {
+	struct fbr_context *fctx;
+	struct fbr_pool_params params;
+	struct fbr_pool_endpoint_tailq endpoints;
+	/* Endpoint of every checked out descriptor, indexed by fd */
+	struct fbr_pool_endpoint **owners;
+	int owners_size;
+	fbr_id_t reaper;
+	struct fbr_cond_var reaper_cond;
+	struct fbr_pool_stats stats;
+};
+
+void fbr_wheel_init(FBR_P);
+void fbr_wheel_destroy(FBR_P);
+void fbr_wheel_add(FBR_P_ struct fbr_wheel_node *node, ev_tstamp deadline);
+void fbr_wheel_del(FBR_P_ struct fbr_wheel_node *node);
+
+void fbr_fd_registry_init(FBR_P);
+void fbr_fd_registry_destroy(FBR_P);
+struct fbr_fd_entry *fbr_fd_lookup(FBR_P_ int fd);
+int fbr_fd_wait(FBR_P_ struct fbr_fd_entry *entry, int events,
+		struct fbr_ev_timeout *tev);
+
+void fbr_zc_drain(FBR_P_ struct fbr_fd_entry *entry);
+void fbr_zc_socket_reset(FBR_P_ struct fbr_fd_entry *entry);
+void fbr_zc_socket_destroy(FBR_P_ struct fbr_fd_entry *entry);
+
+int fbr_uring_init(FBR_P);
+void fbr_uring_destroy(FBR_P);
+ssize_t fbr_uring_read(FBR_P_ int fd, void *buf, size_t count,
+		struct fbr_ev_timeout *tev);
+ssize_t fbr_uring_write(FBR_P_ int fd, const void *buf, size_t count,
+		struct fbr_ev_timeout *tev);
+ssize_t fbr_uring_read_all(FBR_P_ int fd, void *buf, size_t count,
+		struct fbr_ev_timeout *tev);
+ssize_t fbr_uring_write_all(FBR_P_ int fd, const void *buf, size_t count,
+		struct fbr_ev_timeout *tev);
+ssize_t fbr_uring_recv(FBR_P_ int fd, void *buf, size_t len, int flags,
+		struct fbr_ev_timeout *tev);
+ssize_t fbr_uring_send(FBR_P_ int fd, const void *buf, size_t len, int flags,
+		struct fbr_ev_timeout *tev);
+int fbr_uring_accept(FBR_P_ int fd, struct sockaddr *addr,
+		socklen_t *addrlen);
+int fbr_uring_connect(FBR_P_ int fd, const struct sockaddr *addr,
+		socklen_t addrlen, struct fbr_ev_timeout *tev);
+int fbr_uring_files_enabled(FBR_P);
+int fbr_uring_open(FBR_P_ const char *path, int flags, mode_t mode);
+ssize_t fbr_uring_pread(FBR_P_ int fd, void *buf, size_t count, off_t offset);
+ssize_t fbr_uring_pwrite(FBR_P_ int fd, const void *buf, size_t count,
+		off_t offset);
+int fbr_uring_fsync(FBR_P_ int fd, int datasync);
+int fbr_uring_fallocate(FBR_P_ int fd, int mode, off_t offset, off_t len);
+int fbr_uring_stat(FBR_P_ const char *path, int follow, struct stat *buf);
+int fbr_uring_fstat(FBR_P_ int fd, struct stat *buf);
+ssize_t fbr_uring_preadv(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags);
+ssize_t fbr_uring_pwritev(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags);
+
+void fbr_file_inline_init(FBR_P);
+int fbr_file_read_inline(FBR_P_ int fd, void *buf, size_t count,
+		off_t offset, ssize_t *result);
+int fbr_file_stat_inline(FBR_P_ const char *path, int follow,
+		struct stat *buf, int *result);
+int fbr_file_fstat_inline(FBR_P_ int fd, struct stat *buf, int *result);
+int fbr_file_readv_inline(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags, ssize_t *result);
+int fbr_file_writev_inline(FBR_P_ int fd, const struct iovec *iov,
+		int iovcnt, off_t offset, int flags, ssize_t *result);
+ssize_t fbr_file_preadv(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags);
+ssize_t fbr_file_pwritev(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags);
+
+typedef ssize_t (*fbr_io_call_t)(int fd, void *arg);
+ssize_t fbr_io_call(FBR_P_ int fd, int events, int nonblocking,
+		fbr_io_call_t call, void *arg, struct fbr_ev_timeout *tev);
+
 #endif
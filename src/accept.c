@@ -0,0 +1,133 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#define _GNU_SOURCE
+#include <evfibers/config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <evfibers_private/fiber.h>
+
+static ssize_t call_accept(int fd, _unused_ void *arg)
+{
+#ifdef HAVE_ACCEPT4
+	return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int client_fd;
+
+	client_fd = accept(fd, NULL, NULL);
+	if (-1 == client_fd)
+		return -1;
+	if (-1 == fcntl(client_fd, F_SETFL,
+				fcntl(client_fd, F_GETFL) | O_NONBLOCK) ||
+			-1 == fcntl(client_fd, F_SETFD, FD_CLOEXEC)) {
+		close(client_fd);
+		return -1;
+	}
+	return client_fd;
+#endif
+}
+
+int fbr_accept_batch(FBR_P_ int sockfd, int *fds, int count)
+{
+	int nonblocking;
+	int flags;
+	int n = 0;
+	ssize_t retval;
+
+	if (count <= 0) {
+		errno = EINVAL;
+		return_error(-1, FBR_EINVAL);
+	}
+
+	/* Draining past the first connection would block on a blocking
+	 * listener */
+	nonblocking = NULL != fbr_fd_lookup(FBR_A_ sockfd);
+	if (!nonblocking) {
+		flags = fcntl(sockfd, F_GETFL);
+		nonblocking = (-1 != flags) && (flags & O_NONBLOCK);
+	}
+
+	retval = fbr_io_call(FBR_A_ sockfd, EV_READ, nonblocking, call_accept,
+			NULL, NULL);
+	if (-1 == retval)
+		return_error(-1, FBR_ESYSTEM);
+	fds[n++] = retval;
+	if (!nonblocking)
+		return_success(n);
+
+	while (n < count) {
+		retval = call_accept(sockfd, NULL);
+		if (-1 == retval) {
+			if (EINTR == errno)
+				continue;
+			/* Errors other than EAGAIN are reported by the next
+			 * call */
+			break;
+		}
+		fds[n++] = retval;
+	}
+	return_success(n);
+}
+
+#ifdef SO_REUSEPORT
+
+int fbr_listen_reuseport(FBR_P_ const struct sockaddr *addr,
+		socklen_t addrlen, int backlog)
+{
+	int fd;
+	int one = 1;
+	int saved_errno;
+
+	fd = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (-1 == fd)
+		return_error(-1, FBR_ESYSTEM);
+	if (-1 == fcntl(fd, F_SETFD, FD_CLOEXEC))
+		goto error;
+	if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)))
+		goto error;
+	if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+		goto error;
+	if (-1 == bind(fd, addr, addrlen))
+		goto error;
+	if (-1 == listen(fd, backlog))
+		goto error;
+	if (-1 == fbr_fd_register(FBR_A_ fd))
+		goto error;
+	return_success(fd);
+
+error:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return_error(-1, FBR_ESYSTEM);
+}
+
+#else
+
+int fbr_listen_reuseport(FBR_P_ _unused_ const struct sockaddr *addr,
+		_unused_ socklen_t addrlen, _unused_ int backlog)
+{
+	errno = ENOPROTOOPT;
+	return_error(-1, FBR_ESYSTEM);
+}
+
+#endif
@@ -0,0 +1,221 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <evfibers/config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * The ring is a bounded multi-producer queue with per-cell sequence numbers
+ * (see D. Vyukov's "Bounded MPMC queue"). Producers never take locks, the
+ * only shared write on the fast path is the CAS on the enqueue position.
+ */
+
+static size_t round_up_pow2(size_t size)
+{
+	size_t result = 2;
+	while (result < size)
+		result <<= 1;
+	return result;
+}
+
+static void chan_async_cb(_unused_ EV_P_ ev_async *w, _unused_ int revents)
+{
+	struct fbr_chan *chan = w->data;
+	/* Whatever is sent from now on needs a wakeup of its own, the parked
+	 * receivers are woken up by this one */
+	__atomic_store_n(&chan->signalled, 0, __ATOMIC_RELEASE);
+	fbr_cond_broadcast(chan->fctx, &chan->available);
+}
+
+struct fbr_chan *fbr_chan_create(FBR_P_ size_t size)
+{
+	struct fbr_chan *chan;
+	size_t i;
+
+	if (0 == size)
+		return_error(NULL, FBR_EINVAL);
+
+	chan = calloc(1, sizeof(*chan));
+	if (NULL == chan)
+		return_error(NULL, FBR_ESYSTEM);
+	chan->size = round_up_pow2(size);
+	chan->mask = chan->size - 1;
+	chan->cells = calloc(chan->size, sizeof(struct fbr_chan_cell));
+	if (NULL == chan->cells) {
+		free(chan);
+		return_error(NULL, FBR_ESYSTEM);
+	}
+	for (i = 0; i < chan->size; i++)
+		chan->cells[i].seq = i;
+	chan->fctx = fctx;
+	fbr_cond_init(FBR_A_ &chan->available);
+
+	ev_async_init(&chan->async, chan_async_cb);
+	chan->async.data = chan;
+	ev_async_start(fctx->__p->loop, &chan->async);
+	/* Idle channel should not keep the loop alive, parked readers take a
+	 * reference while they wait */
+	ev_unref(fctx->__p->loop);
+
+	return_success(chan);
+}
+
+void fbr_chan_destroy(struct fbr_chan *chan)
+{
+	struct fbr_context *fctx = chan->fctx;
+
+	ev_ref(fctx->__p->loop);
+	ev_async_stop(fctx->__p->loop, &chan->async);
+	fbr_cond_destroy(FBR_A_ &chan->available);
+	free(chan->cells);
+	free(chan);
+}
+
+int fbr_chan_send(struct fbr_chan *chan, void *obj)
+{
+	struct fbr_chan_cell *cell;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&chan->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = chan->cells + (pos & chan->mask);
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (0 == diff) {
+			if (__atomic_compare_exchange_n(&chan->enqueue_pos,
+						&pos, pos + 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&chan->enqueue_pos,
+					__ATOMIC_RELAXED);
+		}
+	}
+	cell->obj = obj;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in chan_park(): either the reader sees the
+	 * object, or we see it parked. Only the first sender after a reader
+	 * has parked pays for the ev_async_send(), the rest of the batch gets
+	 * picked up by the same wakeup. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&chan->parked, __ATOMIC_RELAXED) &&
+			!__atomic_load_n(&chan->signalled, __ATOMIC_RELAXED) &&
+			!__atomic_exchange_n(&chan->signalled, 1,
+				__ATOMIC_ACQ_REL))
+		ev_async_send(chan->fctx->__p->loop, &chan->async);
+	return 0;
+}
+
+static int chan_is_empty(struct fbr_chan *chan)
+{
+	struct fbr_chan_cell *cell;
+	size_t pos;
+
+	pos = chan->dequeue_pos;
+	cell = chan->cells + (pos & chan->mask);
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1;
+}
+
+static int chan_do_pop(struct fbr_chan *chan, void **obj)
+{
+	struct fbr_chan_cell *cell;
+	size_t pos;
+
+	/* Only the owner context reads the channel and fibers do not
+	 * preempt each other, so no CAS is needed on this side */
+	pos = chan->dequeue_pos;
+	cell = chan->cells + (pos & chan->mask);
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return -1;
+	*obj = cell->obj;
+	chan->dequeue_pos = pos + 1;
+	__atomic_store_n(&cell->seq, pos + chan->size, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void chan_park_dtor(FBR_P_ void *_arg)
+{
+	struct fbr_chan *chan = _arg;
+
+	__atomic_sub_fetch(&chan->parked, 1, __ATOMIC_RELAXED);
+	ev_unref(fctx->__p->loop);
+}
+
+/* Any number of fibers of the owner context may be parked at once, each one
+ * is counted until it is woken up, gives up or gets reclaimed */
+static int chan_park(struct fbr_chan *chan)
+{
+	struct fbr_context *fctx = chan->fctx;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	int retval;
+
+	__atomic_add_fetch(&chan->parked, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ev_ref(fctx->__p->loop);
+	dtor.func = chan_park_dtor;
+	dtor.arg = chan;
+	fbr_destructor_add(FBR_A_ &dtor);
+	if (!chan_is_empty(chan)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return 0;
+	}
+	retval = fbr_cond_wait(FBR_A_ &chan->available, NULL);
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	return retval;
+}
+
+int fbr_chan_try_recv(struct fbr_chan *chan, void **obj)
+{
+	return chan_do_pop(chan, obj);
+}
+
+void *fbr_chan_recv(struct fbr_chan *chan)
+{
+	void *obj;
+
+	while (chan_do_pop(chan, &obj))
+		if (-1 == chan_park(chan))
+			return NULL;
+	return obj;
+}
+
+size_t fbr_chan_recv_many(struct fbr_chan *chan, void **objs, size_t max)
+{
+	size_t count = 0;
+
+	assert(max > 0);
+	while (chan_do_pop(chan, objs))
+		if (-1 == chan_park(chan))
+			return 0;
+	for (count = 1; count < max; count++) {
+		if (chan_do_pop(chan, objs + count))
+			break;
+	}
+	return count;
+}
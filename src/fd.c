@@ -0,0 +1,282 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <evfibers/config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * Registry of descriptors with a persistent ev_io each. The I/O wrappers
+ * used to start and stop a watcher of their own around every call, which
+ * with the epoll backend means a couple of epoll_ctl calls per read. A
+ * registered descriptor keeps its watcher running instead, and the interest
+ * mask is only changed lazily: a direction is added when a fiber starts
+ * waiting for it, and dropped when readiness arrives with nobody waiting
+ * (keeping it would make the loop spin, as the readiness is level
+ * triggered). A fiber that keeps reading a stream of requests is usually back
+ * waiting by the time the next one arrives, so the mask hardly ever
+ * changes.
+ *
+ * Readiness is routed to the waiting fibers through a conditional variable
+ * per direction, one fiber per event. Since libev reports the readiness
+ * again on the next iteration while the condition holds, the rest of the
+ * waiters get their turn once the first one has consumed what it wanted.
+ */
+
+/* The watcher may stay active while nobody waits for the descriptor, it
+ * shall not keep the loop alive then */
+static void update_ref(FBR_P_ struct fbr_fd_entry *entry)
+{
+	int unref = ev_is_active(&entry->io) && 0 == entry->waiters;
+
+	if (unref == entry->unref)
+		return;
+	if (unref)
+		ev_unref(fctx->__p->loop);
+	else
+		ev_ref(fctx->__p->loop);
+	entry->unref = unref;
+}
+
+static void set_interest(FBR_P_ struct fbr_fd_entry *entry, int events)
+{
+	if (ev_is_active(&entry->io) && events == (entry->io.events &
+				(EV_READ | EV_WRITE)))
+		return;
+	if (!ev_is_active(&entry->io) && 0 == events)
+		return;
+	if (entry->unref) {
+		ev_ref(fctx->__p->loop);
+		entry->unref = 0;
+	}
+	ev_io_stop(fctx->__p->loop, &entry->io);
+	fctx->__p->fd_interest_changes++;
+	if (0 == events)
+		return;
+	ev_io_set(&entry->io, entry->fd, events);
+	ev_io_start(fctx->__p->loop, &entry->io);
+	update_ref(FBR_A_ entry);
+}
+
+static int current_interest(struct fbr_fd_entry *entry)
+{
+	if (!ev_is_active(&entry->io))
+		return 0;
+	return entry->io.events & (EV_READ | EV_WRITE);
+}
+
+static void fd_io_cb(_unused_ EV_P_ ev_io *w, int revents)
+{
+	struct fbr_fd_entry *entry = w->data;
+	struct fbr_context *fctx = entry->fctx;
+	int drop = 0;
+
+	if (revents & EV_ERROR) {
+		/* libev has already stopped the watcher, most likely the
+		 * descriptor has been closed behind our back. Let everyone
+		 * find that out from the syscall. */
+		if (entry->unref) {
+			ev_ref(fctx->__p->loop);
+			entry->unref = 0;
+		}
+		fbr_cond_broadcast(FBR_A_ &entry->readable);
+		fbr_cond_broadcast(FBR_A_ &entry->writable);
+		return;
+	}
+
+	/* Error queue readiness of a zerocopy socket is reported as both */
+	fbr_zc_drain(FBR_A_ entry);
+
+	if (revents & EV_READ) {
+		if (TAILQ_EMPTY(&entry->readable.waiting))
+			drop |= EV_READ;
+		else
+			fbr_cond_signal(FBR_A_ &entry->readable);
+	}
+	if (revents & EV_WRITE) {
+		if (TAILQ_EMPTY(&entry->writable.waiting))
+			drop |= EV_WRITE;
+		else
+			fbr_cond_signal(FBR_A_ &entry->writable);
+	}
+	if (drop)
+		set_interest(FBR_A_ entry, current_interest(entry) & ~drop);
+}
+
+void fbr_fd_registry_init(FBR_P)
+{
+	fctx->__p->fd_entries = NULL;
+	fctx->__p->fd_entries_size = 0;
+	fctx->__p->fd_interest_changes = 0;
+	fctx->__p->zc_threshold = FBR_ZC_DEFAULT_THRESHOLD;
+}
+
+void fbr_fd_registry_destroy(FBR_P)
+{
+	struct fbr_fd_entry *entry;
+	int i;
+
+	for (i = 0; i < fctx->__p->fd_entries_size; i++) {
+		entry = fctx->__p->fd_entries[i];
+		if (NULL == entry)
+			continue;
+		if (entry->unref)
+			ev_ref(fctx->__p->loop);
+		ev_io_stop(fctx->__p->loop, &entry->io);
+		fbr_zc_socket_destroy(FBR_A_ entry);
+		free(entry);
+	}
+	free(fctx->__p->fd_entries);
+	fctx->__p->fd_entries = NULL;
+	fctx->__p->fd_entries_size = 0;
+}
+
+struct fbr_fd_entry *fbr_fd_lookup(FBR_P_ int fd)
+{
+	struct fbr_fd_entry *entry;
+
+	if (fd < 0 || fd >= fctx->__p->fd_entries_size)
+		return NULL;
+	entry = fctx->__p->fd_entries[fd];
+	if (NULL == entry || !entry->registered)
+		return NULL;
+	return entry;
+}
+
+static struct fbr_fd_entry *get_entry(FBR_P_ int fd)
+{
+	struct fbr_fd_entry **entries;
+	struct fbr_fd_entry *entry;
+	int size;
+
+	if (fd >= fctx->__p->fd_entries_size) {
+		size = max(fctx->__p->fd_entries_size * 2, 64);
+		while (size <= fd)
+			size *= 2;
+		entries = realloc(fctx->__p->fd_entries,
+				size * sizeof(*entries));
+		if (NULL == entries)
+			return NULL;
+		memset(entries + fctx->__p->fd_entries_size, 0x00,
+				(size - fctx->__p->fd_entries_size) *
+				sizeof(*entries));
+		fctx->__p->fd_entries = entries;
+		fctx->__p->fd_entries_size = size;
+	}
+
+	entry = fctx->__p->fd_entries[fd];
+	if (entry)
+		return entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (NULL == entry)
+		return NULL;
+	entry->fctx = fctx;
+	entry->fd = fd;
+	ev_io_init(&entry->io, fd_io_cb, fd, 0);
+	entry->io.data = entry;
+	fbr_cond_init(FBR_A_ &entry->readable);
+	fbr_cond_init(FBR_A_ &entry->writable);
+	fctx->__p->fd_entries[fd] = entry;
+	return entry;
+}
+
+int fbr_fd_register(FBR_P_ int fd)
+{
+	struct fbr_fd_entry *entry;
+
+	if (fd < 0)
+		return_error(-1, FBR_EINVAL);
+	entry = get_entry(FBR_A_ fd);
+	if (NULL == entry)
+		return_error(-1, FBR_ESYSTEM);
+	if (entry->registered)
+		return_error(-1, FBR_EINVAL);
+	if (-1 == fbr_fd_nonblock(FBR_A_ fd))
+		return -1;
+	entry->registered = 1;
+	return_success(0);
+}
+
+int fbr_fd_unregister(FBR_P_ int fd)
+{
+	struct fbr_fd_entry *entry;
+
+	entry = fbr_fd_lookup(FBR_A_ fd);
+	if (NULL == entry)
+		return_error(-1, FBR_EINVAL);
+	set_interest(FBR_A_ entry, 0);
+	fbr_zc_socket_reset(FBR_A_ entry);
+	entry->registered = 0;
+	entry->generation++;
+	/* Waiters notice the generation change and fail with EBADF */
+	fbr_cond_broadcast(FBR_A_ &entry->readable);
+	fbr_cond_broadcast(FBR_A_ &entry->writable);
+	return_success(0);
+}
+
+static void waiter_dtor(FBR_P_ void *arg)
+{
+	struct fbr_fd_entry *entry = arg;
+
+	entry->waiters--;
+	update_ref(FBR_A_ entry);
+}
+
+int fbr_fd_wait(FBR_P_ struct fbr_fd_entry *entry, int events,
+		struct fbr_ev_timeout *tev)
+{
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *fb_events[] = {NULL, NULL, NULL};
+	struct fbr_cond_var *cond;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	unsigned generation = entry->generation;
+	int retval;
+
+	assert(EV_READ == events || EV_WRITE == events);
+	cond = (EV_READ == events) ? &entry->readable : &entry->writable;
+
+	fbr_ev_cond_var_init(FBR_A_ &ev, cond, NULL);
+	fb_events[0] = &ev.ev_base;
+	if (tev)
+		fb_events[1] = &tev->ev_base;
+
+	entry->waiters++;
+	dtor.func = waiter_dtor;
+	dtor.arg = entry;
+	fbr_destructor_add(FBR_A_ &dtor);
+	set_interest(FBR_A_ entry, current_interest(entry) | events);
+	update_ref(FBR_A_ entry);
+	retval = fbr_ev_wait(FBR_A_ fb_events);
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	if (-1 == retval)
+		return -1;
+	if (!ev.ev_base.arrived) {
+		errno = ETIMEDOUT;
+		return_error(-1, FBR_ETIMEDOUT);
+	}
+	if (generation != entry->generation) {
+		errno = EBADF;
+		return_error(-1, FBR_ESYSTEM);
+	}
+	return_success(0);
+}
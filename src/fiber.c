@@ -31,10 +31,12 @@
 #include <valgrind/valgrind.h>
 #else
 #define RUNNING_ON_VALGRIND (0)
-#define VALGRIND_STACK_REGISTER(a,b) (void)0
+#define VALGRIND_STACK_REGISTER(a,b) (0)
+#define VALGRIND_STACK_DEREGISTER(a) (void)0
 #endif
 
 #ifdef FBR_EIO_ENABLED
+#include <pthread.h>
 #include <evfibers/eio.h>
 #endif
 #include <evfibers_private/fiber.h>
@@ -101,35 +103,66 @@ static int fbr_id_unpack(FBR_P_ struct fbr_fiber **ptr, fbr_id_t id)
 	return 0;
 }
 
-static void pending_async_cb(EV_P_ ev_async *w, _unused_ int revents)
+static void pending_prepare_cb(EV_P_ ev_prepare *w, _unused_ int revents)
 {
 	struct fbr_context *fctx;
 	struct fbr_id_tailq_i *item;
-	fctx = (struct fbr_context *)w->data;
+	struct fbr_sched_stats *stats;
+	unsigned count = 0;
+	unsigned resumed = 0;
 	int retval;
 
+	fctx = (struct fbr_context *)w->data;
+	stats = &fctx->__p->sched_stats;
+
 	ENSURE_ROOT_FIBER;
 
-	if (TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_stop(EV_A_ &fctx->__p->pending_async);
-		return;
+	/* Only the fibers that are already queued are resumed within this
+	 * drain, the ones queued by resumed fibers have to wait for the next
+	 * loop iteration, otherwise a pair of fibers signalling each other
+	 * would starve the event loop. */
+	TAILQ_FOREACH(item, &fctx->__p->pending_fibers, entries)
+		count++;
+
+	while (count-- > 0 && !TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
+		item = TAILQ_FIRST(&fctx->__p->pending_fibers);
+		assert(item->head == &fctx->__p->pending_fibers);
+		/* item shall be removed from the queue by a destructor, which
+		 * shall be set by the procedure demanding delayed execution.
+		 * Destructor guarantees removal upon the reclaim of fiber. */
+		retval = fbr_transfer(FBR_A_ item->id);
+		if (-1 == retval) {
+			if (FBR_ENOFIBER != fctx->f_errno)
+				fbr_log_e(FBR_A_ "libevfibers: unexpected error"
+						" trying to call a fiber by id:"
+						" %s", fbr_strerror(FBR_A_
+							fctx->f_errno));
+			continue;
+		}
+		resumed++;
 	}
 
-	item = TAILQ_FIRST(&fctx->__p->pending_fibers);
-	assert(item->head == &fctx->__p->pending_fibers);
-	/* item shall be removed from the queue by a destructor, which shall be
-	 * set by the procedure demanding delayed execution. Destructor
-	 * guarantees removal upon the reclaim of fiber. */
-	ev_async_send(EV_A_ &fctx->__p->pending_async);
+	if (resumed > 0) {
+		stats->drains++;
+		stats->resumed += resumed;
+		stats->last_drain = resumed;
+		if (resumed > stats->max_drain)
+			stats->max_drain = resumed;
+	}
 
-	retval = fbr_transfer(FBR_A_ item->id);
-	if (-1 == retval && FBR_ENOFIBER != fctx->f_errno) {
-		fbr_log_e(FBR_A_ "libevfibers: unexpected error trying to call"
-				" a fiber by id: %s",
-				fbr_strerror(FBR_A_ fctx->f_errno));
+	if (TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
+		ev_prepare_stop(EV_A_ &fctx->__p->pending_prepare);
+		ev_idle_stop(EV_A_ &fctx->__p->pending_idle);
 	}
 }
 
+/* Active idle watcher makes the loop poll without blocking while there are
+ * fibers in the ready queue, the actual work is done in pending_prepare_cb. */
+static void pending_idle_cb(_unused_ EV_P_ _unused_ ev_idle *w,
+		_unused_ int revents)
+{
+}
+
 static void *allocate_in_fiber(FBR_P_ size_t size, struct fbr_fiber *in)
 {
 	struct mem_pool *pool_entry;
@@ -192,16 +225,31 @@ static void stdio_logger(FBR_P_ struct fbr_logger *logger,
 }
 
 void fbr_init(FBR_P_ struct ev_loop *loop)
+{
+	fbr_init_flags(FBR_A_ loop, 0);
+}
+
+void fbr_init_flags(FBR_P_ struct ev_loop *loop, int flags)
 {
 	struct fbr_fiber *root;
 	struct fbr_logger *logger;
 	char *buffer_pattern;
+	unsigned i;
 
 	fctx->__p = malloc(sizeof(struct fbr_context_private));
-	LIST_INIT(&fctx->__p->reclaimed);
+	for (i = 0; i <= FBR_STACK_CLASSES; i++) {
+		TAILQ_INIT(&fctx->__p->stack_classes[i].fibers);
+		fctx->__p->stack_classes[i].count = 0;
+		fctx->__p->stack_classes[i].cap = FBR_STACK_POOL_UNLIMITED;
+	}
+	fctx->__p->stack_classes[FBR_STACK_CLASS_OVERSIZED].cap = 0;
+	fctx->__p->stack_release_threshold = FBR_STACK_RELEASE_THRESHOLD;
+	TAILQ_INIT(&fctx->__p->bare_fibers);
 	LIST_INIT(&fctx->__p->root.children);
 	LIST_INIT(&fctx->__p->root.pool);
 	TAILQ_INIT(&fctx->__p->root.destructors);
+	memset(&fctx->__p->root.deadline, 0x00,
+			sizeof(fctx->__p->root.deadline));
 	TAILQ_INIT(&fctx->__p->pending_fibers);
 
 	root = &fctx->__p->root;
@@ -220,11 +268,27 @@ void fbr_init(FBR_P_ struct ev_loop *loop)
 	fctx->__p->backtraces_enabled = 1;
 	fill_trace_info(FBR_A_ &fctx->__p->sp->tinfo);
 	fctx->__p->loop = loop;
-	fctx->__p->pending_async.data = fctx;
 	fctx->__p->backtraces_enabled = 0;
 	memset(&fctx->__p->key_free_mask, 0xFF,
 			sizeof(fctx->__p->key_free_mask));
-	ev_async_init(&fctx->__p->pending_async, pending_async_cb);
+	ev_prepare_init(&fctx->__p->pending_prepare, pending_prepare_cb);
+	fctx->__p->pending_prepare.data = fctx;
+	ev_idle_init(&fctx->__p->pending_idle, pending_idle_cb);
+	memset(&fctx->__p->sched_stats, 0x00,
+			sizeof(fctx->__p->sched_stats));
+	fctx->__p->group_worker = NULL;
+	fctx->__p->uring = NULL;
+	fctx->__p->eio = NULL;
+	fbr_wheel_init(FBR_A);
+	fbr_fd_registry_init(FBR_A);
+	fbr_file_inline_init(FBR_A);
+#ifdef HAVE_IO_URING
+	/* The readiness based wrappers are the fallback */
+	if (flags & FBR_INIT_IO_URING)
+		fbr_uring_init(FBR_A);
+#else
+	(void)flags;
+#endif
 
 	buffer_pattern = getenv("FBR_BUFFER_FILE_PATTERN");
 	if (buffer_pattern)
@@ -254,6 +318,8 @@ const char *fbr_strerror(_unused_ FBR_P_ enum fbr_error_code code)
 			return "Not enough space in the buffer";
 		case FBR_EEIO:
 			return "libeio request error";
+		case FBR_ETIMEDOUT:
+			return "Deadline has expired";
 	}
 	return "Unknown error";
 }
@@ -316,11 +382,18 @@ static void reclaim_children(FBR_P_ struct fbr_fiber *fiber)
 
 static void fbr_free_in_fiber(_unused_ FBR_P_ _unused_ struct fbr_fiber *fiber,
 		void *ptr, int destructor);
+static void stack_free(struct fbr_fiber *fiber);
+static void stack_pool_put(FBR_P_ struct fbr_fiber *fiber);
+static void stack_compact(struct fbr_fiber *fiber);
+#ifdef FBR_EIO_ENABLED
+static void fbr_eio_destroy(FBR_P);
+#endif
 
 void fbr_destroy(FBR_P)
 {
 	struct fbr_fiber *fiber, *x;
 	struct mem_pool *p, *x2;
+	unsigned i;
 
 	reclaim_children(FBR_A_ &fctx->__p->root);
 
@@ -328,14 +401,37 @@ void fbr_destroy(FBR_P)
 		fbr_free_in_fiber(FBR_A_ &fctx->__p->root, p + 1, 1);
 	}
 
-	LIST_FOREACH_SAFE(fiber, &fctx->__p->reclaimed, entries.reclaimed, x) {
-		free(fiber->stack);
+	for (i = 0; i <= FBR_STACK_CLASSES; i++) {
+		TAILQ_FOREACH_SAFE(fiber, &fctx->__p->stack_classes[i].fibers,
+				entries.reclaimed, x) {
+			stack_free(fiber);
+			free(fiber);
+		}
+	}
+	TAILQ_FOREACH_SAFE(fiber, &fctx->__p->bare_fibers, entries.reclaimed,
+			x) {
 		free(fiber);
 	}
 
+	ev_prepare_stop(fctx->__p->loop, &fctx->__p->pending_prepare);
+	ev_idle_stop(fctx->__p->loop, &fctx->__p->pending_idle);
+#ifdef HAVE_IO_URING
+	fbr_uring_destroy(FBR_A);
+#endif
+#ifdef FBR_EIO_ENABLED
+	fbr_eio_destroy(FBR_A);
+#endif
+	fbr_wheel_destroy(FBR_A);
+	fbr_fd_registry_destroy(FBR_A);
+
 	free(fctx->__p);
 }
 
+int fbr_io_uring_enabled(FBR_P)
+{
+	return NULL != fctx->__p->uring;
+}
+
 void fbr_enable_backtraces(FBR_P_ int enabled)
 {
 	if (enabled)
@@ -345,9 +441,30 @@ void fbr_enable_backtraces(FBR_P_ int enabled)
 
 }
 
-static void cancel_ev(_unused_ FBR_P_ struct fbr_ev_base *ev)
+static void mutex_lock_nodeadline(FBR_P_ struct fbr_mutex *mutex)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	int retval;
+
+	fiber->deadline.suppress++;
+	retval = fbr_mutex_lock(FBR_A_ mutex);
+	fiber->deadline.suppress--;
+	assert(0 == retval);
+	(void)retval;
+}
+
+static void cancel_ev(FBR_P_ struct fbr_ev_base *ev)
 {
+	struct fbr_ev_cond_var *e_cond;
+
 	fbr_destructor_remove(FBR_A_ &ev->item.dtor, 1 /* call it */);
+	if (FBR_EV_COND_VAR == ev->type) {
+		e_cond = fbr_ev_upcast(ev, fbr_ev_cond_var);
+		/* Just like pthread_cond_timedwait, the mutex is held again
+		 * whether the condition was signalled or not */
+		if (e_cond->mutex)
+			mutex_lock_nodeadline(FBR_A_ e_cond->mutex);
+	}
 }
 
 static void post_ev(_unused_ FBR_P_ struct fbr_fiber *fiber,
@@ -449,11 +566,12 @@ static int do_reclaim(FBR_P_ struct fbr_fiber *fiber)
 	fiber_cleanup(FBR_A_ fiber);
 	fiber->id = fctx->__p->last_id++;
 #if 0
-	LIST_FOREACH(f, &fctx->__p->reclaimed, entries.reclaimed) {
+	TAILQ_FOREACH(f, &fctx->__p->stack_classes[fiber->stack_class].fibers,
+			entries.reclaimed) {
 		assert(f != fiber);
 	}
 #endif
-	LIST_INSERT_HEAD(&fctx->__p->reclaimed, fiber, entries.reclaimed);
+	stack_pool_put(FBR_A_ fiber);
 
 	filter_fiber_stack(FBR_A_ fiber);
 
@@ -472,7 +590,7 @@ int fbr_reclaim(FBR_P_ fbr_id_t id)
 	unpack_transfer_errno(-1, &fiber, id);
 
 	fbr_mutex_init(FBR_A_ &mutex);
-	fbr_mutex_lock(FBR_A_ &mutex);
+	mutex_lock_nodeadline(FBR_A_ &mutex);
 	while (fiber->no_reclaim > 0) {
 		fiber->want_reclaim = 1;
 		assert("Attempt to reclaim self while no_reclaim is set would"
@@ -480,7 +598,11 @@ int fbr_reclaim(FBR_P_ fbr_id_t id)
 		if (-1 == fbr_id_unpack(FBR_A_ NULL, id) &&
 				FBR_ENOFIBER == fctx->f_errno)
 			return_success(0);
+		/* Reclaim is not a part of any request, so it ignores the
+		 * deadline of the caller */
+		CURRENT_FIBER->deadline.suppress++;
 		retval = fbr_cond_wait(FBR_A_ &fiber->reclaim_cond, &mutex);
+		CURRENT_FIBER->deadline.suppress--;
 		assert(0 == retval);
 		(void)retval;
 	}
@@ -568,11 +690,43 @@ static void item_dtor(_unused_ FBR_P_ void *arg)
 	}
 }
 
+static void transfer_later(FBR_P_ struct fbr_id_tailq_i *item);
+
+static void ev_timeout_cb(FBR_P_ struct fbr_wheel_node *node)
+{
+	struct fbr_fiber *fiber;
+	struct fbr_ev_timeout *ev = node->data;
+	int retval;
+
+	retval = fbr_id_unpack(FBR_A_ &fiber, ev->ev_base.id);
+	if (-1 == retval) {
+		fbr_log_e(FBR_A_ "libevfibers: fiber is about to be called by"
+			" the timer wheel, but it's id is not valid: %s",
+			fbr_strerror(FBR_A_ fctx->f_errno));
+		abort();
+	}
+
+	post_ev(FBR_A_ fiber, &ev->ev_base);
+	/* Many timeouts tend to expire at once, so the fibers are resumed in
+	 * bulk from the ready queue, the item is removed from there by
+	 * timeout_dtor */
+	transfer_later(FBR_A_ &ev->ev_base.item);
+}
+
+static void timeout_dtor(FBR_P_ void *arg)
+{
+	struct fbr_ev_timeout *ev = arg;
+
+	fbr_wheel_del(FBR_A_ &ev->node);
+	item_dtor(FBR_A_ &ev->ev_base.item);
+}
+
 static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 {
 	struct fbr_ev_watcher *e_watcher;
 	struct fbr_ev_mutex *e_mutex;
 	struct fbr_ev_cond_var *e_cond;
+	struct fbr_ev_timeout *e_timeout;
 	struct fbr_id_tailq_i *item = &ev->item;
 
 	ev->arrived = 0;
@@ -618,9 +772,29 @@ static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 		if (e_cond->mutex)
 			fbr_mutex_unlock(FBR_A_ e_cond->mutex);
 		break;
+	case FBR_EV_TIMEOUT:
+		e_timeout = fbr_ev_upcast(ev, fbr_ev_timeout);
+		/* The event may be reused across waits, and the item still
+		 * points to the ready queue it was last put into */
+		item->head = NULL;
+		if (e_timeout->deadline < ev_now(fctx->__p->loop))
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		ev->item.dtor.func = timeout_dtor;
+		ev->item.dtor.arg = e_timeout;
+		e_timeout->node.cb = ev_timeout_cb;
+		e_timeout->node.data = e_timeout;
+		fbr_wheel_add(FBR_A_ &e_timeout->node, e_timeout->deadline);
+		break;
 	case FBR_EV_EIO:
 #ifdef FBR_EIO_ENABLED
-		/* NOP */
+		/* The completion is delivered through the ready queue */
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		item->head = NULL;
+		ev->data = item;
 #else
 		fbr_log_e(FBR_A_ "libevfibers: libeio support is not compiled");
 		abort();
@@ -639,13 +813,14 @@ static void finish_ev(FBR_P_ struct fbr_ev_base *ev)
 	case FBR_EV_COND_VAR:
 		e_cond = fbr_ev_upcast(ev, fbr_ev_cond_var);
 		if (e_cond->mutex)
-			fbr_mutex_lock(FBR_A_ e_cond->mutex);
+			mutex_lock_nodeadline(FBR_A_ e_cond->mutex);
 		break;
 	case FBR_EV_WATCHER:
 		e_watcher = fbr_ev_upcast(ev, fbr_ev_watcher);
 		ev_set_cb(e_watcher->w, ev_abort_cb);
 		break;
 	case FBR_EV_MUTEX:
+	case FBR_EV_TIMEOUT:
 		/* NOP */
 		break;
 	case FBR_EV_EIO:
@@ -659,41 +834,117 @@ static void finish_ev(FBR_P_ struct fbr_ev_base *ev)
 	}
 }
 
-static void watcher_timer_dtor(_unused_ FBR_P_ void *_arg)
+static void deadline_cb(FBR_P_ struct fbr_wheel_node *node)
+{
+	struct fbr_fiber *fiber = node->data;
+
+	fiber->deadline.expired = 1;
+	if (!fiber->deadline.waiting)
+		return;
+	fiber->ev.arrived = 1;
+	id_tailq_i_set(FBR_A_ &fiber->deadline.item, fiber);
+	transfer_later(FBR_A_ &fiber->deadline.item);
+}
+
+static void deadline_unwatch(struct fbr_fiber *fiber)
+{
+	struct fbr_id_tailq_i *item = &fiber->deadline.item;
+
+	fiber->deadline.waiting = 0;
+	if (item->head) {
+		TAILQ_REMOVE(item->head, item, entries);
+		item->head = NULL;
+	}
+}
+
+/* Makes the deadline of the fiber a part of the wait it's about to start.
+ * If the deadline has already passed, the wait ends right away. */
+static void deadline_watch(FBR_P_ struct fbr_fiber *fiber)
+{
+	if (!fiber->deadline.set || fiber->deadline.suppress > 0)
+		return;
+	if (fiber->deadline.expired ||
+			fiber->deadline.at <= ev_now(fctx->__p->loop)) {
+		fiber->deadline.expired = 1;
+		fiber->ev.arrived = 1;
+		return;
+	}
+	fiber->deadline.waiting = 1;
+}
+
+static void deadline_dtor(FBR_P_ void *arg)
+{
+	struct fbr_fiber *fiber = arg;
+
+	fbr_wheel_del(FBR_A_ &fiber->deadline.node);
+	deadline_unwatch(fiber);
+	fiber->deadline.set = 0;
+	fiber->deadline.expired = 0;
+}
+
+int fbr_deadline_set(FBR_P_ ev_tstamp deadline)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+
+	if (fiber == &fctx->__p->root)
+		return_error(-1, FBR_EINVAL);
+
+	if (fiber->deadline.set) {
+		if (fiber->deadline.at == deadline)
+			return_success(0);
+		fbr_wheel_del(FBR_A_ &fiber->deadline.node);
+	} else {
+		fiber->deadline.dtor.func = deadline_dtor;
+		fiber->deadline.dtor.arg = fiber;
+		fbr_destructor_add(FBR_A_ &fiber->deadline.dtor);
+		fiber->deadline.set = 1;
+	}
+	fiber->deadline.at = deadline;
+	fiber->deadline.expired = 0;
+	fiber->deadline.node.cb = deadline_cb;
+	fiber->deadline.node.data = fiber;
+	fbr_wheel_add(FBR_A_ &fiber->deadline.node, deadline);
+	return_success(0);
+}
+
+void fbr_deadline_clear(FBR_P)
 {
-	struct ev_timer *w = _arg;
-	ev_timer_stop(fctx->__p->loop, w);
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+
+	if (fiber->deadline.set)
+		fbr_destructor_remove(FBR_A_ &fiber->deadline.dtor,
+				1 /* Call it? */);
+}
+
+ev_tstamp fbr_deadline_get(FBR_P)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+
+	if (fiber->deadline.set)
+		return fiber->deadline.at;
+	return 0.;
 }
 
 int fbr_ev_wait_to(FBR_P_ struct fbr_ev_base *events[], ev_tstamp timeout)
 {
 	size_t size;
-	ev_timer timer;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct fbr_ev_timeout tev;
 	struct fbr_ev_base **new_events;
 	struct fbr_ev_base **ev_pptr;
 	int n_events;
 
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-	fbr_ev_watcher_init(FBR_A_ &watcher,
-			(struct ev_watcher *)&timer);
-	dtor.func = watcher_timer_dtor;
-	dtor.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
 	size = 0;
 	for (ev_pptr = events; NULL != *ev_pptr; ev_pptr++)
 		size++;
 	new_events = alloca((size + 2) * sizeof(void *));
 	memcpy(new_events, events, size * sizeof(void *));
-	new_events[size] = &watcher.ev_base;
+	new_events[size] = &tev.ev_base;
 	new_events[size + 1] = NULL;
 	n_events = fbr_ev_wait(FBR_A_ new_events);
-	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
 	if (n_events < 0)
 		return n_events;
-	if (watcher.ev_base.arrived)
+	if (tev.ev_base.arrived)
 		n_events--;
 	return n_events;
 }
@@ -722,8 +973,11 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 		}
 	}
 
+	if (0 == fiber->ev.arrived)
+		deadline_watch(FBR_A_ fiber);
 	while (0 == fiber->ev.arrived)
 		fbr_yield(FBR_A);
+	deadline_unwatch(fiber);
 
 	for (i = 0; NULL != events[i]; i++) {
 		if (events[i]->arrived) {
@@ -732,6 +986,10 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 		} else
 			cancel_ev(FBR_A_ events[i]);
 	}
+	if (0 == num) {
+		errno = ETIMEDOUT;
+		return_error(-1, FBR_ETIMEDOUT);
+	}
 	return_success(num);
 }
 
@@ -754,8 +1012,16 @@ int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one)
 		return_error(-1, FBR_EINVAL);
 	}
 
+	deadline_watch(FBR_A_ fiber);
 	while (0 == fiber->ev.arrived)
 		fbr_yield(FBR_A);
+	deadline_unwatch(fiber);
+
+	if (0 == one->arrived) {
+		cancel_ev(FBR_A_ one);
+		errno = ETIMEDOUT;
+		return_error(-1, FBR_ETIMEDOUT);
+	}
 
 finish:
 	finish_ev(FBR_A_ one);
@@ -766,22 +1032,12 @@ int fbr_ev_wait_one_wto(FBR_P_ struct fbr_ev_base *one, ev_tstamp timeout)
 {
 	int n_events;
 	struct fbr_ev_base *events[] = {one, NULL, NULL};
-	ev_timer timer;
-	struct fbr_ev_watcher twatcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
+	struct fbr_ev_timeout tev;
 
-	fbr_ev_watcher_init(FBR_A_ &twatcher,
-			(struct ev_watcher *)&timer);
-	dtor.func = watcher_timer_dtor;
-	dtor.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor);
-	events[1] = &twatcher.ev_base;
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	events[1] = &tev.ev_base;
 
 	n_events = fbr_ev_wait(FBR_A_ events);
-	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
 
 	if (n_events > 0 && events[0]->arrived)
 		return 0;
@@ -802,6 +1058,7 @@ int fbr_transfer(FBR_P_ fbr_id_t to)
 	fctx->__p->sp->fiber = callee;
 	fill_trace_info(FBR_A_ &fctx->__p->sp->tinfo);
 
+	fctx->__p->sched_stats.switches++;
 	coro_transfer(&caller->ctx, &callee->ctx);
 
 	return_success(0);
@@ -815,6 +1072,8 @@ void fbr_yield(FBR_P)
 			fctx->__p->sp->fiber != &fctx->__p->root);
 	callee = fctx->__p->sp->fiber;
 	caller = (--fctx->__p->sp)->fiber;
+	if (callee->flags & FBR_FIBER_STACK_COMPACT)
+		stack_compact(callee);
 	coro_transfer(&callee->ctx, &caller->ctx);
 }
 
@@ -849,30 +1108,125 @@ void fbr_ev_watcher_init(FBR_P_ struct fbr_ev_watcher *ev, ev_watcher *w)
 	ev->w = w;
 }
 
+void fbr_ev_timeout_init(FBR_P_ struct fbr_ev_timeout *ev, ev_tstamp timeout)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_TIMEOUT);
+	memset(&ev->node, 0x00, sizeof(ev->node));
+	ev->deadline = ev_now(fctx->__p->loop) + timeout;
+}
+
 static void watcher_io_dtor(_unused_ FBR_P_ void *_arg)
 {
 	struct ev_io *w = _arg;
 	ev_io_stop(fctx->__p->loop, w);
 }
 
-int fbr_connect(FBR_P_ int sockfd, const struct sockaddr *addr,
-                   socklen_t addrlen) {
+/* Readiness wait of the I/O wrappers. Descriptors registered with
+ * fbr_fd_register are served by their persistent watcher, the rest get a
+ * private one, which is started by the first wait and stays active until
+ * io_wait_finish, so the *_all functions do not restart it every time.
+ *
+ * The syscall is tried before waiting whenever the descriptor is known not to
+ * block: registered descriptors are switched to non-blocking mode, and socket
+ * calls pass MSG_DONTWAIT. Data that is already there is then picked up
+ * without a trip through the event loop, and the fiber is parked only on
+ * EAGAIN. Other descriptors might be blocking, so they are waited for first,
+ * just like before. */
+struct io_wait {
+	int events;
+	int optimistic;
+	int ready;
+	struct fbr_fd_entry *entry;
 	ev_io io;
 	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct fbr_destructor dtor;
+};
+
+#define IO_AGAIN(err) (EAGAIN == (err) || EWOULDBLOCK == (err))
+
+static void io_wait_init(FBR_P_ struct io_wait *iw, int fd, int events,
+		int nonblocking)
+{
+	iw->events = events;
+	iw->entry = fbr_fd_lookup(FBR_A_ fd);
+	iw->optimistic = nonblocking || NULL != iw->entry;
+	iw->ready = iw->optimistic;
+	ev_io_init(&iw->io, NULL, fd, events);
+	fbr_destructor_init(&iw->dtor);
+}
+
+/* Returns 0 once fd is ready, -1 with errno set if the timeout (if any) or
+ * the deadline of the fiber has expired first */
+static int io_wait(FBR_P_ struct io_wait *iw, struct fbr_ev_timeout *tev)
+{
+	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
+
+	if (iw->entry) {
+		if (-1 == fbr_fd_wait(FBR_A_ iw->entry, iw->events, tev))
+			return -1;
+		iw->ready = 1;
+		return 0;
+	}
+
+	if (!ev_is_active(&iw->io)) {
+		ev_io_start(fctx->__p->loop, &iw->io);
+		iw->dtor.func = watcher_io_dtor;
+		iw->dtor.arg = &iw->io;
+		fbr_destructor_add(FBR_A_ &iw->dtor);
+		fbr_ev_watcher_init(FBR_A_ &iw->watcher, (ev_watcher *)&iw->io);
+	}
+	events[0] = &iw->watcher.ev_base;
+	if (tev)
+		events[1] = &tev->ev_base;
+	if (-1 == fbr_ev_wait(FBR_A_ events))
+		return -1;
+	if (!iw->watcher.ev_base.arrived) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	iw->ready = 1;
+	return 0;
+}
+
+/* Waits unless the syscall is worth trying right away */
+static int io_ready(FBR_P_ struct io_wait *iw, struct fbr_ev_timeout *tev)
+{
+	if (iw->ready)
+		return 0;
+	return io_wait(FBR_A_ iw, tev);
+}
+
+/* Accounts for the result of the syscall, returns 1 if it has to be
+ * repeated */
+static int io_retry(struct io_wait *iw, ssize_t r)
+{
+	if (-1 != r)
+		return 0;
+	if (EINTR == errno)
+		return 1;
+	if (IO_AGAIN(errno)) {
+		iw->ready = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Called after a partial transfer of the *_all functions */
+static void io_progress(struct io_wait *iw)
+{
+	iw->ready = iw->optimistic;
+}
+
+static void io_wait_finish(FBR_P_ struct io_wait *iw)
+{
+	if (ev_is_active(&iw->io))
+		fbr_destructor_remove(FBR_A_ &iw->dtor, 1 /* Call it? */);
+}
+
+static int connect_result(int sockfd)
+{
 	int r;
 	socklen_t len;
-	r = connect(sockfd, addr, addrlen);
-	if ((-1 == r) && (EINPROGRESS != errno))
-	    return -1;
-
-	ev_io_init(&io, NULL, sockfd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
 
 	len = sizeof(r);
 	if (-1 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (void *)&r, &len)) {
@@ -881,217 +1235,140 @@ int fbr_connect(FBR_P_ int sockfd, const struct sockaddr *addr,
 		errno = r;
 		r = -1;
 	}
-
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
 	return r;
 }
 
+int fbr_connect(FBR_P_ int sockfd, const struct sockaddr *addr,
+                   socklen_t addrlen) {
+	struct io_wait iw;
+	int r;
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_connect(FBR_A_ sockfd, addr, addrlen, NULL);
+#endif
+	r = connect(sockfd, addr, addrlen);
+	if ((-1 == r) && (EINPROGRESS != errno))
+	    return -1;
+
+	io_wait_init(FBR_A_ &iw, sockfd, EV_WRITE, 0);
+	r = io_wait(FBR_A_ &iw, NULL);
+	io_wait_finish(FBR_A_ &iw);
+	if (-1 == r)
+		return -1;
+
+	return connect_result(sockfd);
+}
+
 int fbr_connect_wto(FBR_P_ int sockfd, const struct sockaddr *addr,
                    socklen_t addrlen, ev_tstamp timeout) {
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	int r, rc;
-	socklen_t len;
+	struct io_wait iw;
+	struct fbr_ev_timeout tev;
+	int r;
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring) {
+		fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+		return fbr_uring_connect(FBR_A_ sockfd, addr, addrlen, &tev);
+	}
+#endif
 	r = connect(sockfd, addr, addrlen);
 	if ((-1 == r) && (EINPROGRESS != errno))
 	    return -1;
 
-	ev_io_init(&io, NULL, sockfd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	rc = fbr_ev_wait_one_wto(FBR_A_ &watcher.ev_base, timeout);
-	if (0 == rc) {
-		len = sizeof(r);
-		if (-1 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (void *)&r, &len)) {
-			r = -1;
-		} else if ( 0 != r ) {
-			errno = r;
-			r = -1;
-		}
-	} else {
-		r = -1;
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	io_wait_init(FBR_A_ &iw, sockfd, EV_WRITE, 0);
+	r = io_wait(FBR_A_ &iw, &tev);
+	io_wait_finish(FBR_A_ &iw);
+	if (-1 == r) {
 		errno = ETIMEDOUT;
+		return -1;
 	}
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
-	return r;
+	return connect_result(sockfd);
 }
 
 
-ssize_t fbr_read(FBR_P_ int fd, void *buf, size_t count)
+static ssize_t do_read(FBR_P_ int fd, void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
 {
 	ssize_t r;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	ev_io_init(&io, NULL, fd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
-
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	struct io_wait iw;
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_read(FBR_A_ fd, buf, count, tev);
+#endif
+	io_wait_init(FBR_A_ &iw, fd, EV_READ, 0);
 	do {
+		if (-1 == io_ready(FBR_A_ &iw, tev)) {
+			r = -1;
+			break;
+		}
 		r = read(fd, buf, count);
-	} while (-1 == r && EINTR == errno);
-
-	ev_io_stop(fctx->__p->loop, &io);
+	} while (io_retry(&iw, r));
 
+	io_wait_finish(FBR_A_ &iw);
 	return r;
 }
 
-ssize_t fbr_read_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeout)
+ssize_t fbr_read(FBR_P_ int fd, void *buf, size_t count)
 {
-	ssize_t r = 0;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	int rc = 0;
-
-	ev_io_init(&io, NULL, fd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
-
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	rc = fbr_ev_wait_one_wto(FBR_A_ &watcher.ev_base, timeout);
+	return do_read(FBR_A_ fd, buf, count, NULL);
+}
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	if (0 == rc) {
-		do {
-			r = read(fd, buf, count);
-		} while (-1 == r && EINTR == errno);
-	}
-	ev_io_stop(fctx->__p->loop, &io);
+ssize_t fbr_read_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
 
-	return r;
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return do_read(FBR_A_ fd, buf, count, &tev);
 }
 
 
-ssize_t fbr_read_all(FBR_P_ int fd, void *buf, size_t count)
+static ssize_t read_all(FBR_P_ int fd, void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
 {
 	ssize_t r;
 	size_t done = 0;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	ev_io_init(&io, NULL, fd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	struct io_wait iw;
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_read_all(FBR_A_ fd, buf, count, tev);
+#endif
+	io_wait_init(FBR_A_ &iw, fd, EV_READ, 0);
 
 	while (count != done) {
-next:
-		fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
-		for (;;) {
+		do {
+			if (-1 == io_ready(FBR_A_ &iw, tev))
+				goto error;
 			r = read(fd, buf + done, count - done);
-			if (-1 == r) {
-				switch (errno) {
-					case EINTR:
-						continue;
-					case EAGAIN:
-						goto next;
-					default:
-						goto error;
-				}
-			}
-			break;
-		}
+		} while (io_retry(&iw, r));
+		if (-1 == r)
+			goto error;
 		if (0 == r)
 			break;
 		done += r;
+		io_progress(&iw);
 	}
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return (ssize_t)done;
 
 error:
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return -1;
 }
 
+ssize_t fbr_read_all(FBR_P_ int fd, void *buf, size_t count)
+{
+	return read_all(FBR_A_ fd, buf, count, NULL);
+}
+
 ssize_t fbr_read_all_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeout)
 {
-	ssize_t r;
-	size_t done = 0;
-	ev_io io;
-	struct fbr_ev_watcher watcher, twatcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	struct fbr_destructor dtor2 = FBR_DESTRUCTOR_INITIALIZER;
-	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
-	ev_timer timer;
-
-	ev_io_init(&io, NULL, fd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
-
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	events[0] = &watcher.ev_base;
-
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-
-	fbr_ev_watcher_init(FBR_A_ &twatcher,
-			(struct ev_watcher *)&timer);
-	dtor2.func = watcher_timer_dtor;
-	dtor2.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor2);
-	events[1] = &twatcher.ev_base;
-
-	while (count != done) {
-next:
-		fbr_ev_wait(FBR_A_ events);
-		if (events[1]->arrived)
-			goto error;
-
-		for (;;) {
-			r = read(fd, buf + done, count - done);
-			if (-1 == r) {
-				switch (errno) {
-					case EINTR:
-						continue;
-					case EAGAIN:
-						goto next;
-					default:
-						goto error;
-				}
-			}
-			break;
-		}
-		if (0 == r)
-			break;
-		done += r;
-	}
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
-	ev_io_stop(fctx->__p->loop, &io);
-	return (ssize_t)done;
+	struct fbr_ev_timeout tev;
 
-error:
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
-	ev_io_stop(fctx->__p->loop, &io);
-	return -1;
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return read_all(FBR_A_ fd, buf, count, &tev);
 }
 
 
@@ -1140,304 +1417,460 @@ ssize_t fbr_readline(FBR_P_ int fd, void *buffer, size_t n)
 	return total_read;
 }
 
-ssize_t fbr_write(FBR_P_ int fd, const void *buf, size_t count)
+static ssize_t do_write(FBR_P_ int fd, const void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
 {
 	ssize_t r;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	ev_io_init(&io, NULL, fd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
-
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	struct io_wait iw;
 
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_write(FBR_A_ fd, buf, count, tev);
+#endif
+	io_wait_init(FBR_A_ &iw, fd, EV_WRITE, 0);
 	do {
+		if (-1 == io_ready(FBR_A_ &iw, tev)) {
+			r = -1;
+			break;
+		}
 		r = write(fd, buf, count);
-	} while (-1 == r && EINTR == errno);
+	} while (io_retry(&iw, r));
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return r;
 }
 
-ssize_t fbr_write_wto(FBR_P_ int fd, const void *buf, size_t count, ev_tstamp timeout)
+ssize_t fbr_write(FBR_P_ int fd, const void *buf, size_t count)
 {
-	ssize_t r = 0;
-	int rc;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	ev_io_init(&io, NULL, fd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	return do_write(FBR_A_ fd, buf, count, NULL);
+}
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	rc = fbr_ev_wait_one_wto(FBR_A_ &watcher.ev_base, timeout);
-	if (0 == rc) {
-		do {
-			r = write(fd, buf, count);
-		} while (-1 == r && EINTR == errno);
-	}
+ssize_t fbr_write_wto(FBR_P_ int fd, const void *buf, size_t count, ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
-	return r;
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return do_write(FBR_A_ fd, buf, count, &tev);
 }
 
-ssize_t fbr_write_all(FBR_P_ int fd, const void *buf, size_t count)
+static ssize_t write_all(FBR_P_ int fd, const void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
 {
 	ssize_t r;
 	size_t done = 0;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	ev_io_init(&io, NULL, fd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	struct io_wait iw;
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_write_all(FBR_A_ fd, buf, count, tev);
+#endif
+	io_wait_init(FBR_A_ &iw, fd, EV_WRITE, 0);
 
 	while (count != done) {
-next:
-		fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
-		for (;;) {
+		do {
+			if (-1 == io_ready(FBR_A_ &iw, tev))
+				goto error;
 			r = write(fd, buf + done, count - done);
-			if (-1 == r) {
-				switch (errno) {
-					case EINTR:
-						continue;
-					case EAGAIN:
-						goto next;
-					default:
-						goto error;
-				}
-			}
-			break;
-		}
+		} while (io_retry(&iw, r));
+		if (-1 == r)
+			goto error;
 		done += r;
+		io_progress(&iw);
 	}
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return (ssize_t)done;
 
 error:
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return -1;
 }
 
+ssize_t fbr_write_all(FBR_P_ int fd, const void *buf, size_t count)
+{
+	return write_all(FBR_A_ fd, buf, count, NULL);
+}
+
 ssize_t fbr_write_all_wto(FBR_P_ int fd, const void *buf, size_t count, ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
+
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return write_all(FBR_A_ fd, buf, count, &tev);
+}
+
+
+ssize_t fbr_recvfrom(FBR_P_ int sockfd, void *buf, size_t len, int flags,
+		struct sockaddr *src_addr, socklen_t *addrlen)
 {
 	ssize_t r;
-	size_t done = 0;
-	ev_io io;
-	struct fbr_ev_watcher watcher, twatcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	struct fbr_destructor dtor2 = FBR_DESTRUCTOR_INITIALIZER;
-	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
-	ev_timer timer;
+	struct io_wait iw;
 
-	ev_io_init(&io, NULL, fd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	io_wait_init(FBR_A_ &iw, sockfd, EV_READ, 1);
+	do {
+		if (-1 == io_ready(FBR_A_ &iw, NULL)) {
+			r = -1;
+			break;
+		}
+		r = recvfrom(sockfd, buf, len, flags | MSG_DONTWAIT, src_addr,
+				addrlen);
+	} while (io_retry(&iw, r));
+
+	io_wait_finish(FBR_A_ &iw);
+	return r;
+}
+
+ssize_t fbr_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags)
+{
+	ssize_t r;
+	struct io_wait iw;
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	events[0] = &watcher.ev_base;
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_recv(FBR_A_ sockfd, buf, len, flags, NULL);
+#endif
+	io_wait_init(FBR_A_ &iw, sockfd, EV_READ, 1);
+	do {
+		if (-1 == io_ready(FBR_A_ &iw, NULL)) {
+			r = -1;
+			break;
+		}
+		r = recv(sockfd, buf, len, flags | MSG_DONTWAIT);
+	} while (io_retry(&iw, r));
 
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
+	io_wait_finish(FBR_A_ &iw);
+	return r;
+}
 
-	fbr_ev_watcher_init(FBR_A_ &twatcher,
-			(struct ev_watcher *)&timer);
-	dtor2.func = watcher_timer_dtor;
-	dtor2.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor2);
-	events[1] = &twatcher.ev_base;
+ssize_t fbr_sendto(FBR_P_ int sockfd, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	ssize_t r;
+	struct io_wait iw;
 
-	while (count != done) {
-next:
-		fbr_ev_wait(FBR_A_ events);
-		if (events[1]->arrived) {
-			errno = ETIMEDOUT;
-			goto error;
+	io_wait_init(FBR_A_ &iw, sockfd, EV_WRITE, 1);
+	do {
+		if (-1 == io_ready(FBR_A_ &iw, NULL)) {
+			r = -1;
+			break;
 		}
+		r = sendto(sockfd, buf, len, flags | MSG_DONTWAIT, dest_addr,
+				addrlen);
+	} while (io_retry(&iw, r));
 
-		for (;;) {
-			r = write(fd, buf + done, count - done);
-			if (-1 == r) {
-				switch (errno) {
-					case EINTR:
-						continue;
-					case EAGAIN:
-						goto next;
-					default:
-						goto error;
-				}
-			}
+	io_wait_finish(FBR_A_ &iw);
+	return r;
+}
+
+ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags)
+{
+	ssize_t r;
+	struct io_wait iw;
+
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_send(FBR_A_ sockfd, buf, len, flags, NULL);
+#endif
+	io_wait_init(FBR_A_ &iw, sockfd, EV_WRITE, 1);
+	do {
+		if (-1 == io_ready(FBR_A_ &iw, NULL)) {
+			r = -1;
 			break;
 		}
+		r = send(sockfd, buf, len, flags | MSG_DONTWAIT);
+	} while (io_retry(&iw, r));
+
+	io_wait_finish(FBR_A_ &iw);
+	return r;
+}
+
+/* The retry loop of the wrappers for the I/O calls living outside of this
+ * file. nonblocking tells whether call never blocks on its own, so that it is
+ * worth trying before waiting for events on fd. */
+ssize_t fbr_io_call(FBR_P_ int fd, int events, int nonblocking,
+		fbr_io_call_t call, void *arg, struct fbr_ev_timeout *tev)
+{
+	ssize_t r;
+	struct io_wait iw;
+
+	io_wait_init(FBR_A_ &iw, fd, events, nonblocking);
+	do {
+		if (-1 == io_ready(FBR_A_ &iw, tev)) {
+			r = -1;
+			break;
+		}
+		r = call(fd, arg);
+	} while (io_retry(&iw, r));
+
+	io_wait_finish(FBR_A_ &iw);
+	return r;
+}
+
+/* Vectored I/O. All four calls are driven through a msghdr, readv and writev
+ * only use its iovec array. */
+struct vec_op {
+	int events;
+	int nonblocking;
+	ssize_t (*call)(int fd, struct msghdr *msg, int flags);
+};
+
+static ssize_t call_readv(int fd, struct msghdr *msg, _unused_ int flags)
+{
+	return readv(fd, msg->msg_iov, msg->msg_iovlen);
+}
+
+static ssize_t call_writev(int fd, struct msghdr *msg, _unused_ int flags)
+{
+	return writev(fd, msg->msg_iov, msg->msg_iovlen);
+}
+
+static ssize_t call_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	return recvmsg(fd, msg, flags | MSG_DONTWAIT);
+}
+
+static ssize_t call_sendmsg(int fd, struct msghdr *msg, int flags)
+{
+	return sendmsg(fd, msg, flags | MSG_DONTWAIT);
+}
+
+static const struct vec_op op_readv = {EV_READ, 0, call_readv};
+static const struct vec_op op_writev = {EV_WRITE, 0, call_writev};
+static const struct vec_op op_recvmsg = {EV_READ, 1, call_recvmsg};
+static const struct vec_op op_sendmsg = {EV_WRITE, 1, call_sendmsg};
+
+/* Skips count bytes of the iovec array of msg */
+static void iov_advance(struct msghdr *msg, size_t count)
+{
+	while (count > 0 && msg->msg_iovlen > 0) {
+		if (count < msg->msg_iov->iov_len) {
+			msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base +
+				count;
+			msg->msg_iov->iov_len -= count;
+			return;
+		}
+		count -= msg->msg_iov->iov_len;
+		msg->msg_iov++;
+		msg->msg_iovlen--;
+	}
+	/* Empty entries would make the next call return 0 */
+	while (msg->msg_iovlen > 0 && 0 == msg->msg_iov->iov_len) {
+		msg->msg_iov++;
+		msg->msg_iovlen--;
+	}
+}
+
+static ssize_t vec_io(FBR_P_ const struct vec_op *op, int fd,
+		struct msghdr *msg, int flags, struct fbr_ev_timeout *tev)
+{
+	ssize_t r;
+	struct io_wait iw;
+
+	io_wait_init(FBR_A_ &iw, fd, op->events, op->nonblocking);
+	do {
+		if (-1 == io_ready(FBR_A_ &iw, tev)) {
+			r = -1;
+			break;
+		}
+		r = op->call(fd, msg, flags);
+	} while (io_retry(&iw, r));
+
+	io_wait_finish(FBR_A_ &iw);
+	return r;
+}
+
+static ssize_t vec_io_all(FBR_P_ const struct vec_op *op, int fd,
+		struct msghdr *msg, int flags, struct fbr_ev_timeout *tev)
+{
+	ssize_t r;
+	size_t done = 0;
+	struct io_wait iw;
+
+	io_wait_init(FBR_A_ &iw, fd, op->events, op->nonblocking);
+	iov_advance(msg, 0);
+
+	while (msg->msg_iovlen > 0) {
+		do {
+			if (-1 == io_ready(FBR_A_ &iw, tev))
+				goto error;
+			r = op->call(fd, msg, flags);
+		} while (io_retry(&iw, r));
+		if (-1 == r)
+			goto error;
+		if (0 == r)
+			break;
 		done += r;
+		iov_advance(msg, r);
+		/* Ancillary data goes along with the first byte only */
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		io_progress(&iw);
 	}
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return (ssize_t)done;
 
 error:
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
-	ev_io_stop(fctx->__p->loop, &io);
+	io_wait_finish(FBR_A_ &iw);
 	return -1;
 }
 
+static void iov_msg_init(struct msghdr *msg, const struct iovec *iov,
+		int iovcnt)
+{
+	memset(msg, 0x00, sizeof(*msg));
+	msg->msg_iov = (struct iovec *)iov;
+	msg->msg_iovlen = iovcnt;
+}
 
-ssize_t fbr_recvfrom(FBR_P_ int sockfd, void *buf, size_t len, int flags,
-		struct sockaddr *src_addr, socklen_t *addrlen)
+ssize_t fbr_readv(FBR_P_ int fd, const struct iovec *iov, int iovcnt)
 {
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct msghdr msg;
 
-	ev_io_init(&io, NULL, sockfd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	iov_msg_init(&msg, iov, iovcnt);
+	return vec_io(FBR_A_ &op_readv, fd, &msg, 0, NULL);
+}
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+ssize_t fbr_readv_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
+{
+	struct msghdr msg;
+	struct fbr_ev_timeout tev;
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	iov_msg_init(&msg, iov, iovcnt);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io(FBR_A_ &op_readv, fd, &msg, 0, &tev);
+}
+
+ssize_t fbr_readv_all(FBR_P_ int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
 
-	return recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+	iov_msg_init(&msg, iov, iovcnt);
+	return vec_io_all(FBR_A_ &op_readv, fd, &msg, 0, NULL);
 }
 
-ssize_t fbr_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags)
+ssize_t fbr_readv_all_wto(FBR_P_ int fd, struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
 {
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct msghdr msg;
+	struct fbr_ev_timeout tev;
 
-	ev_io_init(&io, NULL, sockfd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	iov_msg_init(&msg, iov, iovcnt);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io_all(FBR_A_ &op_readv, fd, &msg, 0, &tev);
+}
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+ssize_t fbr_writev(FBR_P_ int fd, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	iov_msg_init(&msg, iov, iovcnt);
+	return vec_io(FBR_A_ &op_writev, fd, &msg, 0, NULL);
+}
+
+ssize_t fbr_writev_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
+{
+	struct msghdr msg;
+	struct fbr_ev_timeout tev;
 
-	return recv(sockfd, buf, len, flags);
+	iov_msg_init(&msg, iov, iovcnt);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io(FBR_A_ &op_writev, fd, &msg, 0, &tev);
 }
 
-ssize_t fbr_sendto(FBR_P_ int sockfd, const void *buf, size_t len, int flags,
-		const struct sockaddr *dest_addr, socklen_t addrlen)
+ssize_t fbr_writev_all(FBR_P_ int fd, struct iovec *iov, int iovcnt)
 {
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct msghdr msg;
 
-	ev_io_init(&io, NULL, sockfd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	iov_msg_init(&msg, iov, iovcnt);
+	return vec_io_all(FBR_A_ &op_writev, fd, &msg, 0, NULL);
+}
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+ssize_t fbr_writev_all_wto(FBR_P_ int fd, struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
+{
+	struct msghdr msg;
+	struct fbr_ev_timeout tev;
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	iov_msg_init(&msg, iov, iovcnt);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io_all(FBR_A_ &op_writev, fd, &msg, 0, &tev);
+}
 
-	return sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+ssize_t fbr_recvmsg(FBR_P_ int sockfd, struct msghdr *msg, int flags)
+{
+	return vec_io(FBR_A_ &op_recvmsg, sockfd, msg, flags, NULL);
 }
 
-ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags)
+ssize_t fbr_recvmsg_wto(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp timeout)
 {
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct fbr_ev_timeout tev;
 
-	ev_io_init(&io, NULL, sockfd, EV_WRITE);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io(FBR_A_ &op_recvmsg, sockfd, msg, flags, &tev);
+}
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+ssize_t fbr_sendmsg(FBR_P_ int sockfd, const struct msghdr *msg, int flags)
+{
+	return vec_io(FBR_A_ &op_sendmsg, sockfd, (struct msghdr *)msg, flags,
+			NULL);
+}
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+ssize_t fbr_sendmsg_wto(FBR_P_ int sockfd, const struct msghdr *msg,
+		int flags, ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
 
-	return send(sockfd, buf, len, flags);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io(FBR_A_ &op_sendmsg, sockfd, (struct msghdr *)msg, flags,
+			&tev);
 }
 
-int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+ssize_t fbr_sendmsg_all(FBR_P_ int sockfd, struct msghdr *msg, int flags)
 {
-	int r;
-	ev_io io;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	return vec_io_all(FBR_A_ &op_sendmsg, sockfd, msg, flags, NULL);
+}
 
-	ev_io_init(&io, NULL, sockfd, EV_READ);
-	ev_io_start(fctx->__p->loop, &io);
-	dtor.func = watcher_io_dtor;
-	dtor.arg = &io;
-	fbr_destructor_add(FBR_A_ &dtor);
+ssize_t fbr_sendmsg_all_wto(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return vec_io_all(FBR_A_ &op_sendmsg, sockfd, msg, flags, &tev);
+}
+
+int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	int r;
+	struct io_wait iw;
 
+#ifdef HAVE_IO_URING
+	if (fctx->__p->uring)
+		return fbr_uring_accept(FBR_A_ sockfd, addr, addrlen);
+#endif
+	io_wait_init(FBR_A_ &iw, sockfd, EV_READ, 0);
 	do {
+		if (-1 == io_ready(FBR_A_ &iw, NULL)) {
+			r = -1;
+			break;
+		}
 		r = accept(sockfd, addr, addrlen);
-	} while (-1 == r && EINTR == errno);
-
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_io_stop(fctx->__p->loop, &io);
+	} while (io_retry(&iw, r));
 
+	io_wait_finish(FBR_A_ &iw);
 	return r;
 }
 
 ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds)
 {
-	ev_timer timer;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	ev_tstamp expected = ev_now(fctx->__p->loop) + seconds;
-
-	ev_timer_init(&timer, NULL, seconds, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-	dtor.func = watcher_timer_dtor;
-	dtor.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor);
-
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&timer);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	struct fbr_ev_timeout tev;
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
+	fbr_ev_timeout_init(FBR_A_ &tev, seconds);
+	fbr_ev_wait_one(FBR_A_ &tev.ev_base);
 
-	return max(0., expected - ev_now(fctx->__p->loop));
+	return max(0., tev.deadline - ev_now(fctx->__p->loop));
 }
 
 static void watcher_async_dtor(FBR_P_ void *_arg)
@@ -1490,27 +1923,300 @@ static size_t round_up_to_page_size(size_t size)
 	return size + sz - remainder;
 }
 
+static unsigned stack_class_of(size_t stack_size)
+{
+	unsigned cls = 0;
+	while (cls < FBR_STACK_CLASSES && ((size_t)1 <<
+				(cls + FBR_STACK_CLASS_MIN_SHIFT)) < stack_size)
+		cls++;
+	return cls;
+}
+
+static size_t stack_class_size(unsigned cls, size_t stack_size)
+{
+	if (FBR_STACK_CLASS_OVERSIZED == cls)
+		return round_up_to_page_size(stack_size);
+	return round_up_to_page_size((size_t)1 <<
+			(cls + FBR_STACK_CLASS_MIN_SHIFT));
+}
+
+static struct fbr_fiber *fiber_alloc(FBR_P)
+{
+	struct fbr_fiber *fiber;
+
+	/* Fiber structures are never freed until fbr_destroy as ids refer to
+	 * them, only stacks are */
+	if (!TAILQ_EMPTY(&fctx->__p->bare_fibers)) {
+		fiber = TAILQ_FIRST(&fctx->__p->bare_fibers);
+		TAILQ_REMOVE(&fctx->__p->bare_fibers, fiber, entries.reclaimed);
+		return fiber;
+	}
+	fiber = malloc(sizeof(struct fbr_fiber));
+	if (NULL == fiber)
+		err(EXIT_FAILURE, "malloc failed");
+	memset(fiber, 0x00, sizeof(struct fbr_fiber));
+	fbr_cond_init(FBR_A_ &fiber->reclaim_cond);
+	fiber->id = fctx->__p->last_id++;
+	return fiber;
+}
+
+static void stack_populate(struct fbr_fiber *fiber)
+{
+	size_t sz = get_page_size();
+	size_t off;
+
+#ifdef MADV_POPULATE_WRITE
+	if (0 == madvise(fiber->stack, fiber->stack_size, MADV_POPULATE_WRITE))
+		return;
+#endif
+	/* The fiber has not started yet, nothing lives on its stack */
+	for (off = 0; off < fiber->stack_size; off += sz)
+		((volatile char *)fiber->stack)[off] = 0;
+}
+
+static void stack_alloc(struct fbr_fiber *fiber, unsigned cls,
+		size_t stack_size, int flags)
+{
+	size_t sz = get_page_size();
+	int map_flags = FBR_MAP_ANON_FLAG | MAP_PRIVATE;
+	char *ptr;
+
+	stack_size = stack_class_size(cls, stack_size);
+#ifdef MAP_NORESERVE
+	map_flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_POPULATE
+	if (flags & FBR_FIBER_STACK_POPULATE)
+		map_flags |= MAP_POPULATE;
+#endif
+	/* Pages are committed on first touch, the lowest one is a guard
+	 * against overflows */
+	ptr = mmap(NULL, stack_size + sz, PROT_READ | PROT_WRITE, map_flags,
+			-1, 0);
+	if (MAP_FAILED == ptr)
+		err(EXIT_FAILURE, "mmap failed");
+	if (0 > mprotect(ptr, sz, PROT_NONE))
+		err(EXIT_FAILURE, "mprotect failed");
+	fiber->stack = ptr + sz;
+	fiber->stack_size = stack_size;
+	fiber->stack_class = cls;
+	fiber->valgrind_stack_id = VALGRIND_STACK_REGISTER(fiber->stack,
+			fiber->stack + stack_size);
+#ifndef MAP_POPULATE
+	if (flags & FBR_FIBER_STACK_POPULATE)
+		stack_populate(fiber);
+#endif
+}
+
+static void stack_free(struct fbr_fiber *fiber)
+{
+	size_t sz = get_page_size();
+
+	VALGRIND_STACK_DEREGISTER(fiber->valgrind_stack_id);
+	munmap(fiber->stack - sz, fiber->stack_size + sz);
+	fiber->stack = NULL;
+	fiber->stack_size = 0;
+}
+
+/* Lowest address of the stack still in use by the caller, page aligned */
+static uintptr_t __attribute__((noinline)) stack_live_limit(void)
+{
+	volatile char here;
+	uintptr_t limit;
+
+	limit = (uintptr_t)&here - FBR_STACK_RELEASE_MARGIN;
+	return limit - limit % get_page_size();
+}
+
+static void stack_release(FBR_P_ struct fbr_fiber *fiber)
+{
+	static int advice = 0;
+	size_t threshold = fctx->__p->stack_release_threshold;
+	uintptr_t limit, live;
+	int adv;
+
+	if (threshold >= fiber->stack_size)
+		return;
+	limit = (uintptr_t)fiber->stack + fiber->stack_size - threshold;
+	limit -= limit % get_page_size();
+	/* Fiber reclaiming itself is still running on this stack, everything
+	 * below our own frame is dead though */
+	if (fiber == CURRENT_FIBER) {
+		live = stack_live_limit();
+		if (live < limit)
+			limit = live;
+	}
+	if (limit <= (uintptr_t)fiber->stack)
+		return;
+
+	/* Contexts of a group release stacks concurrently, racing probes
+	 * settle on the same value */
+	if (0 == (adv = __atomic_load_n(&advice, __ATOMIC_RELAXED))) {
+#ifdef MADV_FREE
+		if (0 == madvise(fiber->stack, limit - (uintptr_t)fiber->stack,
+					MADV_FREE)) {
+			__atomic_store_n(&advice, MADV_FREE, __ATOMIC_RELAXED);
+			return;
+		}
+#endif
+		adv = MADV_DONTNEED;
+		__atomic_store_n(&advice, adv, __ATOMIC_RELAXED);
+	}
+	madvise(fiber->stack, limit - (uintptr_t)fiber->stack, adv);
+}
+
+/* Drops the pages below the current frame of a fiber about to be parked.
+ * MADV_DONTNEED is used on purpose, so that the resident set of a parked
+ * fiber really is its live depth. */
+static void stack_compact(struct fbr_fiber *fiber)
+{
+	uintptr_t limit = stack_live_limit();
+
+	if (limit <= (uintptr_t)fiber->stack ||
+			limit > (uintptr_t)fiber->stack + fiber->stack_size)
+		return;
+	madvise(fiber->stack, limit - (uintptr_t)fiber->stack, MADV_DONTNEED);
+}
+
+static size_t stack_class_trim(FBR_P_ struct fbr_stack_class *sc,
+		unsigned keep)
+{
+	struct fbr_fiber *fiber, *prev;
+	size_t released = 0;
+
+	/* Coldest stacks are at the tail. A fiber reclaiming itself is still
+	 * running on its stack, so it has to stay pooled for now. */
+	fiber = TAILQ_LAST(&sc->fibers, fiber_tailq);
+	while (sc->count > keep && fiber) {
+		prev = TAILQ_PREV(fiber, fiber_tailq, entries.reclaimed);
+		if (fiber != CURRENT_FIBER) {
+			TAILQ_REMOVE(&sc->fibers, fiber, entries.reclaimed);
+			sc->count--;
+			released += fiber->stack_size;
+			stack_free(fiber);
+			TAILQ_INSERT_HEAD(&fctx->__p->bare_fibers, fiber,
+					entries.reclaimed);
+		}
+		fiber = prev;
+	}
+	return released;
+}
+
+static void stack_pool_put(FBR_P_ struct fbr_fiber *fiber)
+{
+	struct fbr_stack_class *sc;
+
+	sc = fctx->__p->stack_classes + fiber->stack_class;
+	/* Most recently used stacks are the hottest in cache */
+	TAILQ_INSERT_HEAD(&sc->fibers, fiber, entries.reclaimed);
+	sc->count++;
+	if (sc->count > sc->cap)
+		stack_class_trim(FBR_A_ sc, sc->cap);
+	if (fiber->stack)
+		stack_release(FBR_A_ fiber);
+}
+
+static struct fbr_fiber *stack_pool_get(FBR_P_ unsigned cls,
+		size_t stack_size)
+{
+	struct fbr_stack_class *sc = fctx->__p->stack_classes + cls;
+	struct fbr_fiber *fiber;
+
+	stack_size = stack_class_size(cls, stack_size);
+	TAILQ_FOREACH(fiber, &sc->fibers, entries.reclaimed) {
+		/* Only oversized class has stacks of different sizes */
+		if (fiber->stack_size == stack_size)
+			break;
+	}
+	if (NULL == fiber)
+		return NULL;
+	TAILQ_REMOVE(&sc->fibers, fiber, entries.reclaimed);
+	sc->count--;
+	return fiber;
+}
+
+static struct fbr_stack_class *stack_class_lookup(FBR_P_ size_t stack_size)
+{
+	if (0 == stack_size)
+		stack_size = FBR_STACK_SIZE;
+	return fctx->__p->stack_classes + stack_class_of(stack_size);
+}
+
+void fbr_stack_pool_set_cap(FBR_P_ size_t stack_size, unsigned cap)
+{
+	struct fbr_stack_class *sc = stack_class_lookup(FBR_A_ stack_size);
+
+	sc->cap = cap;
+	if (sc->count > cap)
+		stack_class_trim(FBR_A_ sc, cap);
+}
+
+unsigned fbr_stack_pool_count(FBR_P_ size_t stack_size)
+{
+	return stack_class_lookup(FBR_A_ stack_size)->count;
+}
+
+unsigned fbr_stack_pool_prewarm(FBR_P_ size_t stack_size, unsigned count)
+{
+	struct fbr_stack_class *sc;
+	struct fbr_fiber *fiber;
+	unsigned cls, added = 0;
+
+	if (0 == stack_size)
+		stack_size = FBR_STACK_SIZE;
+	cls = stack_class_of(stack_size);
+	sc = fctx->__p->stack_classes + cls;
+	if (count > sc->cap)
+		count = sc->cap;
+	while (sc->count < count) {
+		fiber = fiber_alloc(FBR_A);
+		stack_alloc(fiber, cls, stack_size, 0);
+		/* Prewarmed stacks go to the cold end */
+		TAILQ_INSERT_TAIL(&sc->fibers, fiber, entries.reclaimed);
+		sc->count++;
+		added++;
+	}
+	return added;
+}
+
+size_t fbr_stack_pool_trim(FBR_P_ unsigned keep)
+{
+	size_t released = 0;
+	unsigned i;
+
+	for (i = 0; i <= FBR_STACK_CLASSES; i++)
+		released += stack_class_trim(FBR_A_
+				fctx->__p->stack_classes + i, keep);
+	return released;
+}
+
+void fbr_stack_set_release_threshold(FBR_P_ size_t threshold)
+{
+	fctx->__p->stack_release_threshold = threshold;
+}
+
 fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 		size_t stack_size)
+{
+	return fbr_create_flags(FBR_A_ name, func, arg, stack_size, 0);
+}
+
+fbr_id_t fbr_create_flags(FBR_P_ const char *name, fbr_fiber_func_t func,
+		void *arg, size_t stack_size, int flags)
 {
 	struct fbr_fiber *fiber;
-	if (!LIST_EMPTY(&fctx->__p->reclaimed)) {
-		fiber = LIST_FIRST(&fctx->__p->reclaimed);
-		LIST_REMOVE(fiber, entries.reclaimed);
-	} else {
-		fiber = malloc(sizeof(struct fbr_fiber));
-		memset(fiber, 0x00, sizeof(struct fbr_fiber));
-		if (0 == stack_size)
-			stack_size = FBR_STACK_SIZE;
-		stack_size = round_up_to_page_size(stack_size);
-		fiber->stack = malloc(stack_size);
-		if (NULL == fiber->stack)
-			err(EXIT_FAILURE, "malloc failed");
-		fiber->stack_size = stack_size;
-		(void)VALGRIND_STACK_REGISTER(fiber->stack, fiber->stack +
-				stack_size);
-		fbr_cond_init(FBR_A_ &fiber->reclaim_cond);
-		fiber->id = fctx->__p->last_id++;
+	unsigned cls;
+
+	if (0 == stack_size)
+		stack_size = FBR_STACK_SIZE;
+	cls = stack_class_of(stack_size);
+	fiber = stack_pool_get(FBR_A_ cls, stack_size);
+	if (NULL == fiber) {
+		fiber = fiber_alloc(FBR_A);
+		stack_alloc(fiber, cls, stack_size, flags);
+	} else if (flags & FBR_FIBER_STACK_POPULATE) {
+		/* Pooled stack might have been released on reclaim */
+		stack_populate(fiber);
 	}
 	coro_create(&fiber->ctx, (coro_func)call_wrapper, FBR_A, fiber->stack,
 			fiber->stack_size);
@@ -1524,6 +2230,8 @@ fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
 	fiber->parent = CURRENT_FIBER;
 	fiber->no_reclaim = 0;
 	fiber->want_reclaim = 0;
+	fiber->flags = flags;
+	memset(&fiber->deadline, 0x00, sizeof(fiber->deadline));
 	return fbr_id_pack(fiber);
 }
 
@@ -1602,16 +2310,20 @@ void fbr_dump_stack(FBR_P_ fbr_logutil_func_t log)
 	}
 }
 
+static void pending_start(FBR_P)
+{
+	ev_prepare_start(fctx->__p->loop, &fctx->__p->pending_prepare);
+	ev_idle_start(fctx->__p->loop, &fctx->__p->pending_idle);
+}
+
 static void transfer_later(FBR_P_ struct fbr_id_tailq_i *item)
 {
 	int was_empty;
 	was_empty = TAILQ_EMPTY(&fctx->__p->pending_fibers);
 	TAILQ_INSERT_TAIL(&fctx->__p->pending_fibers, item, entries);
 	item->head = &fctx->__p->pending_fibers;
-	if (was_empty && !TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_start(fctx->__p->loop, &fctx->__p->pending_async);
-	}
-	ev_async_send(fctx->__p->loop, &fctx->__p->pending_async);
+	if (was_empty)
+		pending_start(FBR_A);
 }
 
 static void transfer_later_tailq(FBR_P_ struct fbr_id_tailq *tailq)
@@ -1623,10 +2335,13 @@ static void transfer_later_tailq(FBR_P_ struct fbr_id_tailq *tailq)
 	}
 	was_empty = TAILQ_EMPTY(&fctx->__p->pending_fibers);
 	TAILQ_CONCAT(&fctx->__p->pending_fibers, tailq, entries);
-	if (was_empty && !TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_start(fctx->__p->loop, &fctx->__p->pending_async);
-	}
-	ev_async_send(fctx->__p->loop, &fctx->__p->pending_async);
+	if (was_empty && !TAILQ_EMPTY(&fctx->__p->pending_fibers))
+		pending_start(FBR_A);
+}
+
+void fbr_get_sched_stats(FBR_P_ struct fbr_sched_stats *stats)
+{
+	memcpy(stats, &fctx->__p->sched_stats, sizeof(*stats));
 }
 
 void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
@@ -1642,15 +2357,17 @@ void fbr_mutex_init(_unused_ FBR_P_ struct fbr_mutex *mutex)
 	TAILQ_INIT(&mutex->pending);
 }
 
-void fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex)
+int fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex)
 {
 	struct fbr_ev_mutex ev;
 
 	assert(!fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
 			"Mutex is already locked by current fiber");
 	fbr_ev_mutex_init(FBR_A_ &ev, mutex);
-	fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &ev.ev_base))
+		return -1;
 	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID));
+	return_success(0);
 }
 
 int fbr_mutex_trylock(FBR_P_ struct fbr_mutex *mutex)
@@ -1729,7 +2446,8 @@ int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex)
 		return_error(-1, FBR_EINVAL);
 
 	fbr_ev_cond_var_init(FBR_A_ &ev, cond, mutex);
-	fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &ev.ev_base))
+		return -1;
 	return_success(0);
 }
 
@@ -1874,19 +2592,28 @@ void *fbr_buffer_alloc_prepare(FBR_P_ struct fbr_buffer *buffer, size_t size)
 	if (size > fbr_buffer_size(FBR_A_ buffer))
 		return_error(NULL, FBR_EINVAL);
 
-	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->write_mutex))
+		return NULL;
 
-	while (buffer->prepared_bytes > 0)
-		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
-				&buffer->write_mutex);
+	while (buffer->prepared_bytes > 0) {
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+					&buffer->write_mutex)) {
+			fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+			return NULL;
+		}
+	}
 
 	assert(0 == buffer->prepared_bytes);
 
 	buffer->prepared_bytes = size;
 
-	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size)
-		fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
-				&buffer->write_mutex);
+	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size) {
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
+					&buffer->write_mutex)) {
+			fbr_buffer_alloc_abort(FBR_A_ buffer);
+			return NULL;
+		}
+	}
 
 	return fbr_buffer_space_ptr(FBR_A_ buffer);
 }
@@ -1912,13 +2639,16 @@ void *fbr_buffer_read_address(FBR_P_ struct fbr_buffer *buffer, size_t size)
 	if (size > fbr_buffer_size(FBR_A_ buffer))
 		return_error(NULL, FBR_EINVAL);
 
-	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->read_mutex))
+		return NULL;
 
 	while (fbr_buffer_bytes(FBR_A_ buffer) < size) {
 		retval = fbr_cond_wait(FBR_A_ &buffer->committed_cond,
 				&buffer->read_mutex);
-		assert(0 == retval);
-		(void)retval;
+		if (-1 == retval) {
+			fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+			return NULL;
+		}
 	}
 
 	buffer->waiting_bytes = size;
@@ -1942,8 +2672,12 @@ void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer)
 int fbr_buffer_resize(FBR_P_ struct fbr_buffer *buffer, size_t size)
 {
 	int rv;
-	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
-	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->read_mutex))
+		return -1;
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->write_mutex)) {
+		fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+		return -1;
+	}
 	rv = fbr_vrb_resize(&buffer->vrb, size, fctx->__p->buffer_file_pattern);
 	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
 	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
@@ -1978,17 +2712,19 @@ void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers)
 		fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
 }
 
-void fbr_mq_push(struct fbr_mq *mq, void *obj)
+int fbr_mq_push(struct fbr_mq *mq, void *obj)
 {
 	unsigned next;
 
 	while ((next = ((mq->head + 1) % mq->max )) == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL))
+			return -1;
 
 	mq->rb[mq->head] = obj;
 	mq->head = next;
 
 	fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+	return 0;
 }
 
 int fbr_mq_try_push(struct fbr_mq *mq, void *obj)
@@ -2008,10 +2744,12 @@ int fbr_mq_try_push(struct fbr_mq *mq, void *obj)
 	return 0;
 }
 
-void fbr_mq_wait_push(struct fbr_mq *mq)
+int fbr_mq_wait_push(struct fbr_mq *mq)
 {
 	while (((mq->head + 1) % mq->max) == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL))
+			return -1;
+	return 0;
 }
 
 static void *mq_do_pop(struct fbr_mq *mq)
@@ -2037,7 +2775,9 @@ void *fbr_mq_pop(struct fbr_mq *mq)
 
 	/* if the head isn't ahead of the tail, we don't have any elements */
 	while (mq->head == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_available_cond,
+					NULL))
+			return NULL;
 
 	return mq_do_pop(mq);
 }
@@ -2052,11 +2792,14 @@ int fbr_mq_try_pop(struct fbr_mq *mq, void **obj)
 	return 0;
 }
 
-void fbr_mq_wait_pop(struct fbr_mq *mq)
+int fbr_mq_wait_pop(struct fbr_mq *mq)
 {
 	/* if the head isn't ahead of the tail, we don't have any elements */
 	while (mq->head == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_available_cond,
+					NULL))
+			return -1;
+	return 0;
 }
 
 void fbr_mq_destroy(struct fbr_mq *mq)
@@ -2360,7 +3103,10 @@ int fbr_waitpid(FBR_P_ pid_t pid)
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&child);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
 	ev_child_stop(fctx->__p->loop, &child);
@@ -2400,118 +3146,559 @@ int fbr_system(FBR_P_ const char *filename, char *const argv[],
 
 #ifdef FBR_EIO_ENABLED
 
-static struct ev_loop *eio_loop;
-static ev_idle repeat_watcher;
-static ev_async ready_watcher;
+/*
+ * libeio is process wide: there is a single set of worker threads and a
+ * single result queue, drained by eio_poll. What is per context is the
+ * glue: every context that calls fbr_eio_init gets an engine with its own
+ * completion queue and ev_async. Whichever engine gets to call eio_poll
+ * hands the completions over to the engines that own them, and each engine
+ * resumes its fibers through the ready queue, so all the completions of a
+ * poll are resumed in one drain instead of one transfer per callback.
+ *
+ * eio_req is freed by libeio as soon as the callback returns, and the
+ * callback may run in another thread, so the callback copies the results
+ * into the event while the waiting fiber cannot go anywhere.
+ */
+
+/*
+ * Requests are admitted to the thread pool by class, see
+ * fbr_eio_class_set. A ticket lives on the stack of the fiber for as long as
+ * its request may occupy the pool. The classes are served by start time fair
+ * queueing: a class is charged the cost of an admitted request divided by
+ * its weight in virtual time, and the class with the earliest virtual time
+ * goes first. A class that has been idle starts from the current virtual
+ * time, so it does not get to spend the share it has not used.
+ */
+struct eio_ticket;
+
+struct eio_class {
+	unsigned weight;
+	/* 0 is unlimited */
+	unsigned workers;
+	unsigned inflight;
+	double vtime;
+	TAILQ_HEAD(, eio_ticket) queue;
+	unsigned queued;
+	uint64_t admitted;
+	uint64_t delayed;
+	ev_tstamp wait_time;
+	ev_tstamp max_wait_time;
+};
+
+enum {
+	EIO_TICKET_IDLE = 0,
+	EIO_TICKET_QUEUED,
+	EIO_TICKET_GRANTED,
+};
+
+struct eio_ticket {
+	struct eio_class *cls;
+	unsigned cost;
+	int state;
+	ev_tstamp queued_at;
+	struct fbr_cond_var granted;
+	struct fbr_destructor dtor;
+	TAILQ_ENTRY(eio_ticket) entries;
+};
+
+struct fbr_eio_engine {
+	struct fbr_context *fctx;
+	/* Completed, not yet resumed, protected by eio_lock */
+	TAILQ_HEAD(, fbr_ev_eio) completed;
+	/* Submitted and not yet completed */
+	unsigned pending;
+	ev_async ready;
+	ev_idle repeat;
+	LIST_ENTRY(fbr_eio_engine) entries;
+	/* Admission state, only touched by the loop thread */
+	struct eio_class classes[FBR_EIO_CLASSES];
+	unsigned inflight;
+	unsigned max_inflight;
+	unsigned fiber_max_inflight;
+	double vclock;
+};
+
+enum {
+	EIO_EV_PENDING = 0,
+	EIO_EV_COMPLETED,
+	EIO_EV_DELIVERED,
+};
 
-/* idle watcher callback, only used when eio_poll */
-/* didn't handle all results in one call */
-static void repeat(EV_P_ ev_idle *w, _unused_ int revents)
+static pthread_once_t eio_once = PTHREAD_ONCE_INIT;
+/* Protects the engine list, completion queues and event states */
+static pthread_mutex_t eio_lock = PTHREAD_MUTEX_INITIALIZER;
+/* eio_poll is not to be called concurrently */
+static pthread_mutex_t eio_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, fbr_eio_engine) eio_engines =
+	LIST_HEAD_INITIALIZER(eio_engines);
+/* The engine calling eio_poll in this thread */
+static __thread struct fbr_eio_engine *eio_polling;
+
+/* Called by libeio, usually from a worker thread, once results are there.
+ * The engines waiting for something are woken up, the first of them to poll
+ * delivers the results to all of them. */
+static void want_poll()
 {
-	if (eio_poll () != -1)
-		ev_idle_stop(EV_A_ w);
+	struct fbr_eio_engine *engine;
+	int woken = 0;
+
+	pthread_mutex_lock(&eio_lock);
+	LIST_FOREACH(engine, &eio_engines, entries) {
+		if (0 == engine->pending)
+			continue;
+		ev_async_send(engine->fctx->__p->loop, &engine->ready);
+		woken++;
+	}
+	/* Only cancelled requests are left, somebody has to reap them */
+	engine = LIST_FIRST(&eio_engines);
+	if (0 == woken && engine)
+		ev_async_send(engine->fctx->__p->loop, &engine->ready);
+	pthread_mutex_unlock(&eio_lock);
 }
 
-/* eio has some results, process them */
-static void ready(EV_P_ _unused_ ev_async *w, _unused_ int revents)
+static void eio_global_init(void)
 {
-	if (eio_poll() == -1)
-		ev_idle_start(EV_A_ &repeat_watcher);
+	eio_init(want_poll, 0);
 }
 
-/* wake up the event loop */
-static void want_poll()
+/* Resumes the fibers whose requests have completed, in bulk from the ready
+ * queue */
+static void engine_deliver(struct fbr_eio_engine *engine)
+{
+	struct fbr_context *fctx = engine->fctx;
+	struct fbr_ev_eio *ev;
+	struct fbr_fiber *fiber;
+
+	pthread_mutex_lock(&eio_lock);
+	while ((ev = TAILQ_FIRST(&engine->completed))) {
+		TAILQ_REMOVE(&engine->completed, ev, entries);
+		ev->state = EIO_EV_DELIVERED;
+		ev_unref(fctx->__p->loop);
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, ev->ev_base.id)) {
+			fbr_log_e(FBR_A_ "libevfibers: fiber is about to be"
+					" resumed by an eio completion, but it's"
+					" id is not valid: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			abort();
+		}
+		post_ev(FBR_A_ fiber, &ev->ev_base);
+		transfer_later(FBR_A_ &ev->ev_base.item);
+	}
+	pthread_mutex_unlock(&eio_lock);
+}
+
+static void engine_poll(struct fbr_eio_engine *engine)
 {
-	ev_async_send(eio_loop, &ready_watcher);
+	int retval;
+
+	pthread_mutex_lock(&eio_poll_lock);
+	eio_polling = engine;
+	retval = eio_poll();
+	eio_polling = NULL;
+	pthread_mutex_unlock(&eio_poll_lock);
+	/* eio_poll did not handle all the results in one call */
+	if (-1 == retval)
+		ev_idle_start(engine->fctx->__p->loop, &engine->repeat);
+	else
+		ev_idle_stop(engine->fctx->__p->loop, &engine->repeat);
+	engine_deliver(engine);
+}
+
+static void repeat(_unused_ EV_P_ ev_idle *w, _unused_ int revents)
+{
+	engine_poll(w->data);
+}
+
+/* eio has some results, or another engine has delivered ours */
+static void ready(_unused_ EV_P_ ev_async *w, _unused_ int revents)
+{
+	engine_poll(w->data);
 }
 
-void fbr_eio_init()
+void fbr_eio_init(FBR_P)
 {
-	if (NULL != eio_loop) {
-		fprintf(stderr, "libevfibers: fbr_eio_init called twice");
+	struct fbr_eio_engine *engine;
+	int i;
+
+	if (fctx->__p->eio)
+		return;
+	pthread_once(&eio_once, eio_global_init);
+	engine = calloc(1, sizeof(*engine));
+	if (NULL == engine) {
+		fbr_log_e(FBR_A_ "libevfibers: unable to allocate eio engine");
 		abort();
 	}
-	eio_loop = EV_DEFAULT;
-	ev_idle_init(&repeat_watcher, repeat);
-	ev_async_init(&ready_watcher, ready);
-	ev_async_start(eio_loop, &ready_watcher);
-	ev_unref(eio_loop);
-	eio_init(want_poll, 0);
+	engine->fctx = fctx;
+	TAILQ_INIT(&engine->completed);
+	for (i = 0; i < FBR_EIO_CLASSES; i++) {
+		engine->classes[i].weight = i + 1;
+		TAILQ_INIT(&engine->classes[i].queue);
+	}
+	ev_idle_init(&engine->repeat, repeat);
+	engine->repeat.data = engine;
+	ev_async_init(&engine->ready, ready);
+	engine->ready.data = engine;
+	ev_async_start(fctx->__p->loop, &engine->ready);
+	ev_unref(fctx->__p->loop);
+	pthread_mutex_lock(&eio_lock);
+	LIST_INSERT_HEAD(&eio_engines, engine, entries);
+	pthread_mutex_unlock(&eio_lock);
+	fctx->__p->eio = engine;
+}
+
+static void fbr_eio_destroy(FBR_P)
+{
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+
+	if (NULL == engine)
+		return;
+	/* The fibers are all reclaimed by now, and have cancelled whatever
+	 * they have been waiting for */
+	pthread_mutex_lock(&eio_lock);
+	LIST_REMOVE(engine, entries);
+	pthread_mutex_unlock(&eio_lock);
+	ev_ref(fctx->__p->loop);
+	ev_async_stop(fctx->__p->loop, &engine->ready);
+	ev_idle_stop(fctx->__p->loop, &engine->repeat);
+	free(engine);
+	fctx->__p->eio = NULL;
 }
 
 void fbr_ev_eio_init(FBR_P_ struct fbr_ev_eio *ev, eio_req *req)
 {
 	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_EIO);
 	ev->req = req;
+	ev->state = EIO_EV_PENDING;
+	ev->buf = NULL;
+	ev->buf_size = 0;
+	ev->buf_string = 0;
 }
 
-static void eio_req_dtor(_unused_ FBR_P_ void *_arg)
+static struct eio_class *pri_class(struct fbr_eio_engine *engine, int pri)
 {
-	eio_req *req = _arg;
-	eio_cancel(req);
+	/* libeio clamps the priority the same way */
+	pri = max(EIO_PRI_MIN, min(EIO_PRI_MAX, pri));
+	return engine->classes + pri - EIO_PRI_MIN;
 }
 
-static int fiber_eio_cb(eio_req *req)
+/* A request that is larger than a limit is admitted once the pool is free of
+ * the requests the limit applies to, or it would never be */
+static int ticket_fits(struct fbr_eio_engine *engine,
+		struct eio_ticket *ticket)
 {
-	struct fbr_fiber *fiber;
-	struct fbr_ev_eio *ev = req->data;
-	struct fbr_context *fctx = ev->ev_base.fctx;
-	int retval;
-
-	ENSURE_ROOT_FIBER;
+	struct eio_class *cls = ticket->cls;
 
-	ev_unref(eio_loop);
-	if (EIO_CANCELLED(req))
+	if (cls->workers && cls->inflight &&
+			cls->inflight + ticket->cost > cls->workers)
+		return 0;
+	if (engine->max_inflight && engine->inflight &&
+			engine->inflight + ticket->cost > engine->max_inflight)
 		return 0;
+	return 1;
+}
 
-	retval = fbr_id_unpack(FBR_A_ &fiber, ev->ev_base.id);
-	if (-1 == retval) {
-		fbr_log_e(FBR_A_ "libevfibers: fiber is about to be called by"
-			" the eio callback, but it's id is not valid: %s",
-			fbr_strerror(FBR_A_ fctx->f_errno));
-		abort();
+static void ticket_grant(FBR_P_ struct fbr_eio_engine *engine,
+		struct eio_ticket *ticket)
+{
+	struct eio_class *cls = ticket->cls;
+	ev_tstamp waited;
+	double start;
+
+	if (EIO_TICKET_QUEUED == ticket->state) {
+		TAILQ_REMOVE(&cls->queue, ticket, entries);
+		cls->queued--;
+		waited = ev_now(fctx->__p->loop) - ticket->queued_at;
+		cls->delayed++;
+		cls->wait_time += waited;
+		cls->max_wait_time = max(cls->max_wait_time, waited);
 	}
+	start = max(cls->vtime, engine->vclock);
+	engine->vclock = start;
+	cls->vtime = start + (double)ticket->cost / cls->weight;
+	cls->inflight += ticket->cost;
+	engine->inflight += ticket->cost;
+	cls->admitted++;
+	ticket->state = EIO_TICKET_GRANTED;
+}
 
-	post_ev(FBR_A_ fiber, &ev->ev_base);
+/* Admits the queued requests while there is room, the class with the
+ * earliest virtual time first */
+static void eio_dispatch(FBR_P_ struct fbr_eio_engine *engine)
+{
+	struct eio_class *cls, *best;
+	struct eio_ticket *ticket;
+	int i;
 
-	retval = fbr_transfer(FBR_A_ fbr_id_pack(fiber));
-	assert(0 == retval);
+	for (;;) {
+		best = NULL;
+		for (i = 0; i < FBR_EIO_CLASSES; i++) {
+			cls = engine->classes + i;
+			ticket = TAILQ_FIRST(&cls->queue);
+			if (NULL == ticket || !ticket_fits(engine, ticket))
+				continue;
+			if (NULL == best || max(cls->vtime, engine->vclock) <
+					max(best->vtime, engine->vclock))
+				best = cls;
+		}
+		if (NULL == best)
+			return;
+		ticket = TAILQ_FIRST(&best->queue);
+		ticket_grant(FBR_A_ engine, ticket);
+		fbr_cond_signal(FBR_A_ &ticket->granted);
+	}
+}
+
+/* Gives up the place in the queue or the slots in the pool */
+static void ticket_dtor(FBR_P_ void *_arg)
+{
+	struct eio_ticket *ticket = _arg;
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+
+	switch (ticket->state) {
+	case EIO_TICKET_QUEUED:
+		TAILQ_REMOVE(&ticket->cls->queue, ticket, entries);
+		ticket->cls->queued--;
+		break;
+	case EIO_TICKET_GRANTED:
+		ticket->cls->inflight -= ticket->cost;
+		engine->inflight -= ticket->cost;
+		break;
+	}
+	ticket->state = EIO_TICKET_IDLE;
+	fbr_cond_destroy(FBR_A_ &ticket->granted);
+	eio_dispatch(FBR_A_ engine);
+}
+
+/* Waits until the request may be sent to the pool. The ticket has to be
+ * released with eio_release once the request is done. */
+static int eio_admit(FBR_P_ struct eio_ticket *ticket, int pri, unsigned cost)
+{
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+
+	ticket->cls = pri_class(engine, pri);
+	ticket->cost = cost;
+	ticket->state = EIO_TICKET_IDLE;
+	fbr_cond_init(FBR_A_ &ticket->granted);
+	ticket->dtor.func = ticket_dtor;
+	ticket->dtor.arg = ticket;
+	fbr_destructor_add(FBR_A_ &ticket->dtor);
+
+	/* Nobody to overtake */
+	if (TAILQ_EMPTY(&ticket->cls->queue) && ticket_fits(engine, ticket)) {
+		ticket_grant(FBR_A_ engine, ticket);
+		return_success(0);
+	}
+
+	ticket->state = EIO_TICKET_QUEUED;
+	ticket->queued_at = ev_now(fctx->__p->loop);
+	TAILQ_INSERT_TAIL(&ticket->cls->queue, ticket, entries);
+	ticket->cls->queued++;
+	while (EIO_TICKET_GRANTED != ticket->state) {
+		if (-1 == fbr_cond_wait(FBR_A_ &ticket->granted, NULL)) {
+			fbr_destructor_remove(FBR_A_ &ticket->dtor, 1);
+			return -1;
+		}
+	}
+	return_success(0);
+}
+
+static void eio_release(FBR_P_ struct eio_ticket *ticket)
+{
+	fbr_destructor_remove(FBR_A_ &ticket->dtor, 1 /* Call it? */);
+}
+
+int fbr_eio_class_set(FBR_P_ int pri, unsigned weight, unsigned workers)
+{
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+	struct eio_class *cls;
+
+	if (NULL == engine)
+		return_error(-1, FBR_EEIO);
+	if (pri < EIO_PRI_MIN || pri > EIO_PRI_MAX || 0 == weight)
+		return_error(-1, FBR_EINVAL);
+	cls = pri_class(engine, pri);
+	cls->weight = weight;
+	cls->workers = workers;
+	/* A raised limit may let somebody in */
+	eio_dispatch(FBR_A_ engine);
+	return_success(0);
+}
+
+int fbr_eio_set_limits(FBR_P_ unsigned max_inflight,
+		unsigned fiber_max_inflight)
+{
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+
+	if (NULL == engine)
+		return_error(-1, FBR_EEIO);
+	engine->max_inflight = max_inflight;
+	engine->fiber_max_inflight = fiber_max_inflight;
+	eio_dispatch(FBR_A_ engine);
+	return_success(0);
+}
+
+int fbr_eio_get_class_stats(FBR_P_ int pri, struct fbr_eio_class_stats *stats)
+{
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+	struct eio_class *cls;
+
+	if (NULL == engine)
+		return_error(-1, FBR_EEIO);
+	if (pri < EIO_PRI_MIN || pri > EIO_PRI_MAX)
+		return_error(-1, FBR_EINVAL);
+	cls = pri_class(engine, pri);
+	stats->queued = cls->queued;
+	stats->inflight = cls->inflight;
+	stats->admitted = cls->admitted;
+	stats->delayed = cls->delayed;
+	stats->wait_time = cls->wait_time;
+	stats->max_wait_time = cls->max_wait_time;
+	return_success(0);
+}
+
+static void eio_req_dtor(FBR_P_ void *_arg)
+{
+	struct fbr_ev_eio *ev = _arg;
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+
+	pthread_mutex_lock(&eio_lock);
+	switch (ev->state) {
+	case EIO_EV_PENDING:
+		/* The callback checks for the cancellation under the lock, and
+		 * will not touch the event anymore */
+		eio_cancel(ev->req);
+		engine->pending--;
+		ev_unref(fctx->__p->loop);
+		break;
+	case EIO_EV_COMPLETED:
+		TAILQ_REMOVE(&engine->completed, ev, entries);
+		ev_unref(fctx->__p->loop);
+		break;
+	case EIO_EV_DELIVERED:
+		/* The ready queue is taken care of by the event item */
+		break;
+	}
+	pthread_mutex_unlock(&eio_lock);
+}
+
+/* Runs in whichever thread called eio_poll */
+static int fiber_eio_cb(eio_req *req)
+{
+	struct fbr_eio_engine *engine;
+	struct fbr_ev_eio *ev;
+
+	pthread_mutex_lock(&eio_lock);
+	/* The event lives on the stack of the fiber that has given up on the
+	 * request, it must not be touched */
+	if (EIO_CANCELLED(req)) {
+		pthread_mutex_unlock(&eio_lock);
+		return 0;
+	}
+
+	ev = req->data;
+	engine = ev->ev_base.fctx->__p->eio;
+	ev->result = req->result;
+	ev->errorno = req->errorno;
+	ev->offs = req->offs;
+	if (ev->buf && req->result >= 0 && req->ptr2) {
+		if (ev->buf_string)
+			memcpy(ev->buf, req->ptr2,
+					min(ev->buf_size, (size_t)req->result));
+		else
+			memcpy(ev->buf, req->ptr2, ev->buf_size);
+	}
+	ev->state = EIO_EV_COMPLETED;
+	TAILQ_INSERT_TAIL(&engine->completed, ev, entries);
+	engine->pending--;
+	/* The polling engine delivers its own completions right after
+	 * eio_poll returns */
+	if (engine != eio_polling)
+		ev_async_send(engine->fctx->__p->loop, &engine->ready);
+	pthread_mutex_unlock(&eio_lock);
 	return 0;
 }
 
+/* The event is set up before the submission, the request may complete in
+ * another thread before the fiber gets to wait for it */
 #define FBR_EIO_PREP \
 	eio_req *req; \
 	struct fbr_ev_eio e_eio; \
+	struct eio_ticket ticket; \
 	int retval; \
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER; \
-	ev_ref(eio_loop);
+	if (NULL == fctx->__p->eio) \
+		return_error(-1, FBR_EEIO); \
+	if (-1 == eio_admit(FBR_A_ &ticket, pri, 1)) \
+		return -1; \
+	fbr_ev_eio_init(FBR_A_ &e_eio, NULL); \
+	pthread_mutex_lock(&eio_lock); \
+	fctx->__p->eio->pending++; \
+	pthread_mutex_unlock(&eio_lock); \
+	ev_ref(fctx->__p->loop);
 
 #define FBR_EIO_WAIT \
 	if (NULL == req) { \
-		ev_unref(eio_loop); \
+		pthread_mutex_lock(&eio_lock); \
+		fctx->__p->eio->pending--; \
+		pthread_mutex_unlock(&eio_lock); \
+		ev_unref(fctx->__p->loop); \
+		eio_release(FBR_A_ &ticket); \
 		return_error(-1, FBR_EEIO); \
 	} \
+	e_eio.req = req; \
 	dtor.func = eio_req_dtor; \
-	dtor.arg = req; \
+	dtor.arg = &e_eio; \
 	fbr_destructor_add(FBR_A_ &dtor); \
-	fbr_ev_eio_init(FBR_A_ &e_eio, req); \
 	retval = fbr_ev_wait_one(FBR_A_ &e_eio.ev_base); \
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */); \
+	fbr_destructor_remove(FBR_A_ &dtor, retval ? 1 : 0 /* Call it? */); \
+	eio_release(FBR_A_ &ticket); \
 	if (retval) \
 		return retval;
 
+/* Results are read from the event, the request is gone by now */
 #define FBR_EIO_RESULT_CHECK \
-	if (0 > req->result) { \
-		errno = req->errorno; \
+	if (0 > e_eio.result) { \
+		errno = e_eio.errorno; \
 		return_error(-1, FBR_ESYSTEM); \
 	}
 
 #define FBR_EIO_RESULT_RET \
 	FBR_EIO_RESULT_CHECK \
-	return req->result;
+	return e_eio.result;
+
+/* Where the callback copies the data pointed to by ptr2 */
+#define FBR_EIO_COPY_OUT(dst, size, string) \
+	e_eio.buf = (dst); \
+	e_eio.buf_size = (size); \
+	e_eio.buf_string = (string);
+
+/* File operations the kernel can do asynchronously are queued in the
+ * io_uring of the context if there is one, see uring.c, the priority does
+ * not apply to them */
+#ifdef HAVE_IO_URING
+#define FBR_EIO_URING(call) \
+	if (fbr_uring_files_enabled(FBR_A)) { \
+		ssize_t uring_retval = (call); \
+		if (0 > uring_retval) \
+			return_error(-1, FBR_ESYSTEM); \
+		return uring_retval; \
+	}
+#else
+#define FBR_EIO_URING(call)
+#endif
+
+/* Calls that are likely to be served from the cache are tried on the loop
+ * thread first, see file.c */
+#define FBR_EIO_INLINE(call) \
+	if (call) { \
+		if (0 > inline_retval) \
+			return_error(-1, FBR_ESYSTEM); \
+		return inline_retval; \
+	}
 
 int fbr_eio_open(FBR_P_ const char *path, int flags, mode_t mode, int pri)
 {
+	FBR_EIO_URING(fbr_uring_open(FBR_A_ path, flags, mode));
 	FBR_EIO_PREP;
 	req = eio_open(path, flags, mode, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
@@ -2633,6 +3820,7 @@ int fbr_eio_sync(FBR_P_ int pri)
 
 int fbr_eio_fsync(FBR_P_ int fd, int pri)
 {
+	FBR_EIO_URING(fbr_uring_fsync(FBR_A_ fd, 0));
 	FBR_EIO_PREP;
 	req = eio_fsync(fd, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
@@ -2641,6 +3829,7 @@ int fbr_eio_fsync(FBR_P_ int fd, int pri)
 
 int fbr_eio_fdatasync(FBR_P_ int fd, int pri)
 {
+	FBR_EIO_URING(fbr_uring_fsync(FBR_A_ fd, 1));
 	FBR_EIO_PREP;
 	req = eio_fdatasync(fd, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
@@ -2693,21 +3882,41 @@ ssize_t fbr_eio_seek(FBR_P_ int fd, off_t offset, int whence, int pri)
 	req = eio_seek(fd, offset, whence, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
 	FBR_EIO_RESULT_CHECK;
-	return req->offs;
+	return e_eio.offs;
 }
 
-ssize_t fbr_eio_read(FBR_P_ int fd, void *buf, size_t length, off_t offset,
-		int pri)
+static ssize_t eio_read_offload(FBR_P_ int fd, void *buf, size_t length,
+		off_t offset, int pri)
 {
+	FBR_EIO_URING(fbr_uring_pread(FBR_A_ fd, buf, length, offset));
 	FBR_EIO_PREP;
 	req = eio_read(fd, buf, length, offset, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
 	FBR_EIO_RESULT_RET;
 }
 
+ssize_t fbr_eio_read(FBR_P_ int fd, void *buf, size_t length, off_t offset,
+		int pri)
+{
+	ssize_t inline_retval, retval;
+	FBR_EIO_INLINE(fbr_file_read_inline(FBR_A_ fd, buf, length, offset,
+				&inline_retval));
+	if (0 == inline_retval)
+		return eio_read_offload(FBR_A_ fd, buf, length, offset, pri);
+	/* Only the beginning of the range was cached */
+	retval = eio_read_offload(FBR_A_ fd, (char *)buf + inline_retval,
+			length - inline_retval,
+			offset < 0 ? offset : offset + inline_retval, pri);
+	/* What has been read stays read, the error is up to the next call */
+	if (-1 == retval)
+		return_success(inline_retval);
+	return inline_retval + retval;
+}
+
 ssize_t fbr_eio_write(FBR_P_ int fd, void *buf, size_t length, off_t offset,
 		int pri)
 {
+	FBR_EIO_URING(fbr_uring_pwrite(FBR_A_ fd, buf, length, offset));
 	FBR_EIO_PREP;
 	req = eio_write(fd, buf, length, offset, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
@@ -2733,82 +3942,77 @@ int fbr_eio_msync(FBR_P_ void *addr, size_t length, int flags, int pri)
 int fbr_eio_readlink(FBR_P_ const char *path, char *buf, size_t size, int pri)
 {
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(buf, size, 1);
 	req = eio_readlink(path, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	strncpy(buf, req->ptr2, min(size, (size_t)req->result));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_realpath(FBR_P_ const char *path, char *buf, size_t size, int pri)
 {
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(buf, size, 1);
 	req = eio_realpath(path, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	strncpy(buf, req->ptr2, min(size, (size_t)req->result));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_stat(FBR_P_ const char *path, EIO_STRUCT_STAT *statdata, int pri)
 {
-	EIO_STRUCT_STAT *st;
+	int inline_retval;
+	FBR_EIO_INLINE(fbr_file_stat_inline(FBR_A_ path, 1, statdata,
+				&inline_retval));
+	FBR_EIO_URING(fbr_uring_stat(FBR_A_ path, 1, statdata));
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(statdata, sizeof(*statdata), 0);
 	req = eio_stat(path, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STAT *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_lstat(FBR_P_ const char *path, EIO_STRUCT_STAT *statdata, int pri)
 {
-	EIO_STRUCT_STAT *st;
+	int inline_retval;
+	FBR_EIO_INLINE(fbr_file_stat_inline(FBR_A_ path, 0, statdata,
+				&inline_retval));
+	FBR_EIO_URING(fbr_uring_stat(FBR_A_ path, 0, statdata));
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(statdata, sizeof(*statdata), 0);
 	req = eio_lstat(path, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STAT *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_fstat(FBR_P_ int fd, EIO_STRUCT_STAT *statdata, int pri)
 {
-	EIO_STRUCT_STAT *st;
+	int inline_retval;
+	FBR_EIO_INLINE(fbr_file_fstat_inline(FBR_A_ fd, statdata,
+				&inline_retval));
+	FBR_EIO_URING(fbr_uring_fstat(FBR_A_ fd, statdata));
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(statdata, sizeof(*statdata), 0);
 	req = eio_fstat(fd, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STAT *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_statvfs(FBR_P_ const char *path, EIO_STRUCT_STATVFS *statdata,
 		int pri)
 {
-	EIO_STRUCT_STATVFS *st;
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(statdata, sizeof(*statdata), 0);
 	req = eio_statvfs(path, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STATVFS *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_fstatvfs(FBR_P_ int fd, EIO_STRUCT_STATVFS *statdata, int pri)
 {
-	EIO_STRUCT_STATVFS *st;
 	FBR_EIO_PREP;
+	FBR_EIO_COPY_OUT(statdata, sizeof(*statdata), 0);
 	req = eio_fstatvfs(fd, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STATVFS *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_EIO_RESULT_RET;
 }
 
 int fbr_eio_sendfile(FBR_P_ int out_fd, int in_fd, off_t in_offset,
@@ -2849,6 +4053,7 @@ int fbr_eio_sync_file_range(FBR_P_ int fd, off_t offset, size_t nbytes,
 
 int fbr_eio_fallocate(FBR_P_ int fd, int mode, off_t offset, off_t len, int pri)
 {
+	FBR_EIO_URING(fbr_uring_fallocate(FBR_A_ fd, mode, offset, len));
 	FBR_EIO_PREP;
 	req = eio_fallocate(fd, mode, offset, len, pri, fiber_eio_cb, &e_eio);
 	FBR_EIO_WAIT;
@@ -2872,6 +4077,449 @@ eio_ssize_t fbr_eio_custom(FBR_P_ fbr_eio_custom_func_t func, void *data,
 	FBR_EIO_RESULT_RET;
 }
 
+/* Arguments of a vectored call, run by the pool as a custom request */
+struct eio_rw_vec {
+	int fd;
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	int flags;
+};
+
+static eio_ssize_t preadv_execute(void *data)
+{
+	struct eio_rw_vec *rw = data;
+	return fbr_file_preadv(rw->fd, rw->iov, rw->iovcnt, rw->offset,
+			rw->flags);
+}
+
+static eio_ssize_t pwritev_execute(void *data)
+{
+	struct eio_rw_vec *rw = data;
+	return fbr_file_pwritev(rw->fd, rw->iov, rw->iovcnt, rw->offset,
+			rw->flags);
+}
+
+static ssize_t eio_preadv_offload(FBR_P_ int fd, const struct iovec *iov,
+		int iovcnt, off_t offset, int flags, int pri)
+{
+	struct eio_rw_vec rw = {fd, iov, iovcnt, offset, flags};
+	FBR_EIO_URING(fbr_uring_preadv(FBR_A_ fd, iov, iovcnt, offset, flags));
+	FBR_EIO_PREP;
+	e_eio.custom_func = preadv_execute;
+	e_eio.custom_arg = &rw;
+	req = eio_custom(custom_execute_cb, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+ssize_t fbr_eio_preadv(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags, int pri)
+{
+	ssize_t inline_retval, retval;
+	struct iovec *rest;
+	size_t skip;
+	int i = 0;
+	FBR_EIO_INLINE(fbr_file_readv_inline(FBR_A_ fd, iov, iovcnt, offset,
+				flags, &inline_retval));
+	if (0 == inline_retval)
+		return eio_preadv_offload(FBR_A_ fd, iov, iovcnt, offset, flags,
+				pri);
+
+	/* Only the beginning of the range was cached, the rest is read into
+	 * what is left of the buffers */
+	skip = inline_retval;
+	while (skip >= iov[i].iov_len)
+		skip -= iov[i++].iov_len;
+	rest = allocate_in_fiber(FBR_A_ (iovcnt - i) * sizeof(*rest),
+			CURRENT_FIBER);
+	memcpy(rest, iov + i, (iovcnt - i) * sizeof(*rest));
+	rest[0].iov_base = (char *)rest[0].iov_base + skip;
+	rest[0].iov_len -= skip;
+	retval = eio_preadv_offload(FBR_A_ fd, rest, iovcnt - i,
+			offset < 0 ? offset : offset + inline_retval, flags, pri);
+	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, rest, 1);
+	/* What has been read stays read, the error is up to the next call */
+	if (-1 == retval)
+		return_success(inline_retval);
+	return inline_retval + retval;
+}
+
+ssize_t fbr_eio_pwritev(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags, int pri)
+{
+	struct eio_rw_vec rw = {fd, iov, iovcnt, offset, flags};
+	ssize_t inline_retval;
+	FBR_EIO_INLINE(fbr_file_writev_inline(FBR_A_ fd, iov, iovcnt, offset,
+				flags, &inline_retval));
+	FBR_EIO_URING(fbr_uring_pwritev(FBR_A_ fd, iov, iovcnt, offset,
+				flags));
+	FBR_EIO_PREP;
+	e_eio.custom_func = pwritev_execute;
+	e_eio.custom_arg = &rw;
+	req = eio_custom(custom_execute_cb, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+/*
+ * A batch lives on the heap: its members may complete, and the group gets
+ * finished, after the fiber has taken what it has waited for and left. It is
+ * freed by whichever of the fiber and the group callback is the last to let
+ * go of it.
+ */
+struct eio_batch_member {
+	struct eio_batch *batch;
+	struct fbr_eio_op *op;
+	eio_req *req;
+};
+
+struct eio_batch {
+	struct fbr_ev_eio ev;
+	struct fbr_eio_engine *engine;
+	size_t count;
+	size_t wait_for;
+	size_t completed;
+	/* Next member to submit */
+	size_t next;
+	int pri;
+	int refs;
+	struct eio_batch_member members[];
+};
+
+static void batch_unref(struct eio_batch *batch)
+{
+	if (0 == --batch->refs)
+		free(batch);
+}
+
+/* Called with eio_lock held */
+static void batch_member_done(struct eio_batch_member *member,
+		eio_ssize_t result, int errorno)
+{
+	struct eio_batch *batch = member->batch;
+	struct fbr_eio_engine *engine = batch->engine;
+
+	member->op->result = result;
+	member->op->errorno = errorno;
+	member->op->done = 1;
+	if (++batch->completed != batch->wait_for)
+		return;
+	batch->ev.state = EIO_EV_COMPLETED;
+	TAILQ_INSERT_TAIL(&engine->completed, &batch->ev, entries);
+	engine->pending--;
+	if (engine != eio_polling)
+		ev_async_send(engine->fctx->__p->loop, &engine->ready);
+}
+
+static int batch_member_cb(eio_req *req)
+{
+	struct eio_batch_member *member = req->data;
+
+	pthread_mutex_lock(&eio_lock);
+	/* Cancelled once the fiber has stopped waiting. The operation may
+	 * have run nevertheless, and nobody is going to close what it has
+	 * opened. The operations array is not ours anymore, so the type is
+	 * taken from the request. */
+	if (EIO_CANCELLED(req)) {
+		pthread_mutex_unlock(&eio_lock);
+		if (EIO_OPEN == req->type && req->result >= 0)
+			close(req->result);
+		return 0;
+	}
+	member->req = NULL;
+	if (req->result >= 0 && req->ptr2 &&
+			(FBR_EIO_OP_STAT == member->op->type ||
+			 FBR_EIO_OP_LSTAT == member->op->type ||
+			 FBR_EIO_OP_FSTAT == member->op->type))
+		memcpy(member->op->buf, req->ptr2, sizeof(EIO_STRUCT_STAT));
+	batch_member_done(member, req->result, req->errorno);
+	pthread_mutex_unlock(&eio_lock);
+	return 0;
+}
+
+/* All the members, cancelled or not, are gone */
+static int batch_group_cb(eio_req *req)
+{
+	pthread_mutex_lock(&eio_lock);
+	batch_unref(req->data);
+	pthread_mutex_unlock(&eio_lock);
+	return 0;
+}
+
+static eio_req *batch_submit(struct eio_batch_member *member, int pri)
+{
+	struct fbr_eio_op *op = member->op;
+
+	switch (op->type) {
+	case FBR_EIO_OP_OPEN:
+		return eio_open(op->path, op->flags, op->mode, pri,
+				batch_member_cb, member);
+	case FBR_EIO_OP_CLOSE:
+		return eio_close(op->fd, pri, batch_member_cb, member);
+	case FBR_EIO_OP_READ:
+		return eio_read(op->fd, op->buf, op->length, op->offset, pri,
+				batch_member_cb, member);
+	case FBR_EIO_OP_WRITE:
+		return eio_write(op->fd, op->buf, op->length, op->offset, pri,
+				batch_member_cb, member);
+	case FBR_EIO_OP_STAT:
+		return eio_stat(op->path, pri, batch_member_cb, member);
+	case FBR_EIO_OP_LSTAT:
+		return eio_lstat(op->path, pri, batch_member_cb, member);
+	case FBR_EIO_OP_FSTAT:
+		return eio_fstat(op->fd, pri, batch_member_cb, member);
+	case FBR_EIO_OP_FSYNC:
+		return eio_fsync(op->fd, pri, batch_member_cb, member);
+	case FBR_EIO_OP_FDATASYNC:
+		return eio_fdatasync(op->fd, pri, batch_member_cb, member);
+	case FBR_EIO_OP_UNLINK:
+		return eio_unlink(op->path, pri, batch_member_cb, member);
+	case FBR_EIO_OP_READAHEAD:
+		return eio_readahead(op->fd, op->offset, op->length, pri,
+				batch_member_cb, member);
+	}
+	errno = EINVAL;
+	return NULL;
+}
+
+/* Called by libeio with eio_poll_lock held whenever the group has room for
+ * another member. Adding nothing stops the feeding, which is what happens
+ * once the fiber has got what it has waited for. */
+static void batch_feed(eio_req *grp)
+{
+	struct eio_batch *batch = grp->data;
+	struct eio_batch_member *member;
+	eio_req *req;
+
+	pthread_mutex_lock(&eio_lock);
+	while (batch->completed < batch->wait_for &&
+			batch->next < batch->count) {
+		member = batch->members + batch->next++;
+		req = batch_submit(member, batch->pri);
+		if (req) {
+			member->req = req;
+			eio_grp_add(grp, req);
+			break;
+		}
+		batch_member_done(member, -1, errno);
+	}
+	pthread_mutex_unlock(&eio_lock);
+}
+
+/* Runs once the fiber stops waiting, whichever way */
+static void batch_dtor(FBR_P_ void *_arg)
+{
+	struct eio_batch *batch = _arg;
+	size_t i;
+
+	pthread_mutex_lock(&eio_lock);
+	switch (batch->ev.state) {
+	case EIO_EV_PENDING:
+		batch->engine->pending--;
+		ev_unref(fctx->__p->loop);
+		break;
+	case EIO_EV_COMPLETED:
+		TAILQ_REMOVE(&batch->engine->completed, &batch->ev, entries);
+		ev_unref(fctx->__p->loop);
+		break;
+	case EIO_EV_DELIVERED:
+		break;
+	}
+	/* The operations array belongs to the caller from now on */
+	batch->ev.state = EIO_EV_DELIVERED;
+	batch->wait_for = 0;
+	for (i = 0; i < batch->count; i++) {
+		if (batch->members[i].req)
+			eio_cancel(batch->members[i].req);
+	}
+	batch_unref(batch);
+	pthread_mutex_unlock(&eio_lock);
+}
+
+ssize_t fbr_eio_batch(FBR_P_ struct fbr_eio_op *ops, size_t count,
+		size_t wait_for, int pri)
+{
+	struct fbr_eio_engine *engine = fctx->__p->eio;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct eio_ticket ticket;
+	struct eio_batch *batch;
+	eio_req *grp;
+	ssize_t done = 0;
+	size_t limit = count;
+	size_t i;
+	int retval;
+
+	if (NULL == engine)
+		return_error(-1, FBR_EEIO);
+	if (0 == count)
+		return_success(0);
+	if (0 == wait_for || wait_for > count)
+		wait_for = count;
+	/* The ticket covers every member in flight at once, so they are kept
+	 * within the limits it is admitted against, or an oversized ticket
+	 * would flood the pool once the class is idle */
+	if (engine->fiber_max_inflight)
+		limit = min(limit, engine->fiber_max_inflight);
+	if (pri_class(engine, pri)->workers)
+		limit = min(limit, pri_class(engine, pri)->workers);
+	if (engine->max_inflight)
+		limit = min(limit, engine->max_inflight);
+
+	batch = malloc(sizeof(*batch) + count * sizeof(*batch->members));
+	if (NULL == batch) {
+		errno = ENOMEM;
+		return_error(-1, FBR_ESYSTEM);
+	}
+	if (-1 == eio_admit(FBR_A_ &ticket, pri, limit)) {
+		free(batch);
+		return -1;
+	}
+	fbr_ev_eio_init(FBR_A_ &batch->ev, NULL);
+	batch->engine = engine;
+	batch->count = count;
+	batch->wait_for = wait_for;
+	batch->completed = 0;
+	batch->next = 0;
+	batch->pri = pri;
+	/* The fiber and the group */
+	batch->refs = 2;
+	for (i = 0; i < count; i++) {
+		ops[i].done = 0;
+		ops[i].result = -1;
+		ops[i].errorno = ECANCELED;
+		batch->members[i].batch = batch;
+		batch->members[i].op = ops + i;
+		batch->members[i].req = NULL;
+	}
+
+	pthread_mutex_lock(&eio_lock);
+	engine->pending++;
+	pthread_mutex_unlock(&eio_lock);
+	ev_ref(fctx->__p->loop);
+
+	/* Nobody may poll until the first members are in the group, or the
+	 * group might finish early, or a member before its request is
+	 * recorded */
+	pthread_mutex_lock(&eio_poll_lock);
+	grp = eio_grp(batch_group_cb, batch);
+	if (NULL == grp) {
+		pthread_mutex_unlock(&eio_poll_lock);
+		batch->refs--;
+		batch_dtor(FBR_A_ batch);
+		eio_release(FBR_A_ &ticket);
+		return_error(-1, FBR_EEIO);
+	}
+	batch->ev.req = grp;
+	/* Submits the first limit members right away */
+	eio_grp_feed(grp, batch_feed, limit);
+	pthread_mutex_unlock(&eio_poll_lock);
+
+	dtor.func = batch_dtor;
+	dtor.arg = batch;
+	fbr_destructor_add(FBR_A_ &dtor);
+	retval = fbr_ev_wait_one(FBR_A_ &batch->ev.ev_base);
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	eio_release(FBR_A_ &ticket);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < count; i++)
+		done += ops[i].done;
+	return_success(done);
+}
+
+/*
+ * The buffer only has one region prepared at a time, so the file is read in
+ * windows of depth chunks: a window is prepared, which waits for the
+ * consumer to free enough space, its chunks are read by a single batch and
+ * it is committed at once. Along with the batch the pool is asked to read
+ * ahead the window after, so that is mostly served from the page cache
+ * while the consumer is busy with this one.
+ */
+ssize_t fbr_eio_stream(FBR_P_ int fd, off_t offset, size_t length,
+		struct fbr_buffer *buffer, size_t chunk, unsigned depth, int pri)
+{
+	struct fbr_eio_op *ops;
+	size_t window, want, got, total = 0;
+	unsigned count, i;
+	ssize_t retval;
+	char *ptr;
+	int eof = 0;
+
+	if (0 == chunk || 0 == depth || offset < 0)
+		return_error(-1, FBR_EINVAL);
+	/* With the whole buffer in flight the consumer would have to drain
+	 * it completely before the next reads could start */
+	window = max(fbr_buffer_size(FBR_A_ buffer) / 2, (size_t)1);
+	chunk = min(chunk, window);
+	depth = min(depth, window / chunk);
+	window = depth * chunk;
+
+	ops = allocate_in_fiber(FBR_A_ depth * sizeof(*ops), CURRENT_FIBER);
+	while (!eof && (0 == length || total < length)) {
+		want = window;
+		if (length)
+			want = min(want, length - total);
+		ptr = fbr_buffer_alloc_prepare(FBR_A_ buffer, want);
+		if (NULL == ptr) {
+			fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ops, 1);
+			return -1;
+		}
+
+		memset(ops, 0x00, depth * sizeof(*ops));
+		for (count = 0; count * chunk < want; count++) {
+			ops[count].type = FBR_EIO_OP_READ;
+			ops[count].fd = fd;
+			ops[count].buf = ptr + count * chunk;
+			ops[count].length = min(chunk, want - count * chunk);
+			ops[count].offset = offset + total + count * chunk;
+		}
+		/* Only a hint, so nobody waits for it: it is not a member of
+		 * the batch, and is reaped without a callback. Done inline,
+		 * readahead would block the loop until the I/O is queued. */
+		if (0 == length || total + want < length)
+			eio_readahead(fd, offset + total + want, window, pri,
+					NULL, NULL);
+		retval = fbr_eio_batch(FBR_A_ ops, count, 0, pri);
+		if (-1 == retval) {
+			fbr_buffer_alloc_abort(FBR_A_ buffer);
+			fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ops, 1);
+			return -1;
+		}
+
+		/* Only the data up to the first short or failed read is
+		 * contiguous, a short read of a regular file means its end */
+		got = 0;
+		retval = 0;
+		for (i = 0; i < count; i++) {
+			if (0 > ops[i].result) {
+				errno = ops[i].errorno;
+				retval = -1;
+				break;
+			}
+			got += ops[i].result;
+			if ((size_t)ops[i].result < ops[i].length) {
+				eof = 1;
+				break;
+			}
+		}
+		if (got) {
+			buffer->prepared_bytes = got;
+			fbr_buffer_alloc_commit(FBR_A_ buffer);
+		} else {
+			fbr_buffer_alloc_abort(FBR_A_ buffer);
+		}
+		total += got;
+		if (-1 == retval) {
+			fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ops, 1);
+			return_error(-1, FBR_ESYSTEM);
+		}
+	}
+	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ops, 1);
+	return_success(total);
+}
+
 #else
 
 void fbr_eio_init(FBR_PU)
@@ -0,0 +1,242 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#define _GNU_SOURCE
+
+#include <evfibers/config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * Inline fast path of the file wrappers. Handing a read of a page cached
+ * file or a stat of a hot inode to a worker thread costs way more than the
+ * call itself, so they are attempted on the loop thread first.
+ *
+ * Reads use preadv2 with RWF_NOWAIT, which fails with EAGAIN instead of
+ * going to the disk, and only then the read is offloaded. Metadata calls
+ * have no such flag, so they are done inline while they stay cheap: a call
+ * that takes longer than STAT_SLOW means the metadata is not cached, and
+ * the following ones are offloaded, with every STAT_PROBE-th still tried
+ * inline to find out whether the cache is warm again.
+ */
+
+#define STAT_SLOW 50e-6
+#define STAT_PROBE 64
+
+void fbr_file_inline_init(FBR_P)
+{
+	memset(&fctx->__p->file_inline, 0x00,
+			sizeof(fctx->__p->file_inline));
+}
+
+void fbr_get_file_stats(FBR_P_ struct fbr_file_stats *stats)
+{
+	memcpy(stats, &fctx->__p->file_inline.stats, sizeof(*stats));
+}
+
+int fbr_file_read_inline(FBR_P_ int fd, void *buf, size_t count,
+		off_t offset, ssize_t *result)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	return fbr_file_readv_inline(FBR_A_ fd, &iov, 1, offset, 0, result);
+}
+
+/* Returns 1 if the read is complete, with its result. Otherwise the read is
+ * to be offloaded, result is set to the number of bytes read inline
+ * already, and the offloaded part starts that far into iov and the file. */
+int fbr_file_readv_inline(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags, ssize_t *result)
+{
+	struct fbr_file_inline *fi = &fctx->__p->file_inline;
+#ifdef HAVE_RWF_NOWAIT
+	struct iovec part;
+	ssize_t retval;
+	size_t total = 0, done = 0, skip = 0;
+	int i;
+
+	*result = 0;
+	if (fi->no_nowait)
+		goto offload;
+	/* A caller that has asked for RWF_NOWAIT gets EAGAIN or a short
+	 * read as is. Offset of -1 means the file position, as with eio. */
+	if (flags & RWF_NOWAIT) {
+		fi->stats.inline_reads++;
+		*result = preadv2(fd, iov, iovcnt, offset < 0 ? -1 : offset,
+				flags);
+		return 1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	/* A short read is either the end of file or the end of the cached
+	 * part of the range, the next read tells which: 0 is the end of file,
+	 * EAGAIN leaves the rest to the offloaded read */
+	i = 0;
+	for (;;) {
+		if (skip) {
+			part.iov_base = (char *)iov[i].iov_base + skip;
+			part.iov_len = iov[i].iov_len - skip;
+			retval = preadv2(fd, &part, 1,
+					offset < 0 ? -1 : offset + (off_t)done,
+					flags | RWF_NOWAIT);
+		} else {
+			retval = preadv2(fd, iov + i, iovcnt - i,
+					offset < 0 ? -1 : offset + (off_t)done,
+					flags | RWF_NOWAIT);
+		}
+		if (-1 == retval)
+			break;
+		done += retval;
+		if (0 == retval || done == total) {
+			fi->stats.inline_reads++;
+			*result = done;
+			return 1;
+		}
+		skip += retval;
+		while (skip >= iov[i].iov_len)
+			skip -= iov[i++].iov_len;
+	}
+	*result = done;
+	/* EAGAIN is the usual cache miss. Whatever else went wrong is
+	 * reported by the offloaded read, unless the kernel does not know
+	 * preadv2 at all, then there is no point in trying again. */
+	if (ENOSYS == errno)
+		fi->no_nowait = 1;
+offload:
+#else
+	(void)fd;
+	(void)iov;
+	(void)iovcnt;
+	(void)offset;
+	(void)flags;
+	*result = 0;
+#endif
+	fi->stats.offloaded_reads++;
+	return 0;
+}
+
+/* Writes are not attempted inline unless asked to, as there is no telling
+ * whether they would block on writeback */
+int fbr_file_writev_inline(_unused_ FBR_P_ int fd, const struct iovec *iov,
+		int iovcnt, off_t offset, int flags, ssize_t *result)
+{
+#ifdef HAVE_RWF_NOWAIT
+	if (0 == (flags & RWF_NOWAIT))
+		return 0;
+	*result = pwritev2(fd, iov, iovcnt, offset < 0 ? -1 : offset, flags);
+	return 1;
+#else
+	(void)fd;
+	(void)iov;
+	(void)iovcnt;
+	(void)offset;
+	(void)flags;
+	(void)result;
+	return 0;
+#endif
+}
+
+/*
+ * Blocking vectored calls for the thread pool. Without preadv2 and pwritev2
+ * there is nowhere to pass the flags to.
+ */
+ssize_t fbr_file_preadv(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags)
+{
+#ifdef HAVE_RWF_NOWAIT
+	return preadv2(fd, iov, iovcnt, offset < 0 ? -1 : offset, flags);
+#else
+	if (flags) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (offset < 0)
+		return readv(fd, iov, iovcnt);
+	return preadv(fd, iov, iovcnt, offset);
+#endif
+}
+
+ssize_t fbr_file_pwritev(int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags)
+{
+#ifdef HAVE_RWF_NOWAIT
+	return pwritev2(fd, iov, iovcnt, offset < 0 ? -1 : offset, flags);
+#else
+	if (flags) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (offset < 0)
+		return writev(fd, iov, iovcnt);
+	return pwritev(fd, iov, iovcnt, offset);
+#endif
+}
+
+static int stat_offload(struct fbr_file_inline *fi)
+{
+	if (fi->stat_slow && 0 != ++fi->stat_offloaded % STAT_PROBE) {
+		fi->stats.offloaded_stats++;
+		return 1;
+	}
+	return 0;
+}
+
+static void stat_account(struct fbr_file_inline *fi, ev_tstamp start)
+{
+	fi->stats.inline_stats++;
+	fi->stat_slow = ev_time() - start > STAT_SLOW;
+	if (fi->stat_slow)
+		fi->stats.slow_inline_stats++;
+}
+
+int fbr_file_stat_inline(FBR_P_ const char *path, int follow,
+		struct stat *buf, int *result)
+{
+	struct fbr_file_inline *fi = &fctx->__p->file_inline;
+	ev_tstamp start;
+
+	if (stat_offload(fi))
+		return 0;
+	start = ev_time();
+	if (follow)
+		*result = stat(path, buf);
+	else
+		*result = lstat(path, buf);
+	stat_account(fi, start);
+	return 1;
+}
+
+int fbr_file_fstat_inline(FBR_P_ int fd, struct stat *buf, int *result)
+{
+	struct fbr_file_inline *fi = &fctx->__p->file_inline;
+	ev_tstamp start;
+
+	if (stat_offload(fi))
+		return 0;
+	start = ev_time();
+	*result = fstat(fd, buf);
+	stat_account(fi, start);
+	return 1;
+}
@@ -0,0 +1,438 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <evfibers/config.h>
+
+#include <pthread.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <evfibers_private/fiber.h>
+
+/* Maximum number of tasks started by a worker within one loop iteration */
+#define GROUP_TASK_BATCH 64
+
+struct fbr_group_task {
+	char name[FBR_MAX_FIBER_NAME];
+	fbr_fiber_func_t func;
+	void *arg;
+	size_t stack_size;
+	TAILQ_ENTRY(fbr_group_task) entries;
+};
+
+TAILQ_HEAD(group_task_tailq, fbr_group_task);
+
+struct fbr_group_worker {
+	struct fbr_group *group;
+	unsigned index;
+	pthread_t thread;
+	struct ev_loop *loop;
+	struct fbr_context fctx;
+	pthread_mutex_t lock;
+	struct group_task_tailq tasks;
+	struct group_task_tailq pinned;
+	ev_async wakeup;
+	ev_prepare steal;
+	int idle;
+	int stop;
+};
+
+struct fbr_group {
+	unsigned size;
+	unsigned next;
+	pthread_mutex_t lock;
+	pthread_cond_t started_cond;
+	unsigned started;
+	struct fbr_group_worker *workers;
+};
+
+static struct fbr_group_task *task_new(const char *name, fbr_fiber_func_t func,
+		void *arg, size_t stack_size)
+{
+	struct fbr_group_task *task;
+
+	task = malloc(sizeof(*task));
+	if (NULL == task)
+		return NULL;
+	strncpy(task->name, name, FBR_MAX_FIBER_NAME - 1);
+	task->name[FBR_MAX_FIBER_NAME - 1] = '\0';
+	task->func = func;
+	task->arg = arg;
+	task->stack_size = stack_size;
+	return task;
+}
+
+static void free_tasks(struct group_task_tailq *tailq)
+{
+	struct fbr_group_task *task, *x;
+	TAILQ_FOREACH_SAFE(task, tailq, entries, x) {
+		free(task);
+	}
+	TAILQ_INIT(tailq);
+}
+
+/* Takes up to a half of stealable tasks from the tail of victim's queue */
+static unsigned steal_from(struct fbr_group_worker *thief,
+		struct fbr_group_worker *victim)
+{
+	struct fbr_group_task *task;
+	struct group_task_tailq loot;
+	unsigned total = 0, count;
+
+	TAILQ_INIT(&loot);
+	pthread_mutex_lock(&victim->lock);
+	TAILQ_FOREACH(task, &victim->tasks, entries)
+		total++;
+	for (count = (total + 1) / 2; count > 0; count--) {
+		task = TAILQ_LAST(&victim->tasks, group_task_tailq);
+		TAILQ_REMOVE(&victim->tasks, task, entries);
+		TAILQ_INSERT_HEAD(&loot, task, entries);
+	}
+	pthread_mutex_unlock(&victim->lock);
+
+	if (TAILQ_EMPTY(&loot))
+		return 0;
+
+	pthread_mutex_lock(&thief->lock);
+	TAILQ_CONCAT(&thief->tasks, &loot, entries);
+	pthread_mutex_unlock(&thief->lock);
+	return (total + 1) / 2;
+}
+
+static int try_steal(struct fbr_group_worker *worker)
+{
+	struct fbr_group *group = worker->group;
+	unsigned i;
+
+	for (i = 1; i < group->size; i++) {
+		if (steal_from(worker, group->workers +
+					(worker->index + i) % group->size))
+			return 1;
+	}
+	return 0;
+}
+
+static struct fbr_group_task *pop_task(struct fbr_group_worker *worker)
+{
+	struct fbr_group_task *task;
+
+	pthread_mutex_lock(&worker->lock);
+	task = TAILQ_FIRST(&worker->pinned);
+	if (task) {
+		TAILQ_REMOVE(&worker->pinned, task, entries);
+	} else {
+		task = TAILQ_FIRST(&worker->tasks);
+		if (task)
+			TAILQ_REMOVE(&worker->tasks, task, entries);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return task;
+}
+
+static void run_tasks(struct fbr_group_worker *worker)
+{
+	struct fbr_context *fctx = &worker->fctx;
+	struct fbr_group_task *task;
+	fbr_id_t id;
+	unsigned i;
+
+	/* Tasks are popped one by one, so that the rest of the queue remains
+	 * stealable while a CPU-heavy task is running. */
+	for (i = 0; i < GROUP_TASK_BATCH; i++) {
+		task = pop_task(worker);
+		if (NULL == task)
+			return;
+		id = fbr_create(FBR_A_ task->name, task->func, task->arg,
+				task->stack_size);
+		free(task);
+		if (fbr_id_isnull(id)) {
+			fbr_log_e(FBR_A_ "libevfibers: unable to create a"
+					" group task fiber: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			continue;
+		}
+		fbr_transfer(FBR_A_ id);
+	}
+	/* There might be more of them, let the loop breathe first */
+	ev_async_send(worker->loop, &worker->wakeup);
+}
+
+static void wakeup_cb(EV_P_ ev_async *w, _unused_ int revents)
+{
+	struct fbr_group_worker *worker = w->data;
+
+	if (__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+		ev_break(EV_A_ EVBREAK_ALL);
+		return;
+	}
+	run_tasks(worker);
+}
+
+static int worker_has_tasks(struct fbr_group_worker *worker)
+{
+	int retval;
+	pthread_mutex_lock(&worker->lock);
+	retval = !TAILQ_EMPTY(&worker->tasks) || !TAILQ_EMPTY(&worker->pinned);
+	pthread_mutex_unlock(&worker->lock);
+	return retval;
+}
+
+/* Runs right before the loop is about to block, which is the moment the
+ * worker runs out of work and may steal some from the others. */
+static void steal_cb(EV_P_ ev_prepare *w, _unused_ int revents)
+{
+	struct fbr_group_worker *worker = w->data;
+	struct fbr_context *fctx = &worker->fctx;
+
+	if (!TAILQ_EMPTY(&fctx->__p->pending_fibers))
+		return;
+	if (worker_has_tasks(worker) || try_steal(worker)) {
+		__atomic_store_n(&worker->idle, 0, __ATOMIC_RELEASE);
+		ev_async_send(EV_A_ &worker->wakeup);
+		return;
+	}
+	__atomic_store_n(&worker->idle, 1, __ATOMIC_RELEASE);
+	/* Work might have been submitted while we were not yet idle */
+	if (worker_has_tasks(worker)) {
+		__atomic_store_n(&worker->idle, 0, __ATOMIC_RELEASE);
+		ev_async_send(EV_A_ &worker->wakeup);
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct fbr_group_worker *worker = arg;
+	struct fbr_group *group = worker->group;
+	struct fbr_context *fctx = &worker->fctx;
+
+	fbr_init(FBR_A_ worker->loop);
+	fctx->__p->group_worker = worker;
+
+	ev_async_init(&worker->wakeup, wakeup_cb);
+	worker->wakeup.data = worker;
+	ev_async_start(worker->loop, &worker->wakeup);
+	ev_prepare_init(&worker->steal, steal_cb);
+	worker->steal.data = worker;
+	ev_prepare_start(worker->loop, &worker->steal);
+
+	pthread_mutex_lock(&group->lock);
+	group->started++;
+	pthread_cond_signal(&group->started_cond);
+	pthread_mutex_unlock(&group->lock);
+
+	ev_run(worker->loop, 0);
+
+	ev_prepare_stop(worker->loop, &worker->steal);
+	ev_async_stop(worker->loop, &worker->wakeup);
+	fbr_destroy(FBR_A);
+	return NULL;
+}
+
+/* Stops and joins the first running workers, and frees everything */
+static void group_teardown(struct fbr_group *group, unsigned running)
+{
+	struct fbr_group_worker *worker;
+	unsigned i;
+
+	for (i = 0; i < running; i++) {
+		worker = group->workers + i;
+		__atomic_store_n(&worker->stop, 1, __ATOMIC_RELEASE);
+		ev_async_send(worker->loop, &worker->wakeup);
+	}
+	/* Workers steal from each other till the very end, so none of the
+	 * queues can go away before all of them are joined */
+	for (i = 0; i < running; i++)
+		pthread_join(group->workers[i].thread, NULL);
+	for (i = 0; i < group->size; i++) {
+		worker = group->workers + i;
+		if (NULL == worker->loop)
+			break;
+		ev_loop_destroy(worker->loop);
+		free_tasks(&worker->tasks);
+		free_tasks(&worker->pinned);
+		pthread_mutex_destroy(&worker->lock);
+	}
+	pthread_cond_destroy(&group->started_cond);
+	pthread_mutex_destroy(&group->lock);
+	free(group->workers);
+	free(group);
+}
+
+struct fbr_group *fbr_group_create(unsigned size)
+{
+	struct fbr_group *group;
+	struct fbr_group_worker *worker;
+	unsigned i;
+	int retval = 0;
+
+	if (0 == size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	group = calloc(1, sizeof(*group));
+	if (NULL == group)
+		return NULL;
+	group->workers = calloc(size, sizeof(*group->workers));
+	if (NULL == group->workers) {
+		free(group);
+		return NULL;
+	}
+	group->size = size;
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->started_cond, NULL);
+
+	/* All the queues are there before any worker may steal from them */
+	for (i = 0; i < size; i++) {
+		worker = group->workers + i;
+		worker->group = group;
+		worker->index = i;
+		worker->loop = ev_loop_new(EVFLAG_AUTO);
+		if (NULL == worker->loop) {
+			group_teardown(group, 0);
+			errno = ENOMEM;
+			return NULL;
+		}
+		pthread_mutex_init(&worker->lock, NULL);
+		TAILQ_INIT(&worker->tasks);
+		TAILQ_INIT(&worker->pinned);
+	}
+
+	for (i = 0; i < size; i++) {
+		worker = group->workers + i;
+		retval = pthread_create(&worker->thread, NULL, worker_thread,
+				worker);
+		if (retval)
+			break;
+	}
+
+	/* The wakeup watchers of the workers have to be running before they
+	 * can be told to stop */
+	pthread_mutex_lock(&group->lock);
+	while (group->started < i)
+		pthread_cond_wait(&group->started_cond, &group->lock);
+	pthread_mutex_unlock(&group->lock);
+
+	if (i < size) {
+		group_teardown(group, i);
+		errno = retval;
+		return NULL;
+	}
+	return group;
+}
+
+void fbr_group_destroy(struct fbr_group *group)
+{
+	group_teardown(group, group->size);
+}
+
+unsigned fbr_group_size(struct fbr_group *group)
+{
+	return group->size;
+}
+
+static void wake_idle_worker(struct fbr_group *group,
+		struct fbr_group_worker *except)
+{
+	struct fbr_group_worker *worker;
+	unsigned i;
+
+	for (i = 0; i < group->size; i++) {
+		worker = group->workers + i;
+		if (worker == except)
+			continue;
+		if (__atomic_load_n(&worker->idle, __ATOMIC_ACQUIRE)) {
+			ev_async_send(worker->loop, &worker->wakeup);
+			return;
+		}
+	}
+}
+
+static void enqueue(struct fbr_group_worker *worker,
+		struct fbr_group_task *task, int pinned)
+{
+	pthread_mutex_lock(&worker->lock);
+	if (pinned)
+		TAILQ_INSERT_TAIL(&worker->pinned, task, entries);
+	else
+		TAILQ_INSERT_TAIL(&worker->tasks, task, entries);
+	pthread_mutex_unlock(&worker->lock);
+	ev_async_send(worker->loop, &worker->wakeup);
+}
+
+int fbr_group_submit(struct fbr_group *group, const char *name,
+		fbr_fiber_func_t func, void *arg, size_t stack_size)
+{
+	struct fbr_group_task *task;
+	struct fbr_group_worker *worker;
+	unsigned index;
+
+	task = task_new(name, func, arg, stack_size);
+	if (NULL == task)
+		return -1;
+	index = __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED);
+	worker = group->workers + index % group->size;
+	enqueue(worker, task, 0);
+	/* Target worker might be busy crunching numbers, give idle ones a
+	 * chance to steal the task */
+	if (!__atomic_load_n(&worker->idle, __ATOMIC_ACQUIRE))
+		wake_idle_worker(group, worker);
+	return 0;
+}
+
+int fbr_group_submit_to(struct fbr_group *group, unsigned index,
+		const char *name, fbr_fiber_func_t func, void *arg,
+		size_t stack_size)
+{
+	struct fbr_group_task *task;
+
+	if (index >= group->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	task = task_new(name, func, arg, stack_size);
+	if (NULL == task)
+		return -1;
+	enqueue(group->workers + index, task, 1);
+	return 0;
+}
+
+int fbr_group_broadcast(struct fbr_group *group, const char *name,
+		fbr_fiber_func_t func, void *arg, size_t stack_size)
+{
+	unsigned i;
+	int retval;
+
+	for (i = 0; i < group->size; i++) {
+		retval = fbr_group_submit_to(group, i, name, func, arg,
+				stack_size);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+int fbr_group_worker(FBR_P)
+{
+	struct fbr_group_worker *worker = fctx->__p->group_worker;
+	if (NULL == worker)
+		return_error(-1, FBR_EINVAL);
+	return_success(worker->index);
+}
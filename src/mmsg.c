@@ -0,0 +1,119 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#define _GNU_SOURCE
+#include <evfibers/config.h>
+
+#ifdef HAVE_RECVMMSG
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * Batched datagram I/O. A readiness wakeup drains as many datagrams as there
+ * are slots in the vector, instead of one per trip through the event loop.
+ */
+
+struct mmsg_args {
+	struct mmsghdr *msgvec;
+	unsigned int vlen;
+	int flags;
+};
+
+static ssize_t call_recvmmsg(int fd, void *_arg)
+{
+	struct mmsg_args *arg = _arg;
+
+	return recvmmsg(fd, arg->msgvec, arg->vlen, arg->flags | MSG_DONTWAIT,
+			NULL);
+}
+
+static ssize_t call_sendmmsg(int fd, void *_arg)
+{
+	struct mmsg_args *arg = _arg;
+
+	return sendmmsg(fd, arg->msgvec, arg->vlen, arg->flags | MSG_DONTWAIT);
+}
+
+static int recv_batch(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, struct fbr_ev_timeout *tev)
+{
+	struct mmsg_args arg = {msgvec, vlen, flags};
+
+	return fbr_io_call(FBR_A_ sockfd, EV_READ, 1, call_recvmmsg, &arg,
+			tev);
+}
+
+static int send_batch(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, struct fbr_ev_timeout *tev)
+{
+	struct mmsg_args arg;
+	unsigned int sent = 0;
+	ssize_t retval;
+
+	arg.flags = flags;
+	while (sent < vlen) {
+		arg.msgvec = msgvec + sent;
+		arg.vlen = vlen - sent;
+		retval = fbr_io_call(FBR_A_ sockfd, EV_WRITE, 1, call_sendmmsg,
+				&arg, tev);
+		if (-1 == retval) {
+			/* Report the error once nothing has been sent, just
+			 * like sendmmsg does */
+			if (0 == sent)
+				return -1;
+			break;
+		}
+		sent += retval;
+	}
+	return sent;
+}
+
+int fbr_recvmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags)
+{
+	return recv_batch(FBR_A_ sockfd, msgvec, vlen, flags, NULL);
+}
+
+int fbr_recvmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
+
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return recv_batch(FBR_A_ sockfd, msgvec, vlen, flags, &tev);
+}
+
+int fbr_sendmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags)
+{
+	return send_batch(FBR_A_ sockfd, msgvec, vlen, flags, NULL);
+}
+
+int fbr_sendmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout)
+{
+	struct fbr_ev_timeout tev;
+
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	return send_batch(FBR_A_ sockfd, msgvec, vlen, flags, &tev);
+}
+
+#endif
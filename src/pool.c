@@ -0,0 +1,435 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <evfibers/config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * Connections are established lazily by checkouts and kept per endpoint.
+ * Every fiber that can not get a connection right away waits on the
+ * conditional variable of the endpoint, which is signalled one fiber at a
+ * time whenever something changes there: a connection is checked in or
+ * closed, or a connect finishes. The woken fiber starts over, so a checkout
+ * that happened in between may get ahead of it, which is fine as long as the
+ * wait is bounded by a timeout.
+ */
+
+static void close_conn(FBR_P_ int fd)
+{
+	/* Descriptors that failed before registration are closed all the
+	 * same */
+	fbr_fd_unregister(FBR_A_ fd);
+	close(fd);
+}
+
+/* The peer of an idle connection is not supposed to send anything, so
+ * either EOF or data means the connection is of no use anymore */
+static int conn_alive(int fd)
+{
+	ssize_t retval;
+	char c;
+
+	retval = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (-1 == retval)
+		return EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno;
+	return 0;
+}
+
+static struct fbr_pool_endpoint *get_endpoint(struct fbr_pool *pool,
+		const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct fbr_pool_endpoint *ep;
+
+	TAILQ_FOREACH(ep, &pool->endpoints, entries) {
+		if (ep->addrlen == addrlen && 0 == memcmp(&ep->addr, addr,
+					addrlen))
+			return ep;
+	}
+
+	ep = calloc(1, sizeof(*ep));
+	if (NULL == ep)
+		return NULL;
+	memcpy(&ep->addr, addr, addrlen);
+	ep->addrlen = addrlen;
+	TAILQ_INIT(&ep->idle);
+	fbr_cond_init(pool->fctx, &ep->available);
+	TAILQ_INSERT_TAIL(&pool->endpoints, ep, entries);
+	return ep;
+}
+
+static int set_owner(struct fbr_pool *pool, int fd,
+		struct fbr_pool_endpoint *ep)
+{
+	struct fbr_pool_endpoint **owners;
+	int size;
+
+	if (fd >= pool->owners_size) {
+		size = max(pool->owners_size * 2, 64);
+		while (size <= fd)
+			size *= 2;
+		owners = realloc(pool->owners, size * sizeof(*owners));
+		if (NULL == owners)
+			return -1;
+		memset(owners + pool->owners_size, 0x00,
+				(size - pool->owners_size) * sizeof(*owners));
+		pool->owners = owners;
+		pool->owners_size = size;
+	}
+	pool->owners[fd] = ep;
+	return 0;
+}
+
+static void remove_idle(struct fbr_pool *pool, struct fbr_pool_endpoint *ep,
+		struct fbr_pool_conn *conn)
+{
+	TAILQ_REMOVE(&ep->idle, conn, entries);
+	ep->nidle--;
+	pool->stats.idle--;
+	free(conn);
+}
+
+static int take_idle(FBR_P_ struct fbr_pool *pool,
+		struct fbr_pool_endpoint *ep)
+{
+	struct fbr_pool_conn *conn;
+	int fd;
+
+	while ((conn = TAILQ_FIRST(&ep->idle))) {
+		fd = conn->fd;
+		remove_idle(pool, ep, conn);
+		if (conn_alive(fd))
+			return fd;
+		pool->stats.broken++;
+		close_conn(FBR_A_ fd);
+	}
+	return -1;
+}
+
+static int can_connect(struct fbr_pool *pool, struct fbr_pool_endpoint *ep)
+{
+	const struct fbr_pool_params *params = &pool->params;
+
+	if (params->max_conns && ep->nidle + ep->nbusy + ep->nconnecting >=
+			params->max_conns)
+		return 0;
+	if (params->max_connecting && ep->nconnecting >=
+			params->max_connecting)
+		return 0;
+	return 1;
+}
+
+struct connect_attempt {
+	struct fbr_pool *pool;
+	struct fbr_pool_endpoint *ep;
+	int fd;
+};
+
+/* Also runs if the connecting fiber gets reclaimed, so the slot is not lost */
+static void connect_dtor(FBR_P_ void *arg)
+{
+	struct connect_attempt *ca = arg;
+
+	ca->ep->nconnecting--;
+	ca->pool->stats.connecting--;
+	if (-1 != ca->fd)
+		close_conn(FBR_A_ ca->fd);
+	fbr_cond_signal(FBR_A_ &ca->ep->available);
+}
+
+static int pool_connect(FBR_P_ struct fbr_pool *pool,
+		struct fbr_pool_endpoint *ep, struct fbr_ev_timeout *tev)
+{
+	struct connect_attempt ca;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	ev_tstamp timeout;
+	int saved_errno;
+	int fd;
+
+	ca.pool = pool;
+	ca.ep = ep;
+	ca.fd = -1;
+	ep->nconnecting++;
+	pool->stats.connecting++;
+	dtor.func = connect_dtor;
+	dtor.arg = &ca;
+	fbr_destructor_add(FBR_A_ &dtor);
+
+	timeout = tev->deadline - ev_now(fctx->__p->loop);
+	if (pool->params.connect_timeout > 0)
+		timeout = min(timeout, pool->params.connect_timeout);
+	if (timeout <= 0) {
+		errno = ETIMEDOUT;
+		goto error;
+	}
+
+	ca.fd = socket(ep->addr.ss_family, SOCK_STREAM, 0);
+	if (-1 == ca.fd)
+		goto error;
+	if (-1 == fcntl(ca.fd, F_SETFD, FD_CLOEXEC))
+		goto error;
+	if (-1 == fbr_fd_register(FBR_A_ ca.fd))
+		goto error;
+	if (-1 == fbr_connect_wto(FBR_A_ ca.fd, (struct sockaddr *)&ep->addr,
+				ep->addrlen, timeout))
+		goto error;
+
+	fd = ca.fd;
+	ca.fd = -1;
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	return fd;
+
+error:
+	saved_errno = errno;
+	pool->stats.connect_failures++;
+	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	errno = saved_errno;
+	return -1;
+}
+
+static void reap(FBR_P_ struct fbr_pool *pool)
+{
+	struct fbr_pool_endpoint *ep;
+	struct fbr_pool_conn *conn, *tmp;
+	ev_tstamp now = ev_now(fctx->__p->loop);
+	int fd;
+
+	TAILQ_FOREACH(ep, &pool->endpoints, entries) {
+		TAILQ_FOREACH_SAFE(conn, &ep->idle, entries, tmp) {
+			if (now - conn->idle_since >=
+					pool->params.idle_timeout)
+				pool->stats.evictions++;
+			else if (!conn_alive(conn->fd))
+				pool->stats.broken++;
+			else
+				continue;
+			fd = conn->fd;
+			remove_idle(pool, ep, conn);
+			close_conn(FBR_A_ fd);
+			fbr_cond_signal(FBR_A_ &ep->available);
+		}
+	}
+}
+
+static ev_tstamp next_expiry(struct fbr_pool *pool)
+{
+	struct fbr_pool_endpoint *ep;
+	struct fbr_pool_conn *oldest;
+	ev_tstamp expiry = 0.;
+	int found = 0;
+
+	TAILQ_FOREACH(ep, &pool->endpoints, entries) {
+		oldest = TAILQ_LAST(&ep->idle, fbr_pool_conn_tailq);
+		if (NULL == oldest)
+			continue;
+		if (!found || oldest->idle_since < expiry)
+			expiry = oldest->idle_since;
+		found = 1;
+	}
+	return expiry + pool->params.idle_timeout;
+}
+
+/* Sleeps until the oldest idle connection expires, checking the health of the
+ * rest on the way, and does not hold a timer while there is nothing idle */
+static void reaper_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_pool *pool = _arg;
+	ev_tstamp delay;
+
+	for (;;) {
+		while (0 == pool->stats.idle)
+			fbr_cond_wait(FBR_A_ &pool->reaper_cond, NULL);
+		delay = next_expiry(pool) - ev_now(fctx->__p->loop);
+		if (delay > 0)
+			fbr_sleep(FBR_A_ delay);
+		reap(FBR_A_ pool);
+	}
+}
+
+struct fbr_pool *fbr_pool_create(FBR_P_ const struct fbr_pool_params *params)
+{
+	struct fbr_pool *pool;
+
+	if (params->connect_timeout < 0 || params->idle_timeout < 0)
+		return_error(NULL, FBR_EINVAL);
+
+	pool = calloc(1, sizeof(*pool));
+	if (NULL == pool)
+		return_error(NULL, FBR_ESYSTEM);
+	pool->fctx = fctx;
+	pool->params = *params;
+	TAILQ_INIT(&pool->endpoints);
+	fbr_cond_init(FBR_A_ &pool->reaper_cond);
+	pool->reaper = FBR_ID_NULL;
+
+	if (params->idle_timeout > 0) {
+		pool->reaper = fbr_create(FBR_A_ "pool_reaper", reaper_fiber,
+				pool, 0);
+		if (fbr_id_isnull(pool->reaper)) {
+			free(pool);
+			return NULL;
+		}
+		fbr_transfer(FBR_A_ pool->reaper);
+	}
+	return_success(pool);
+}
+
+int fbr_pool_checkout(FBR_P_ struct fbr_pool *pool,
+		const struct sockaddr *addr, socklen_t addrlen,
+		ev_tstamp timeout)
+{
+	struct fbr_pool_endpoint *ep;
+	struct fbr_ev_timeout tev;
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *fb_events[] = {NULL, NULL, NULL};
+	ev_tstamp wait_start = 0.;
+	ev_tstamp waited;
+	int saved_errno;
+	int fd;
+
+	if (addrlen > sizeof(ep->addr)) {
+		errno = EINVAL;
+		return_error(-1, FBR_EINVAL);
+	}
+	ep = get_endpoint(pool, addr, addrlen);
+	if (NULL == ep) {
+		errno = ENOMEM;
+		return_error(-1, FBR_ESYSTEM);
+	}
+
+	fbr_ev_timeout_init(FBR_A_ &tev, timeout);
+	for (;;) {
+		fd = take_idle(FBR_A_ pool, ep);
+		if (-1 != fd) {
+			pool->stats.hits++;
+			break;
+		}
+		if (can_connect(pool, ep)) {
+			fd = pool_connect(FBR_A_ pool, ep, &tev);
+			if (-1 != fd)
+				pool->stats.misses++;
+			break;
+		}
+
+		if (0. == wait_start) {
+			wait_start = ev_now(fctx->__p->loop);
+			pool->stats.waits++;
+		}
+		fbr_ev_cond_var_init(FBR_A_ &ev, &ep->available, NULL);
+		fb_events[0] = &ev.ev_base;
+		fb_events[1] = &tev.ev_base;
+		if (-1 == fbr_ev_wait(FBR_A_ fb_events))
+			break;
+		if (!ev.ev_base.arrived) {
+			errno = ETIMEDOUT;
+			break;
+		}
+	}
+
+	saved_errno = errno;
+	if (0. != wait_start) {
+		waited = ev_now(fctx->__p->loop) - wait_start;
+		pool->stats.wait_time += waited;
+		pool->stats.max_wait_time = max(pool->stats.max_wait_time,
+				waited);
+	}
+	if (-1 != fd && -1 == set_owner(pool, fd, ep)) {
+		close_conn(FBR_A_ fd);
+		fd = -1;
+		saved_errno = ENOMEM;
+	}
+	errno = saved_errno;
+	if (-1 == fd) {
+		if (ETIMEDOUT == errno) {
+			pool->stats.timeouts++;
+			return_error(-1, FBR_ETIMEDOUT);
+		}
+		return_error(-1, FBR_ESYSTEM);
+	}
+
+	ep->nbusy++;
+	pool->stats.busy++;
+	return_success(fd);
+}
+
+int fbr_pool_checkin(FBR_P_ struct fbr_pool *pool, int fd, int reusable)
+{
+	struct fbr_pool_endpoint *ep = NULL;
+	struct fbr_pool_conn *conn = NULL;
+
+	if (fd >= 0 && fd < pool->owners_size)
+		ep = pool->owners[fd];
+	if (NULL == ep) {
+		errno = EINVAL;
+		return_error(-1, FBR_EINVAL);
+	}
+	pool->owners[fd] = NULL;
+	ep->nbusy--;
+	pool->stats.busy--;
+
+	if (reusable)
+		conn = malloc(sizeof(*conn));
+	if (NULL == conn) {
+		close_conn(FBR_A_ fd);
+		fbr_cond_signal(FBR_A_ &ep->available);
+		return_success(0);
+	}
+
+	conn->fd = fd;
+	conn->idle_since = ev_now(fctx->__p->loop);
+	TAILQ_INSERT_HEAD(&ep->idle, conn, entries);
+	ep->nidle++;
+	if (1 == ++pool->stats.idle)
+		fbr_cond_signal(FBR_A_ &pool->reaper_cond);
+	fbr_cond_signal(FBR_A_ &ep->available);
+	return_success(0);
+}
+
+void fbr_pool_get_stats(_unused_ FBR_P_ struct fbr_pool *pool,
+		struct fbr_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
+
+void fbr_pool_destroy(FBR_P_ struct fbr_pool *pool)
+{
+	struct fbr_pool_endpoint *ep, *ep_tmp;
+	struct fbr_pool_conn *conn, *conn_tmp;
+
+	if (!fbr_id_isnull(pool->reaper))
+		fbr_reclaim(FBR_A_ pool->reaper);
+
+	TAILQ_FOREACH_SAFE(ep, &pool->endpoints, entries, ep_tmp) {
+		TAILQ_FOREACH_SAFE(conn, &ep->idle, entries, conn_tmp) {
+			close_conn(FBR_A_ conn->fd);
+			free(conn);
+		}
+		fbr_cond_destroy(FBR_A_ &ep->available);
+		free(ep);
+	}
+	fbr_cond_destroy(FBR_A_ &pool->reaper_cond);
+	free(pool->owners);
+	free(pool);
+}
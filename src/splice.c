@@ -0,0 +1,277 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#define _GNU_SOURCE
+#include <evfibers/config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * In-kernel copying on the loop thread. The data never visits user space,
+ * and unlike fbr_eio_sendfile no thread pool round trip is needed when the
+ * destination socket can take the data right away. Reading the source file
+ * may still block on the disk, so it should be hot in the page cache.
+ */
+
+#ifdef HAVE_SENDFILE
+
+struct sendfile_args {
+	int in_fd;
+	off_t *offset;
+	size_t count;
+};
+
+static ssize_t call_sendfile(int fd, void *_arg)
+{
+	struct sendfile_args *arg = _arg;
+
+	return sendfile(fd, arg->in_fd, arg->offset, arg->count);
+}
+
+static ssize_t do_sendfile(FBR_P_ int out_fd, int in_fd, off_t *offset,
+		size_t count, int all)
+{
+	struct sendfile_args arg = {in_fd, offset, count};
+	size_t done = 0;
+	ssize_t retval;
+
+	do {
+		arg.count = count - done;
+		retval = fbr_io_call(FBR_A_ out_fd, EV_WRITE, 0, call_sendfile,
+				&arg, NULL);
+		if (-1 == retval)
+			return -1;
+		if (0 == retval)
+			break;
+		done += retval;
+	} while (all && done < count);
+	return done;
+}
+
+ssize_t fbr_sendfile(FBR_P_ int out_fd, int in_fd, off_t *offset,
+		size_t count)
+{
+	return do_sendfile(FBR_A_ out_fd, in_fd, offset, count, 0);
+}
+
+ssize_t fbr_sendfile_all(FBR_P_ int out_fd, int in_fd, off_t *offset,
+		size_t count)
+{
+	return do_sendfile(FBR_A_ out_fd, in_fd, offset, count, 1);
+}
+
+#endif
+
+#ifdef HAVE_SPLICE
+
+struct splice_args {
+	int fd_in;
+	loff_t *off_in;
+	int fd_out;
+	loff_t *off_out;
+	size_t len;
+	unsigned int flags;
+	/* The pipe end SPLICE_F_NONBLOCK applies to, and the event it needs */
+	int pipe_fd;
+	int pipe_events;
+	int pipe_busy;
+};
+
+static int pipe_ready(struct splice_args *arg)
+{
+	struct pollfd pfd;
+
+	pfd.fd = arg->pipe_fd;
+	pfd.events = EV_READ == arg->pipe_events ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+	return 0 != poll(&pfd, 1, 0);
+}
+
+/* EAGAIN comes from either end, waiting for the other end while the pipe is
+ * empty or full would spin, so such a failure is reported back as busy */
+static ssize_t splice_result(struct splice_args *arg, ssize_t retval)
+{
+	if (-1 == retval && EAGAIN == errno && !pipe_ready(arg)) {
+		arg->pipe_busy = 1;
+		return 0;
+	}
+	return retval;
+}
+
+static ssize_t call_splice(_unused_ int fd, void *_arg)
+{
+	struct splice_args *arg = _arg;
+
+	return splice_result(arg, splice(arg->fd_in, arg->off_in, arg->fd_out,
+				arg->off_out, arg->len,
+				arg->flags | SPLICE_F_NONBLOCK));
+}
+
+static ssize_t call_tee(_unused_ int fd, void *_arg)
+{
+	struct splice_args *arg = _arg;
+
+	return splice_result(arg, tee(arg->fd_in, arg->fd_out, arg->len,
+				arg->flags | SPLICE_F_NONBLOCK));
+}
+
+static ssize_t call_pipe_wait(_unused_ int fd, void *_arg)
+{
+	if (pipe_ready(_arg))
+		return 0;
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Moves one chunk, waiting for fd first and for the pipe end whenever it
+ * turns out to be the one not ready */
+static ssize_t splice_once(FBR_P_ struct splice_args *arg, int fd,
+		int events, fbr_io_call_t call)
+{
+	ssize_t retval;
+
+	for (;;) {
+		arg->pipe_busy = 0;
+		retval = fbr_io_call(FBR_A_ fd, events, 0, call, arg, NULL);
+		if (!arg->pipe_busy)
+			return retval;
+		retval = fbr_io_call(FBR_A_ arg->pipe_fd, arg->pipe_events, 0,
+				call_pipe_wait, arg, NULL);
+		if (-1 == retval)
+			return -1;
+	}
+}
+
+static int is_pipe(int fd)
+{
+	struct stat st;
+
+	if (-1 == fstat(fd, &st))
+		return 0;
+	return S_ISFIFO(st.st_mode);
+}
+
+/* One end of a splice is a pipe, the other one is what usually needs
+ * waiting for. SPLICE_F_NONBLOCK only covers the pipe, so the other end is
+ * tried first only if it is known not to block. */
+static ssize_t do_splice(FBR_P_ struct splice_args *arg, int all)
+{
+	size_t len = arg->len;
+	size_t done = 0;
+	ssize_t retval;
+	int fd, events;
+
+	if (is_pipe(arg->fd_in)) {
+		fd = arg->fd_out;
+		events = EV_WRITE;
+		arg->pipe_fd = arg->fd_in;
+		arg->pipe_events = EV_READ;
+	} else {
+		fd = arg->fd_in;
+		events = EV_READ;
+		arg->pipe_fd = arg->fd_out;
+		arg->pipe_events = EV_WRITE;
+	}
+
+	do {
+		arg->len = len - done;
+		retval = splice_once(FBR_A_ arg, fd, events, call_splice);
+		if (-1 == retval)
+			return -1;
+		if (0 == retval)
+			break;
+		done += retval;
+	} while (all && done < len);
+	return done;
+}
+
+ssize_t fbr_splice(FBR_P_ int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags)
+{
+	struct splice_args arg = {fd_in, off_in, fd_out, off_out, len, flags,
+		-1, 0, 0};
+
+	return do_splice(FBR_A_ &arg, 0);
+}
+
+ssize_t fbr_splice_all(FBR_P_ int fd_in, loff_t *off_in, int fd_out,
+		loff_t *off_out, size_t len, unsigned int flags)
+{
+	struct splice_args arg = {fd_in, off_in, fd_out, off_out, len, flags,
+		-1, 0, 0};
+
+	return do_splice(FBR_A_ &arg, 1);
+}
+
+ssize_t fbr_tee(FBR_P_ int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+	struct splice_args arg = {fd_in, NULL, fd_out, NULL, len, flags,
+		fd_out, EV_WRITE, 0};
+
+	return splice_once(FBR_A_ &arg, fd_in, EV_READ, call_tee);
+}
+
+#define PROXY_CHUNK (64 * 1024)
+
+ssize_t fbr_proxy(FBR_P_ int fd_in, int fd_out)
+{
+	int pipefd[2];
+	size_t total = 0;
+	ssize_t retval, moved;
+	int saved_errno;
+
+	if (-1 == pipe2(pipefd, O_NONBLOCK | O_CLOEXEC))
+		return -1;
+
+	for (;;) {
+		/* The pipe is always drained before the next chunk, so the
+		 * input side is the only one to wait for here */
+		moved = fbr_splice(FBR_A_ fd_in, NULL, pipefd[1], NULL,
+				PROXY_CHUNK, SPLICE_F_MOVE);
+		if (-1 == moved)
+			goto error;
+		if (0 == moved)
+			break;
+		retval = fbr_splice_all(FBR_A_ pipefd[0], NULL, fd_out, NULL,
+				moved, SPLICE_F_MOVE);
+		if (-1 == retval)
+			goto error;
+		total += retval;
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return total;
+
+error:
+	saved_errno = errno;
+	close(pipefd[0]);
+	close(pipefd[1]);
+	errno = saved_errno;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,295 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <evfibers/config.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * Buffered stream over a descriptor. Reads go to the descriptor in chunks of
+ * the buffer size, and the parsing functions pick requests out of the
+ * buffer, so a line costs a memchr over the bytes that arrived instead of a
+ * syscall per byte. Writes are collected in the write buffer and leave in
+ * one syscall once the fiber runs out of buffered input and is about to wait
+ * for more: a fiber serving pipelined requests answers all of them with a
+ * single write.
+ */
+
+int fbr_stream_init(FBR_P_ struct fbr_stream *stream, int fd, size_t size)
+{
+	if (fd < 0 || 0 == size)
+		return_error(-1, FBR_EINVAL);
+	memset(stream, 0x00, sizeof(*stream));
+	stream->fd = fd;
+	stream->rbuf = malloc(size);
+	stream->wbuf = malloc(size);
+	if (NULL == stream->rbuf || NULL == stream->wbuf) {
+		free(stream->rbuf);
+		free(stream->wbuf);
+		return_error(-1, FBR_ESYSTEM);
+	}
+	stream->size = size;
+	return_success(0);
+}
+
+void fbr_stream_destroy(_unused_ FBR_P_ struct fbr_stream *stream)
+{
+	free(stream->rbuf);
+	free(stream->wbuf);
+	stream->rbuf = NULL;
+	stream->wbuf = NULL;
+}
+
+int fbr_stream_flush(FBR_P_ struct fbr_stream *stream)
+{
+	size_t done = 0;
+	ssize_t retval = 0;
+
+	while (done < stream->wlen) {
+		retval = fbr_write(FBR_A_ stream->fd, stream->wbuf + done,
+				stream->wlen - done);
+		if (-1 == retval)
+			break;
+		done += retval;
+	}
+	/* Whatever made it out before an error must not be sent again by the
+	 * next flush */
+	if (done < stream->wlen)
+		memmove(stream->wbuf, stream->wbuf + done,
+				stream->wlen - done);
+	stream->wlen -= done;
+	return -1 == retval ? -1 : 0;
+}
+
+static size_t buffered(struct fbr_stream *stream)
+{
+	return stream->rend - stream->rstart;
+}
+
+/* Reads whatever is available into the read buffer, returns the number of
+ * bytes read, 0 at the end of file or -1 on error. The buffered writes are
+ * flushed first: chances are the peer waits for them before sending any
+ * more. */
+static ssize_t fill(FBR_P_ struct fbr_stream *stream)
+{
+	ssize_t retval;
+
+	if (stream->eof)
+		return 0;
+	if (-1 == fbr_stream_flush(FBR_A_ stream))
+		return -1;
+	if (stream->rstart > 0) {
+		memmove(stream->rbuf, stream->rbuf + stream->rstart,
+				stream->rend - stream->rstart);
+		stream->rend -= stream->rstart;
+		stream->rstart = 0;
+	}
+	retval = fbr_read(FBR_A_ stream->fd, stream->rbuf + stream->rend,
+			stream->size - stream->rend);
+	if (-1 == retval)
+		return -1;
+	if (0 == retval)
+		stream->eof = 1;
+	stream->rend += retval;
+	return retval;
+}
+
+static void take(struct fbr_stream *stream, void *buf, size_t count)
+{
+	memcpy(buf, stream->rbuf + stream->rstart, count);
+	stream->rstart += count;
+	if (stream->rstart == stream->rend) {
+		stream->rstart = 0;
+		stream->rend = 0;
+	}
+}
+
+ssize_t fbr_stream_read(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t count)
+{
+	ssize_t retval;
+
+	if (0 == count)
+		return 0;
+	if (0 == buffered(stream)) {
+		/* Nothing to gain from copying large reads through the
+		 * buffer */
+		if (count >= stream->size && !stream->eof) {
+			if (-1 == fbr_stream_flush(FBR_A_ stream))
+				return -1;
+			retval = fbr_read(FBR_A_ stream->fd, buf, count);
+			if (0 == retval)
+				stream->eof = 1;
+			return retval;
+		}
+		retval = fill(FBR_A_ stream);
+		if (retval <= 0)
+			return retval;
+	}
+	count = min(count, buffered(stream));
+	take(stream, buf, count);
+	return count;
+}
+
+ssize_t fbr_stream_read_exact(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t count)
+{
+	size_t done = 0;
+	size_t chunk;
+	ssize_t retval;
+
+	while (done < count) {
+		chunk = min(count - done, buffered(stream));
+		if (chunk > 0) {
+			take(stream, (char *)buf + done, chunk);
+			done += chunk;
+			continue;
+		}
+		if (count - done >= stream->size && !stream->eof) {
+			if (-1 == fbr_stream_flush(FBR_A_ stream))
+				return -1;
+			retval = fbr_read_all(FBR_A_ stream->fd,
+					(char *)buf + done, count - done);
+			if (-1 == retval)
+				return -1;
+			if ((size_t)retval < count - done)
+				stream->eof = 1;
+			done += retval;
+			break;
+		}
+		retval = fill(FBR_A_ stream);
+		if (-1 == retval)
+			return -1;
+		if (0 == retval)
+			break;
+	}
+	return done;
+}
+
+ssize_t fbr_stream_peek(FBR_P_ struct fbr_stream *stream, void **ptr,
+		size_t count)
+{
+	ssize_t retval;
+
+	if (count > stream->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (buffered(stream) < count) {
+		retval = fill(FBR_A_ stream);
+		if (-1 == retval)
+			return -1;
+		if (0 == retval)
+			break;
+	}
+	*ptr = stream->rbuf + stream->rstart;
+	return buffered(stream);
+}
+
+void fbr_stream_consume(_unused_ FBR_P_ struct fbr_stream *stream,
+		size_t count)
+{
+	count = min(count, buffered(stream));
+	stream->rstart += count;
+	if (stream->rstart == stream->rend) {
+		stream->rstart = 0;
+		stream->rend = 0;
+	}
+}
+
+ssize_t fbr_stream_read_until(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t n, int delim)
+{
+	char *out = buf;
+	size_t done = 0;
+	size_t scanned = 0;
+	size_t look;
+	char *found;
+	ssize_t retval;
+
+	if (0 == n || NULL == buf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Every byte is looked at once, and stays buffered until the line is
+	 * complete, so a failed read loses nothing. Only a read buffer full of
+	 * bytes without the delimiter has to move on to the caller buffer
+	 * early. */
+	while (done < n - 1) {
+		look = min(n - 1 - done, buffered(stream));
+		found = memchr(stream->rbuf + stream->rstart + scanned, delim,
+				look - scanned);
+		if (found) {
+			look = found - (stream->rbuf + stream->rstart) + 1;
+			take(stream, out + done, look);
+			done += look;
+			break;
+		}
+		scanned = look;
+		if (done + look == n - 1 || stream->eof) {
+			take(stream, out + done, look);
+			done += look;
+			break;
+		}
+		if (buffered(stream) == stream->size) {
+			take(stream, out + done, look);
+			done += look;
+			scanned = 0;
+		}
+		retval = fill(FBR_A_ stream);
+		if (-1 == retval) {
+			/* What has been handed over already is returned, the
+			 * error is up to the next read */
+			if (0 == done)
+				return -1;
+			break;
+		}
+	}
+	out[done] = '\0';
+	return done;
+}
+
+ssize_t fbr_stream_readline(FBR_P_ struct fbr_stream *stream, void *buf,
+		size_t n)
+{
+	return fbr_stream_read_until(FBR_A_ stream, buf, n, '\n');
+}
+
+ssize_t fbr_stream_write(FBR_P_ struct fbr_stream *stream, const void *buf,
+		size_t count)
+{
+	ssize_t retval;
+
+	if (stream->wlen + count > stream->size) {
+		if (-1 == fbr_stream_flush(FBR_A_ stream))
+			return -1;
+		if (count >= stream->size) {
+			retval = fbr_write_all(FBR_A_ stream->fd, buf, count);
+			if (-1 == retval)
+				return -1;
+			return count;
+		}
+	}
+	memcpy(stream->wbuf + stream->wlen, buf, count);
+	stream->wlen += count;
+	return count;
+}
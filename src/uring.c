@@ -0,0 +1,833 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <evfibers/config.h>
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * io_uring engine of the socket I/O wrappers. Instead of waiting for
+ * readiness and then doing the syscall, the operation itself is queued in the
+ * submission ring and the fiber parks until its completion shows up.
+ *
+ * Nothing is submitted right away: the queued entries are passed to the
+ * kernel in one io_uring_enter by a prepare watcher with the lowest priority,
+ * i.e. at the end of the loop iteration, after the ready queue has been
+ * drained and everyone has queued what they wanted. The watcher stays active
+ * all the time, one started by the drain would only be invoked by the next
+ * iteration, after the loop has blocked. The completion ring is
+ * watched by an ev_io on the ring descriptor, and every completion signals
+ * the fiber waiting for it.
+ *
+ * File operations of the eio wrappers go through the same ring when the
+ * kernel supports them, so that the reads, writes and stats of all the fibers
+ * blocked in an iteration are passed to the kernel in one go too, instead of
+ * one thread pool round trip each.
+ *
+ * The ring is used through the raw system calls, so only the kernel headers
+ * are needed to build it.
+ */
+
+#define URING_ENTRIES 256
+
+/* Completions of the poll requests that get linked in front of an operation
+ * on a non-blocking descriptor carry the request pointer with this bit set */
+#define URING_POLL_TAG 1
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static void uring_submit(struct fbr_uring *ring)
+{
+	int retval;
+
+	while (ring->unsubmitted > 0) {
+		retval = uring_enter(ring->fd, ring->unsubmitted, 0, 0);
+		if (-1 == retval) {
+			if (EINTR == errno)
+				continue;
+			/* EAGAIN or EBUSY: the completions have to be
+			 * reaped first, the prepare watcher retries */
+			return;
+		}
+		ring->unsubmitted -= retval;
+		if (0 == retval)
+			return;
+	}
+}
+
+static void uring_hold(struct fbr_uring *ring, unsigned count)
+{
+	/* The ring descriptor keeps the loop alive only while something is in
+	 * flight */
+	if (0 == ring->inflight)
+		ev_ref(ring->fctx->__p->loop);
+	ring->inflight += count;
+}
+
+static void uring_release(struct fbr_uring *ring)
+{
+	ring->inflight--;
+	if (0 == ring->inflight)
+		ev_unref(ring->fctx->__p->loop);
+}
+
+static void uring_reap(FBR_P_ struct fbr_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct fbr_uring_req *req;
+	unsigned head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		req = (struct fbr_uring_req *)(uintptr_t)cqe->user_data;
+		head++;
+		uring_release(ring);
+		/* Cancellations and linked polls are of no interest */
+		if (NULL == req || ((uintptr_t)req & URING_POLL_TAG))
+			continue;
+		req->res = cqe->res;
+		req->done = 1;
+		if (req->orphaned) {
+			LIST_REMOVE(req, orphans);
+			req->next_free = ring->free_reqs;
+			ring->free_reqs = req;
+			continue;
+		}
+		fbr_cond_signal(FBR_A_ &req->done_cond);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_io_cb(_unused_ EV_P_ ev_io *w, _unused_ int revents)
+{
+	struct fbr_uring *ring = w->data;
+
+	uring_reap(ring->fctx, ring);
+}
+
+static void uring_prepare_cb(_unused_ EV_P_ ev_prepare *w,
+		_unused_ int revents)
+{
+	struct fbr_uring *ring = w->data;
+
+	if (0 == ring->unsubmitted)
+		return;
+	uring_submit(ring);
+	/* Operations that could be done right away have completed by now */
+	uring_reap(ring->fctx, ring);
+}
+
+static struct io_uring_sqe *uring_sqe(struct fbr_uring *ring, unsigned index)
+{
+	return &ring->sqes[index & *ring->sq_mask];
+}
+
+/* Makes room for count zeroed submission entries, starting at the returned
+ * index, by submitting what has been queued so far if the ring is full.
+ * Entries of a link have to be reserved at once, so that the link is not
+ * split between two submissions. */
+static unsigned uring_reserve(FBR_P_ struct fbr_uring *ring, unsigned count)
+{
+	unsigned head, tail, i;
+
+	tail = *ring->sq_tail;
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	while (tail + count - head > ring->sq_entries) {
+		uring_submit(ring);
+		if (ring->unsubmitted > 0) {
+			/* The completion ring is full, make room in it */
+			uring_reap(FBR_A_ ring);
+			uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			uring_reap(FBR_A_ ring);
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	for (i = 0; i < count; i++)
+		memset(uring_sqe(ring, tail + i), 0x00,
+				sizeof(struct io_uring_sqe));
+	return tail;
+}
+
+static void uring_queue(struct fbr_uring *ring, unsigned count)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + count,
+			__ATOMIC_RELEASE);
+	ring->unsubmitted += count;
+	uring_hold(ring, count);
+}
+
+static struct fbr_uring_req *req_get(FBR_P_ struct fbr_uring *ring)
+{
+	struct fbr_uring_req *req;
+
+	req = ring->free_reqs;
+	if (req) {
+		ring->free_reqs = req->next_free;
+	} else {
+		req = malloc(sizeof(*req));
+		if (NULL == req)
+			return NULL;
+	}
+	req->done = 0;
+	req->orphaned = 0;
+	fbr_cond_init(FBR_A_ &req->done_cond);
+	return req;
+}
+
+static void req_put(struct fbr_uring *ring, struct fbr_uring_req *req)
+{
+	req->next_free = ring->free_reqs;
+	ring->free_reqs = req;
+}
+
+/* Asks the kernel to cancel the request along with the poll it may be linked
+ * to. The cancellation is submitted right away, so that an operation waiting
+ * for readiness does not touch its buffer anymore once this returns. */
+static void req_cancel(FBR_P_ struct fbr_uring *ring,
+		struct fbr_uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	index = uring_reserve(FBR_A_ ring, 2);
+	sqe = uring_sqe(ring, index);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)req | URING_POLL_TAG;
+	sqe = uring_sqe(ring, index + 1);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)req;
+	uring_queue(ring, 2);
+	uring_submit(ring);
+}
+
+static void req_orphan_dtor(FBR_P_ void *arg)
+{
+	struct fbr_uring_req *req = arg;
+
+	req->orphaned = 1;
+	LIST_INSERT_HEAD(&fctx->__p->uring->orphans, req, orphans);
+	req_cancel(FBR_A_ fctx->__p->uring, req);
+}
+
+/* Waits for the completion of req, returns its result. Once the timeout or
+ * the deadline of the fiber expires the request is cancelled, but the
+ * completion is still waited for, as the operation may have finished in the
+ * meantime, and it must not outlive the buffers it uses. */
+static int32_t req_wait(FBR_P_ struct fbr_uring *ring,
+		struct fbr_uring_req *req, struct fbr_ev_timeout *tev)
+{
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *fb_events[] = {NULL, NULL, NULL};
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	int32_t res;
+	int cancelled = 0;
+	int retval;
+
+	dtor.func = req_orphan_dtor;
+	dtor.arg = req;
+	fbr_destructor_add(FBR_A_ &dtor);
+	while (!req->done) {
+		fbr_ev_cond_var_init(FBR_A_ &ev, &req->done_cond, NULL);
+		fb_events[0] = &ev.ev_base;
+		fb_events[1] = (tev && !cancelled) ? &tev->ev_base : NULL;
+		if (cancelled)
+			CURRENT_FIBER->deadline.suppress++;
+		retval = fbr_ev_wait(FBR_A_ fb_events);
+		if (cancelled)
+			CURRENT_FIBER->deadline.suppress--;
+		if (req->done || cancelled)
+			continue;
+		if (-1 == retval || !ev.ev_base.arrived) {
+			req_cancel(FBR_A_ ring, req);
+			cancelled = 1;
+		}
+	}
+	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
+
+	res = req->res;
+	req_put(ring, req);
+	if (cancelled && -ECANCELED == res)
+		res = -ETIMEDOUT;
+	return res;
+}
+
+struct uring_op {
+	uint8_t opcode;
+	int fd;
+	const void *addr;
+	uint32_t len;
+	uint64_t off;
+	uint32_t op_flags;
+	short poll_events;
+};
+
+/* Submits the operation and waits for it. Non-blocking descriptors make the
+ * kernel fail the operation with EAGAIN instead of waiting for readiness, in
+ * which case it is resubmitted behind a linked poll. Operations without
+ * poll_events, i.e. the file ones, are never retried. */
+static ssize_t uring_call(FBR_P_ const struct uring_op *op,
+		struct fbr_ev_timeout *tev)
+{
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct fbr_uring_req *req;
+	struct io_uring_sqe *sqe;
+	unsigned index;
+	int linked = 0;
+	int32_t res;
+
+	for (;;) {
+		req = req_get(FBR_A_ ring);
+		if (NULL == req) {
+			errno = ENOMEM;
+			return -1;
+		}
+		index = uring_reserve(FBR_A_ ring, linked + 1);
+		if (linked) {
+			sqe = uring_sqe(ring, index++);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = op->fd;
+			sqe->poll_events = op->poll_events;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = (uintptr_t)req | URING_POLL_TAG;
+		}
+		sqe = uring_sqe(ring, index);
+		sqe->opcode = op->opcode;
+		sqe->fd = op->fd;
+		sqe->addr = (uintptr_t)op->addr;
+		sqe->len = op->len;
+		sqe->off = op->off;
+		if (IORING_OP_POLL_ADD == op->opcode)
+			sqe->poll_events = op->poll_events;
+		else
+			sqe->rw_flags = op->op_flags;
+		sqe->user_data = (uintptr_t)req;
+		uring_queue(ring, linked + 1);
+
+		res = req_wait(FBR_A_ ring, req, tev);
+		if ((-EAGAIN == res || -EINTR == res) && op->poll_events) {
+			linked = 1;
+			continue;
+		}
+		break;
+	}
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+ssize_t fbr_uring_read(FBR_P_ int fd, void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_READ,
+		.fd = fd,
+		.addr = buf,
+		.len = min(count, (size_t)INT32_MAX),
+		/* Current file position */
+		.off = (uint64_t)-1,
+		.poll_events = POLLIN,
+	};
+
+	return uring_call(FBR_A_ &op, tev);
+}
+
+ssize_t fbr_uring_write(FBR_P_ int fd, const void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_WRITE,
+		.fd = fd,
+		.addr = buf,
+		.len = min(count, (size_t)INT32_MAX),
+		.off = (uint64_t)-1,
+		.poll_events = POLLOUT,
+	};
+
+	return uring_call(FBR_A_ &op, tev);
+}
+
+ssize_t fbr_uring_read_all(FBR_P_ int fd, void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (count != done) {
+		r = fbr_uring_read(FBR_A_ fd, (char *)buf + done, count - done,
+				tev);
+		if (-1 == r)
+			return -1;
+		if (0 == r)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+ssize_t fbr_uring_write_all(FBR_P_ int fd, const void *buf, size_t count,
+		struct fbr_ev_timeout *tev)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (count != done) {
+		r = fbr_uring_write(FBR_A_ fd, (const char *)buf + done,
+				count - done, tev);
+		if (-1 == r)
+			return -1;
+		done += r;
+	}
+	return done;
+}
+
+ssize_t fbr_uring_recv(FBR_P_ int fd, void *buf, size_t len, int flags,
+		struct fbr_ev_timeout *tev)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_RECV,
+		.fd = fd,
+		.addr = buf,
+		.len = min(len, (size_t)INT32_MAX),
+		.op_flags = flags,
+		.poll_events = POLLIN,
+	};
+
+	return uring_call(FBR_A_ &op, tev);
+}
+
+ssize_t fbr_uring_send(FBR_P_ int fd, const void *buf, size_t len, int flags,
+		struct fbr_ev_timeout *tev)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_SEND,
+		.fd = fd,
+		.addr = buf,
+		.len = min(len, (size_t)INT32_MAX),
+		.op_flags = flags,
+		.poll_events = POLLOUT,
+	};
+
+	return uring_call(FBR_A_ &op, tev);
+}
+
+int fbr_uring_accept(FBR_P_ int fd, struct sockaddr *addr,
+		socklen_t *addrlen)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_ACCEPT,
+		.fd = fd,
+		.addr = addr,
+		/* addr2 shares the space with off */
+		.off = (uintptr_t)addrlen,
+		.poll_events = POLLIN,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+int fbr_uring_connect(FBR_P_ int fd, const struct sockaddr *addr,
+		socklen_t addrlen, struct fbr_ev_timeout *tev)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_CONNECT,
+		.fd = fd,
+		.addr = addr,
+		.off = addrlen,
+		.poll_events = POLLOUT,
+	};
+	struct uring_op poll_op = {
+		.opcode = IORING_OP_POLL_ADD,
+		.fd = fd,
+		.poll_events = POLLOUT,
+	};
+	socklen_t len;
+	int error;
+
+	if (0 == uring_call(FBR_A_ &op, tev))
+		return 0;
+	if (EINPROGRESS != errno)
+		return -1;
+
+	/* A non-blocking socket only starts connecting, the outcome is known
+	 * once it becomes writable */
+	if (-1 == uring_call(FBR_A_ &poll_op, tev))
+		return -1;
+	len = sizeof(error);
+	if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len))
+		return -1;
+	if (0 != error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int fbr_uring_open(FBR_P_ const char *path, int flags, mode_t mode)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_OPENAT,
+		.fd = AT_FDCWD,
+		.addr = path,
+		.len = mode,
+		/* open_flags share the space with rw_flags */
+		.op_flags = flags,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+ssize_t fbr_uring_pread(FBR_P_ int fd, void *buf, size_t count, off_t offset)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_READ,
+		.fd = fd,
+		.addr = buf,
+		.len = min(count, (size_t)INT32_MAX),
+		/* Negative offset means the file position, as with eio */
+		.off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+ssize_t fbr_uring_pwrite(FBR_P_ int fd, const void *buf, size_t count,
+		off_t offset)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_WRITE,
+		.fd = fd,
+		.addr = buf,
+		.len = min(count, (size_t)INT32_MAX),
+		.off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+/* The iovec array is copied by the kernel at submission, the flags are the
+ * RWF_* ones of preadv2 and pwritev2 */
+ssize_t fbr_uring_preadv(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_READV,
+		.fd = fd,
+		.addr = iov,
+		.len = iovcnt,
+		.off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset,
+		.op_flags = flags,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+ssize_t fbr_uring_pwritev(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		off_t offset, int flags)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_WRITEV,
+		.fd = fd,
+		.addr = iov,
+		.len = iovcnt,
+		.off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset,
+		.op_flags = flags,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+int fbr_uring_fsync(FBR_P_ int fd, int datasync)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_FSYNC,
+		.fd = fd,
+		.op_flags = datasync ? IORING_FSYNC_DATASYNC : 0,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+int fbr_uring_fallocate(FBR_P_ int fd, int mode, off_t offset, off_t len)
+{
+	struct uring_op op = {
+		.opcode = IORING_OP_FALLOCATE,
+		.fd = fd,
+		/* The length is passed in addr, the mode in len */
+		.addr = (const void *)(uintptr_t)len,
+		.len = mode,
+		.off = offset,
+	};
+
+	return uring_call(FBR_A_ &op, NULL);
+}
+
+static int uring_statx(FBR_P_ int dirfd, const char *path, int flags,
+		struct stat *buf)
+{
+	struct statx stx;
+	struct uring_op op = {
+		.opcode = IORING_OP_STATX,
+		.fd = dirfd,
+		.addr = path,
+		.len = STATX_BASIC_STATS,
+		/* The statx buffer is passed in addr2, i.e. off */
+		.off = (uintptr_t)&stx,
+		.op_flags = flags,
+	};
+
+	if (-1 == uring_call(FBR_A_ &op, NULL))
+		return -1;
+	memset(buf, 0x00, sizeof(*buf));
+	buf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	buf->st_ino = stx.stx_ino;
+	buf->st_mode = stx.stx_mode;
+	buf->st_nlink = stx.stx_nlink;
+	buf->st_uid = stx.stx_uid;
+	buf->st_gid = stx.stx_gid;
+	buf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	buf->st_size = stx.stx_size;
+	buf->st_blksize = stx.stx_blksize;
+	buf->st_blocks = stx.stx_blocks;
+	buf->st_atim.tv_sec = stx.stx_atime.tv_sec;
+	buf->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	buf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	buf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	buf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	buf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	return 0;
+}
+
+int fbr_uring_stat(FBR_P_ const char *path, int follow, struct stat *buf)
+{
+	return uring_statx(FBR_A_ AT_FDCWD, path,
+			follow ? 0 : AT_SYMLINK_NOFOLLOW, buf);
+}
+
+int fbr_uring_fstat(FBR_P_ int fd, struct stat *buf)
+{
+	return uring_statx(FBR_A_ fd, "", AT_EMPTY_PATH, buf);
+}
+
+int fbr_uring_files_enabled(FBR_P)
+{
+	return fctx->__p->uring && fctx->__p->uring->files;
+}
+
+static int uring_probe(int fd, const uint8_t *needed, size_t count)
+
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	unsigned i;
+	int retval;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (NULL == probe)
+		return 0;
+	retval = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			probe, 256);
+	for (i = 0; 0 == retval && i < count; i++) {
+		if (needed[i] > probe->last_op ||
+				!(probe->ops[needed[i]].flags &
+					IO_URING_OP_SUPPORTED))
+			retval = -1;
+	}
+	free(probe);
+	return 0 == retval;
+}
+
+static const uint8_t socket_ops[] = {
+	IORING_OP_READ, IORING_OP_WRITE, IORING_OP_RECV, IORING_OP_SEND,
+	IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_POLL_ADD,
+	IORING_OP_ASYNC_CANCEL,
+};
+
+static const uint8_t file_ops[] = {
+	IORING_OP_OPENAT, IORING_OP_FSYNC, IORING_OP_FALLOCATE,
+	IORING_OP_STATX, IORING_OP_READV, IORING_OP_WRITEV,
+};
+
+static void uring_unmap(struct fbr_uring *ring)
+{
+	if (ring->sqes && MAP_FAILED != ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && MAP_FAILED != ring->cq_ring &&
+			ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && MAP_FAILED != ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+int fbr_uring_init(FBR_P)
+{
+	struct fbr_uring *ring;
+	struct io_uring_params params;
+	char *sq, *cq;
+	unsigned i;
+	int saved_errno;
+
+	ring = calloc(1, sizeof(*ring));
+	if (NULL == ring)
+		return_error(-1, FBR_ESYSTEM);
+	ring->fctx = fctx;
+
+	memset(&params, 0x00, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (-1 == ring->fd) {
+		free(ring);
+		return_error(-1, FBR_ESYSTEM);
+	}
+	/* Completions must not be dropped, otherwise a fiber would wait for
+	 * its one forever */
+	if (!(params.features & IORING_FEAT_NODROP) ||
+			!uring_probe(ring->fd, socket_ops,
+				sizeof(socket_ops))) {
+		errno = ENOSYS;
+		goto error;
+	}
+
+	/* The file operations are optional, the eio wrappers fall back to the
+	 * thread pool without them */
+	ring->files = uring_probe(ring->fd, file_ops, sizeof(file_ops));
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size,
+				ring->cq_ring_size);
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring)
+		goto error;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+	if (MAP_FAILED == ring->cq_ring)
+		goto error;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes)
+		goto error;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	/* Submission entries are always queued in order */
+	for (i = 0; i < ring->sq_entries; i++)
+		ring->sq_array[i] = i;
+	LIST_INIT(&ring->orphans);
+
+	ev_io_init(&ring->io, uring_io_cb, ring->fd, EV_READ);
+	ring->io.data = ring;
+	ev_io_start(fctx->__p->loop, &ring->io);
+	ev_unref(fctx->__p->loop);
+	ev_prepare_init(&ring->prepare, uring_prepare_cb);
+	ring->prepare.data = ring;
+	/* Runs after the ready queue drain, see above */
+	ev_set_priority(&ring->prepare, EV_MINPRI);
+	ev_prepare_start(fctx->__p->loop, &ring->prepare);
+	ev_unref(fctx->__p->loop);
+
+	fctx->__p->uring = ring;
+	return_success(0);
+
+error:
+	saved_errno = errno;
+	uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	errno = saved_errno;
+	return_error(-1, FBR_ESYSTEM);
+}
+
+void fbr_uring_destroy(FBR_P)
+{
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct fbr_uring_req *req;
+
+	if (NULL == ring)
+		return;
+	if (0 == ring->inflight)
+		ev_ref(fctx->__p->loop);
+	ev_ref(fctx->__p->loop);
+	ev_prepare_stop(fctx->__p->loop, &ring->prepare);
+	ev_io_stop(fctx->__p->loop, &ring->io);
+	/* Closing the ring cancels whatever is still in flight */
+	uring_unmap(ring);
+	close(ring->fd);
+	while ((req = LIST_FIRST(&ring->orphans))) {
+		LIST_REMOVE(req, orphans);
+		free(req);
+	}
+	while ((req = ring->free_reqs)) {
+		ring->free_reqs = req->next_free;
+		free(req);
+	}
+	free(ring);
+	fctx->__p->uring = NULL;
+}
+
+#endif
@@ -0,0 +1,329 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <evfibers/config.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * Hierarchical timer wheel (see G. Varghese and T. Lauck, "Hashed and
+ * Hierarchical Timing Wheels"). Time is counted in ticks of `slack' seconds
+ * since the wheel base. Level 0 has a slot per tick for the next
+ * FBR_WHEEL_SLOTS ticks, each next level has slots FBR_WHEEL_SLOTS times
+ * wider. Whenever the time crosses the boundary of a slot on the upper level,
+ * the slot is cascaded: its nodes are put back into the wheel and land on the
+ * finer levels. Both arming and disarming a node are O(1).
+ *
+ * Occupancy bitmaps allow to find the next tick that has anything to do
+ * without walking the slots, so the whole wheel is driven by a single libev
+ * timer, which is armed for that tick.
+ */
+
+#define LEVEL_SHIFT(level) ((level) * FBR_WHEEL_BITS)
+#define SLOT_MASK ((uint64_t)FBR_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((UINT64_C(1) << LEVEL_SHIFT(FBR_WHEEL_LEVELS)) - 1)
+#define NO_TICK UINT64_MAX
+
+static uint64_t deadline_to_tick(struct fbr_wheel *wheel, ev_tstamp deadline)
+{
+	ev_tstamp ticks = (deadline - wheel->base) / wheel->slack;
+	uint64_t tick;
+
+	if (ticks <= 0.)
+		return 0;
+	if (ticks >= (ev_tstamp)(UINT64_C(1) << 62))
+		return UINT64_C(1) << 62;
+	tick = ticks;
+	/* Round up: a node must never expire before its deadline */
+	if ((ev_tstamp)tick < ticks)
+		tick++;
+	return tick;
+}
+
+static uint64_t now_to_tick(struct fbr_wheel *wheel, ev_tstamp now)
+{
+	/* A tiny bias compensates the rounding error of the timer arithmetic,
+	 * otherwise a timer fired right at the tick may miss it */
+	ev_tstamp ticks = (now - wheel->base) / wheel->slack + 1e-6;
+
+	if (ticks <= 0.)
+		return 0;
+	return ticks;
+}
+
+static void place(struct fbr_wheel *wheel, struct fbr_wheel_node *node)
+{
+	uint64_t at = node->expires;
+	uint64_t delta;
+	unsigned level;
+	unsigned slot;
+
+	if (at <= wheel->now)
+		at = wheel->now + 1;
+	delta = at - wheel->now;
+	if (delta > MAX_DELTA) {
+		/* Too far away, will be cascaded and placed again */
+		delta = MAX_DELTA;
+		at = wheel->now + MAX_DELTA;
+	}
+	for (level = 0; level < FBR_WHEEL_LEVELS - 1; level++)
+		if (delta < (UINT64_C(1) << LEVEL_SHIFT(level + 1)))
+			break;
+	slot = (at >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+	LIST_INSERT_HEAD(&wheel->slots[level][slot], node, entries);
+	wheel->occupied[level] |= UINT64_C(1) << slot;
+	node->level = level;
+	node->slot = slot;
+}
+
+static void unplace(struct fbr_wheel *wheel, struct fbr_wheel_node *node)
+{
+	LIST_REMOVE(node, entries);
+	if (LIST_EMPTY(&wheel->slots[node->level][node->slot]))
+		wheel->occupied[node->level] &= ~(UINT64_C(1) << node->slot);
+}
+
+/* Returns the nearest tick past the current one at which some slot is either
+ * due to expire or to be cascaded */
+static uint64_t next_tick(struct fbr_wheel *wheel)
+{
+	uint64_t next = NO_TICK;
+	uint64_t unit;
+	uint64_t first;
+	uint64_t occupied;
+	uint64_t tick;
+	unsigned idx;
+	unsigned level;
+
+	for (level = 0; level < FBR_WHEEL_LEVELS; level++) {
+		occupied = wheel->occupied[level];
+		if (0 == occupied)
+			continue;
+		unit = UINT64_C(1) << LEVEL_SHIFT(level);
+		first = (wheel->now | (unit - 1)) + 1;
+		idx = (first >> LEVEL_SHIFT(level)) & SLOT_MASK;
+		if (idx)
+			occupied = (occupied >> idx) |
+				(occupied << (FBR_WHEEL_SLOTS - idx));
+		tick = first + __builtin_ctzll(occupied) * unit;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+static void cascade(struct fbr_wheel *wheel, unsigned level, unsigned slot)
+{
+	struct fbr_wheel_slot list;
+	struct fbr_wheel_node *node;
+
+	if (LIST_EMPTY(&wheel->slots[level][slot]))
+		return;
+	LIST_INIT(&list);
+	while (!LIST_EMPTY(&wheel->slots[level][slot])) {
+		node = LIST_FIRST(&wheel->slots[level][slot]);
+		LIST_REMOVE(node, entries);
+		LIST_INSERT_HEAD(&list, node, entries);
+	}
+	wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+	while (!LIST_EMPTY(&list)) {
+		node = LIST_FIRST(&list);
+		LIST_REMOVE(node, entries);
+		place(wheel, node);
+	}
+}
+
+static void run_tick(FBR_P_ uint64_t tick)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	struct fbr_wheel_slot *slot;
+	struct fbr_wheel_node *node;
+	int level;
+
+	/* Nothing happens in between, so the wheel may jump right before the
+	 * tick. Cascaded nodes are placed relative to it, thus the ones that
+	 * expire at the tick land in level 0 and are run below. */
+	wheel->now = tick - 1;
+	/* Upper levels go first so that their nodes have a chance to fall
+	 * through the lower levels before these get cascaded */
+	for (level = FBR_WHEEL_LEVELS - 1; level > 0; level--) {
+		if (tick & ((UINT64_C(1) << LEVEL_SHIFT(level)) - 1))
+			continue;
+		cascade(wheel, level,
+				(tick >> LEVEL_SHIFT(level)) & SLOT_MASK);
+	}
+
+	wheel->now = tick;
+	slot = &wheel->slots[0][tick & SLOT_MASK];
+	while (!LIST_EMPTY(slot)) {
+		node = LIST_FIRST(slot);
+		assert(node->expires <= tick);
+		unplace(wheel, node);
+		node->armed = 0;
+		wheel->count--;
+		node->cb(FBR_A_ node);
+	}
+}
+
+static void advance(FBR_P_ uint64_t target)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	uint64_t tick;
+
+	while (wheel->count > 0) {
+		tick = next_tick(wheel);
+		if (tick > target)
+			break;
+		run_tick(FBR_A_ tick);
+	}
+	if (target > wheel->now)
+		wheel->now = target;
+}
+
+static void rearm(FBR_P)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	uint64_t tick;
+	ev_tstamp after;
+
+	if (0 == wheel->count) {
+		ev_timer_stop(fctx->__p->loop, &wheel->timer);
+		return;
+	}
+	tick = next_tick(wheel);
+	if (ev_is_active(&wheel->timer) && tick == wheel->armed)
+		return;
+	wheel->armed = tick;
+	after = wheel->base + tick * wheel->slack -
+		ev_now(fctx->__p->loop);
+	ev_timer_stop(fctx->__p->loop, &wheel->timer);
+	ev_timer_set(&wheel->timer, max(after, 0.), 0.);
+	ev_timer_start(fctx->__p->loop, &wheel->timer);
+}
+
+static void wheel_timer_cb(EV_P_ ev_timer *w, _unused_ int revents)
+{
+	struct fbr_context *fctx = w->data;
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	uint64_t target;
+
+	ENSURE_ROOT_FIBER;
+
+	/* libev timers run on the monotonic clock, so the armed tick is known
+	 * to be due even if the wall clock has been stepped back */
+	target = max(now_to_tick(wheel, ev_now(EV_A)), wheel->armed);
+	advance(FBR_A_ target);
+	rearm(FBR_A);
+}
+
+void fbr_wheel_init(FBR_P)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	unsigned level, slot;
+
+	for (level = 0; level < FBR_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FBR_WHEEL_SLOTS; slot++)
+			LIST_INIT(&wheel->slots[level][slot]);
+		wheel->occupied[level] = 0;
+	}
+	wheel->now = 0;
+	wheel->armed = 0;
+	wheel->base = ev_now(fctx->__p->loop);
+	wheel->slack = FBR_TIMER_SLACK;
+	wheel->count = 0;
+	ev_timer_init(&wheel->timer, wheel_timer_cb, 0., 0.);
+	wheel->timer.data = fctx;
+}
+
+void fbr_wheel_destroy(FBR_P)
+{
+	ev_timer_stop(fctx->__p->loop, &fctx->__p->wheel.timer);
+}
+
+void fbr_wheel_add(FBR_P_ struct fbr_wheel_node *node, ev_tstamp deadline)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+
+	assert(!node->armed);
+	/* Catch up with the time passed since the last expiration, so that
+	 * the node is placed relative to the actual current tick */
+	if (0 == wheel->count)
+		wheel->now = max(wheel->now,
+				now_to_tick(wheel, ev_now(fctx->__p->loop)));
+	node->deadline = deadline;
+	node->expires = deadline_to_tick(wheel, deadline);
+	node->armed = 1;
+	place(wheel, node);
+	wheel->count++;
+	rearm(FBR_A);
+}
+
+void fbr_wheel_del(FBR_P_ struct fbr_wheel_node *node)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+
+	if (!node->armed)
+		return;
+	unplace(wheel, node);
+	node->armed = 0;
+	wheel->count--;
+	if (0 == wheel->count)
+		ev_timer_stop(fctx->__p->loop, &wheel->timer);
+}
+
+int fbr_set_timer_slack(FBR_P_ ev_tstamp slack)
+{
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	struct fbr_wheel_slot list;
+	struct fbr_wheel_node *node;
+	unsigned level, slot;
+
+	if (slack <= 0.)
+		return_error(-1, FBR_EINVAL);
+
+	LIST_INIT(&list);
+	for (level = 0; level < FBR_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FBR_WHEEL_SLOTS; slot++) {
+			while (!LIST_EMPTY(&wheel->slots[level][slot])) {
+				node = LIST_FIRST(&wheel->slots[level][slot]);
+				LIST_REMOVE(node, entries);
+				LIST_INSERT_HEAD(&list, node, entries);
+			}
+		}
+		wheel->occupied[level] = 0;
+	}
+
+	wheel->slack = slack;
+	wheel->base = ev_now(fctx->__p->loop);
+	wheel->now = 0;
+	while (!LIST_EMPTY(&list)) {
+		node = LIST_FIRST(&list);
+		LIST_REMOVE(node, entries);
+		node->expires = deadline_to_tick(wheel, node->deadline);
+		place(wheel, node);
+	}
+	if (wheel->count > 0) {
+		ev_timer_stop(fctx->__p->loop, &wheel->timer);
+		rearm(FBR_A);
+	}
+	return_success(0);
+}
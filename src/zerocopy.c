@@ -0,0 +1,348 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#define _GNU_SOURCE
+#include <evfibers/config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef HAVE_MSG_ZEROCOPY
+#include <time.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include <evfibers_private/fiber.h>
+
+/*
+ * MSG_ZEROCOPY sends. The kernel numbers every successful zerocopy send call
+ * on a socket, starting from zero, and reports ranges of these numbers on
+ * the error queue of the socket once it is done with the buffers. A request
+ * remembers the range of its own calls and is released when all of them are
+ * reported.
+ *
+ * The error queue is drained whenever the persistent watcher of the socket
+ * fires, before every zerocopy send, and by a reaper timer that runs while
+ * there are requests pending, as readiness of the error queue is only
+ * delivered to an active watcher.
+ */
+
+#define REAPER_INTERVAL 0.001
+
+void fbr_set_zc_threshold(FBR_P_ size_t threshold)
+{
+	fctx->__p->zc_threshold = threshold;
+}
+
+void fbr_zc_init(_unused_ FBR_P_ struct fbr_zc *zc,
+		fbr_zc_release_func_t func, void *arg)
+{
+	memset(zc, 0x00, sizeof(*zc));
+	zc->func = func;
+	zc->arg = arg;
+	zc->released = 1;
+}
+
+static void release(FBR_P_ struct fbr_zc *zc)
+{
+	zc->released = 1;
+	if (zc->func)
+		zc->func(FBR_A_ zc, zc->arg);
+}
+
+static void release_all(FBR_P_ struct fbr_zc_socket *zcs,
+		struct fbr_zc_tailq *released)
+{
+	struct fbr_zc *zc;
+
+	if (TAILQ_EMPTY(released))
+		return;
+	if (TAILQ_EMPTY(&zcs->pending))
+		ev_timer_stop(fctx->__p->loop, &zcs->reaper);
+	/* The callbacks may send more, so they are only called once the
+	 * pending list is consistent */
+	while (!TAILQ_EMPTY(released)) {
+		zc = TAILQ_FIRST(released);
+		TAILQ_REMOVE(released, zc, entries);
+		release(FBR_A_ zc);
+	}
+	fbr_cond_broadcast(FBR_A_ &zcs->released);
+}
+
+#ifdef HAVE_MSG_ZEROCOPY
+
+/* Serial number comparison, the counter wraps around */
+static int seq_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+static void complete(struct fbr_zc_socket *zcs, uint32_t lo, uint32_t hi,
+		int copied, struct fbr_zc_tailq *released)
+{
+	struct fbr_zc *zc, *next;
+	uint32_t from, to;
+
+	for (zc = TAILQ_FIRST(&zcs->pending); zc; zc = next) {
+		next = TAILQ_NEXT(zc, entries);
+		from = seq_before(lo, zc->first) ? zc->first : lo;
+		to = seq_before(zc->last, hi) ? zc->last : hi;
+		if (seq_before(to, from))
+			continue;
+		zc->pending -= to - from + 1;
+		if (copied)
+			zc->copied = 1;
+		if (0 == zc->pending) {
+			TAILQ_REMOVE(&zcs->pending, zc, entries);
+			TAILQ_INSERT_TAIL(released, zc, entries);
+		}
+	}
+}
+
+void fbr_zc_drain(FBR_P_ struct fbr_fd_entry *entry)
+{
+	struct fbr_zc_socket *zcs = entry->zc;
+	struct fbr_zc_tailq released;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	char control[128];
+	ssize_t retval;
+
+	if (NULL == zcs || TAILQ_EMPTY(&zcs->pending))
+		return;
+	TAILQ_INIT(&released);
+	for (;;) {
+		memset(&msg, 0x00, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		retval = recvmsg(entry->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (-1 == retval) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(SOL_IP == cmsg->cmsg_level &&
+						IP_RECVERR == cmsg->cmsg_type) &&
+					!(SOL_IPV6 == cmsg->cmsg_level &&
+						IPV6_RECVERR ==
+						cmsg->cmsg_type))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin ||
+					0 != serr->ee_errno)
+				continue;
+			complete(zcs, serr->ee_info, serr->ee_data,
+					serr->ee_code &
+					SO_EE_CODE_ZEROCOPY_COPIED,
+					&released);
+		}
+	}
+	release_all(FBR_A_ zcs, &released);
+}
+
+static int try_enable(int fd)
+{
+	int one = 1;
+
+	return 0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+#else
+
+void fbr_zc_drain(_unused_ FBR_P_ _unused_ struct fbr_fd_entry *entry)
+{
+}
+
+static int try_enable(_unused_ int fd)
+{
+	return 0;
+}
+
+#endif
+
+static void reaper_cb(_unused_ EV_P_ ev_timer *w, _unused_ int revents)
+{
+	struct fbr_fd_entry *entry = w->data;
+	struct fbr_context *fctx = entry->fctx;
+
+	fbr_zc_drain(FBR_A_ entry);
+}
+
+static struct fbr_zc_socket *get_socket(FBR_P_ struct fbr_fd_entry *entry)
+{
+	struct fbr_zc_socket *zcs = entry->zc;
+	struct stat st;
+
+	if (NULL == zcs) {
+		zcs = calloc(1, sizeof(*zcs));
+		if (NULL == zcs)
+			return NULL;
+		if (0 == fstat(entry->fd, &st)) {
+			zcs->dev = st.st_dev;
+			zcs->ino = st.st_ino;
+		}
+		TAILQ_INIT(&zcs->pending);
+		fbr_cond_init(FBR_A_ &zcs->released);
+		ev_timer_init(&zcs->reaper, reaper_cb, REAPER_INTERVAL,
+				REAPER_INTERVAL);
+		zcs->reaper.data = entry;
+		entry->zc = zcs;
+	}
+	if (!zcs->probed) {
+		/* The kernel numbers the sends per socket, so the numbering
+		 * only goes on if the descriptor is still the same socket */
+		if (0 == fstat(entry->fd, &st) && (st.st_dev != zcs->dev ||
+					st.st_ino != zcs->ino)) {
+			fbr_zc_socket_destroy(FBR_A_ entry);
+			return get_socket(FBR_A_ entry);
+		}
+		zcs->enabled = try_enable(entry->fd);
+		zcs->probed = 1;
+	}
+	return zcs;
+}
+
+/* Releases whatever is still pending, the descriptor is about to go. The
+ * kernel has not reported these yet, so they are marked aborted. The send
+ * numbering is kept, as the socket may be registered again. */
+void fbr_zc_socket_reset(FBR_P_ struct fbr_fd_entry *entry)
+{
+	struct fbr_zc_socket *zcs = entry->zc;
+	struct fbr_zc_tailq released;
+	struct fbr_zc *zc;
+
+	if (NULL == zcs)
+		return;
+	fbr_zc_drain(FBR_A_ entry);
+	TAILQ_FOREACH(zc, &zcs->pending, entries)
+		zc->aborted = 1;
+	TAILQ_INIT(&released);
+	TAILQ_CONCAT(&released, &zcs->pending, entries);
+	ev_timer_stop(fctx->__p->loop, &zcs->reaper);
+	release_all(FBR_A_ zcs, &released);
+	zcs->probed = 0;
+}
+
+void fbr_zc_socket_destroy(FBR_P_ struct fbr_fd_entry *entry)
+{
+	if (NULL == entry->zc)
+		return;
+	fbr_zc_socket_reset(FBR_A_ entry);
+	fbr_cond_destroy(FBR_A_ &entry->zc->released);
+	free(entry->zc);
+	entry->zc = NULL;
+}
+
+struct send_args {
+	const char *buf;
+	size_t len;
+	int flags;
+};
+
+static ssize_t call_send(int fd, void *_arg)
+{
+	struct send_args *arg = _arg;
+
+	return send(fd, arg->buf, arg->len, arg->flags | MSG_DONTWAIT);
+}
+
+ssize_t fbr_send_zc(FBR_P_ int sockfd, const void *buf, size_t len,
+		int flags, struct fbr_zc *zc)
+{
+	struct fbr_fd_entry *entry;
+	struct fbr_zc_socket *zcs;
+	struct send_args arg;
+	size_t done = 0;
+	ssize_t retval = 0;
+	int zerocopy;
+
+	entry = fbr_fd_lookup(FBR_A_ sockfd);
+	if (NULL == entry) {
+		errno = EINVAL;
+		return_error(-1, FBR_EINVAL);
+	}
+	zcs = get_socket(FBR_A_ entry);
+	if (NULL == zcs) {
+		errno = ENOMEM;
+		return_error(-1, FBR_ESYSTEM);
+	}
+
+	zc->released = 0;
+	zc->copied = 0;
+	zc->aborted = 0;
+	zc->pending = 0;
+	zerocopy = zcs->enabled && len >= fctx->__p->zc_threshold;
+	if (zerocopy)
+		/* Completions free the socket memory the kernel accounts
+		 * zerocopy buffers against */
+		fbr_zc_drain(FBR_A_ entry);
+
+	while (done < len) {
+		arg.buf = (const char *)buf + done;
+		arg.len = len - done;
+		arg.flags = flags;
+#ifdef HAVE_MSG_ZEROCOPY
+		if (zerocopy)
+			arg.flags |= MSG_ZEROCOPY;
+#endif
+		retval = fbr_io_call(FBR_A_ sockfd, EV_WRITE, 1, call_send,
+				&arg, NULL);
+		if (-1 == retval && zerocopy && ENOBUFS == errno) {
+			/* Out of the locked memory allowance, copy the rest */
+			zerocopy = 0;
+			continue;
+		}
+		if (-1 == retval)
+			break;
+		if (zerocopy) {
+			if (0 == zc->pending)
+				zc->first = zcs->next_seq;
+			zc->last = zcs->next_seq++;
+			zc->pending++;
+		}
+		done += retval;
+	}
+
+	if (zc->pending) {
+		/* Even after a failure, the part that went out is still
+		 * referenced by the kernel */
+		TAILQ_INSERT_TAIL(&zcs->pending, zc, entries);
+		zc->socket = zcs;
+		if (!ev_is_active(&zcs->reaper))
+			ev_timer_start(fctx->__p->loop, &zcs->reaper);
+	} else {
+		zc->copied = 1;
+		release(FBR_A_ zc);
+	}
+	if (-1 == retval)
+		return_error(-1, FBR_ESYSTEM);
+	return_success(len);
+}
+
+int fbr_zc_wait(FBR_P_ struct fbr_zc *zc)
+{
+	while (!zc->released)
+		if (-1 == fbr_cond_wait(FBR_A_ &zc->socket->released, NULL))
+			return -1;
+	return_success(0);
+}
@@ -0,0 +1,238 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "chan.h"
+
+#define PRODUCER_COUNT 4
+#define PRODUCER_ITEMS 100000
+
+START_TEST(test_chan_basic)
+{
+	struct fbr_context context;
+	struct fbr_chan *chan;
+	void *obj;
+	int retval;
+	uintptr_t i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	chan = fbr_chan_create(&context, 0);
+	fail_unless(NULL == chan, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+
+	chan = fbr_chan_create(&context, 3);
+	fail_if(NULL == chan, NULL);
+	retval = fbr_chan_try_recv(chan, &obj);
+	fail_unless(-1 == retval, NULL);
+	/* Capacity is rounded up to 4 */
+	for (i = 0; i < 4; i++) {
+		retval = fbr_chan_send(chan, (void *)i);
+		fail_unless(0 == retval, NULL);
+	}
+	retval = fbr_chan_send(chan, (void *)i);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(EAGAIN == errno, NULL);
+	for (i = 0; i < 4; i++) {
+		retval = fbr_chan_try_recv(chan, &obj);
+		fail_unless(0 == retval, NULL);
+		fail_unless(i == (uintptr_t)obj, NULL);
+	}
+	retval = fbr_chan_try_recv(chan, &obj);
+	fail_unless(-1 == retval, NULL);
+
+	/* Idle channel should not keep the loop running */
+	ev_run(EV_DEFAULT, 0);
+
+	fbr_chan_destroy(chan);
+	fbr_destroy(&context);
+}
+END_TEST
+
+struct producer_arg {
+	struct fbr_chan *chan;
+	uintptr_t id;
+};
+
+static void *producer_thread(void *_arg)
+{
+	struct producer_arg *arg = _arg;
+	uintptr_t i;
+	void *obj;
+
+	for (i = 0; i < PRODUCER_ITEMS; i++) {
+		obj = (void *)((arg->id << 24) | i);
+		while (fbr_chan_send(arg->chan, obj))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void consumer_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_chan *chan = _arg;
+	uintptr_t next[PRODUCER_COUNT] = {0};
+	void *objs[64];
+	uintptr_t value, id;
+	size_t count, i, total = 0;
+
+	while (total < PRODUCER_COUNT * PRODUCER_ITEMS) {
+		count = fbr_chan_recv_many(chan, objs, 64);
+		fail_unless(count > 0 && count <= 64, NULL);
+		for (i = 0; i < count; i++) {
+			value = (uintptr_t)objs[i];
+			id = value >> 24;
+			fail_unless(id < PRODUCER_COUNT, NULL);
+			/* Per-producer order is preserved */
+			fail_unless(next[id] == (value & 0xffffff), NULL);
+			next[id]++;
+		}
+		total += count;
+	}
+	ev_break(fctx->__p->loop, EVBREAK_ALL);
+}
+
+START_TEST(test_chan_threads)
+{
+	struct fbr_context context;
+	struct fbr_chan *chan;
+	struct producer_arg args[PRODUCER_COUNT];
+	pthread_t threads[PRODUCER_COUNT];
+	fbr_id_t consumer;
+	int i, retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	chan = fbr_chan_create(&context, 256);
+	fail_if(NULL == chan, NULL);
+
+	consumer = fbr_create(&context, "consumer", consumer_fiber, chan, 0);
+	fail_if(fbr_id_isnull(consumer), NULL);
+	retval = fbr_transfer(&context, consumer);
+	fail_unless(0 == retval, NULL);
+
+	for (i = 0; i < PRODUCER_COUNT; i++) {
+		args[i].chan = chan;
+		args[i].id = i;
+		retval = pthread_create(threads + i, NULL, producer_thread,
+				args + i);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+
+	for (i = 0; i < PRODUCER_COUNT; i++)
+		pthread_join(threads[i], NULL);
+
+	fbr_chan_destroy(chan);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define RECEIVER_COUNT 4
+#define CHAN_STOP ((void *)UINTPTR_MAX)
+
+struct receiver_arg {
+	struct fbr_chan *chan;
+	size_t *total;
+};
+
+static void receiver_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct receiver_arg *arg = _arg;
+	void *obj;
+	int i;
+
+	for (;;) {
+		obj = fbr_chan_recv(arg->chan);
+		if (CHAN_STOP == obj)
+			return;
+		if (++*arg->total < PRODUCER_COUNT * PRODUCER_ITEMS)
+			continue;
+		/* Everything is in, the rest of the receivers are parked */
+		for (i = 0; i < RECEIVER_COUNT - 1; i++)
+			fail_unless(0 == fbr_chan_send(arg->chan, CHAN_STOP),
+					NULL);
+		return;
+	}
+}
+
+START_TEST(test_chan_receivers)
+{
+	struct fbr_context context;
+	struct fbr_chan *chan;
+	struct producer_arg args[PRODUCER_COUNT];
+	struct receiver_arg receiver_arg;
+	pthread_t threads[PRODUCER_COUNT];
+	fbr_id_t receivers[RECEIVER_COUNT];
+	size_t total = 0;
+	int i, retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	chan = fbr_chan_create(&context, 256);
+	fail_if(NULL == chan, NULL);
+
+	/* Several fibers of the owner context receive at once, a receiver
+	 * taking an object the others have been woken up for must not leave
+	 * them parked for good */
+	receiver_arg.chan = chan;
+	receiver_arg.total = &total;
+	for (i = 0; i < RECEIVER_COUNT; i++) {
+		receivers[i] = fbr_create(&context, "receiver", receiver_fiber,
+				&receiver_arg, 0);
+		fail_if(fbr_id_isnull(receivers[i]), NULL);
+		retval = fbr_transfer(&context, receivers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+	fail_unless(RECEIVER_COUNT == chan->parked, NULL);
+
+	for (i = 0; i < PRODUCER_COUNT; i++) {
+		args[i].chan = chan;
+		args[i].id = i;
+		retval = pthread_create(threads + i, NULL, producer_thread,
+				args + i);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+
+	for (i = 0; i < PRODUCER_COUNT; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < RECEIVER_COUNT; i++)
+		fail_unless(fbr_is_reclaimed(&context, receivers[i]), NULL);
+	fail_unless(PRODUCER_COUNT * PRODUCER_ITEMS == total, NULL);
+	fail_unless(0 == chan->parked, NULL);
+
+	fbr_chan_destroy(chan);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * chan_tcase(void)
+{
+	TCase *tc_chan = tcase_create ("Chan");
+	tcase_add_test(tc_chan, test_chan_basic);
+	tcase_add_test(tc_chan, test_chan_threads);
+	tcase_add_test(tc_chan, test_chan_receivers);
+	return tc_chan;
+}
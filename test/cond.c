@@ -84,6 +84,60 @@ START_TEST(test_cond_broadcast)
 }
 END_TEST
 
+static void cond_nomutex_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	fbr_cond_wait(FBR_A_ arg->cond, NULL);
+	*arg->flag_ptr += 1;
+}
+
+START_TEST(test_cond_broadcast_drain)
+{
+	struct fbr_context context;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_cond_var cond;
+	struct fbr_sched_stats stats;
+	int flag = 0;
+	int i;
+	const int num_fibers = 100;
+	int retval;
+	struct fiber_arg arg = {
+		.flag_ptr = &flag
+	};
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fbr_cond_init(&context, &cond);
+	arg.cond = &cond;
+
+	for(i = 0; i < num_fibers; i++) {
+		fiber = fbr_create(&context, "cond_i", cond_nomutex_fiber, &arg,
+				0);
+		fail_if(fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		fail_unless(0 == retval, NULL);
+	}
+
+	fbr_get_sched_stats(&context, &stats);
+	fail_unless(0 == stats.drains, NULL);
+
+	fbr_cond_broadcast(&context, &cond);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(flag == num_fibers, NULL);
+
+	fbr_get_sched_stats(&context, &stats);
+	fail_unless(1 == stats.drains, NULL);
+	fail_unless(num_fibers == stats.resumed, NULL);
+	fail_unless(num_fibers == stats.last_drain, NULL);
+	fail_unless(num_fibers == stats.max_drain, NULL);
+
+	fbr_cond_destroy(&context, &cond);
+	fbr_destroy(&context);
+}
+END_TEST
+
 START_TEST(test_cond_signal)
 {
 	struct fbr_context context;
@@ -309,6 +363,7 @@ TCase * cond_tcase(void)
 {
 	TCase *tc_cond = tcase_create ("Cond");
 	tcase_add_test(tc_cond, test_cond_broadcast);
+	tcase_add_test(tc_cond, test_cond_broadcast_drain);
 	tcase_add_test(tc_cond, test_cond_signal);
 	tcase_add_test(tc_cond, test_cond_bad_mutex);
 	tcase_add_test(tc_cond, test_two_conds);
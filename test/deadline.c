@@ -0,0 +1,243 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <unistd.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "deadline.h"
+
+static void reader_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	struct fbr_wheel *wheel = &fctx->__p->wheel;
+	ev_tstamp started, deadline;
+	ssize_t retval;
+	char c;
+	int i;
+
+	fail_unless(0. == fbr_deadline_get(FBR_A), NULL);
+	started = ev_now(fctx->__p->loop);
+	deadline = started + 0.05;
+	fail_unless(0 == fbr_deadline_set(FBR_A_ deadline), NULL);
+	fail_unless(1 == wheel->count, NULL);
+	/* Same deadline again is a no-op */
+	fail_unless(0 == fbr_deadline_set(FBR_A_ deadline), NULL);
+	fail_unless(1 == wheel->count, NULL);
+	fail_unless(deadline == fbr_deadline_get(FBR_A), NULL);
+
+	retval = fbr_read(FBR_A_ fds[0], &c, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(ev_now(fctx->__p->loop) >= deadline, NULL);
+
+	/* The rest of the request fails right away */
+	started = ev_now(fctx->__p->loop);
+	for (i = 0; i < 3; i++) {
+		retval = fbr_read_all(FBR_A_ fds[0], &c, 1);
+		fail_unless(-1 == retval, NULL);
+		fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	}
+	fail_unless(fbr_sleep(FBR_A_ 1.) > 0.9, NULL);
+	fail_unless(started == ev_now(fctx->__p->loop), NULL);
+	fail_if(CURRENT_FIBER->deadline.node.armed, NULL);
+
+	fbr_deadline_clear(FBR_A);
+	fail_unless(0. == fbr_deadline_get(FBR_A), NULL);
+	retval = fbr_read(FBR_A_ fds[0], &c, 1);
+	fail_unless(1 == retval, NULL);
+	fail_unless('x' == c, NULL);
+}
+
+static void writer_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	ssize_t retval;
+
+	fbr_sleep(FBR_A_ 0.2);
+	retval = fbr_write(FBR_A_ fds[1], "x", 1);
+	fail_unless(1 == retval, NULL);
+}
+
+START_TEST(test_deadline_io)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fail_unless(-1 == fbr_deadline_set(&context, 1.), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+
+	retval = pipe(fds);
+	fail_unless(0 == retval, NULL);
+	fbr_fd_nonblock(&context, fds[0]);
+
+	reader = fbr_create(&context, "reader", reader_fiber, fds, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer", writer_fiber, fds, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+struct sync_arg {
+	struct fbr_mutex mutex;
+	struct fbr_mutex own_mutex;
+	struct fbr_cond_var cond;
+	struct fbr_mq *mq;
+	int done;
+};
+
+static void holder_fiber(FBR_P_ void *_arg)
+{
+	struct sync_arg *arg = _arg;
+
+	fbr_mutex_lock(FBR_A_ &arg->mutex);
+	fbr_sleep(FBR_A_ 0.3);
+	fbr_mutex_unlock(FBR_A_ &arg->mutex);
+}
+
+static void waiter_fiber(FBR_P_ void *_arg)
+{
+	struct sync_arg *arg = _arg;
+	int retval;
+
+	fbr_deadline_set(FBR_A_ ev_now(fctx->__p->loop) + 0.05);
+
+	retval = fbr_mutex_lock(FBR_A_ &arg->mutex);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_if(fbr_id_eq(arg->mutex.locked_by, fbr_self(FBR_A)), NULL);
+
+	/* Uncontended mutex does not block, so the deadline is irrelevant */
+	retval = fbr_mutex_lock(FBR_A_ &arg->own_mutex);
+	fail_unless(0 == retval, NULL);
+
+	/* The mutex is held again when the wait is given up */
+	retval = fbr_cond_wait(FBR_A_ &arg->cond, &arg->own_mutex);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(fbr_id_eq(arg->own_mutex.locked_by, fbr_self(FBR_A)),
+			NULL);
+	fbr_mutex_unlock(FBR_A_ &arg->own_mutex);
+
+	fail_unless(NULL == fbr_mq_pop(arg->mq), NULL);
+	fail_unless(-1 == fbr_mq_wait_pop(arg->mq), NULL);
+
+	/* Sleep is cut short as well */
+	fail_unless(fbr_sleep(FBR_A_ 10.) > 9., NULL);
+	arg->done = 1;
+}
+
+START_TEST(test_deadline_sync)
+{
+	struct fbr_context context;
+	struct sync_arg arg;
+	fbr_id_t holder, waiter;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_mutex_init(&context, &arg.mutex);
+	fbr_mutex_init(&context, &arg.own_mutex);
+	fbr_cond_init(&context, &arg.cond);
+	arg.mq = fbr_mq_create(&context, 4, 0);
+	arg.done = 0;
+
+	holder = fbr_create(&context, "holder", holder_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(holder), NULL);
+	retval = fbr_transfer(&context, holder);
+	fail_unless(0 == retval, NULL);
+	waiter = fbr_create(&context, "waiter", waiter_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(1 == arg.done, NULL);
+	fbr_mq_destroy(arg.mq);
+	fbr_cond_destroy(&context, &arg.cond);
+	fbr_mutex_destroy(&context, &arg.mutex);
+	fbr_mutex_destroy(&context, &arg.own_mutex);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void doomed_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_cond_var *cond = _arg;
+
+	fbr_deadline_set(FBR_A_ ev_now(fctx->__p->loop) + 10.);
+	fbr_cond_wait(FBR_A_ cond, NULL);
+	fail("cond wait was not interrupted by reclaim");
+}
+
+START_TEST(test_deadline_reclaim)
+{
+	struct fbr_context context;
+	struct fbr_cond_var cond;
+	fbr_id_t id;
+	ev_tstamp started;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_cond_init(&context, &cond);
+
+	id = fbr_create(&context, "doomed", doomed_fiber, &cond, 0);
+	fail_if(fbr_id_isnull(id), NULL);
+	retval = fbr_transfer(&context, id);
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == context.__p->wheel.count, NULL);
+
+	retval = fbr_reclaim(&context, id);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == context.__p->wheel.count, NULL);
+
+	started = ev_time();
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(ev_time() - started < 1., NULL);
+
+	fbr_cond_destroy(&context, &cond);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * deadline_tcase(void)
+{
+	TCase *tc_deadline = tcase_create ("Deadline");
+	tcase_add_test(tc_deadline, test_deadline_io);
+	tcase_add_test(tc_deadline, test_deadline_sync);
+	tcase_add_test(tc_deadline, test_deadline_reclaim);
+	return tc_deadline;
+}
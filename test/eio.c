@@ -23,10 +23,14 @@
 #include <errno.h>
 #include <ev.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <limits.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <evfibers/eio.h>
 #include <evfibers_private/fiber.h>
 
@@ -282,7 +286,7 @@ START_TEST(test_eio)
 	fbr_id_t fiber = FBR_ID_NULL;
 	struct fbr_context context;
 	fbr_init(&context, EV_DEFAULT);
-	fbr_eio_init();
+	fbr_eio_init(&context);
 	signal(SIGPIPE, SIG_IGN);
 
 	fiber = fbr_create(&context, "io_fiber", io_fiber, NULL, 0);
@@ -295,10 +299,482 @@ START_TEST(test_eio)
 }
 END_TEST
 
+#define BATCH_CHUNKS 64
+#define BATCH_CHUNK_SIZE 16
+
+static int count_fds(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	int count = 0;
+
+	fail_if(NULL == dir, NULL);
+	while (readdir(dir))
+		count++;
+	closedir(dir);
+	return count;
+}
+
+static void batch_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_eio_op ops[BATCH_CHUNKS + 2];
+	char chunks[BATCH_CHUNKS][BATCH_CHUNK_SIZE];
+	char data[BATCH_CHUNKS * BATCH_CHUNK_SIZE];
+	EIO_STRUCT_STAT statdata;
+	struct fbr_sched_stats stats;
+	uint64_t switches;
+	ssize_t retval;
+	int fd, fds;
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = i % 251;
+	fd = fbr_eio_open(FBR_A_ "./async.batch", O_RDWR | O_CREAT | O_TRUNC,
+			0600, 0);
+	fail_unless(fd >= 0, NULL);
+	retval = fbr_eio_write(FBR_A_ fd, data, sizeof(data), 0, 0);
+	fail_unless(sizeof(data) == retval, NULL);
+
+	memset(ops, 0x00, sizeof(ops));
+	for (i = 0; i < BATCH_CHUNKS; i++) {
+		ops[i].type = FBR_EIO_OP_READ;
+		ops[i].fd = fd;
+		ops[i].buf = chunks[i];
+		ops[i].length = BATCH_CHUNK_SIZE;
+		ops[i].offset = i * BATCH_CHUNK_SIZE;
+	}
+	ops[BATCH_CHUNKS].type = FBR_EIO_OP_STAT;
+	ops[BATCH_CHUNKS].path = "./async.batch";
+	ops[BATCH_CHUNKS].buf = &statdata;
+	ops[BATCH_CHUNKS + 1].type = FBR_EIO_OP_STAT;
+	ops[BATCH_CHUNKS + 1].path = "./async.batch.missing";
+	ops[BATCH_CHUNKS + 1].buf = &statdata;
+
+	/* The fiber is parked once for the whole batch */
+	fbr_get_sched_stats(FBR_A_ &stats);
+	switches = stats.switches;
+	retval = fbr_eio_batch(FBR_A_ ops, BATCH_CHUNKS + 2, 0, 0);
+	fail_unless(BATCH_CHUNKS + 2 == retval, NULL);
+	fbr_get_sched_stats(FBR_A_ &stats);
+	fail_unless(switches + 1 == stats.switches, NULL);
+	for (i = 0; i < BATCH_CHUNKS; i++) {
+		fail_unless(ops[i].done, NULL);
+		fail_unless(BATCH_CHUNK_SIZE == ops[i].result, NULL);
+		fail_unless(0 == memcmp(chunks[i], data + i * BATCH_CHUNK_SIZE,
+					BATCH_CHUNK_SIZE), NULL);
+	}
+	fail_unless(-1 == ops[BATCH_CHUNKS + 1].result, NULL);
+	fail_unless(ENOENT == ops[BATCH_CHUNKS + 1].errorno, NULL);
+
+	/* Fed to the pool a few at a time */
+	fail_unless(0 == fbr_eio_set_limits(FBR_A_ 0, 4), NULL);
+	retval = fbr_eio_batch(FBR_A_ ops, BATCH_CHUNKS, 0, 0);
+	fail_unless(BATCH_CHUNKS == retval, NULL);
+	for (i = 0; i < BATCH_CHUNKS; i++)
+		fail_unless(BATCH_CHUNK_SIZE == ops[i].result, NULL);
+	fail_unless(0 == fbr_eio_set_limits(FBR_A_ 0, 0), NULL);
+
+	/* Waiting for the first few, the rest gets cancelled */
+	retval = fbr_eio_batch(FBR_A_ ops, BATCH_CHUNKS, 3, 0);
+	fail_unless(retval >= 3 && retval <= BATCH_CHUNKS, NULL);
+	for (i = 0; i < BATCH_CHUNKS; i++) {
+		if (!ops[i].done)
+			fail_unless(ECANCELED == ops[i].errorno, NULL);
+	}
+
+	/* Cancelled opens that have run anyway do not leak descriptors */
+	fds = count_fds();
+	memset(ops, 0x00, sizeof(ops));
+	for (i = 0; i < BATCH_CHUNKS; i++) {
+		ops[i].type = FBR_EIO_OP_OPEN;
+		ops[i].path = "./async.batch";
+		ops[i].flags = O_RDONLY;
+	}
+	retval = fbr_eio_batch(FBR_A_ ops, BATCH_CHUNKS, 1, 0);
+	fail_unless(retval >= 1, NULL);
+	for (i = 0; i < BATCH_CHUNKS; i++) {
+		if (ops[i].done && ops[i].result >= 0)
+			close(ops[i].result);
+	}
+	for (i = 0; i < 100 && count_fds() != fds; i++)
+		fbr_sleep(FBR_A_ 0.01);
+	fail_unless(fds == count_fds(), NULL);
+	ops[BATCH_CHUNKS].type = FBR_EIO_OP_STAT;
+	ops[BATCH_CHUNKS].path = "./async.batch";
+	ops[BATCH_CHUNKS].buf = &statdata;
+
+	retval = fbr_eio_batch(FBR_A_ ops + BATCH_CHUNKS, 1, 0, 0);
+	fail_unless(1 == retval, NULL);
+	fail_unless(sizeof(data) == statdata.st_size, NULL);
+
+	fbr_eio_close(FBR_A_ fd, 0);
+	fbr_eio_unlink(FBR_A_ "./async.batch", 0);
+}
+
+START_TEST(test_eio_batch)
+{
+	int retval;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_context context;
+	fbr_init(&context, EV_DEFAULT);
+	fbr_eio_init(&context);
+
+	fiber = fbr_create(&context, "batch_fiber", batch_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, fiber), NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void vectored_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct iovec iov[3];
+	char header[4], payload[8], trailer[4];
+	char data[16];
+	ssize_t retval;
+	int fd;
+
+	fd = fbr_eio_open(FBR_A_ "./async.vectored",
+			O_RDWR | O_CREAT | O_TRUNC, 0600, 0);
+	fail_unless(fd >= 0, NULL);
+
+	iov[0].iov_base = "HDR:";
+	iov[0].iov_len = 4;
+	iov[1].iov_base = "payload!";
+	iov[1].iov_len = 8;
+	iov[2].iov_base = ":END";
+	iov[2].iov_len = 4;
+	retval = fbr_eio_pwritev(FBR_A_ fd, iov, 3, 0, 0, 0);
+	fail_unless(16 == retval, NULL);
+	retval = fbr_eio_read(FBR_A_ fd, data, sizeof(data), 0, 0);
+	fail_unless(16 == retval, NULL);
+	fail_unless(0 == memcmp(data, "HDR:payload!:END", 16), NULL);
+
+	iov[0].iov_base = header;
+	iov[1].iov_base = payload;
+	iov[2].iov_base = trailer;
+	retval = fbr_eio_preadv(FBR_A_ fd, iov, 3, 0, 0, 0);
+	fail_unless(16 == retval, NULL);
+	fail_unless(0 == memcmp(header, "HDR:", 4), NULL);
+	fail_unless(0 == memcmp(payload, "payload!", 8), NULL);
+	fail_unless(0 == memcmp(trailer, ":END", 4), NULL);
+
+	/* Short reads at the end of file */
+	retval = fbr_eio_read(FBR_A_ fd, data, sizeof(data), 10, 0);
+	fail_unless(6 == retval, NULL);
+	fail_unless(0 == memcmp(data, "d!:END", 6), NULL);
+	retval = fbr_eio_preadv(FBR_A_ fd, iov, 3, 6, 0, 0);
+	fail_unless(10 == retval, NULL);
+	fail_unless(0 == memcmp(header, "yloa", 4), NULL);
+	fail_unless(0 == memcmp(payload, "d!:END", 6), NULL);
+
+	fbr_eio_close(FBR_A_ fd, 0);
+	fbr_eio_unlink(FBR_A_ "./async.vectored", 0);
+}
+
+START_TEST(test_eio_vectored)
+{
+	int retval;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_context context;
+	fbr_init(&context, EV_DEFAULT);
+	fbr_eio_init(&context);
+
+	fiber = fbr_create(&context, "vectored_fiber", vectored_fiber, NULL,
+			0);
+	fail_if(fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, fiber), NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define STREAM_FILE_SIZE (256 * 1024 + 123)
+
+struct stream_test {
+	struct fbr_buffer buffer;
+	char *data;
+	int fd;
+	off_t offset;
+	size_t length;
+	size_t expected;
+	ssize_t streamed;
+};
+
+static void stream_producer_fiber(FBR_P_ void *_arg)
+{
+	struct stream_test *st = _arg;
+
+	st->streamed = fbr_eio_stream(FBR_A_ st->fd, st->offset, st->length,
+			&st->buffer, 4096, 4, 0);
+}
+
+static void stream_consumer_fiber(FBR_P_ void *_arg)
+{
+	struct stream_test *st = _arg;
+	size_t consumed = 0;
+	size_t size;
+	char *ptr;
+
+	while (consumed < st->expected) {
+		size = min((size_t)1000, st->expected - consumed);
+		ptr = fbr_buffer_read_address(FBR_A_ &st->buffer, size);
+		fail_unless(NULL != ptr, NULL);
+		fail_unless(0 == memcmp(ptr, st->data + st->offset + consumed,
+					size), NULL);
+		fbr_buffer_read_advance(FBR_A_ &st->buffer);
+		consumed += size;
+	}
+}
+
+static void run_stream(struct fbr_context *fctx, struct stream_test *st)
+{
+	fbr_id_t producer, consumer;
+
+	st->streamed = -1;
+	fail_unless(0 == fbr_buffer_init(FBR_A_ &st->buffer, 64 * 1024), NULL);
+	producer = fbr_create(FBR_A_ "stream_producer", stream_producer_fiber,
+			st, 0);
+	fail_if(fbr_id_isnull(producer), NULL);
+	consumer = fbr_create(FBR_A_ "stream_consumer", stream_consumer_fiber,
+			st, 0);
+	fail_if(fbr_id_isnull(consumer), NULL);
+	fail_unless(0 == fbr_transfer(FBR_A_ producer), NULL);
+	fail_unless(0 == fbr_transfer(FBR_A_ consumer), NULL);
+	ev_run(fctx->__p->loop, 0);
+	fail_unless(fbr_is_reclaimed(FBR_A_ producer), NULL);
+	fail_unless(fbr_is_reclaimed(FBR_A_ consumer), NULL);
+	fail_unless((ssize_t)st->expected == st->streamed, NULL);
+	fail_unless(0 == fbr_buffer_bytes(FBR_A_ &st->buffer), NULL);
+	fbr_buffer_destroy(FBR_A_ &st->buffer);
+}
+
+START_TEST(test_eio_stream)
+{
+	struct fbr_context context;
+	struct stream_test st;
+	struct fbr_buffer buffer;
+	size_t i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_eio_init(&context);
+
+	st.data = malloc(STREAM_FILE_SIZE);
+	fail_unless(NULL != st.data, NULL);
+	for (i = 0; i < STREAM_FILE_SIZE; i++)
+		st.data[i] = i % 253;
+	st.fd = open("./async.stream", O_RDWR | O_CREAT | O_TRUNC, 0600);
+	fail_unless(st.fd >= 0, NULL);
+	fail_unless(STREAM_FILE_SIZE == write(st.fd, st.data,
+				STREAM_FILE_SIZE), NULL);
+
+	/* Up to the end of the file, which is several buffers long */
+	st.offset = 0;
+	st.length = 0;
+	st.expected = STREAM_FILE_SIZE;
+	run_stream(&context, &st);
+
+	/* A slice in the middle */
+	st.offset = 5000;
+	st.length = 100000;
+	st.expected = 100000;
+	run_stream(&context, &st);
+
+	fail_unless(0 == fbr_buffer_init(&context, &buffer, 0), NULL);
+	fail_unless(-1 == fbr_eio_stream(&context, st.fd, 0, 0, &buffer, 0, 4,
+				0), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fbr_buffer_destroy(&context, &buffer);
+
+	close(st.fd);
+	unlink("./async.stream");
+	free(st.data);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define CLASS_BULK_FIBERS 8
+#define CLASS_META_FIBERS 4
+
+static int class_order[CLASS_BULK_FIBERS + CLASS_META_FIBERS];
+static int class_order_len;
+static int class_running;
+static int class_max_running;
+
+static eio_ssize_t class_op(void *data)
+{
+	int running = __sync_add_and_fetch(&class_running, 1);
+	int max_running;
+
+	while ((max_running = class_max_running) < running)
+		__sync_bool_compare_and_swap(&class_max_running, max_running,
+				running);
+	usleep(1000);
+	class_order[__sync_fetch_and_add(&class_order_len, 1)] =
+		*(int *)data;
+	__sync_sub_and_fetch(&class_running, 1);
+	return 0;
+}
+
+static void class_fiber(FBR_P_ void *_arg)
+{
+	eio_ssize_t retval;
+
+	retval = fbr_eio_custom(FBR_A_ class_op, _arg, *(int *)_arg);
+	fail_unless(0 == retval, NULL);
+}
+
+static int class_pipes[CLASS_BULK_FIBERS][2];
+
+/* Samples the slots the bulk class holds while the batch reads are blocked
+ * on the empty pipes, then lets them through */
+static void class_batch_sampler(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_eio_class_stats stats;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		fbr_sleep(FBR_A_ 0.01);
+		fail_unless(0 == fbr_eio_get_class_stats(FBR_A_ EIO_PRI_MIN,
+					&stats), NULL);
+		class_max_running = max(class_max_running,
+				(int)stats.inflight);
+	}
+	for (i = 0; i < CLASS_BULK_FIBERS; i++)
+		fail_unless(1 == write(class_pipes[i][1], "x", 1), NULL);
+}
+
+static void class_batch_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_eio_op ops[CLASS_BULK_FIBERS];
+	char bufs[CLASS_BULK_FIBERS];
+	ssize_t retval;
+	int i;
+
+	memset(ops, 0x00, sizeof(ops));
+	for (i = 0; i < CLASS_BULK_FIBERS; i++) {
+		ops[i].type = FBR_EIO_OP_READ;
+		ops[i].fd = class_pipes[i][0];
+		ops[i].buf = bufs + i;
+		ops[i].length = 1;
+		ops[i].offset = -1;
+	}
+	retval = fbr_eio_batch(FBR_A_ ops, CLASS_BULK_FIBERS, 0, EIO_PRI_MIN);
+	fail_unless(CLASS_BULK_FIBERS == retval, NULL);
+	for (i = 0; i < CLASS_BULK_FIBERS; i++)
+		fail_unless(1 == ops[i].result, NULL);
+}
+
+static void run_class_fibers(struct fbr_context *fctx, int bulk, int meta)
+{
+	static int bulk_pri = EIO_PRI_MIN, meta_pri = EIO_PRI_MAX;
+	fbr_id_t fibers[CLASS_BULK_FIBERS + CLASS_META_FIBERS];
+	int i;
+
+	class_order_len = 0;
+	class_max_running = 0;
+	for (i = 0; i < bulk + meta; i++) {
+		fibers[i] = fbr_create(FBR_A_ "class_fiber", class_fiber,
+				i < bulk ? &bulk_pri : &meta_pri, 0);
+		fail_if(fbr_id_isnull(fibers[i]), NULL);
+		fail_unless(0 == fbr_transfer(FBR_A_ fibers[i]), NULL);
+	}
+	ev_run(fctx->__p->loop, 0);
+	for (i = 0; i < bulk + meta; i++)
+		fail_unless(fbr_is_reclaimed(FBR_A_ fibers[i]), NULL);
+	fail_unless(bulk + meta == class_order_len, NULL);
+}
+
+START_TEST(test_eio_classes)
+{
+	struct fbr_context context;
+	struct fbr_eio_class_stats stats;
+	fbr_id_t batch, sampler;
+	int meta_seen = 0;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fail_unless(-1 == fbr_eio_set_limits(&context, 1, 0), NULL);
+	fail_unless(FBR_EEIO == context.f_errno, NULL);
+	fbr_eio_init(&context);
+	fail_unless(-1 == fbr_eio_class_set(&context, EIO_PRI_MAX + 1, 1, 0),
+			NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fail_unless(-1 == fbr_eio_class_set(&context, EIO_PRI_MAX, 0, 0),
+			NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+
+	/* One request in the pool at a time, the metadata class gets four
+	 * times the share of the bulk one: once the first bulk request is
+	 * done, all the metadata requests overtake the queued bulk ones */
+	fail_unless(0 == fbr_eio_set_limits(&context, 1, 0), NULL);
+	fail_unless(0 == fbr_eio_class_set(&context, EIO_PRI_MIN, 1, 0), NULL);
+	fail_unless(0 == fbr_eio_class_set(&context, EIO_PRI_MAX, 4, 0), NULL);
+	run_class_fibers(&context, CLASS_BULK_FIBERS, CLASS_META_FIBERS);
+	fail_unless(1 == class_max_running, NULL);
+	fail_unless(EIO_PRI_MIN == class_order[0], NULL);
+	for (i = 1; i <= CLASS_META_FIBERS; i++)
+		meta_seen += (EIO_PRI_MAX == class_order[i]);
+	fail_unless(CLASS_META_FIBERS == meta_seen, NULL);
+
+	fail_unless(0 == fbr_eio_get_class_stats(&context, EIO_PRI_MAX,
+				&stats), NULL);
+	fail_unless(0 == stats.queued, NULL);
+	fail_unless(0 == stats.inflight, NULL);
+	fail_unless(CLASS_META_FIBERS == stats.admitted, NULL);
+	fail_unless(CLASS_META_FIBERS == stats.delayed, NULL);
+	fail_unless(stats.max_wait_time > 0., NULL);
+	fail_unless(stats.wait_time >= stats.max_wait_time, NULL);
+	fail_unless(0 == fbr_eio_get_class_stats(&context, EIO_PRI_MIN,
+				&stats), NULL);
+	fail_unless(CLASS_BULK_FIBERS == stats.admitted, NULL);
+	fail_unless(CLASS_BULK_FIBERS - 1 == stats.delayed, NULL);
+
+	/* The bulk class may only occupy two workers */
+	fail_unless(0 == fbr_eio_set_limits(&context, 0, 0), NULL);
+	fail_unless(0 == fbr_eio_class_set(&context, EIO_PRI_MIN, 1, 2), NULL);
+	run_class_fibers(&context, CLASS_BULK_FIBERS, 0);
+	fail_unless(class_max_running <= 2, NULL);
+
+	/* So may a batch that is larger than the cap */
+	class_max_running = 0;
+	for (i = 0; i < CLASS_BULK_FIBERS; i++)
+		fail_unless(0 == pipe(class_pipes[i]), NULL);
+	batch = fbr_create(&context, "class_batch", class_batch_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(batch), NULL);
+	sampler = fbr_create(&context, "class_batch_sampler",
+			class_batch_sampler, NULL, 0);
+	fail_if(fbr_id_isnull(sampler), NULL);
+	fail_unless(0 == fbr_transfer(&context, batch), NULL);
+	fail_unless(0 == fbr_transfer(&context, sampler), NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, batch), NULL);
+	fail_unless(fbr_is_reclaimed(&context, sampler), NULL);
+	fail_unless(class_max_running > 0, NULL);
+	fail_unless(class_max_running <= 2, NULL);
+	for (i = 0; i < CLASS_BULK_FIBERS; i++) {
+		close(class_pipes[i][0]);
+		close(class_pipes[i][1]);
+	}
+
+	fbr_destroy(&context);
+}
+END_TEST
+
 TCase * eio_tcase(void)
 {
 	TCase *tc_eio = tcase_create("EIO");
 	tcase_add_test(tc_eio, test_eio);
+	tcase_add_test(tc_eio, test_eio_batch);
+	tcase_add_test(tc_eio, test_eio_vectored);
+	tcase_add_test(tc_eio, test_eio_stream);
+	tcase_add_test(tc_eio, test_eio_classes);
 	return tc_eio;
 }
 
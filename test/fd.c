@@ -0,0 +1,276 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "fd.h"
+
+#define ROUNDS 1000
+
+static void stream_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+	char c;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		if (i % 2)
+			retval = fbr_read(FBR_A_ fd, &c, 1);
+		else
+			retval = fbr_read_all(FBR_A_ fd, &c, 1);
+		fail_unless(1 == retval, NULL);
+		fail_unless('x' == c, NULL);
+	}
+	fail_unless(0 == fbr_fd_unregister(FBR_A_ fd), NULL);
+}
+
+static void stream_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		retval = fbr_write(FBR_A_ fd, "x", 1);
+		fail_unless(1 == retval, NULL);
+		fbr_sleep(FBR_A_ 0.);
+	}
+}
+
+START_TEST(test_fd_register)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = pipe(fds);
+	fail_unless(0 == retval, NULL);
+	fail_unless(-1 == fbr_fd_register(&context, -1), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fail_unless(-1 == fbr_fd_unregister(&context, fds[0]), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+	fail_unless(-1 == fbr_fd_register(&context, fds[0]), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fail_unless(fcntl(fds[0], F_GETFL) & O_NONBLOCK, NULL);
+
+	reader = fbr_create(&context, "reader", stream_reader_fiber, fds + 0,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer", stream_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+	/* The watcher is started by the first read and stopped by
+	 * fbr_fd_unregister, per-call watchers would restart for every call */
+	fail_unless(2 == context.__p->fd_interest_changes,
+			"%llu interest changes",
+			(unsigned long long)context.__p->fd_interest_changes);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void unregistered_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+	char c;
+
+	retval = fbr_read(FBR_A_ fd, &c, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(EBADF == errno, NULL);
+}
+
+static void timed_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+	char c;
+
+	errno = 0;
+	retval = fbr_read_all_wto(FBR_A_ fd, &c, 1, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+
+	retval = fbr_read_wto(FBR_A_ fd, &c, 1, 1.0);
+	fail_unless(1 == retval, NULL);
+	fail_unless('z' == c, NULL);
+}
+
+static void late_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+
+	fbr_sleep(FBR_A_ 0.1);
+	retval = fbr_write(FBR_A_ fd, "z", 1);
+	fail_unless(1 == retval, NULL);
+}
+
+START_TEST(test_fd_unregister)
+{
+	struct fbr_context context;
+	fbr_id_t reader, timed_reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = pipe(fds);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+
+	reader = fbr_create(&context, "reader", unregistered_reader_fiber,
+			fds, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	fail_unless(ev_is_active(&context.__p->fd_entries[fds[0]]->io), NULL);
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]), NULL);
+	fail_if(ev_is_active(&context.__p->fd_entries[fds[0]]->io), NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+
+	/* Registration may be renewed, timeouts work as usual */
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+	timed_reader = fbr_create(&context, "timed_reader", timed_reader_fiber,
+			fds, 0);
+	fail_if(fbr_id_isnull(timed_reader), NULL);
+	retval = fbr_transfer(&context, timed_reader);
+	fail_unless(0 == retval, NULL);
+	writer = fbr_create(&context, "writer", late_writer_fiber, fds + 1, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, timed_reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void fast_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	struct fbr_sched_stats stats;
+	uint64_t switches;
+	ssize_t retval;
+	char buf[4];
+
+	/* Data that is already there is read without a trip through the loop */
+	fbr_get_sched_stats(FBR_A_ &stats);
+	switches = stats.switches;
+	retval = fbr_read(FBR_A_ fd, buf, 2);
+	fail_unless(2 == retval, NULL);
+	retval = fbr_read_all(FBR_A_ fd, buf, 2);
+	fail_unless(2 == retval, NULL);
+	fbr_get_sched_stats(FBR_A_ &stats);
+	fail_unless(switches == stats.switches, NULL);
+	fail_unless(0 == fctx->__p->fd_interest_changes, NULL);
+
+	/* Nothing left, the fiber has to wait for the writer */
+	retval = fbr_read_all(FBR_A_ fd, buf, 4);
+	fail_unless(4 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "efgh", 4), NULL);
+	fbr_get_sched_stats(FBR_A_ &stats);
+	fail_unless(switches < stats.switches, NULL);
+}
+
+static void delayed_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+
+	retval = fbr_write(FBR_A_ fd, "ef", 2);
+	fail_unless(2 == retval, NULL);
+	fbr_sleep(FBR_A_ 0.01);
+	retval = fbr_write_all(FBR_A_ fd, "gh", 2);
+	fail_unless(2 == retval, NULL);
+}
+
+START_TEST(test_fd_fast_path)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = pipe(fds);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[1]), NULL);
+	retval = write(fds[1], "abcd", 4);
+	fail_unless(4 == retval, NULL);
+
+	reader = fbr_create(&context, "reader", fast_reader_fiber, fds, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	writer = fbr_create(&context, "writer", delayed_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]), NULL);
+	fail_unless(0 == fbr_fd_unregister(&context, fds[1]), NULL);
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * fd_tcase(void)
+{
+	TCase *tc_fd = tcase_create ("fd");
+	tcase_add_test(tc_fd, test_fd_register);
+	tcase_add_test(tc_fd, test_fd_unregister);
+	tcase_add_test(tc_fd, test_fd_fast_path);
+	return tc_fd;
+}
@@ -0,0 +1,225 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "file.h"
+
+static int temp_file(char *path, size_t size)
+{
+	int fd;
+
+	snprintf(path, size, "/tmp/evfibers_file_%d", getpid());
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	fail_unless(fd >= 0, NULL);
+	fail_unless(10 == write(fd, "0123456789", 10), NULL);
+	fail_unless(0 == lseek(fd, 0, SEEK_SET), NULL);
+	return fd;
+}
+
+START_TEST(test_file_inline_read)
+{
+	struct fbr_context context;
+	struct fbr_file_stats stats;
+	char path[64];
+	char buf[16];
+	ssize_t result = -1;
+	int fd;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fd = temp_file(path, sizeof(path));
+
+	/* The data has just been written, so it is in the page cache */
+	retval = fbr_file_read_inline(&context, fd, buf, 4, 6, &result);
+	fbr_get_file_stats(&context, &stats);
+#ifdef HAVE_RWF_NOWAIT
+	fail_unless(1 == retval, NULL);
+	fail_unless(4 == result, NULL);
+	fail_unless(0 == memcmp(buf, "6789", 4), NULL);
+	/* Negative offset reads from the file position and moves it */
+	retval = fbr_file_read_inline(&context, fd, buf, 3, -1, &result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(3 == result, NULL);
+	fail_unless(0 == memcmp(buf, "012", 3), NULL);
+	fail_unless(3 == lseek(fd, 0, SEEK_CUR), NULL);
+	/* A cached read that hits the end of file is complete, there is
+	 * nothing to offload */
+	retval = fbr_file_read_inline(&context, fd, buf, sizeof(buf), 6,
+			&result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(4 == result, NULL);
+	fail_unless(0 == memcmp(buf, "6789", 4), NULL);
+	fbr_get_file_stats(&context, &stats);
+	fail_unless(3 == stats.inline_reads, NULL);
+	fail_unless(0 == stats.offloaded_reads, NULL);
+#else
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == stats.offloaded_reads, NULL);
+#endif
+
+	close(fd);
+	unlink(path);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_file_inline_stat)
+{
+	struct fbr_context context;
+	struct fbr_file_stats stats;
+	struct stat st;
+	char path[64];
+	int result = -1;
+	int fd;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fd = temp_file(path, sizeof(path));
+
+	retval = fbr_file_stat_inline(&context, path, 1, &st, &result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(0 == result, NULL);
+	fail_unless(10 == st.st_size, NULL);
+	/* A loaded machine may make any call slow enough to switch stats to
+	 * offloading, which is not what is tested here */
+	context.__p->file_inline.stat_slow = 0;
+	retval = fbr_file_fstat_inline(&context, fd, &st, &result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(0 == result, NULL);
+	fail_unless(S_ISREG(st.st_mode), NULL);
+	/* Failures are final as well, there is nothing to offload */
+	unlink(path);
+	context.__p->file_inline.stat_slow = 0;
+	retval = fbr_file_stat_inline(&context, path, 0, &st, &result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(-1 == result, NULL);
+	fail_unless(ENOENT == errno, NULL);
+
+	/* Once an inline call turns out slow, only probes stay inline */
+	context.__p->file_inline.stat_slow = 1;
+	for (i = 0; i < 63; i++) {
+		retval = fbr_file_fstat_inline(&context, fd, &st, &result);
+		fail_unless(0 == retval, NULL);
+	}
+	retval = fbr_file_fstat_inline(&context, fd, &st, &result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(0 == result, NULL);
+	fbr_get_file_stats(&context, &stats);
+	fail_unless(4 == stats.inline_stats, NULL);
+	fail_unless(63 == stats.offloaded_stats, NULL);
+	if (0 == stats.slow_inline_stats) {
+		/* The probe was fast, stats are back inline */
+		retval = fbr_file_fstat_inline(&context, fd, &st, &result);
+		fail_unless(1 == retval, NULL);
+	}
+
+	close(fd);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_file_vectored)
+{
+	struct fbr_context context;
+	struct fbr_file_stats stats;
+	struct iovec iov[2];
+	char path[64];
+	char head[3], tail[3];
+	ssize_t result = -1;
+	int fd;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fd = temp_file(path, sizeof(path));
+
+	iov[0].iov_base = "ab";
+	iov[0].iov_len = 2;
+	iov[1].iov_base = "cd";
+	iov[1].iov_len = 2;
+	fail_unless(4 == fbr_file_pwritev(fd, iov, 2, 10, 0), NULL);
+	/* Plain writes are left to the pool */
+	retval = fbr_file_writev_inline(&context, fd, iov, 2, 10, 0, &result);
+	fail_unless(0 == retval, NULL);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = tail;
+	iov[1].iov_len = sizeof(tail);
+	fail_unless(6 == fbr_file_preadv(fd, iov, 2, 8, 0), NULL);
+	fail_unless(0 == memcmp(head, "89a", 3), NULL);
+	fail_unless(0 == memcmp(tail, "bcd", 3), NULL);
+
+	retval = fbr_file_readv_inline(&context, fd, iov, 2, 2, 0, &result);
+	fbr_get_file_stats(&context, &stats);
+#ifdef HAVE_RWF_NOWAIT
+	fail_unless(1 == retval, NULL);
+	fail_unless(6 == result, NULL);
+	fail_unless(0 == memcmp(head, "234", 3), NULL);
+	fail_unless(0 == memcmp(tail, "567", 3), NULL);
+	fail_unless(1 == stats.inline_reads, NULL);
+	/* Up to the end of file, which is in the middle of the second
+	 * buffer */
+	retval = fbr_file_readv_inline(&context, fd, iov, 2, 10, 0, &result);
+	fail_unless(1 == retval, NULL);
+	fail_unless(4 == result, NULL);
+	fail_unless(0 == memcmp(head, "abc", 3), NULL);
+	fail_unless('d' == tail[0], NULL);
+	fbr_get_file_stats(&context, &stats);
+	fail_unless(2 == stats.inline_reads, NULL);
+	fail_unless(0 == stats.offloaded_reads, NULL);
+#ifdef RWF_APPEND
+	/* Flags are passed through, the offset does not matter for appends */
+	iov[0].iov_base = "e";
+	iov[0].iov_len = 1;
+	fail_unless(1 == fbr_file_pwritev(fd, iov, 1, 0, RWF_APPEND), NULL);
+	fail_unless(1 == pread(fd, head, 1, 14), NULL);
+	fail_unless('e' == head[0], NULL);
+#endif
+#else
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == stats.offloaded_reads, NULL);
+	fail_unless(-1 == fbr_file_preadv(fd, iov, 2, 0, 1), NULL);
+	fail_unless(EOPNOTSUPP == errno, NULL);
+#endif
+
+	close(fd);
+	unlink(path);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * file_tcase(void)
+{
+	TCase *tc_file = tcase_create ("file");
+	tcase_add_test(tc_file, test_file_inline_read);
+	tcase_add_test(tc_file, test_file_inline_stat);
+	tcase_add_test(tc_file, test_file_vectored);
+	return tc_file;
+}
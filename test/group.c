@@ -0,0 +1,153 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <string.h>
+#include <unistd.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "group.h"
+
+#define TASK_COUNT 1000
+#define NWORKERS 4
+
+static int counter;
+static int spinning;
+static int workers_seen[NWORKERS];
+static int task_workers[NWORKERS];
+
+static int wait_for(int *value, int expected)
+{
+	int i;
+	/* 10 seconds at most */
+	for (i = 0; i < 10000; i++) {
+		if (expected == __atomic_load_n(value, __ATOMIC_ACQUIRE))
+			return 1;
+		usleep(1000);
+	}
+	return 0;
+}
+
+static void count_fiber(FBR_P_ _unused_ void *_arg)
+{
+	int worker = fbr_group_worker(FBR_A);
+	fail_unless(worker >= 0 && worker < NWORKERS, NULL);
+	__atomic_add_fetch(task_workers + worker, 1, __ATOMIC_RELAXED);
+	/* Let the others run in between */
+	fbr_sleep(FBR_A_ 0.001);
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELEASE);
+}
+
+START_TEST(test_group_submit)
+{
+	struct fbr_group *group;
+	struct fbr_context context;
+	int i, retval;
+
+	counter = 0;
+	group = fbr_group_create(NWORKERS);
+	fail_if(NULL == group, NULL);
+	fail_unless(NWORKERS == fbr_group_size(group), NULL);
+	for (i = 0; i < TASK_COUNT; i++) {
+		retval = fbr_group_submit(group, "count", count_fiber, NULL, 0);
+		fail_unless(0 == retval, NULL);
+	}
+	fail_unless(wait_for(&counter, TASK_COUNT), NULL);
+	fbr_group_destroy(group);
+
+	fbr_init(&context, EV_DEFAULT);
+	retval = fbr_group_worker(&context);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void broadcast_fiber(FBR_P_ _unused_ void *_arg)
+{
+	__atomic_add_fetch(workers_seen + fbr_group_worker(FBR_A), 1,
+			__ATOMIC_RELAXED);
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELEASE);
+}
+
+START_TEST(test_group_broadcast)
+{
+	struct fbr_group *group;
+	int i, retval;
+
+	counter = 0;
+	group = fbr_group_create(NWORKERS);
+	fail_if(NULL == group, NULL);
+	retval = fbr_group_broadcast(group, "broadcast", broadcast_fiber,
+			NULL, 0);
+	fail_unless(0 == retval, NULL);
+	fail_unless(wait_for(&counter, NWORKERS), NULL);
+	for (i = 0; i < NWORKERS; i++)
+		fail_unless(1 == workers_seen[i], NULL);
+	retval = fbr_group_submit_to(group, NWORKERS, "invalid",
+			broadcast_fiber, NULL, 0);
+	fail_unless(-1 == retval, NULL);
+	fbr_group_destroy(group);
+}
+END_TEST
+
+static void spinner_fiber(FBR_P_ _unused_ void *_arg)
+{
+	fail_unless(0 == fbr_group_worker(FBR_A), NULL);
+	__atomic_store_n(&spinning, 1, __ATOMIC_RELEASE);
+	/* Hog the worker without yielding until the rest of the tasks are
+	 * done elsewhere */
+	wait_for(&counter, TASK_COUNT);
+}
+
+START_TEST(test_group_steal)
+{
+	struct fbr_group *group;
+	int i, retval;
+
+	counter = 0;
+	spinning = 0;
+	memset(task_workers, 0x00, sizeof(task_workers));
+	group = fbr_group_create(2);
+	fail_if(NULL == group, NULL);
+	retval = fbr_group_submit_to(group, 0, "spinner", spinner_fiber,
+			NULL, 0);
+	fail_unless(0 == retval, NULL);
+	fail_unless(wait_for(&spinning, 1), NULL);
+	for (i = 0; i < TASK_COUNT; i++) {
+		retval = fbr_group_submit(group, "count", count_fiber, NULL, 0);
+		fail_unless(0 == retval, NULL);
+	}
+	/* Worker 0 is busy spinning, so everything has to be stolen by
+	 * worker 1 */
+	fail_unless(wait_for(&counter, TASK_COUNT), NULL);
+	fail_unless(0 == task_workers[0], NULL);
+	fail_unless(TASK_COUNT == task_workers[1], NULL);
+	fbr_group_destroy(group);
+}
+END_TEST
+
+TCase * group_tcase(void)
+{
+	TCase *tc_group = tcase_create ("Group");
+	tcase_add_test(tc_group, test_group_submit);
+	tcase_add_test(tc_group, test_group_broadcast);
+	tcase_add_test(tc_group, test_group_steal);
+	return tc_group;
+}
@@ -16,11 +16,13 @@
 
  ********************************************************************/
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
@@ -192,6 +194,593 @@ START_TEST(test_read_write_all)
 }
 END_TEST
 
+#define vec_size (1 * 1024 * 1024 + 5)
+static void fill_pattern(char *buf, size_t offset, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		buf[i] = (offset + i) % 251;
+}
+
+static void vec_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(vec_size);
+	char *expected = malloc(vec_size);
+	struct iovec iov[3];
+	ssize_t retval;
+
+	/* Split at different places than the writer does */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 3;
+	iov[1].iov_base = buf + 3;
+	iov[1].iov_len = 1000;
+	iov[2].iov_base = buf + 1003;
+	iov[2].iov_len = vec_size - 1003;
+	retval = fbr_readv_all(FBR_A_ fd, iov, 3);
+	fail_unless(vec_size == retval, NULL);
+	fill_pattern(expected, 0, vec_size);
+	fail_unless(0 == memcmp(buf, expected, vec_size), NULL);
+
+	retval = fbr_readv(FBR_A_ fd, iov, 3);
+	fail_unless(0 == retval, NULL);
+	free(expected);
+	free(buf);
+}
+
+static void vec_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char header[5];
+	char *body = malloc(vec_size - 5);
+	struct iovec iov[3];
+	ssize_t retval;
+
+	fill_pattern(header, 0, 5);
+	fill_pattern(body, 5, vec_size - 5);
+	iov[0].iov_base = header;
+	iov[0].iov_len = 5;
+	iov[1].iov_base = NULL;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = body;
+	iov[2].iov_len = vec_size - 5;
+	retval = fbr_writev_all(FBR_A_ fd, iov, 3);
+	fail_unless(vec_size == retval, NULL);
+	close(fd);
+	free(body);
+}
+#undef vec_size
+
+START_TEST(test_readv_writev_all)
+{
+	struct fbr_context context;
+	fbr_id_t reader = FBR_ID_NULL, writer = FBR_ID_NULL;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval);
+	retval = fbr_fd_register(&context, fds[0]);
+	fail_unless(0 == retval);
+	retval = fbr_fd_nonblock(&context, fds[1]);
+	fail_unless(0 == retval);
+
+	reader = fbr_create(&context, "reader_vec", vec_reader_fiber, fds + 0,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer_vec", vec_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader));
+	fail_unless(fbr_is_reclaimed(&context, writer));
+
+	fbr_fd_unregister(&context, fds[0]);
+	close(fds[0]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void msg_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char head[4], tail[16];
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t retval;
+
+	memset(&msg, 0x00, sizeof(msg));
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = tail;
+	iov[1].iov_len = sizeof(tail);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	retval = fbr_recvmsg_wto(FBR_A_ fd, &msg, 0, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+
+	retval = fbr_recvmsg(FBR_A_ fd, &msg, 0);
+	fail_unless(11 == retval, NULL);
+	fail_unless(0 == memcmp(head, "PING", 4), NULL);
+	fail_unless(0 == memcmp(tail, " pong\n\n", 7), NULL);
+}
+
+static void msg_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char buf[] = "PING pong\n\n";
+	struct iovec iov[3];
+	struct msghdr msg;
+	ssize_t retval;
+
+	fbr_sleep(FBR_A_ 0.05);
+	memset(&msg, 0x00, sizeof(msg));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = buf + 4;
+	iov[1].iov_len = 5;
+	iov[2].iov_base = buf + 9;
+	iov[2].iov_len = 2;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	retval = fbr_sendmsg_all(FBR_A_ fd, &msg, 0);
+	fail_unless(11 == retval, NULL);
+	fail_unless(0 == msg.msg_iovlen, NULL);
+}
+
+START_TEST(test_sendmsg_recvmsg)
+{
+	struct fbr_context context;
+	fbr_id_t reader = FBR_ID_NULL, writer = FBR_ID_NULL;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval);
+
+	reader = fbr_create(&context, "reader_msg", msg_reader_fiber, fds + 0,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer_msg", msg_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader));
+	fail_unless(fbr_is_reclaimed(&context, writer));
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#ifdef HAVE_RECVMMSG
+#define mmsg_count 10
+static void mmsg_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char bufs[16][8];
+	struct mmsghdr msgs[16];
+	struct iovec iovs[16];
+	int retval;
+	int i;
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for (i = 0; i < 16; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	retval = fbr_recvmmsg_wto(FBR_A_ fd, msgs, 16, 0, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+
+	/* The whole batch is picked up by a single wakeup */
+	retval = fbr_recvmmsg(FBR_A_ fd, msgs, 16, 0);
+	fail_unless(mmsg_count == retval, "%d", retval);
+	for (i = 0; i < mmsg_count; i++) {
+		fail_unless(2 == msgs[i].msg_len, NULL);
+		fail_unless('a' + i == bufs[i][0], NULL);
+	}
+}
+
+static void mmsg_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char bufs[mmsg_count][2];
+	struct mmsghdr msgs[mmsg_count];
+	struct iovec iovs[mmsg_count];
+	int retval;
+	int i;
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for (i = 0; i < mmsg_count; i++) {
+		bufs[i][0] = 'a' + i;
+		bufs[i][1] = '\0';
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	fbr_sleep(FBR_A_ 0.05);
+	retval = fbr_sendmmsg(FBR_A_ fd, msgs, mmsg_count, 0);
+	fail_unless(mmsg_count == retval, NULL);
+	for (i = 0; i < mmsg_count; i++)
+		fail_unless(2 == msgs[i].msg_len, NULL);
+}
+#undef mmsg_count
+
+START_TEST(test_mmsg)
+{
+	struct fbr_context context;
+	fbr_id_t reader = FBR_ID_NULL, writer = FBR_ID_NULL;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_DGRAM, 0, fds);
+	fail_unless(0 == retval);
+
+	reader = fbr_create(&context, "reader_mmsg", mmsg_reader_fiber, fds + 0,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer_mmsg", mmsg_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader));
+	fail_unless(fbr_is_reclaimed(&context, writer));
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+#endif
+
+#define pump_size (1 * 1024 * 1024 + 7)
+static void pump_check_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(pump_size + 1);
+	char *expected = malloc(pump_size);
+	ssize_t retval;
+
+	retval = fbr_read_all(FBR_A_ fd, buf, pump_size + 1);
+	fail_unless(pump_size == retval, "%zd", retval);
+	fill_pattern(expected, 0, pump_size);
+	fail_unless(0 == memcmp(buf, expected, pump_size), NULL);
+	free(expected);
+	free(buf);
+}
+
+#ifdef HAVE_SENDFILE
+static void sendfile_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	off_t offset = 0;
+	ssize_t retval;
+
+	retval = fbr_sendfile_all(FBR_A_ fds[1], fds[2], &offset,
+			pump_size + 100);
+	fail_unless(pump_size == retval, "%zd", retval);
+	fail_unless(pump_size == offset, NULL);
+	close(fds[1]);
+}
+
+START_TEST(test_sendfile)
+{
+	struct fbr_context context;
+	fbr_id_t reader = FBR_ID_NULL, sender = FBR_ID_NULL;
+	char path[] = "/tmp/fbr_sendfile.XXXXXX";
+	char *buf = malloc(pump_size);
+	int fds[3];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fds[2] = mkstemp(path);
+	fail_unless(fds[2] >= 0);
+	unlink(path);
+	fill_pattern(buf, 0, pump_size);
+	retval = write(fds[2], buf, pump_size);
+	fail_unless(pump_size == retval);
+	free(buf);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval);
+	retval = fbr_fd_nonblock(&context, fds[0]);
+	fail_unless(0 == retval);
+	retval = fbr_fd_register(&context, fds[1]);
+	fail_unless(0 == retval);
+
+	reader = fbr_create(&context, "reader_sendfile", pump_check_fiber,
+			fds + 0, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	sender = fbr_create(&context, "sendfile", sendfile_fiber, fds, 0);
+	fail_if(fbr_id_isnull(sender), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, sender);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader));
+	fail_unless(fbr_is_reclaimed(&context, sender));
+
+	fbr_fd_unregister(&context, fds[1]);
+	close(fds[0]);
+	close(fds[2]);
+	fbr_destroy(&context);
+}
+END_TEST
+#endif
+
+#ifdef HAVE_SPLICE
+static void pump_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(pump_size);
+	ssize_t retval;
+
+	fill_pattern(buf, 0, pump_size);
+	retval = fbr_write_all(FBR_A_ fd, buf, pump_size);
+	fail_unless(pump_size == retval, NULL);
+	close(fd);
+	free(buf);
+}
+
+static void proxy_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	ssize_t retval;
+
+	retval = fbr_proxy(FBR_A_ fds[0], fds[1]);
+	fail_unless(pump_size == retval, "%zd", retval);
+	shutdown(fds[1], SHUT_WR);
+}
+
+START_TEST(test_proxy)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer, proxy;
+	int in_fds[2], out_fds[2];
+	int proxy_fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, in_fds);
+	fail_unless(0 == retval);
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, out_fds);
+	fail_unless(0 == retval);
+	fail_unless(0 == fbr_fd_nonblock(&context, in_fds[1]));
+	fail_unless(0 == fbr_fd_register(&context, in_fds[0]));
+	fail_unless(0 == fbr_fd_nonblock(&context, out_fds[0]));
+	fail_unless(0 == fbr_fd_nonblock(&context, out_fds[1]));
+	proxy_fds[0] = in_fds[0];
+	proxy_fds[1] = out_fds[0];
+
+	reader = fbr_create(&context, "reader_proxy", pump_check_fiber,
+			out_fds + 1, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	proxy = fbr_create(&context, "proxy", proxy_fiber, proxy_fds, 0);
+	fail_if(fbr_id_isnull(proxy), NULL);
+	writer = fbr_create(&context, "writer_proxy", pump_writer_fiber,
+			in_fds + 1, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	fail_unless(0 == fbr_transfer(&context, reader), NULL);
+	fail_unless(0 == fbr_transfer(&context, proxy), NULL);
+	fail_unless(0 == fbr_transfer(&context, writer), NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader));
+	fail_unless(fbr_is_reclaimed(&context, proxy));
+	fail_unless(fbr_is_reclaimed(&context, writer));
+
+	fbr_fd_unregister(&context, in_fds[0]);
+	close(in_fds[0]);
+	close(out_fds[0]);
+	close(out_fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+/* Fills a non-blocking pipe up, returns the number of bytes in it */
+static size_t fill_pipe(int fd)
+{
+	char buf[4096];
+	size_t total = 0;
+	ssize_t retval;
+
+	memset(buf, 'x', sizeof(buf));
+	for (;;) {
+		retval = write(fd, buf, sizeof(buf));
+		if (-1 == retval) {
+			fail_unless(EAGAIN == errno, NULL);
+			return total;
+		}
+		total += retval;
+	}
+}
+
+struct pipe_drain_arg {
+	int fd;
+	size_t size;
+};
+
+static void pipe_drain_fiber(FBR_P_ void *_arg)
+{
+	struct pipe_drain_arg *arg = _arg;
+	char buf[4096];
+	size_t total = 0;
+	ssize_t retval;
+
+	fbr_sleep(FBR_A_ 0.1);
+	while (total < arg->size) {
+		retval = read(arg->fd, buf, min(sizeof(buf), arg->size - total));
+		fail_unless(retval > 0, NULL);
+		total += retval;
+	}
+}
+
+static void tee_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	char buf[16];
+	ssize_t retval;
+
+	retval = fbr_tee(FBR_A_ fds[0], fds[1], sizeof(buf), 0);
+	fail_unless(5 == retval, "%zd", retval);
+	/* tee does not consume the input */
+	retval = read(fds[0], buf, sizeof(buf));
+	fail_unless(5 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "hello", 5), NULL);
+}
+
+START_TEST(test_tee)
+{
+	struct fbr_context context;
+	struct pipe_drain_arg drain_arg;
+	fbr_id_t tee, drain;
+	int in_fds[2], out_fds[2];
+	int tee_fds[2];
+	unsigned int iteration;
+	char buf[16];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fail_unless(0 == pipe2(in_fds, O_NONBLOCK), NULL);
+	fail_unless(0 == pipe2(out_fds, O_NONBLOCK), NULL);
+	tee_fds[0] = in_fds[0];
+	tee_fds[1] = out_fds[1];
+	drain_arg.fd = out_fds[0];
+	drain_arg.size = fill_pipe(out_fds[1]);
+	retval = write(in_fds[1], "hello", 5);
+	fail_unless(5 == retval, NULL);
+
+	/* Input is there, but the output pipe stays full for a while: the
+	 * fiber has to wait for it instead of spinning the loop */
+	tee = fbr_create(&context, "tee", tee_fiber, tee_fds, 0);
+	fail_if(fbr_id_isnull(tee), NULL);
+	drain = fbr_create(&context, "drain", pipe_drain_fiber, &drain_arg, 0);
+	fail_if(fbr_id_isnull(drain), NULL);
+	fail_unless(0 == fbr_transfer(&context, tee), NULL);
+	fail_unless(0 == fbr_transfer(&context, drain), NULL);
+
+	iteration = ev_iteration(EV_DEFAULT);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(ev_iteration(EV_DEFAULT) - iteration < 100, NULL);
+
+	fail_unless(fbr_is_reclaimed(&context, tee), NULL);
+	fail_unless(fbr_is_reclaimed(&context, drain), NULL);
+	retval = read(out_fds[0], buf, sizeof(buf));
+	fail_unless(5 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "hello", 5), NULL);
+
+	close(in_fds[0]);
+	close(in_fds[1]);
+	close(out_fds[0]);
+	close(out_fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void splice_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	ssize_t retval;
+
+	retval = fbr_splice(FBR_A_ fds[0], NULL, fds[1], NULL, 16, 0);
+	fail_unless(5 == retval, "%zd", retval);
+}
+
+START_TEST(test_splice_full_pipe)
+{
+	struct fbr_context context;
+	struct pipe_drain_arg drain_arg;
+	fbr_id_t splicer, drain;
+	int sock_fds[2], out_fds[2];
+	int splice_fds[2];
+	unsigned int iteration;
+	char buf[16];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, sock_fds);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == pipe2(out_fds, O_NONBLOCK), NULL);
+	splice_fds[0] = sock_fds[0];
+	splice_fds[1] = out_fds[1];
+	drain_arg.fd = out_fds[0];
+	drain_arg.size = fill_pipe(out_fds[1]);
+	retval = write(sock_fds[1], "world", 5);
+	fail_unless(5 == retval, NULL);
+
+	/* The socket is readable, it's the pipe that is not ready */
+	splicer = fbr_create(&context, "splice", splice_fiber, splice_fds, 0);
+	fail_if(fbr_id_isnull(splicer), NULL);
+	drain = fbr_create(&context, "drain", pipe_drain_fiber, &drain_arg, 0);
+	fail_if(fbr_id_isnull(drain), NULL);
+	fail_unless(0 == fbr_transfer(&context, splicer), NULL);
+	fail_unless(0 == fbr_transfer(&context, drain), NULL);
+
+	iteration = ev_iteration(EV_DEFAULT);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(ev_iteration(EV_DEFAULT) - iteration < 100, NULL);
+
+	fail_unless(fbr_is_reclaimed(&context, splicer), NULL);
+	fail_unless(fbr_is_reclaimed(&context, drain), NULL);
+	retval = read(out_fds[0], buf, sizeof(buf));
+	fail_unless(5 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "world", 5), NULL);
+
+	close(sock_fds[0]);
+	close(sock_fds[1]);
+	close(out_fds[0]);
+	close(out_fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+#endif
+#undef pump_size
+
 static void line_reader_fiber(FBR_P_ void *_arg)
 {
 	int fd = *(int *)_arg;
@@ -489,6 +1078,344 @@ START_TEST(test_tcp)
 END_TEST
 
 
+#define zc_size (4 * 1024 * 1024)
+static void zc_release_cb(_unused_ FBR_P_ struct fbr_zc *zc, void *arg)
+{
+	fail_unless(zc->released, NULL);
+	(*(int *)arg)++;
+}
+
+static void zc_sender_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(zc_size);
+	struct fbr_zc zc, small_zc;
+	int small_released = 0;
+	ssize_t retval;
+
+	fill_pattern(buf, 0, zc_size);
+
+	fbr_zc_init(FBR_A_ &zc, NULL, NULL);
+	retval = fbr_send_zc(FBR_A_ fd, buf, zc_size - 10, 0, &zc);
+	fail_unless(zc_size - 10 == retval, NULL);
+	retval = fbr_zc_wait(FBR_A_ &zc);
+	fail_unless(0 == retval, NULL);
+	fail_unless(zc.released, NULL);
+	fail_unless(0 == zc.pending, NULL);
+	fail_if(zc.aborted, NULL);
+
+	/* Below the threshold the data is copied and released right away */
+	fbr_zc_init(FBR_A_ &small_zc, zc_release_cb, &small_released);
+	retval = fbr_send_zc(FBR_A_ fd, buf + zc_size - 10, 10, 0, &small_zc);
+	fail_unless(10 == retval, NULL);
+	fail_unless(1 == small_released, NULL);
+	fail_unless(small_zc.copied, NULL);
+
+	shutdown(fd, SHUT_WR);
+	free(buf);
+}
+
+static void zc_receiver_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(zc_size + 1);
+	char *expected = malloc(zc_size);
+	ssize_t retval;
+
+	retval = fbr_read_all(FBR_A_ fd, buf, zc_size + 1);
+	fail_unless(zc_size == retval, "%zd", retval);
+	fill_pattern(expected, 0, zc_size);
+	fail_unless(0 == memcmp(buf, expected, zc_size), NULL);
+	free(expected);
+	free(buf);
+}
+
+static void zc_unregistered_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	struct fbr_zc zc;
+	ssize_t retval;
+
+	fbr_zc_init(FBR_A_ &zc, NULL, NULL);
+	retval = fbr_send_zc(FBR_A_ fd, "x", 1, 0, &zc);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(EINVAL == errno, NULL);
+}
+
+START_TEST(test_send_zc)
+{
+	struct fbr_context context;
+	fbr_id_t sender, receiver, unregistered;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listen_fd, fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(listen_fd < 0);
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	fail_unless(0 == retval);
+	retval = listen(listen_fd, 1);
+	fail_unless(0 == retval);
+	retval = getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen);
+	fail_unless(0 == retval);
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fds[0] < 0);
+	retval = connect(fds[0], (struct sockaddr *)&addr, addrlen);
+	fail_unless(0 == retval);
+	fds[1] = accept(listen_fd, NULL, NULL);
+	fail_if(fds[1] < 0);
+	close(listen_fd);
+
+	fail_unless(0 == fbr_fd_register(&context, fds[0]));
+	fail_unless(0 == fbr_fd_nonblock(&context, fds[1]));
+
+	unregistered = fbr_create(&context, "zc_unregistered",
+			zc_unregistered_fiber, fds + 1, 0);
+	fail_if(fbr_id_isnull(unregistered), NULL);
+	fail_unless(0 == fbr_transfer(&context, unregistered), NULL);
+	receiver = fbr_create(&context, "zc_receiver", zc_receiver_fiber,
+			fds + 1, 0);
+	fail_if(fbr_id_isnull(receiver), NULL);
+	sender = fbr_create(&context, "zc_sender", zc_sender_fiber, fds, 0);
+	fail_if(fbr_id_isnull(sender), NULL);
+	fail_unless(0 == fbr_transfer(&context, receiver), NULL);
+	fail_unless(0 == fbr_transfer(&context, sender), NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, unregistered));
+	fail_unless(fbr_is_reclaimed(&context, receiver));
+	fail_unless(fbr_is_reclaimed(&context, sender));
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]));
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+/* The kernel goes on numbering the sends of the socket after it is
+ * registered again, a request numbered from zero would never be released */
+static void zc_reregister_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(zc_size);
+	struct fbr_zc zc;
+	ssize_t retval;
+
+	fill_pattern(buf, 0, zc_size);
+
+	fbr_zc_init(FBR_A_ &zc, NULL, NULL);
+	retval = fbr_send_zc(FBR_A_ fd, buf, zc_size / 2, 0, &zc);
+	fail_unless(zc_size / 2 == retval, NULL);
+	fail_unless(0 == fbr_zc_wait(FBR_A_ &zc), NULL);
+	fail_if(zc.aborted, NULL);
+
+	fail_unless(0 == fbr_fd_unregister(FBR_A_ fd), NULL);
+	fail_unless(0 == fbr_fd_register(FBR_A_ fd), NULL);
+
+	retval = fbr_send_zc(FBR_A_ fd, buf + zc_size / 2, zc_size / 2, 0,
+			&zc);
+	fail_unless(zc_size / 2 == retval, NULL);
+	fail_unless(0 == fbr_zc_wait(FBR_A_ &zc), NULL);
+	fail_unless(zc.released, NULL);
+	fail_if(zc.aborted, NULL);
+
+	shutdown(fd, SHUT_WR);
+	free(buf);
+}
+
+START_TEST(test_send_zc_reregister)
+{
+	struct fbr_context context;
+	fbr_id_t sender, receiver;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listen_fd, fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(listen_fd < 0);
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	fail_unless(0 == retval);
+	retval = listen(listen_fd, 1);
+	fail_unless(0 == retval);
+	retval = getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen);
+	fail_unless(0 == retval);
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fds[0] < 0);
+	retval = connect(fds[0], (struct sockaddr *)&addr, addrlen);
+	fail_unless(0 == retval);
+	fds[1] = accept(listen_fd, NULL, NULL);
+	fail_if(fds[1] < 0);
+	close(listen_fd);
+
+	fail_unless(0 == fbr_fd_register(&context, fds[0]));
+	fail_unless(0 == fbr_fd_nonblock(&context, fds[1]));
+
+	receiver = fbr_create(&context, "zc_receiver", zc_receiver_fiber,
+			fds + 1, 0);
+	fail_if(fbr_id_isnull(receiver), NULL);
+	sender = fbr_create(&context, "zc_reregister", zc_reregister_fiber,
+			fds, 0);
+	fail_if(fbr_id_isnull(sender), NULL);
+	fail_unless(0 == fbr_transfer(&context, receiver), NULL);
+	fail_unless(0 == fbr_transfer(&context, sender), NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, receiver));
+	fail_unless(fbr_is_reclaimed(&context, sender));
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]));
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_send_zc_abort)
+{
+	struct fbr_context context;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct fbr_zc zc;
+	int listen_fd, fds[2];
+	char *buf;
+	int released = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(listen_fd < 0);
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	fail_unless(0 == retval);
+	retval = listen(listen_fd, 1);
+	fail_unless(0 == retval);
+	retval = getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen);
+	fail_unless(0 == retval);
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fds[0] < 0);
+	retval = connect(fds[0], (struct sockaddr *)&addr, addrlen);
+	fail_unless(0 == retval);
+	fds[1] = accept(listen_fd, NULL, NULL);
+	fail_if(fds[1] < 0);
+	close(listen_fd);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]));
+
+	/* Over the loopback the buffer is referenced until the peer reads the
+	 * data, which it never does here */
+	buf = malloc(64 * 1024);
+	fill_pattern(buf, 0, 64 * 1024);
+	fbr_zc_init(&context, &zc, zc_release_cb, &released);
+	retval = fbr_send_zc(&context, fds[0], buf, 64 * 1024, 0, &zc);
+	fail_unless(64 * 1024 == retval, NULL);
+	if (zc.released) {
+		/* No zerocopy here, the data has been copied */
+		fail_unless(zc.copied, NULL);
+		fail_if(zc.aborted, NULL);
+	} else {
+		fail_unless(0 == fbr_fd_unregister(&context, fds[0]));
+		fail_unless(1 == released, NULL);
+		fail_unless(zc.released, NULL);
+		fail_unless(zc.aborted, NULL);
+	}
+
+	fbr_fd_unregister(&context, fds[0]);
+	close(fds[0]);
+	close(fds[1]);
+	free(buf);
+	fbr_destroy(&context);
+}
+END_TEST
+#undef zc_size
+
+#define accept_clients 5
+static void acceptor_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	int fds[16];
+	int retval;
+	int i;
+
+	/* All the pending connections are taken in a single call */
+	retval = fbr_accept_batch(FBR_A_ fd, fds, 16);
+	fail_unless(accept_clients == retval, "%d", retval);
+	for (i = 0; i < retval; i++) {
+		fail_unless(fcntl(fds[i], F_GETFL) & O_NONBLOCK, NULL);
+		fail_unless(fcntl(fds[i], F_GETFD) & FD_CLOEXEC, NULL);
+		close(fds[i]);
+	}
+}
+
+START_TEST(test_accept_batch)
+{
+	struct fbr_context context;
+	fbr_id_t acceptor;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listen_fd, other_fd;
+	int clients[accept_clients];
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listen_fd = fbr_listen_reuseport(&context, (struct sockaddr *)&addr,
+			sizeof(addr), 16);
+	fail_if(listen_fd < 0);
+	retval = getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen);
+	fail_unless(0 == retval);
+	/* Another worker may listen on the same port */
+	other_fd = fbr_listen_reuseport(&context, (struct sockaddr *)&addr,
+			addrlen, 16);
+	fail_if(other_fd < 0);
+	fail_unless(0 == fbr_fd_unregister(&context, other_fd));
+	close(other_fd);
+
+	acceptor = fbr_create(&context, "acceptor", acceptor_fiber,
+			&listen_fd, 0);
+	fail_if(fbr_id_isnull(acceptor), NULL);
+	fail_unless(0 == fbr_transfer(&context, acceptor), NULL);
+
+	for (i = 0; i < accept_clients; i++) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		fail_if(clients[i] < 0);
+		retval = connect(clients[i], (struct sockaddr *)&addr,
+				addrlen);
+		fail_unless(0 == retval);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, acceptor));
+
+	for (i = 0; i < accept_clients; i++)
+		close(clients[i]);
+	fail_unless(0 == fbr_fd_unregister(&context, listen_fd));
+	close(listen_fd);
+	fbr_destroy(&context);
+}
+END_TEST
+#undef accept_clients
+
 TCase * io_tcase(void)
 {
 	TCase *tc_io = tcase_create ("IO");
@@ -498,5 +1425,22 @@ TCase * io_tcase(void)
 	tcase_add_test(tc_io, test_udp);
 	tcase_add_test(tc_io, test_tcp);
 	tcase_add_test(tc_io, test_read_write_premature);
+	tcase_add_test(tc_io, test_readv_writev_all);
+	tcase_add_test(tc_io, test_sendmsg_recvmsg);
+#ifdef HAVE_RECVMMSG
+	tcase_add_test(tc_io, test_mmsg);
+#endif
+#ifdef HAVE_SENDFILE
+	tcase_add_test(tc_io, test_sendfile);
+#endif
+#ifdef HAVE_SPLICE
+	tcase_add_test(tc_io, test_proxy);
+	tcase_add_test(tc_io, test_tee);
+	tcase_add_test(tc_io, test_splice_full_pipe);
+#endif
+	tcase_add_test(tc_io, test_send_zc);
+	tcase_add_test(tc_io, test_send_zc_reregister);
+	tcase_add_test(tc_io, test_send_zc_abort);
+	tcase_add_test(tc_io, test_accept_batch);
 	return tc_io;
 }
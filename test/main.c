@@ -32,12 +32,25 @@
 #include "eio.h"
 #include "async-wait.h"
 #include "popen3.h"
+#include "group.h"
+#include "chan.h"
+#include "stack.h"
+#include "wheel.h"
+#include "deadline.h"
+#include "fd.h"
+#include "stream.h"
+#include "pool.h"
+#include "uring.h"
+#include "file.h"
 
 Suite *evfibers_suite(void)
 {
 	Suite *s;
 	TCase *tc_init, *tc_mutex, *tc_cond, *tc_reclaim, *tc_io, *tc_logger,
-	      *tc_buffer, *tc_key, *tc_eio, *tc_async_wait, *tc_popen3;
+	      *tc_buffer, *tc_key, *tc_eio, *tc_async_wait, *tc_popen3,
+	      *tc_group, *tc_chan, *tc_stack, *tc_wheel,
+	      *tc_deadline, *tc_fd, *tc_stream, *tc_pool, *tc_uring,
+	      *tc_file;
 
 	s = suite_create ("evfibers");
 	tc_init = init_tcase();
@@ -51,6 +64,16 @@ Suite *evfibers_suite(void)
 	tc_eio = eio_tcase();
 	tc_async_wait = async_wait_tcase();
 	tc_popen3 = popen3_tcase();
+	tc_group = group_tcase();
+	tc_chan = chan_tcase();
+	tc_stack = stack_tcase();
+	tc_wheel = wheel_tcase();
+	tc_deadline = deadline_tcase();
+	tc_fd = fd_tcase();
+	tc_stream = stream_tcase();
+	tc_pool = pool_tcase();
+	tc_uring = uring_tcase();
+	tc_file = file_tcase();
 	suite_add_tcase(s, tc_init);
 	suite_add_tcase(s, tc_mutex);
 	suite_add_tcase(s, tc_cond);
@@ -62,6 +85,16 @@ Suite *evfibers_suite(void)
 	suite_add_tcase(s, tc_eio);
 	suite_add_tcase(s, tc_async_wait);
 	suite_add_tcase(s, tc_popen3);
+	suite_add_tcase(s, tc_group);
+	suite_add_tcase(s, tc_chan);
+	suite_add_tcase(s, tc_stack);
+	suite_add_tcase(s, tc_wheel);
+	suite_add_tcase(s, tc_deadline);
+	suite_add_tcase(s, tc_fd);
+	suite_add_tcase(s, tc_stream);
+	suite_add_tcase(s, tc_pool);
+	suite_add_tcase(s, tc_uring);
+	suite_add_tcase(s, tc_file);
 
 	return s;
 }
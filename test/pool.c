@@ -0,0 +1,229 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "pool.h"
+
+struct pool_test {
+	struct fbr_pool *pool;
+	struct sockaddr_in addr;
+	struct sockaddr_in refused_addr;
+	int listen_fd;
+	int held_fd;
+};
+
+static int listen_loopback(struct sockaddr_in *addr)
+{
+	socklen_t addrlen = sizeof(*addr);
+	int fd;
+	int retval;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fd < 0);
+	memset(addr, 0x00, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+	fail_unless(0 == retval);
+	retval = listen(fd, 16);
+	fail_unless(0 == retval);
+	retval = getsockname(fd, (struct sockaddr *)addr, &addrlen);
+	fail_unless(0 == retval);
+	return fd;
+}
+
+static void reuse_fiber(FBR_P_ void *_arg)
+{
+	struct pool_test *pt = _arg;
+	struct sockaddr *addr = (struct sockaddr *)&pt->addr;
+	struct fbr_pool_stats stats;
+	int fd, fd2, server_fd;
+
+	fd = fbr_pool_checkout(FBR_A_ pt->pool, addr, sizeof(pt->addr), 1.0);
+	fail_if(fd < 0);
+	fail_unless(0 == fbr_pool_checkin(FBR_A_ pt->pool, fd, 1), NULL);
+	fd2 = fbr_pool_checkout(FBR_A_ pt->pool, addr, sizeof(pt->addr), 1.0);
+	fail_unless(fd == fd2, NULL);
+
+	/* Closed by the peer while idle, replaced by a new connection */
+	fail_unless(0 == fbr_pool_checkin(FBR_A_ pt->pool, fd, 1), NULL);
+	server_fd = accept(pt->listen_fd, NULL, NULL);
+	fail_if(server_fd < 0);
+	close(server_fd);
+	fbr_sleep(FBR_A_ 0.01);
+	fd = fbr_pool_checkout(FBR_A_ pt->pool, addr, sizeof(pt->addr), 1.0);
+	fail_if(fd < 0);
+	fail_unless(0 == fbr_pool_checkin(FBR_A_ pt->pool, fd, 0), NULL);
+	fail_unless(-1 == fbr_pool_checkin(FBR_A_ pt->pool, fd, 0), NULL);
+	fail_unless(FBR_EINVAL == fctx->f_errno, NULL);
+
+	fd = fbr_pool_checkout(FBR_A_ pt->pool,
+			(struct sockaddr *)&pt->refused_addr,
+			sizeof(pt->refused_addr), 1.0);
+	fail_unless(-1 == fd, NULL);
+	fail_unless(ECONNREFUSED == errno, NULL);
+	fail_unless(FBR_ESYSTEM == fctx->f_errno, NULL);
+
+	fbr_pool_get_stats(FBR_A_ pt->pool, &stats);
+	fail_unless(1 == stats.hits, NULL);
+	fail_unless(2 == stats.misses, NULL);
+	fail_unless(1 == stats.broken, NULL);
+	fail_unless(1 == stats.connect_failures, NULL);
+	fail_unless(0 == stats.waits, NULL);
+	fail_unless(0 == stats.idle, NULL);
+	fail_unless(0 == stats.busy, NULL);
+	fail_unless(0 == stats.connecting, NULL);
+}
+
+START_TEST(test_pool_reuse)
+{
+	struct fbr_context context;
+	struct fbr_pool_params params;
+	struct pool_test pt;
+	fbr_id_t fiber;
+	int refused_fd;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	pt.listen_fd = listen_loopback(&pt.addr);
+	refused_fd = listen_loopback(&pt.refused_addr);
+	close(refused_fd);
+
+	memset(&params, 0x00, sizeof(params));
+	pt.pool = fbr_pool_create(&context, &params);
+	fail_if(NULL == pt.pool, NULL);
+
+	fiber = fbr_create(&context, "reuse", reuse_fiber, &pt, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, fiber), NULL);
+
+	fbr_pool_destroy(&context, pt.pool);
+	close(pt.listen_fd);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void holder_fiber(FBR_P_ void *_arg)
+{
+	struct pool_test *pt = _arg;
+	int fd;
+
+	fd = fbr_pool_checkout(FBR_A_ pt->pool, (struct sockaddr *)&pt->addr,
+			sizeof(pt->addr), 1.0);
+	fail_if(fd < 0);
+	pt->held_fd = fd;
+	fbr_sleep(FBR_A_ 0.05);
+	fail_unless(0 == fbr_pool_checkin(FBR_A_ pt->pool, fd, 1), NULL);
+}
+
+static void waiter_fiber(FBR_P_ void *_arg)
+{
+	struct pool_test *pt = _arg;
+	int fd;
+
+	fd = fbr_pool_checkout(FBR_A_ pt->pool, (struct sockaddr *)&pt->addr,
+			sizeof(pt->addr), 1.0);
+	fail_unless(fd == pt->held_fd, NULL);
+	fail_unless(0 == fbr_pool_checkin(FBR_A_ pt->pool, fd, 1), NULL);
+}
+
+static void impatient_fiber(FBR_P_ void *_arg)
+{
+	struct pool_test *pt = _arg;
+	int fd;
+
+	fd = fbr_pool_checkout(FBR_A_ pt->pool, (struct sockaddr *)&pt->addr,
+			sizeof(pt->addr), 0.01);
+	fail_unless(-1 == fd, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+}
+
+START_TEST(test_pool_wait)
+{
+	struct fbr_context context;
+	struct fbr_pool_params params;
+	struct fbr_pool_stats stats;
+	struct pool_test pt;
+	fbr_id_t holder, waiter, impatient;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	pt.listen_fd = listen_loopback(&pt.addr);
+	memset(&params, 0x00, sizeof(params));
+	params.max_conns = 1;
+	params.idle_timeout = 0.05;
+	pt.pool = fbr_pool_create(&context, &params);
+	fail_if(NULL == pt.pool, NULL);
+
+	holder = fbr_create(&context, "holder", holder_fiber, &pt, 0);
+	fail_if(fbr_id_isnull(holder), NULL);
+	retval = fbr_transfer(&context, holder);
+	fail_unless(0 == retval, NULL);
+	waiter = fbr_create(&context, "waiter", waiter_fiber, &pt, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+	impatient = fbr_create(&context, "impatient", impatient_fiber, &pt, 0);
+	fail_if(fbr_id_isnull(impatient), NULL);
+	retval = fbr_transfer(&context, impatient);
+	fail_unless(0 == retval, NULL);
+
+	/* Returns once the reaper has evicted the idle connection */
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, holder), NULL);
+	fail_unless(fbr_is_reclaimed(&context, waiter), NULL);
+	fail_unless(fbr_is_reclaimed(&context, impatient), NULL);
+
+	fbr_pool_get_stats(&context, pt.pool, &stats);
+	fail_unless(1 == stats.misses, NULL);
+	fail_unless(1 == stats.hits, NULL);
+	fail_unless(2 == stats.waits, NULL);
+	fail_unless(1 == stats.timeouts, NULL);
+	fail_unless(1 == stats.evictions, NULL);
+	fail_unless(0 == stats.idle, NULL);
+	fail_unless(stats.max_wait_time >= 0.03, "%f", stats.max_wait_time);
+	fail_unless(stats.wait_time >= stats.max_wait_time, NULL);
+
+	fbr_pool_destroy(&context, pt.pool);
+	close(pt.listen_fd);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * pool_tcase(void)
+{
+	TCase *tc_pool = tcase_create ("pool");
+	tcase_add_test(tc_pool, test_pool_reuse);
+	tcase_add_test(tc_pool, test_pool_wait);
+	return tc_pool;
+}
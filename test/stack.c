@@ -0,0 +1,276 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "stack.h"
+
+static void noop_fiber(_unused_ FBR_P_ _unused_ void *_arg)
+{
+}
+
+static void run_fibers(FBR_P_ size_t stack_size, int count)
+{
+	fbr_id_t ids[count];
+	int i, retval;
+
+	for (i = 0; i < count; i++) {
+		ids[i] = fbr_create(FBR_A_ "noop", noop_fiber, NULL,
+				stack_size);
+		fail_if(fbr_id_isnull(ids[i]), NULL);
+	}
+	for (i = 0; i < count; i++) {
+		retval = fbr_transfer(FBR_A_ ids[i]);
+		fail_unless(0 == retval, NULL);
+		fail_unless(fbr_is_reclaimed(FBR_A_ ids[i]), NULL);
+	}
+}
+
+START_TEST(test_stack_classes)
+{
+	struct fbr_context context;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	run_fibers(&context, 20 * 1024, 3);
+	/* 20 KB and 32 KB belong to the same class, default stacks do not */
+	fail_unless(3 == fbr_stack_pool_count(&context, 20 * 1024), NULL);
+	fail_unless(3 == fbr_stack_pool_count(&context, 32 * 1024), NULL);
+	fail_unless(0 == fbr_stack_pool_count(&context, 0), NULL);
+
+	run_fibers(&context, 0, 2);
+	fail_unless(3 == fbr_stack_pool_count(&context, 20 * 1024), NULL);
+	fail_unless(2 == fbr_stack_pool_count(&context, 0), NULL);
+
+	/* Stacks are reused within the class */
+	fbr_create(&context, "idle", noop_fiber, NULL, 17 * 1024);
+	fail_unless(2 == fbr_stack_pool_count(&context, 20 * 1024), NULL);
+
+	/* Oversized stacks are not pooled by default, except for the one of
+	 * the fiber which has reclaimed itself last as it was still running
+	 * on it */
+	run_fibers(&context, 4 * 1024 * 1024, 3);
+	fail_unless(1 == fbr_stack_pool_count(&context, 4 * 1024 * 1024),
+			NULL);
+	fail_unless(4 * 1024 * 1024 == fbr_stack_pool_trim(&context, 0)
+			- 2 * 32 * 1024 - 2 * FBR_STACK_SIZE, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_stack_cap)
+{
+	struct fbr_context context;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fbr_stack_pool_set_cap(&context, 0, 2);
+	run_fibers(&context, 0, 5);
+	fail_unless(2 == fbr_stack_pool_count(&context, 0), NULL);
+
+	fbr_stack_pool_set_cap(&context, 0, 1);
+	fail_unless(1 == fbr_stack_pool_count(&context, 0), NULL);
+
+	fbr_stack_pool_set_cap(&context, 0, FBR_STACK_POOL_UNLIMITED);
+	run_fibers(&context, 0, 5);
+	fail_unless(5 == fbr_stack_pool_count(&context, 0), NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_stack_prewarm_trim)
+{
+	struct fbr_context context;
+	size_t released;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fail_unless(10 == fbr_stack_pool_prewarm(&context, 8192, 10), NULL);
+	fail_unless(10 == fbr_stack_pool_count(&context, 8192), NULL);
+	fail_unless(0 == fbr_stack_pool_prewarm(&context, 8192, 5), NULL);
+	fbr_create(&context, "idle", noop_fiber, NULL, 8192);
+	fail_unless(9 == fbr_stack_pool_count(&context, 8192), NULL);
+
+	fbr_stack_pool_set_cap(&context, 0, 3);
+	fail_unless(3 == fbr_stack_pool_prewarm(&context, 0, 10), NULL);
+
+	released = fbr_stack_pool_trim(&context, 1);
+	fail_unless(8 * 8192 + 2 * FBR_STACK_SIZE == released, NULL);
+	fail_unless(1 == fbr_stack_pool_count(&context, 8192), NULL);
+	fail_unless(1 == fbr_stack_pool_count(&context, 0), NULL);
+
+	/* Trimmed fibers are reused for new stacks */
+	run_fibers(&context, 0, 3);
+	fail_unless(3 == fbr_stack_pool_count(&context, 0), NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static int recurse(int depth)
+{
+	volatile char buf[512];
+	buf[0] = depth;
+	if (0 == depth)
+		return buf[0];
+	return recurse(depth - 1) + buf[0];
+}
+
+static void deep_fiber(_unused_ FBR_P_ void *_arg)
+{
+	int *depth = _arg;
+	recurse(*depth);
+}
+
+START_TEST(test_stack_guard)
+{
+	struct fbr_context context;
+	fbr_id_t id;
+	int depth = 1000;
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	fail_if(-1 == pid, NULL);
+	if (0 == pid) {
+		signal(SIGSEGV, SIG_DFL);
+		fbr_init(&context, EV_DEFAULT);
+		/* Half a megabyte of frames on a 16 KB stack */
+		id = fbr_create(&context, "deep", deep_fiber, &depth,
+				16 * 1024);
+		fbr_transfer(&context, id);
+		_exit(0);
+	}
+	fail_unless(pid == waitpid(pid, &status, 0), NULL);
+	fail_unless(WIFSIGNALED(status), NULL);
+	fail_unless(SIGSEGV == WTERMSIG(status), NULL);
+}
+END_TEST
+
+static int stack_resident_pages(fbr_id_t id)
+{
+	struct fbr_fiber *fiber = id.p;
+	size_t sz = sysconf(_SC_PAGESIZE);
+	size_t pages = fiber->stack_size / sz, i;
+	unsigned char vec[pages];
+	int count = 0;
+
+	fail_unless(0 == mincore(fiber->stack, fiber->stack_size, vec), NULL);
+	for (i = 0; i < pages; i++)
+		count += vec[i] & 1;
+	return count;
+}
+
+static int stack_resident(fbr_id_t id)
+{
+	struct fbr_fiber *fiber = id.p;
+	return stack_resident_pages(id) ==
+		(int)(fiber->stack_size / sysconf(_SC_PAGESIZE));
+}
+
+START_TEST(test_stack_populate_release)
+{
+	struct fbr_context context;
+	fbr_id_t id;
+	int depth = 100;
+	int i, retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	id = fbr_create(&context, "lazy", noop_fiber, NULL, 256 * 1024);
+	fail_if(stack_resident(id), NULL);
+	id = fbr_create_flags(&context, "eager", noop_fiber, NULL, 256 * 1024,
+			FBR_FIBER_STACK_POPULATE);
+	fail_unless(stack_resident(id), NULL);
+
+	/* Released stacks are still usable */
+	fbr_stack_set_release_threshold(&context, 0);
+	for (i = 0; i < 3; i++) {
+		id = fbr_create(&context, "deep", deep_fiber, &depth, 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(&context, id);
+		fail_unless(0 == retval, NULL);
+		fail_unless(1 == fbr_stack_pool_count(&context, 0), NULL);
+	}
+	id = fbr_create_flags(&context, "eager", noop_fiber, NULL, 0,
+			FBR_FIBER_STACK_POPULATE);
+	fail_unless(stack_resident(id), NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static struct fbr_cond_var park_cond;
+
+static void park_fiber(FBR_P_ void *_arg)
+{
+	int *depth = _arg;
+	recurse(*depth);
+	fbr_cond_wait(FBR_A_ &park_cond, NULL);
+}
+
+START_TEST(test_stack_compact)
+{
+	struct fbr_context context;
+	fbr_id_t plain, compact;
+	/* Roughly 50 KB deep */
+	int depth = 100;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_cond_init(&context, &park_cond);
+
+	plain = fbr_create(&context, "plain", park_fiber, &depth, 0);
+	fbr_transfer(&context, plain);
+	compact = fbr_create_flags(&context, "compact", park_fiber, &depth, 0,
+			FBR_FIBER_STACK_COMPACT);
+	fbr_transfer(&context, compact);
+
+	/* Both are parked now, only the plain one is still holding the pages
+	 * it used while recursing */
+	fail_unless(stack_resident_pages(plain) >= 10, NULL);
+	fail_unless(stack_resident_pages(compact) <= 2, NULL);
+
+	fbr_cond_broadcast(&context, &park_cond);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(fbr_is_reclaimed(&context, plain), NULL);
+	fail_unless(fbr_is_reclaimed(&context, compact), NULL);
+
+	fbr_cond_destroy(&context, &park_cond);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * stack_tcase(void)
+{
+	TCase *tc_stack = tcase_create ("Stack");
+	tcase_add_test(tc_stack, test_stack_classes);
+	tcase_add_test(tc_stack, test_stack_cap);
+	tcase_add_test(tc_stack, test_stack_prewarm_trim);
+	tcase_add_test(tc_stack, test_stack_guard);
+	tcase_add_test(tc_stack, test_stack_populate_release);
+	tcase_add_test(tc_stack, test_stack_compact);
+	return tc_stack;
+}
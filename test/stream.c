@@ -0,0 +1,309 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "stream.h"
+
+#define STREAM_BUF_SIZE 16
+
+/* Lets the fibers process whatever there is to process */
+static void run_pending(void)
+{
+	int i;
+
+	for (i = 0; i < 10; i++)
+		ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+}
+
+static const char input[] = "hello\nworld, this is a long line\nABCDEFGH"
+	"0123456789012345678901234567890123456789";
+
+static void parser_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	struct fbr_stream stream;
+	char buf[64];
+	void *ptr;
+	ssize_t retval;
+
+	fail_unless(0 == fbr_stream_init(FBR_A_ &stream, fd, STREAM_BUF_SIZE),
+			NULL);
+
+	retval = fbr_stream_readline(FBR_A_ &stream, buf, sizeof(buf));
+	fail_unless(6 == retval, NULL);
+	fail_unless(0 == strcmp(buf, "hello\n"), NULL);
+
+	/* The line does not fit, the rest of it stays in the stream */
+	retval = fbr_stream_read_until(FBR_A_ &stream, buf, 8, '\n');
+	fail_unless(7 == retval, NULL);
+	fail_unless(0 == strcmp(buf, "world, "), NULL);
+	retval = fbr_stream_readline(FBR_A_ &stream, buf, sizeof(buf));
+	fail_unless(0 == strcmp(buf, "this is a long line\n"), "%s", buf);
+
+	retval = fbr_stream_peek(FBR_A_ &stream, &ptr, 4);
+	fail_unless(retval >= 4, NULL);
+	fail_unless(0 == memcmp(ptr, "ABCD", 4), NULL);
+	fbr_stream_consume(FBR_A_ &stream, 2);
+	retval = fbr_stream_read_exact(FBR_A_ &stream, buf, 6);
+	fail_unless(6 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "CDEFGH", 6), NULL);
+
+	/* Larger than the buffer */
+	retval = fbr_stream_read_exact(FBR_A_ &stream, buf, 40);
+	fail_unless(40 == retval, NULL);
+	fail_unless(0 == memcmp(buf, input + sizeof(input) - 41, 40), NULL);
+
+	retval = fbr_stream_read(FBR_A_ &stream, buf, sizeof(buf));
+	fail_unless(0 == retval, NULL);
+	retval = fbr_stream_readline(FBR_A_ &stream, buf, sizeof(buf));
+	fail_unless(0 == retval, NULL);
+	fbr_stream_destroy(FBR_A_ &stream);
+}
+
+START_TEST(test_stream_read)
+{
+	struct fbr_context context;
+	fbr_id_t parser;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+
+	parser = fbr_create(&context, "parser", parser_fiber, fds, 0);
+	fail_if(fbr_id_isnull(parser), NULL);
+	retval = fbr_transfer(&context, parser);
+	fail_unless(0 == retval, NULL);
+
+	/* Dribble the input in, so that the parser has to wait in between */
+	retval = write(fds[1], input, 10);
+	fail_unless(10 == retval, NULL);
+	run_pending();
+	retval = write(fds[1], input + 10, sizeof(input) - 1 - 10);
+	fail_unless((int)sizeof(input) - 1 - 10 == retval, NULL);
+	shutdown(fds[1], SHUT_WR);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, parser), NULL);
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]), NULL);
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void echo_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	struct fbr_stream stream;
+	char buf[STREAM_BUF_SIZE * 2];
+	ssize_t retval;
+
+	fail_unless(0 == fbr_stream_init(FBR_A_ &stream, fd, STREAM_BUF_SIZE),
+			NULL);
+	for (;;) {
+		retval = fbr_stream_readline(FBR_A_ &stream, buf, sizeof(buf));
+		fail_unless(-1 != retval, NULL);
+		if (0 == retval)
+			break;
+		retval = fbr_stream_write(FBR_A_ &stream, buf, retval);
+		fail_unless(-1 != retval, NULL);
+	}
+	fail_unless(0 == fbr_stream_flush(FBR_A_ &stream), NULL);
+	fbr_stream_destroy(FBR_A_ &stream);
+}
+
+START_TEST(test_stream_write)
+{
+	struct fbr_context context;
+	fbr_id_t echo;
+	int fds[2];
+	char buf[64];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+	fail_unless(0 == fbr_fd_nonblock(&context, fds[1]), NULL);
+
+	echo = fbr_create(&context, "echo", echo_fiber, fds, 0);
+	fail_if(fbr_id_isnull(echo), NULL);
+	retval = fbr_transfer(&context, echo);
+	fail_unless(0 == retval, NULL);
+
+	/* Pipelined requests are answered together, once the echo fiber has
+	 * nothing more to read */
+	retval = write(fds[1], "a\nb\nc\n", 6);
+	fail_unless(6 == retval, NULL);
+	run_pending();
+	retval = read(fds[1], buf, sizeof(buf));
+	fail_unless(6 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "a\nb\nc\n", 6), NULL);
+	retval = read(fds[1], buf, sizeof(buf));
+	fail_unless(-1 == retval && EAGAIN == errno, NULL);
+
+	/* A write that overflows the buffer goes out right away */
+	retval = write(fds[1], "0123456789abcdef0123\n", 21);
+	fail_unless(21 == retval, NULL);
+	shutdown(fds[1], SHUT_WR);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, echo), NULL);
+	retval = read(fds[1], buf, sizeof(buf));
+	fail_unless(21 == retval, NULL);
+	fail_unless(0 == memcmp(buf, "0123456789abcdef0123\n", 21), NULL);
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]), NULL);
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define FLUSH_SIZE (256 * 1024)
+
+static void late_writer_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	char buf[4096];
+	size_t total = 0;
+	ssize_t retval, i;
+
+	fbr_sleep(FBR_A_ 0.1);
+	retval = fbr_write(FBR_A_ fds[1], "tial\n", 5);
+	fail_unless(5 == retval, NULL);
+
+	/* Then drain whatever the stream fiber flushes, once its deadline
+	 * has passed */
+	fbr_sleep(FBR_A_ 0.2);
+	for (;;) {
+		retval = fbr_read(FBR_A_ fds[1], buf, sizeof(buf));
+		fail_unless(-1 != retval, NULL);
+		if (0 == retval)
+			break;
+		for (i = 0; i < retval; i++)
+			fail_unless((char)((total + i) % 251) == buf[i], NULL);
+		total += retval;
+	}
+	fail_unless(FLUSH_SIZE == total, NULL);
+}
+
+static void timeout_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	struct fbr_stream stream;
+	char buf[64];
+	char *data;
+	ssize_t retval;
+	size_t i;
+
+	fail_unless(0 == fbr_stream_init(FBR_A_ &stream, fd, FLUSH_SIZE),
+			NULL);
+
+	/* The line is incomplete when the deadline hits, nothing of it is
+	 * lost */
+	fbr_deadline_set(FBR_A_ ev_now(fctx->__p->loop) + 0.05);
+	retval = fbr_stream_readline(FBR_A_ &stream, buf, sizeof(buf));
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fbr_deadline_clear(FBR_A);
+	retval = fbr_stream_readline(FBR_A_ &stream, buf, sizeof(buf));
+	fail_unless(8 == retval, NULL);
+	fail_unless(0 == strcmp(buf, "partial\n"), NULL);
+
+	/* The peer is not reading yet, only a part of the data makes it out
+	 * before the deadline, and the next flush sends just the rest */
+	data = malloc(FLUSH_SIZE);
+	fail_if(NULL == data, NULL);
+	for (i = 0; i < FLUSH_SIZE; i++)
+		data[i] = i % 251;
+	retval = fbr_stream_write(FBR_A_ &stream, data, FLUSH_SIZE - 1);
+	fail_unless(FLUSH_SIZE - 1 == retval, NULL);
+	retval = fbr_stream_write(FBR_A_ &stream, data + FLUSH_SIZE - 1, 1);
+	fail_unless(1 == retval, NULL);
+	fbr_deadline_set(FBR_A_ ev_now(fctx->__p->loop) + 0.05);
+	fail_unless(-1 == fbr_stream_flush(FBR_A_ &stream), NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(stream.wlen > 0 && stream.wlen < FLUSH_SIZE, NULL);
+	fbr_deadline_clear(FBR_A);
+	fail_unless(0 == fbr_stream_flush(FBR_A_ &stream), NULL);
+	shutdown(fd, SHUT_WR);
+	free(data);
+	fbr_stream_destroy(FBR_A_ &stream);
+}
+
+START_TEST(test_stream_timeout)
+{
+	struct fbr_context context;
+	fbr_id_t stream, writer;
+	int fds[2];
+	int retval;
+	int sndbuf = 4096;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+			sizeof(sndbuf));
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == fbr_fd_register(&context, fds[0]), NULL);
+	fail_unless(0 == fbr_fd_nonblock(&context, fds[1]), NULL);
+	retval = write(fds[1], "par", 3);
+	fail_unless(3 == retval, NULL);
+
+	stream = fbr_create(&context, "stream", timeout_fiber, fds, 0);
+	fail_if(fbr_id_isnull(stream), NULL);
+	writer = fbr_create(&context, "writer", late_writer_fiber, fds, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, stream);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, stream), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	fail_unless(0 == fbr_fd_unregister(&context, fds[0]), NULL);
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * stream_tcase(void)
+{
+	TCase *tc_stream = tcase_create ("stream");
+	tcase_add_test(tc_stream, test_stream_read);
+	tcase_add_test(tc_stream, test_stream_write);
+	tcase_add_test(tc_stream, test_stream_timeout);
+	return tc_stream;
+}
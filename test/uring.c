@@ -0,0 +1,417 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "uring.h"
+
+#define BLOCK_SIZE 4096
+#define BLOCKS 64
+
+/* The context falls back to the readiness based wrappers on kernels without
+ * io_uring, the tests are pointless then */
+static int init_uring(struct fbr_context *context)
+{
+	fbr_init_flags(context, EV_DEFAULT, FBR_INIT_IO_URING);
+#ifdef HAVE_IO_URING
+	if (fbr_io_uring_enabled(context))
+		return 0;
+#endif
+	fbr_destroy(context);
+	return -1;
+}
+
+static void echo_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char buf[BLOCK_SIZE];
+	ssize_t retval;
+
+	for (;;) {
+		retval = fbr_recv(FBR_A_ fd, buf, sizeof(buf), 0);
+		fail_unless(retval >= 0, NULL);
+		if (0 == retval)
+			break;
+		retval = fbr_write_all(FBR_A_ fd, buf, retval);
+		fail_unless(retval > 0, NULL);
+	}
+	close(fd);
+}
+
+static void client_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char out[BLOCK_SIZE], in[BLOCK_SIZE];
+	ssize_t retval;
+	int i;
+
+	for (i = 0; i < BLOCKS; i++) {
+		memset(out, 'a' + i % 26, sizeof(out));
+		retval = fbr_send(FBR_A_ fd, out, sizeof(out), 0);
+		fail_unless(sizeof(out) == retval, NULL);
+		retval = fbr_read_all(FBR_A_ fd, in, sizeof(in));
+		fail_unless(sizeof(in) == retval, NULL);
+		fail_unless(0 == memcmp(in, out, sizeof(in)), NULL);
+	}
+	shutdown(fd, SHUT_WR);
+	retval = fbr_read(FBR_A_ fd, in, sizeof(in));
+	fail_unless(0 == retval, NULL);
+}
+
+START_TEST(test_uring_echo)
+{
+	struct fbr_context context;
+	fbr_id_t echo, client;
+	int fds[2];
+	int retval;
+
+	if (-1 == init_uring(&context))
+		return;
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	/* Non-blocking descriptors are polled for before the operation */
+	fail_unless(0 == fbr_fd_nonblock(&context, fds[1]), NULL);
+
+	echo = fbr_create(&context, "echo", echo_fiber, fds + 0, 0);
+	fail_if(fbr_id_isnull(echo), NULL);
+	client = fbr_create(&context, "client", client_fiber, fds + 1, 0);
+	fail_if(fbr_id_isnull(client), NULL);
+	retval = fbr_transfer(&context, echo);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, client);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, echo), NULL);
+	fail_unless(fbr_is_reclaimed(&context, client), NULL);
+
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+struct accept_test {
+	int listen_fd;
+	struct sockaddr_in addr;
+	struct sockaddr_in refused_addr;
+};
+
+static void acceptor_fiber(FBR_P_ void *_arg)
+{
+	struct accept_test *at = _arg;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	ssize_t retval;
+	char c;
+	int fd;
+
+	fd = fbr_accept(FBR_A_ at->listen_fd, (struct sockaddr *)&addr,
+			&addrlen);
+	fail_if(fd < 0);
+	fail_unless(AF_INET == addr.sin_family, NULL);
+	retval = fbr_read(FBR_A_ fd, &c, 1);
+	fail_unless(1 == retval, NULL);
+	fail_unless('x' == c, NULL);
+	close(fd);
+}
+
+static void connector_fiber(FBR_P_ void *_arg)
+{
+	struct accept_test *at = _arg;
+	ssize_t retval;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fd < 0);
+	fail_unless(0 == fbr_fd_nonblock(FBR_A_ fd), NULL);
+	retval = fbr_connect(FBR_A_ fd, (struct sockaddr *)&at->addr,
+			sizeof(at->addr));
+	fail_unless(0 == retval, NULL);
+	retval = fbr_write(FBR_A_ fd, "x", 1);
+	fail_unless(1 == retval, NULL);
+	close(fd);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fd < 0);
+	retval = fbr_connect_wto(FBR_A_ fd, (struct sockaddr *)&at->refused_addr,
+			sizeof(at->refused_addr), 1.0);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ECONNREFUSED == errno, NULL);
+	close(fd);
+}
+
+static int listen_loopback(struct sockaddr_in *addr)
+{
+	socklen_t addrlen = sizeof(*addr);
+	int fd;
+	int retval;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_if(fd < 0);
+	memset(addr, 0x00, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+	fail_unless(0 == retval);
+	retval = listen(fd, 16);
+	fail_unless(0 == retval);
+	retval = getsockname(fd, (struct sockaddr *)addr, &addrlen);
+	fail_unless(0 == retval);
+	return fd;
+}
+
+START_TEST(test_uring_accept_connect)
+{
+	struct fbr_context context;
+	struct accept_test at;
+	fbr_id_t acceptor, connector;
+	int retval;
+
+	if (-1 == init_uring(&context))
+		return;
+
+	at.listen_fd = listen_loopback(&at.addr);
+	close(listen_loopback(&at.refused_addr));
+
+	acceptor = fbr_create(&context, "acceptor", acceptor_fiber, &at, 0);
+	fail_if(fbr_id_isnull(acceptor), NULL);
+	connector = fbr_create(&context, "connector", connector_fiber, &at, 0);
+	fail_if(fbr_id_isnull(connector), NULL);
+	retval = fbr_transfer(&context, acceptor);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, connector);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, acceptor), NULL);
+	fail_unless(fbr_is_reclaimed(&context, connector), NULL);
+
+	close(at.listen_fd);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void timed_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+	char c = 0;
+
+	retval = fbr_read_wto(FBR_A_ fd, &c, 1, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	fail_unless(0 == c, NULL);
+
+	retval = fbr_read_wto(FBR_A_ fd, &c, 1, 1.0);
+	fail_unless(1 == retval, NULL);
+	fail_unless('z' == c, NULL);
+}
+
+static void late_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+
+	fbr_sleep(FBR_A_ 0.05);
+	retval = fbr_write(FBR_A_ fd, "z", 1);
+	fail_unless(1 == retval, NULL);
+}
+
+static void stuck_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char c;
+
+	fbr_read(FBR_A_ fd, &c, 1);
+	fail("the read is not supposed to complete");
+}
+
+START_TEST(test_uring_cancel)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer, stuck;
+	int fds[2], stuck_fds[2];
+	int retval;
+
+	if (-1 == init_uring(&context))
+		return;
+
+	retval = pipe(fds);
+	fail_unless(0 == retval, NULL);
+	reader = fbr_create(&context, "reader", timed_reader_fiber, fds + 0, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer", late_writer_fiber, fds + 1, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	/* A reclaimed fiber leaves its request behind, which is cancelled and
+	 * does not keep the loop alive */
+	retval = pipe(stuck_fds);
+	fail_unless(0 == retval, NULL);
+	stuck = fbr_create(&context, "stuck", stuck_reader_fiber, stuck_fds, 0);
+	fail_if(fbr_id_isnull(stuck), NULL);
+	retval = fbr_transfer(&context, stuck);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	retval = fbr_reclaim(&context, stuck);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->inflight, NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	close(stuck_fds[0]);
+	close(stuck_fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#ifdef HAVE_IO_URING
+#define FILE_FIBERS 8
+
+struct file_test {
+	char path[64];
+	int index;
+};
+
+static void file_fiber(FBR_P_ void *_arg)
+{
+	struct file_test *ft = _arg;
+	char out[BLOCK_SIZE], in[BLOCK_SIZE];
+	struct iovec iov[2];
+	struct stat st;
+	ssize_t retval;
+	int fd;
+	int i;
+
+	fd = fbr_uring_open(FBR_A_ ft->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	fail_unless(fd >= 0, NULL);
+	retval = fbr_uring_fallocate(FBR_A_ fd, 0, 0, BLOCKS * BLOCK_SIZE);
+	fail_unless(0 == retval, NULL);
+	for (i = 0; i < BLOCKS; i++) {
+		memset(out, 'a' + (ft->index + i) % 26, sizeof(out));
+		retval = fbr_uring_pwrite(FBR_A_ fd, out, sizeof(out),
+				i * BLOCK_SIZE);
+		fail_unless(sizeof(out) == retval, NULL);
+	}
+	fail_unless(0 == fbr_uring_fsync(FBR_A_ fd, 0), NULL);
+	fail_unless(0 == fbr_uring_fsync(FBR_A_ fd, 1), NULL);
+	for (i = BLOCKS - 1; i >= 0; i--) {
+		memset(out, 'a' + (ft->index + i) % 26, sizeof(out));
+		retval = fbr_uring_pread(FBR_A_ fd, in, sizeof(in),
+				i * BLOCK_SIZE);
+		fail_unless(sizeof(in) == retval, NULL);
+		fail_unless(0 == memcmp(in, out, sizeof(in)), NULL);
+	}
+	/* Negative offset reads from the file position */
+	retval = fbr_uring_pread(FBR_A_ fd, in, sizeof(in), -1);
+	fail_unless(sizeof(in) == retval, NULL);
+	fail_unless('a' + ft->index % 26 == in[0], NULL);
+
+	/* Vectored calls go out as a single operation */
+	memset(out, 'A', BLOCK_SIZE / 2);
+	memset(out + BLOCK_SIZE / 2, 'Z', BLOCK_SIZE / 2);
+	iov[0].iov_base = out;
+	iov[0].iov_len = BLOCK_SIZE / 2;
+	iov[1].iov_base = out + BLOCK_SIZE / 2;
+	iov[1].iov_len = BLOCK_SIZE / 2;
+	retval = fbr_uring_pwritev(FBR_A_ fd, iov, 2, BLOCK_SIZE, 0);
+	fail_unless(BLOCK_SIZE == retval, NULL);
+	iov[0].iov_base = in + BLOCK_SIZE / 2;
+	iov[1].iov_base = in;
+	retval = fbr_uring_preadv(FBR_A_ fd, iov, 2, BLOCK_SIZE, 0);
+	fail_unless(BLOCK_SIZE == retval, NULL);
+	fail_unless('A' == in[BLOCK_SIZE / 2] && 'Z' == in[0], NULL);
+
+	fail_unless(0 == fbr_uring_fstat(FBR_A_ fd, &st), NULL);
+	fail_unless(BLOCKS * BLOCK_SIZE == st.st_size, NULL);
+	fail_unless(S_ISREG(st.st_mode), NULL);
+	fail_unless(0 == fbr_uring_stat(FBR_A_ ft->path, 1, &st), NULL);
+	fail_unless(BLOCKS * BLOCK_SIZE == st.st_size, NULL);
+	fail_unless(0 == fbr_uring_stat(FBR_A_ ft->path, 0, &st), NULL);
+	fail_unless(st.st_ino > 0, NULL);
+	close(fd);
+	unlink(ft->path);
+
+	fail_unless(-1 == fbr_uring_stat(FBR_A_ ft->path, 1, &st), NULL);
+	fail_unless(ENOENT == errno, NULL);
+	fail_unless(-1 == fbr_uring_open(FBR_A_ ft->path, O_RDONLY, 0), NULL);
+	fail_unless(ENOENT == errno, NULL);
+}
+
+START_TEST(test_uring_files)
+{
+	struct fbr_context context;
+	struct file_test tests[FILE_FIBERS];
+	fbr_id_t fibers[FILE_FIBERS];
+	int retval;
+	int i;
+
+	if (-1 == init_uring(&context))
+		return;
+	if (!fbr_uring_files_enabled(&context)) {
+		fbr_destroy(&context);
+		return;
+	}
+
+	for (i = 0; i < FILE_FIBERS; i++) {
+		snprintf(tests[i].path, sizeof(tests[i].path),
+				"/tmp/evfibers_uring_%d_%d", getpid(), i);
+		tests[i].index = i;
+		fibers[i] = fbr_create(&context, "file", file_fiber,
+				tests + i, 0);
+		fail_if(fbr_id_isnull(fibers[i]), NULL);
+		retval = fbr_transfer(&context, fibers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+	ev_run(EV_DEFAULT, 0);
+	for (i = 0; i < FILE_FIBERS; i++)
+		fail_unless(fbr_is_reclaimed(&context, fibers[i]), NULL);
+	fail_unless(0 == context.__p->uring->inflight, NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+#endif
+
+TCase * uring_tcase(void)
+{
+	TCase *tc_uring = tcase_create ("uring");
+	tcase_add_test(tc_uring, test_uring_echo);
+	tcase_add_test(tc_uring, test_uring_accept_connect);
+	tcase_add_test(tc_uring, test_uring_cancel);
+#ifdef HAVE_IO_URING
+	tcase_add_test(tc_uring, test_uring_files);
+#endif
+	return tc_uring;
+}
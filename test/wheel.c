@@ -0,0 +1,201 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "wheel.h"
+
+#define NUM_SLEEPERS 6
+
+struct sleeper {
+	ev_tstamp seconds;
+	ev_tstamp deadline;
+	ev_tstamp woken;
+	int *order;
+	int rank;
+};
+
+static void sleeper_fiber(FBR_P_ void *_arg)
+{
+	struct sleeper *s = _arg;
+
+	s->deadline = ev_now(fctx->__p->loop) + s->seconds;
+	fbr_sleep(FBR_A_ s->seconds);
+	s->woken = ev_now(fctx->__p->loop);
+	s->rank = (*s->order)++;
+}
+
+START_TEST(test_wheel_order)
+{
+	struct fbr_context context;
+	struct sleeper sleepers[NUM_SLEEPERS];
+	/* With 0.1ms slack these end up on every level of the wheel */
+	const ev_tstamp seconds[NUM_SLEEPERS] = {
+		0.5, 0.0003, 0.05, 0.002, 0.2, 0.0051
+	};
+	const int expected[NUM_SLEEPERS] = {5, 0, 3, 1, 4, 2};
+	fbr_id_t id;
+	int order = 0;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	retval = fbr_set_timer_slack(&context, 0.0001);
+	fail_unless(0 == retval, NULL);
+
+	for (i = 0; i < NUM_SLEEPERS; i++) {
+		sleepers[i].seconds = seconds[i];
+		sleepers[i].order = &order;
+		id = fbr_create(&context, "sleeper", sleeper_fiber,
+				&sleepers[i], 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(&context, id);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(NUM_SLEEPERS == order, NULL);
+	for (i = 0; i < NUM_SLEEPERS; i++) {
+		fail_unless(expected[i] == sleepers[i].rank, NULL);
+		fail_unless(sleepers[i].woken >= sleepers[i].deadline, NULL);
+		/* Cascading from the upper levels must not cost a rotation */
+		fail_unless(sleepers[i].woken - sleepers[i].deadline < 0.05,
+				NULL);
+	}
+	fail_unless(0 == context.__p->wheel.count, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void batch_fiber(FBR_P_ void *_arg)
+{
+	int *woken = _arg;
+	fbr_sleep(FBR_A_ 0.001 * (1 + *woken % 40));
+	(*woken)++;
+}
+
+START_TEST(test_wheel_slack)
+{
+	struct fbr_context context;
+	struct fbr_sched_stats stats;
+	const int num_fibers = 30;
+	fbr_id_t id;
+	int woken = 0;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = fbr_set_timer_slack(&context, 0.);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+
+	for (i = 0; i < num_fibers; i++) {
+		id = fbr_create(&context, "batch", batch_fiber, &woken, 0);
+		fail_if(fbr_id_isnull(id), NULL);
+		retval = fbr_transfer(&context, id);
+		fail_unless(0 == retval, NULL);
+	}
+	/* Armed timeouts follow the slack change, now that all deadlines fall
+	 * into the same tick they expire together */
+	retval = fbr_set_timer_slack(&context, 0.2);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(num_fibers == woken, NULL);
+	fbr_get_sched_stats(&context, &stats);
+	fail_unless(num_fibers == stats.max_drain, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void wait_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_cond_var *cond = _arg;
+	struct fbr_ev_cond_var ev;
+	struct fbr_ev_base *events[] = {&ev.ev_base, NULL};
+	int retval;
+
+	fbr_ev_cond_var_init(FBR_A_ &ev, cond, NULL);
+	retval = fbr_ev_wait_to(FBR_A_ events, 10.);
+	fail_unless(1 == retval, NULL);
+	fail_unless(ev.ev_base.arrived, NULL);
+}
+
+static void sleep_fiber(FBR_P_ _unused_ void *_arg)
+{
+	fbr_sleep(FBR_A_ 10.);
+	fail("sleep was not interrupted by reclaim");
+}
+
+START_TEST(test_wheel_cancel)
+{
+	struct fbr_context context;
+	struct fbr_cond_var cond;
+	fbr_id_t waiter, sleeper;
+	ev_tstamp started;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_cond_init(&context, &cond);
+
+	waiter = fbr_create(&context, "waiter", wait_fiber, &cond, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+
+	sleeper = fbr_create(&context, "sleeper", sleep_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(sleeper), NULL);
+	retval = fbr_transfer(&context, sleeper);
+	fail_unless(0 == retval, NULL);
+
+	fail_unless(2 == context.__p->wheel.count, NULL);
+	fail_unless(ev_is_active(&context.__p->wheel.timer), NULL);
+
+	/* Both timeouts are disarmed, so the loop has nothing to wait for */
+	fbr_cond_signal(&context, &cond);
+	retval = fbr_reclaim(&context, sleeper);
+	fail_unless(0 == retval, NULL);
+
+	started = ev_time();
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(ev_time() - started < 1., NULL);
+
+	fail_unless(fbr_is_reclaimed(&context, waiter), NULL);
+	fail_unless(0 == context.__p->wheel.count, NULL);
+	fail_if(ev_is_active(&context.__p->wheel.timer), NULL);
+
+	fbr_cond_destroy(&context, &cond);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * wheel_tcase(void)
+{
+	TCase *tc_wheel = tcase_create ("Wheel");
+	tcase_add_test(tc_wheel, test_wheel_order);
+	tcase_add_test(tc_wheel, test_wheel_slack);
+	tcase_add_test(tc_wheel, test_wheel_cancel);
+	return tc_wheel;
+}